@@ -1,9 +1,17 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <gflags/gflags.h>
+#include <glog/logging.h>
 #include <folly/Likely.h>
 #include <folly/Range.h>
 #include <folly/Conv.h>
 #include <folly/Format.h>
+#include <folly/dynamic.h>
 #include <folly/small_vector.h>
 #include <proxygen/lib/http/HTTPCommonHeaders.h>
 #include <proxygen/lib/http/HTTPMethod.h>
@@ -23,13 +31,17 @@
 #include "FtcMapping.h"
 #include "F404Mapping.h"
 #include "F606Mapping.h"
+#include "KeyFilter.h"
 #include "AccessLog.h"
+#include "CallFwd.h"
 
 using namespace proxygen;
 using folly::StringPiece;
 
 DEFINE_uint32(max_query_length, 32768,
               "Maximum length of POST x-www-form-urlencoded body");
+DEFINE_uint32(metrics_period, 10,
+              "How often (in seconds) /metrics report is computed, requests get the last one");
 
 
 bool isJsonRequested(StringPiece accept) {
@@ -150,8 +162,7 @@ class TargetHandler final : public RequestHandler {
       f606Available = false;
     }
 
-    us_rn_.resize(N);
-    ca_rn_.resize(N);
+    rn_.resize(N);
     if (dncAvailable)
       us_dnc_.resize(N);
     if (dnoAvailable)
@@ -171,10 +182,8 @@ class TargetHandler final : public RequestHandler {
     if (f606Available)
       us_f606_.resize(N);
 
-    PhoneMapping::getUS()
-      .getRNs(N, pn_.data(), us_rn_.data());
-    PhoneMapping::getCA()
-      .getRNs(N, pn_.data(), ca_rn_.data());
+    NanpMapping::getNANP()
+      .getRNs(N, pn_.data(), rn_.data());
 
     if (dncAvailable)
       DncMapping::getDNC()
@@ -193,9 +202,7 @@ class TargetHandler final : public RequestHandler {
       lerg_search_key.resize(N);
 
       for (size_t i = 0; i < N; ++i) {
-        uint64_t rn = us_rn_[i];
-        if (rn == PhoneNumber::NONE)
-          rn = ca_rn_[i];
+        uint64_t rn = rn_[i];
 
         if (rn != PhoneNumber::NONE)
           lerg_search_key[i] = rn;
@@ -236,9 +243,7 @@ class TargetHandler final : public RequestHandler {
     if (json_)
       record += "[\n";
     for (size_t i = 0; i < N; ++i) {
-      uint64_t rn = us_rn_[i];
-      if (rn == PhoneNumber::NONE)
-        rn = ca_rn_[i];
+      uint64_t rn = rn_[i];
 
       std::string lrn_str = std::string("");
       std::string dno_str = std::string("");
@@ -452,8 +457,7 @@ class TargetHandler final : public RequestHandler {
   bool json_ = false;
   std::unique_ptr<folly::IOBuf> body_;
   folly::small_vector<uint64_t, 16> pn_;
-  folly::small_vector<uint64_t, 16> us_rn_;
-  folly::small_vector<uint64_t, 16> ca_rn_;
+  folly::small_vector<uint64_t, 16> rn_;
   folly::small_vector<uint64_t, 16> us_dnc_;
   folly::small_vector<uint64_t, 16> us_dno_;
   folly::small_vector<uint64_t, 16> us_tollfree_;
@@ -497,10 +501,8 @@ class ReverseHandler final : public RequestHandler {
     if (json)
       record_ += "[\n";
     for (std::pair<uint64_t, uint64_t> range : query_) {
-      us.inverseRNs(range.first, range.second);
-      sendBody(us, json);
-      ca.inverseRNs(range.first, range.second);
-      sendBody(ca, json);
+      sendBody(us, us.scanRNs(range.first, range.second), json);
+      sendBody(ca, ca.scanRNs(range.first, range.second), json);
     }
     if (json)
       record_ += "]\n";
@@ -510,13 +512,15 @@ class ReverseHandler final : public RequestHandler {
     downstream_->sendEOM();
   }
 
-  void sendBody(PhoneMapping &db, bool json) {
-    for (; db.hasRow(); db.advance()) {
-      if (json) {
-        folly::format(&record_, "  {{\"pn\": \"{}\", \"rn\": \"{}\"}},\n",
-                      db.currentPN(), db.currentRN());
-      } else {
-        folly::format(&record_, "{},{}\n", db.currentPN(), db.currentRN());
+  void sendBody(const PhoneMapping &db, PhoneMapping::RowScan scan, bool json) {
+    while (size_t n = db.readRows(scan, pn_.size(), pn_.data(), rn_.data())) {
+      for (size_t i = 0; i < n; ++i) {
+        if (json) {
+          folly::format(&record_, "  {{\"pn\": \"{}\", \"rn\": \"{}\"}},\n",
+                        pn_[i], rn_[i]);
+        } else {
+          folly::format(&record_, "{},{}\n", pn_[i], rn_[i]);
+        }
       }
 
       if (record_.size() > 1000) {
@@ -566,8 +570,155 @@ class ReverseHandler final : public RequestHandler {
   }
 
  private:
+  static constexpr size_t SCAN_ROWS = 256;
+
   std::vector<std::pair<uint64_t, uint64_t>> query_;
   std::string record_;
+  std::array<uint64_t, SCAN_ROWS> pn_;
+  std::array<uint64_t, SCAN_ROWS> rn_;
+};
+
+/** Write memory usage of datasets and filter counters in Prometheus
+  * text exposition format. */
+static std::string formatMetrics() {
+  std::string out;
+  folly::dynamic report = memoryReport();
+
+  out += "# TYPE callfwd_memory_bytes gauge\n";
+  for (const auto &dataset : report.items()) {
+    if (const folly::dynamic *parts = dataset.second.get_ptr("parts"))
+      for (const auto &part : parts->items())
+        folly::format(&out, "callfwd_memory_bytes{{dataset=\"{}\",part=\"{}\"}} {}\n",
+                      dataset.first.asString(), part.first.asString(),
+                      part.second["bytes"].asInt());
+  }
+
+  out += "# TYPE callfwd_load_factor gauge\n";
+  for (const auto &dataset : report.items()) {
+    if (const folly::dynamic *parts = dataset.second.get_ptr("parts"))
+      for (const auto &part : parts->items())
+        if (const folly::dynamic *loadFactor = part.second.get_ptr("load_factor"))
+          folly::format(&out, "callfwd_load_factor{{dataset=\"{}\",part=\"{}\"}} {}\n",
+                        dataset.first.asString(), part.first.asString(),
+                        loadFactor->asDouble());
+  }
+
+  out += "# TYPE callfwd_retired_versions gauge\n";
+  out += "# TYPE callfwd_retired_bytes gauge\n";
+  for (const auto &dataset : report.items()) {
+    if (const folly::dynamic *versions = dataset.second.get_ptr("retired_versions")) {
+      folly::format(&out, "callfwd_retired_versions{{dataset=\"{}\"}} {}\n",
+                    dataset.first.asString(), versions->asInt());
+      folly::format(&out, "callfwd_retired_bytes{{dataset=\"{}\"}} {}\n",
+                    dataset.first.asString(),
+                    dataset.second["retired_bytes"].asInt());
+    }
+  }
+
+  const folly::dynamic &large = report["large_blocks"];
+  folly::format(&out, "# TYPE callfwd_large_blocks gauge\ncallfwd_large_blocks {}\n",
+                large["count"].asInt());
+  folly::format(&out, "# TYPE callfwd_large_block_bytes gauge\ncallfwd_large_block_bytes {}\n",
+                large["bytes"].asInt());
+
+  const folly::dynamic &reclaimer = report["reclaimer"];
+  folly::format(&out, "# TYPE callfwd_reclaim_pending_versions gauge\n"
+                "callfwd_reclaim_pending_versions {}\n",
+                reclaimer["pending_versions"].asInt());
+  folly::format(&out, "# TYPE callfwd_reclaim_pending_bytes gauge\n"
+                "callfwd_reclaim_pending_bytes {}\n",
+                reclaimer["pending_bytes"].asInt());
+  folly::format(&out, "# TYPE callfwd_reclaim_lag_seconds gauge\n"
+                "callfwd_reclaim_lag_seconds {}\n",
+                reclaimer["lag_seconds"].asDouble());
+  folly::format(&out, "# TYPE callfwd_reclaimed_bytes_total counter\n"
+                "callfwd_reclaimed_bytes_total {}\n",
+                reclaimer["reclaimed_bytes"].asInt());
+
+  out += "# TYPE callfwd_filter_keys_total counter\n";
+  FilterStats::forEach([&](const FilterStats &stats) {
+    FilterStats::Totals t = stats.totals();
+    const char *fmt = "callfwd_filter_keys_total{{table=\"{}\",result=\"{}\"}} {}\n";
+    folly::format(&out, fmt, stats.name(), "rejected", t.rejected);
+    folly::format(&out, fmt, stats.name(), "found", t.found);
+    folly::format(&out, fmt, stats.name(), "false_positive", t.falsePositives());
+  });
+  return out;
+}
+
+namespace {
+// Never destroyed, the refreshing thread runs until exit
+struct MetricsCache {
+  std::mutex mutex;
+  std::shared_ptr<const std::string> text;  // null until the first report
+};
+}
+
+/** Get /metrics text computed by a thread of its own every
+  * --metrics_period seconds, so requests never walk datasets on the IO
+  * thread. The first call starts the thread. */
+static std::shared_ptr<const std::string> cachedMetrics() {
+  static MetricsCache *cache = [] {
+    MetricsCache *c = new MetricsCache;
+    std::thread([c] {
+      while (true) {
+        try {
+          auto text = std::make_shared<const std::string>(formatMetrics());
+          std::lock_guard<std::mutex> lock(c->mutex);
+          c->text = std::move(text);
+        } catch (std::exception &e) {
+          LOG(ERROR) << "metrics: " << e.what();
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(std::max(FLAGS_metrics_period, 1u)));
+      }
+    }).detach();
+    return c;
+  }();
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  return cache->text;
+}
+
+class MetricsHandler final : public RequestHandler {
+ public:
+  void onRequest(std::unique_ptr<HTTPMessage> req) noexcept override {
+    if (req->getMethod() != HTTPMethod::GET) {
+      ResponseBuilder(downstream_)
+        .status(400, "Bad Request")
+        .sendWithEOM();
+      return;
+    }
+
+    std::shared_ptr<const std::string> text = cachedMetrics();
+    if (!text) {
+      ResponseBuilder(downstream_)
+        .status(503, "Service Unavailable")
+        .sendWithEOM();
+      return;
+    }
+
+    ResponseBuilder(downstream_)
+      .status(200, "OK")
+      .header(HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4")
+      .body(*text)
+      .sendWithEOM();
+  }
+
+  void onBody(std::unique_ptr<folly::IOBuf> body) noexcept override {
+  }
+
+  void onEOM() noexcept override {
+  }
+
+  void onUpgrade(UpgradeProtocol proto) noexcept override {
+  }
+
+  void requestComplete() noexcept override {
+    delete this;
+  }
+
+  void onError(ProxygenError err) noexcept override {
+    delete this;
+  }
 };
 
 class ApiHandlerFactory : public RequestHandlerFactory {
@@ -595,6 +746,8 @@ class ApiHandlerFactory : public RequestHandlerFactory {
       return this->makeHandler<TargetHandler>();
     } else if (path == "/reverse") {
       return this->makeHandler<ReverseHandler>();
+    } else if (path == "/metrics") {
+      return this->makeHandler<MetricsHandler>();
     } else {
       return new DirectResponseHandler(404, "Not found", "");
     }
@@ -603,5 +756,7 @@ class ApiHandlerFactory : public RequestHandlerFactory {
 
 std::unique_ptr<RequestHandlerFactory> makeApiHandlerFactory()
 {
+  // First report is ready by the time US/CA are loaded
+  cachedMetrics();
   return std::make_unique<ApiHandlerFactory>();
 }
@@ -0,0 +1,41 @@
+#include "Arena.h"
+#include "HugePages.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Blocks grow twice up to the largest, a small dataset takes one page
+static constexpr size_t MIN_BLOCK = LARGE_ALLOCATION;
+static constexpr size_t MAX_BLOCK = size_t(64) << 20;
+
+Arena::~Arena() noexcept {
+  for (const auto &block : blocks_)
+    deallocateLarge(block.first, block.second);
+}
+
+void* Arena::allocate(size_t bytes, size_t align) {
+  uintptr_t pos = reinterpret_cast<uintptr_t>(pos_);
+  uintptr_t aligned = (pos + align - 1) & ~uintptr_t(align - 1);
+  if (!pos_ || aligned + bytes > reinterpret_cast<uintptr_t>(end_)) {
+    size_t next = blocks_.empty() ? MIN_BLOCK : std::min(blocks_.back().second * 2, MAX_BLOCK);
+    size_t length = std::max(next, bytes + align);
+    blocks_.reserve(blocks_.size() + 1);
+    uint8_t *block = static_cast<uint8_t*>(allocateLarge(length));
+    blocks_.emplace_back(block, length);
+    bytes_ += length;
+    pos_ = block;
+    end_ = block + length;
+    pos = reinterpret_cast<uintptr_t>(pos_);
+    aligned = (pos + align - 1) & ~uintptr_t(align - 1);
+  }
+  pos_ += aligned - pos + bytes;
+  return reinterpret_cast<void*>(aligned);
+}
+
+folly::StringPiece Arena::copy(folly::StringPiece s) {
+  if (s.empty())
+    return folly::StringPiece();
+  char *p = static_cast<char*>(allocate(s.size(), 1));
+  memcpy(p, s.data(), s.size());
+  return folly::StringPiece(p, p + s.size());
+}
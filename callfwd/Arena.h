@@ -0,0 +1,41 @@
+#ifndef CALLFWD_ARENA_H
+#define CALLFWD_ARENA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include <folly/Range.h>
+
+/*
+ * Memory of many small objects of a dataset version, e.g. strings of its
+ * rows. They are placed one after another in blocks of allocateLarge(),
+ * never freed one by one, and the blocks are unmapped together with the
+ * arena. Reclaiming a version gives its pages back to the OS at once
+ * instead of freeing millions of objects into the heap.
+ */
+class Arena {
+ public:
+  Arena() noexcept = default;
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena() noexcept;
+
+  /** Allocate bytes aligned on a power of 2, valid while arena lives. */
+  void* allocate(size_t bytes, size_t align = alignof(std::max_align_t));
+
+  /** Copy string into arena. */
+  folly::StringPiece copy(folly::StringPiece s);
+
+  /** Get bytes of blocks held. */
+  size_t allocatedBytes() const noexcept { return bytes_; }
+
+ private:
+  std::vector<std::pair<void*, size_t>> blocks_;
+  uint8_t *pos_ = nullptr;
+  uint8_t *end_ = nullptr;
+  size_t bytes_ = 0;
+};
+
+#endif // CALLFWD_ARENA_H
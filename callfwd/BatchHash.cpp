@@ -0,0 +1,148 @@
+#include "BatchHash.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BATCHHASH_X86 1
+#endif
+
+static void mixScalar(size_t N, const uint64_t *keys, uint64_t seed, uint64_t *out) {
+  for (size_t i = 0; i < N; ++i)
+    out[i] = mixHash(keys[i] ^ seed);
+}
+
+static void multiplyShiftScalar(size_t N, const uint64_t *keys, uint64_t multiplier,
+                                unsigned shift, uint64_t *out) {
+  for (size_t i = 0; i < N; ++i)
+    out[i] = (keys[i] * multiplier) >> shift;
+}
+
+#if BATCHHASH_X86
+
+__attribute__((target("avx2")))
+static inline __m256i mullo64(__m256i a, __m256i b) {
+  // AVX2 lacks 64-bit multiply, combine three 32x32->64 products
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i t1 = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+  __m256i t2 = _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32));
+  __m256i cross = _mm256_slli_epi64(_mm256_add_epi64(t1, t2), 32);
+  return _mm256_add_epi64(lo, cross);
+}
+
+__attribute__((target("avx2")))
+static void mixAVX2(size_t N, const uint64_t *keys, uint64_t seed, uint64_t *out) {
+  const __m256i s = _mm256_set1_epi64x(seed);
+  const __m256i c1 = _mm256_set1_epi64x(0xff51afd7ed558ccdull);
+  const __m256i c2 = _mm256_set1_epi64x(0xc4ceb9fe1a85ec53ull);
+  size_t i = 0;
+  for (; i + 4 <= N; i += 4) {
+    __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+    k = _mm256_xor_si256(k, s);
+    k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+    k = mullo64(k, c1);
+    k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+    k = mullo64(k, c2);
+    k = _mm256_xor_si256(k, _mm256_srli_epi64(k, 33));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), k);
+  }
+  mixScalar(N - i, keys + i, seed, out + i);
+}
+
+__attribute__((target("avx2")))
+static void multiplyShiftAVX2(size_t N, const uint64_t *keys, uint64_t multiplier,
+                              unsigned shift, uint64_t *out) {
+  const __m256i m = _mm256_set1_epi64x(multiplier);
+  const __m128i sh = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 4 <= N; i += 4) {
+    __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+    k = _mm256_srl_epi64(mullo64(k, m), sh);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), k);
+  }
+  multiplyShiftScalar(N - i, keys + i, multiplier, shift, out + i);
+}
+
+// GCC headers trip -Wmaybe-uninitialized on _mm512_undefined_epi32()
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f,avx512dq")))
+static void mixAVX512(size_t N, const uint64_t *keys, uint64_t seed, uint64_t *out) {
+  const __m512i s = _mm512_set1_epi64(seed);
+  const __m512i c1 = _mm512_set1_epi64(0xff51afd7ed558ccdull);
+  const __m512i c2 = _mm512_set1_epi64(0xc4ceb9fe1a85ec53ull);
+  size_t i = 0;
+  for (; i + 8 <= N; i += 8) {
+    __m512i k = _mm512_loadu_si512(keys + i);
+    k = _mm512_xor_si512(k, s);
+    k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+    k = _mm512_mullo_epi64(k, c1);
+    k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+    k = _mm512_mullo_epi64(k, c2);
+    k = _mm512_xor_si512(k, _mm512_srli_epi64(k, 33));
+    _mm512_storeu_si512(out + i, k);
+  }
+  mixScalar(N - i, keys + i, seed, out + i);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void multiplyShiftAVX512(size_t N, const uint64_t *keys, uint64_t multiplier,
+                                unsigned shift, uint64_t *out) {
+  const __m512i m = _mm512_set1_epi64(multiplier);
+  const __m128i sh = _mm_cvtsi32_si128(shift);
+  size_t i = 0;
+  for (; i + 8 <= N; i += 8) {
+    __m512i k = _mm512_loadu_si512(keys + i);
+    k = _mm512_srl_epi64(_mm512_mullo_epi64(k, m), sh);
+    _mm512_storeu_si512(out + i, k);
+  }
+  multiplyShiftScalar(N - i, keys + i, multiplier, shift, out + i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif // BATCHHASH_X86
+
+namespace {
+
+enum class Isa { SCALAR, AVX2, AVX512 };
+
+Isa detectIsa() noexcept {
+#if BATCHHASH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    return Isa::AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return Isa::AVX2;
+#endif
+  return Isa::SCALAR;
+}
+
+Isa currentIsa() noexcept {
+  static const Isa isa = detectIsa();
+  return isa;
+}
+
+} // namespace
+
+void mixHashBatch(size_t N, const uint64_t *keys, uint64_t seed, uint64_t *out) noexcept {
+#if BATCHHASH_X86
+  Isa isa = currentIsa();
+  if (isa == Isa::AVX512)
+    return mixAVX512(N, keys, seed, out);
+  if (isa == Isa::AVX2)
+    return mixAVX2(N, keys, seed, out);
+#endif
+  mixScalar(N, keys, seed, out);
+}
+
+void multiplyShiftBatch(size_t N, const uint64_t *keys, uint64_t multiplier,
+                        unsigned shift, uint64_t *out) noexcept {
+#if BATCHHASH_X86
+  Isa isa = currentIsa();
+  if (isa == Isa::AVX512)
+    return multiplyShiftAVX512(N, keys, multiplier, shift, out);
+  if (isa == Isa::AVX2)
+    return multiplyShiftAVX2(N, keys, multiplier, shift, out);
+#endif
+  multiplyShiftScalar(N, keys, multiplier, shift, out);
+}
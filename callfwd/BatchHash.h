@@ -0,0 +1,30 @@
+#ifndef CALLFWD_BATCHHASH_H
+#define CALLFWD_BATCHHASH_H
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Hash functions over batches of 64-bit keys. Batches are processed with
+ * AVX-512 or AVX2 when the CPU supports them, scalar code is used
+ * otherwise. Results are identical to the scalar functions below.
+ */
+
+/** MurmurHash3 finalizer, a bijection. */
+inline uint64_t mixHash(uint64_t k) noexcept {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+/** Compute mixHash(key ^ seed) for every key. */
+void mixHashBatch(size_t N, const uint64_t *keys, uint64_t seed, uint64_t *out) noexcept;
+
+/** Compute (key * multiplier) >> shift for every key. */
+void multiplyShiftBatch(size_t N, const uint64_t *keys, uint64_t multiplier,
+                        unsigned shift, uint64_t *out) noexcept;
+
+#endif // CALLFWD_BATCHHASH_H
@@ -0,0 +1,133 @@
+#ifndef CALLFWD_BATCHLOOKUP_H
+#define CALLFWD_BATCHLOOKUP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+#include <folly/small_vector.h>
+
+/**
+ * Software-pipelined batch lookup, a form of asynchronous memory access
+ * chaining where every probe is the same chain of steps.
+ *
+ * Probe defines `STAGES`, a `State` type and `stage<S>(i, state)` methods.
+ * Every stage reads memory prefetched by the previous one and prefetches
+ * what the next one needs. Stage S of key i runs next to stage S-1 of key
+ * i+distance, so about `distance * STAGES` independent cache misses are
+ * in flight over the whole batch. Fixed-size groups instead drain the
+ * pipeline after every group.
+ */
+template <class Probe>
+void pipelinedLookup(Probe &probe, size_t N, size_t distance);
+
+/**
+ * Group prefetching over the same Probe: every stage runs for a group of
+ * keys before the next one starts. Pipeline is drained after each group,
+ * but tight per-stage loops are cheaper when probes are compute-bound,
+ * e.g. the whole index fits in last level cache.
+ */
+template <class Probe>
+void groupLookup(Probe &probe, size_t N, size_t group);
+
+namespace detail {
+
+template <unsigned S, bool CHECKED, class Probe, class State>
+inline void pipelineStage(Probe &probe, State *ring, size_t mask,
+                          size_t t, size_t N, size_t distance) {
+  if (CHECKED && t < S * distance)
+    return;
+  size_t i = t - S * distance;
+  if (!CHECKED || i < N)
+    probe.template stage<S>(i, ring[i & mask]);
+}
+
+template <class Probe, class State, unsigned... S>
+inline void groupStep(Probe &probe, State *state, size_t begin, size_t end,
+                      std::integer_sequence<unsigned, S...>) {
+  (([&] {
+    for (size_t i = begin; i < end; ++i)
+      probe.template stage<S>(i, state[i - begin]);
+  })(), ...);
+}
+
+template <bool CHECKED, class Probe, class State, unsigned... S>
+inline void pipelineStep(Probe &probe, State *ring, size_t mask, size_t t,
+                         size_t N, size_t distance,
+                         std::integer_sequence<unsigned, S...>) {
+  // Run later stages first, a key leaves the ring before its slot is reused
+  (pipelineStage<Probe::STAGES - 1 - S, CHECKED>(probe, ring, mask, t, N, distance), ...);
+}
+
+} // namespace detail
+
+template <class Probe>
+void pipelinedLookup(Probe &probe, size_t N, size_t distance) {
+  constexpr unsigned STAGES = Probe::STAGES;
+  using Stages = std::make_integer_sequence<unsigned, STAGES>;
+  distance = std::max<size_t>(distance, 1);
+
+  // Keys in flight never exceed STAGES * distance
+  size_t inflight = std::min<size_t>(N, STAGES * distance);
+  size_t ringSize = 1;
+  while (ringSize < inflight)
+    ringSize *= 2;
+  folly::small_vector<typename Probe::State, 64> ring(ringSize);
+  size_t mask = ringSize - 1;
+
+  // Fill pipeline, run it with every stage busy, then drain
+  size_t fill = (STAGES - 1) * distance;
+  size_t steps = N + fill;
+  size_t t = 0;
+  for (; t < std::min(fill, steps); ++t)
+    detail::pipelineStep<true>(probe, ring.data(), mask, t, N, distance, Stages());
+  for (; t < N; ++t)
+    detail::pipelineStep<false>(probe, ring.data(), mask, t, N, distance, Stages());
+  for (; t < steps; ++t)
+    detail::pipelineStep<true>(probe, ring.data(), mask, t, N, distance, Stages());
+}
+
+template <class Probe>
+void groupLookup(Probe &probe, size_t N, size_t group) {
+  using Stages = std::make_integer_sequence<unsigned, Probe::STAGES>;
+  group = std::max<size_t>(group, 1);
+  folly::small_vector<typename Probe::State, 64> state(std::min(N, group));
+
+  for (size_t begin = 0; begin < N; begin += group)
+    detail::groupStep(probe, state.data(), begin, std::min(N, begin + group), Stages());
+}
+
+/**
+ * Two-stage probe of a folly F14 map: hashing prefetches the chunk,
+ * then find() compares tags and keys. Emit is called as emit(i, iterator).
+ */
+template <class Map, class Emit>
+struct F14Probe {
+  static constexpr unsigned STAGES = 2;
+  using State = typename std::decay<
+    decltype(std::declval<const Map&>().prehash(uint64_t()))>::type;
+
+  const Map &map;
+  const uint64_t *keys;
+  Emit emit;
+
+  template <unsigned S>
+  void stage(size_t i, State &token) {
+    if constexpr (S == 0)
+      token = map.prehash(keys[i]);
+    else
+      emit(i, map.find(token, keys[i]));
+  }
+};
+
+/** Look up a batch of keys in F14 map, see F14Probe. */
+template <class Map, class Emit>
+void f14Lookup(const Map &map, size_t N, const uint64_t *keys,
+               size_t distance, Emit emit) {
+  F14Probe<Map, Emit> probe{map, keys, std::move(emit)};
+  pipelinedLookup(probe, N, distance);
+}
+
+#endif // CALLFWD_BATCHLOOKUP_H
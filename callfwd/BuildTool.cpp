@@ -0,0 +1,205 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <glog/logging.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+#include <folly/stop_watch.h>
+#include <folly/init/Init.h>
+#include <folly/portability/GFlags.h>
+#include <folly/Range.h>
+
+#include "CSVReader.h"
+#include "PhoneMapping.h"
+#include "DncMapping.h"
+#include "DnoMapping.h"
+#include "TollFreeMapping.h"
+#include "LergMapping.h"
+#include "YoumailMapping.h"
+#include "GeoMapping.h"
+#include "FtcMapping.h"
+#include "F404Mapping.h"
+#include "F606Mapping.h"
+
+/*
+ * Offline builder of datasets. Parses a feed and builds its indexes the
+ * same way `reload` does, but outside of the daemon, so the whole machine
+ * is available to it. US/CA mapping is written as a binary snapshot for
+ * `load_snapshot`; other datasets have no snapshot format and are only
+ * checked. A JSON report with row count, timings and memory of the built
+ * dataset is printed to stdout, the first bad row or duplicate key is
+ * logged with its line number and fails the build.
+ */
+
+using folly::StringPiece;
+
+DEFINE_string(type, "nanp",
+              "Dataset of input: nanp, dnc, tollfree, dno, dno_npa, dno_npa_nxx, "
+              "dno_npa_nxx_x, lerg, youmail, geo, ftc, 404 or 606");
+DEFINE_string(output, "",
+              "Write snapshot of US/CA mapping to this path, "
+              "without it the input is only checked");
+DEFINE_string(index, "f14",
+              "Lookup index of US/CA snapshot: f14, mph or npanxx");
+DEFINE_string(country, "US", "Country recorded in US/CA snapshot metadata");
+
+static StringPiece osBasename(StringPiece path) {
+  auto idx = path.rfind('/');
+  if (idx == StringPiece::npos) {
+    return path;
+  }
+  return path.subpiece(idx + 1);
+}
+
+static double elapsedSeconds(folly::stop_watch<> &watch) {
+  double seconds = watch.elapsed().count() / 1000.0;
+  watch.reset();
+  return seconds;
+}
+
+/**
+ * Read rows of path into builder by fromCSV(reader, line) and build it, then
+ * pass the mapping to finish(mapping, report). Row size of the feed gives
+ * an estimate to preallocate for, the same as callfwdctl sends.
+ */
+template <class Builder, class FromCSV, class Finish>
+static int buildFile(const std::string &path, Builder &builder, size_t rowSize,
+                     folly::dynamic meta, FromCSV &&fromCSV, Finish &&finish)
+{
+  folly::dynamic report = folly::dynamic::object
+    ("file_name", path)
+    ("type", FLAGS_type);
+
+  struct stat st;
+  size_t estimate = 0;
+  if (!StringPiece(path).endsWith("gz") && stat(path.c_str(), &st) == 0)
+    estimate = st.st_size / rowSize;
+
+  time_t now = time(nullptr);
+  char built[32];
+  strftime(built, sizeof(built), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+  builder.sizeHint(estimate + estimate / 20);
+  meta["file_name"] = path;
+  meta["loaded"] = built;
+  meta["row_estimate"] = estimate;
+  builder.setMetadata(meta);
+
+  folly::stop_watch<> watch;
+  size_t nrows = 0;
+  try {
+    CSVReader in(path);
+    LOG(INFO) << "Reading " << FLAGS_type << " from " << path
+              << " (" << estimate << " rows estimated)";
+    while (!in.eof())
+      fromCSV(in, nrows);
+  } catch (std::runtime_error &e) {
+    LOG(ERROR) << osBasename(path) << ':' << nrows + 1 << ": " << e.what();
+    return 1;
+  }
+  report["rows"] = nrows;
+  report["read_seconds"] = elapsedSeconds(watch);
+
+  LOG(INFO) << "Building index (" << nrows << " rows)...";
+  try {
+    auto mapping = builder.build();
+    report["build_seconds"] = elapsedSeconds(watch);
+    report["memory"] = mapping.memoryUsage();
+    finish(mapping, report);
+  } catch (std::runtime_error &e) {
+    LOG(ERROR) << osBasename(path) << ": " << e.what();
+    return 1;
+  }
+
+  std::cout << folly::toPrettyJson(report) << std::endl;
+  return 0;
+}
+
+/** Build aux dataset only to check it, rows are read by 10000. */
+template <class Builder>
+static int checkFile(const std::string &path, size_t rowSize) {
+  Builder builder;
+  return buildFile(path, builder, rowSize, folly::dynamic::object(),
+    [&](CSVReader &in, size_t &nrows) {
+      builder.fromCSV(in, nrows, 10000);
+    },
+    [](auto &mapping, folly::dynamic &report) {});
+}
+
+static int buildNANP(const std::string &path) {
+  PhoneMapping::Builder builder;
+  builder.setEngine(PhoneMapping::parseEngine(FLAGS_index));
+  // Load command passes its own country, this one is for the record
+  folly::dynamic meta = folly::dynamic::object
+    ("country", FLAGS_country)
+    ("index", FLAGS_index);
+  return buildFile(path, builder, 23, meta,
+    [&](CSVReader &in, size_t &nrows) {
+      builder.fromCSV(in, nrows, 1 << 20);
+    },
+    [&](PhoneMapping &mapping, folly::dynamic &report) {
+      if (FLAGS_output.empty())
+        return;
+      folly::stop_watch<> watch;
+      mapping.writeSnapshot(FLAGS_output);
+      report["snapshot"] = FLAGS_output;
+      report["write_seconds"] = elapsedSeconds(watch);
+    });
+}
+
+static int buildDNO(const std::string &path, const std::string &dnotype,
+                    size_t rowSize) {
+  DnoMapping::Builder builder;
+  return buildFile(path, builder, rowSize, folly::dynamic::object(),
+    [&](CSVReader &in, size_t &nrows) {
+      builder.fromCSV(in, dnotype, nrows, 10000);
+    },
+    [](DnoMapping &mapping, folly::dynamic &report) {});
+}
+
+int main(int argc, char* argv[]) {
+  FLAGS_logtostderr = true;
+  gflags::SetUsageMessage("[--type=nanp] [--output=snapshot] input.{txt,tar.gz}");
+  folly::Init init(&argc, &argv);
+  setlocale(LC_ALL, "C");
+
+  if (argc != 2) {
+    std::cerr << gflags::ProgramUsage() << std::endl;
+    return 2;
+  }
+  const std::string path = argv[1];
+  const std::string &type = FLAGS_type;
+
+  if (type == "nanp")
+    return buildNANP(path);
+  if (type == "dnc")
+    return checkFile<DncMapping::Builder>(path, 11);
+  if (type == "tollfree")
+    return checkFile<TollFreeMapping::Builder>(path, 38);
+  if (type == "dno")
+    return buildDNO(path, "dno", 38);
+  if (type == "dno_npa")
+    return buildDNO(path, "dno_npa", 7);
+  if (type == "dno_npa_nxx")
+    return buildDNO(path, "dno_npa_nxx", 11);
+  if (type == "dno_npa_nxx_x")
+    return buildDNO(path, "dno_npa_nxx_x", 37);
+  if (type == "lerg")
+    return checkFile<LergMapping::Builder>(path, 69);
+  if (type == "youmail")
+    return checkFile<YoumailMapping::Builder>(path, 45);
+  if (type == "geo")
+    return checkFile<GeoMapping::Builder>(path, 190);
+  if (type == "ftc")
+    return checkFile<FtcMapping::Builder>(path, 120);
+  if (type == "404")
+    return checkFile<F404Mapping::Builder>(path, 38);
+  if (type == "606")
+    return checkFile<F606Mapping::Builder>(path, 190);
+
+  LOG(ERROR) << "Unknown dataset type: " << type;
+  return 2;
+}
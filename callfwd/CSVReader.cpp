@@ -0,0 +1,219 @@
+#include "CSVReader.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include "InflatePipeline.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Pipes are read by blocks of this size, the buffer grows for longer lines
+static constexpr size_t BLOCK_SIZE = size_t(4) << 20;
+
+static std::system_error errnoError(const std::string &what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+/** Find first c in [p, e), or e if there is none. */
+static const char* findByte(const char *p, const char *e, char c) {
+#if defined(__x86_64__)
+  const __m128i needle = _mm_set1_epi8(c);
+  for (; e - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+#endif
+  while (p != e && *p != c)
+    ++p;
+  return p;
+}
+
+CSVReader::CSVReader(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw errnoError("open " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    auto err = errnoError("fstat " + path);
+    close(fd);
+    throw err;
+  }
+
+  char magic[2];
+  bool regular = S_ISREG(st.st_mode);
+  if (!regular || (pread(fd, magic, 2, 0) == 2 && InflatePipeline::isGzip(magic, 2))) {
+    fd_ = fd;
+    buf_.reset(new char[BLOCK_SIZE]);
+    capacity_ = BLOCK_SIZE;
+    pos_ = end_ = buf_.get();
+    if (regular) {
+      inflate_ = std::make_unique<InflatePipeline>(fd_, nullptr, 0);
+      fd_ = -1;
+      return;
+    }
+
+    // A pipe can't be peeked, pass what was read to the pipeline
+    refill();
+    if (InflatePipeline::isGzip(pos_, end_ - pos_)) {
+      inflate_ = std::make_unique<InflatePipeline>(fd_, pos_, end_ - pos_);
+      fd_ = -1;
+      pos_ = end_ = buf_.get();
+      drained_ = false;
+    }
+    return;
+  }
+
+  close(fd);
+  file_ = MappedFile::openReadOnly(path);
+  file_.willNeed();
+  pos_ = reinterpret_cast<const char*>(file_.range().begin());
+  end_ = reinterpret_cast<const char*>(file_.range().end());
+  drained_ = true;
+}
+
+CSVReader::CSVReader(std::istream &in)
+  : buf_(new char[BLOCK_SIZE])
+  , capacity_(BLOCK_SIZE)
+  , in_(&in)
+{
+  pos_ = end_ = buf_.get();
+}
+
+CSVReader::~CSVReader() noexcept {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+void CSVReader::refill() {
+  size_t rest = end_ - pos_;
+  if (rest == capacity_) {
+    // Line longer than the buffer
+    std::unique_ptr<char[]> grown(new char[capacity_ * 2]);
+    memcpy(grown.get(), pos_, rest);
+    buf_ = std::move(grown);
+    capacity_ *= 2;
+  } else if (pos_ != buf_.get()) {
+    memmove(buf_.get(), pos_, rest);
+  }
+
+  char *begin = buf_.get();
+  char *end = begin + rest;
+  char *limit = begin + capacity_;
+  while (end != limit) {
+    ssize_t n;
+    if (in_) {
+      n = in_->rdbuf()->sgetn(end, limit - end);
+    } else if (inflate_) {
+      n = inflate_->read(end, limit - end);
+    } else {
+      n = read(fd_, end, limit - end);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw errnoError("read");
+    }
+    if (n == 0) {
+      drained_ = true;
+      break;
+    }
+    end += n;
+  }
+  pos_ = begin;
+  end_ = end;
+}
+
+bool CSVReader::cutLine(folly::StringPiece &line) {
+  const char *nl = findByte(pos_, end_, '\n');
+  if (nl == end_ && (!drained_ || pos_ == end_))
+    return false;
+
+  const char *e = nl;
+  if (e != pos_ && e[-1] == '\r')
+    --e;
+  line = folly::StringPiece(pos_, e);
+  pos_ = nl == end_ ? nl : nl + 1;
+  return true;
+}
+
+bool CSVReader::eof() {
+  while (pos_ == end_ && !drained_)
+    refill();
+  return pos_ == end_;
+}
+
+bool CSVReader::readLine(folly::StringPiece &line) {
+  while (!cutLine(line)) {
+    if (drained_)
+      return false;
+    refill();
+  }
+  return true;
+}
+
+size_t CSVReader::readLines(size_t limit, std::vector<folly::StringPiece> &lines) {
+  lines.clear();
+  folly::StringPiece line;
+  while (lines.size() < limit) {
+    if (cutLine(line)) {
+      lines.push_back(line);
+      continue;
+    }
+    // Refill would move lines already handed out
+    if (drained_ || !lines.empty())
+      break;
+    refill();
+  }
+  return lines.size();
+}
+
+void CSVReader::split(folly::StringPiece line,
+                      std::vector<folly::StringPiece> &fields) {
+  fields.clear();
+  const char *begin = line.begin();
+  const char *p = begin;
+  const char *e = line.end();
+#if defined(__x86_64__)
+  const __m128i comma = _mm_set1_epi8(',');
+  auto cut = [&](const char *base, unsigned mask) {
+    for (; mask; mask &= mask - 1) {
+      const char *c = base + __builtin_ctz(mask);
+      fields.emplace_back(begin, c);
+      begin = c + 1;
+    }
+  };
+  for (; e - p >= 16; p += 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    cut(p, _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, comma)));
+  }
+  if (p != e && e - line.begin() >= 16) {
+    // Load the last 16 bytes of line again, skip ones seen already
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(e - 16));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, comma));
+    cut(e - 16, mask & ~0u << (16 - (e - p)));
+    p = e;
+  }
+#endif
+  for (; p != e; ++p) {
+    if (*p == ',') {
+      fields.emplace_back(begin, p);
+      begin = p + 1;
+    }
+  }
+  fields.emplace_back(begin, e);
+}
+
+void CSVReader::splitRow(folly::StringPiece line,
+                         std::vector<folly::StringPiece> &fields) {
+  split(line, fields);
+  if (fields.back().empty())
+    fields.pop_back();
+}
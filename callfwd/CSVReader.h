@@ -0,0 +1,125 @@
+#ifndef CALLFWD_CSVREADER_H
+#define CALLFWD_CSVREADER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include "MappedFile.h"
+
+class InflatePipeline;
+
+/*
+ * Input of Builder::fromCSV(). A regular file is mapped and its lines are
+ * handed out as views into the mapping, a pipe or stream is read by large
+ * blocks into a buffer. Line breaks and commas are found 16 bytes at a
+ * time and numbers are parsed in place, nothing is allocated per line.
+ * A .gz or .tar.gz input is recognized by its content and unpacked by
+ * InflatePipeline on the way into the buffer.
+ */
+class CSVReader {
+ public:
+  /** Map regular file, or read it by blocks if it is a pipe or gzip.
+    * Throws `system_error` if file can't be opened. */
+  explicit CSVReader(const std::string &path);
+
+  /** Read stream by blocks. */
+  explicit CSVReader(std::istream &in);
+
+  CSVReader(const CSVReader&) = delete;
+  CSVReader& operator=(const CSVReader&) = delete;
+  ~CSVReader() noexcept;
+
+  /** Check if all lines were read. */
+  bool eof();
+
+  /** Get next line without line break, false at the end of input.
+    * The view is valid until the next read. */
+  bool readLine(folly::StringPiece &line);
+
+  /** Get up to `limit` next lines, fewer if they don't fit the buffer
+    * but at least one before the end of input. Views are valid until
+    * the next read. Returns number of lines. */
+  size_t readLines(size_t limit, std::vector<folly::StringPiece> &lines);
+
+  /** Split line by commas into fields, n commas give n+1 fields. */
+  static void split(folly::StringPiece line,
+                    std::vector<folly::StringPiece> &fields);
+
+  /** Same as split(), but a comma ending the line doesn't start a field,
+    * the way getline() splits a stringstream. */
+  static void splitRow(folly::StringPiece line,
+                       std::vector<folly::StringPiece> &fields);
+
+  /** Parse decimal number with optional spaces around it. Digits may be
+    * separated by `separator`, e.g. '-' in 201-555-0100.
+    * Throws `runtime_error` if it is not a number. */
+  static uint64_t parseNumber(folly::StringPiece field, char separator = 0);
+
+ private:
+  /** Move the rest to the front of buffer and read more input. */
+  void refill();
+
+  /** Cut next line, false if it doesn't end in the buffer yet. */
+  bool cutLine(folly::StringPiece &line);
+
+  MappedFile file_;
+  std::unique_ptr<char[]> buf_;
+  size_t capacity_ = 0;
+  const char *pos_ = nullptr;
+  const char *end_ = nullptr;
+  std::istream *in_ = nullptr;
+  std::unique_ptr<InflatePipeline> inflate_;
+  int fd_ = -1;
+  bool drained_ = false;  // nothing left to read into buffer
+};
+
+inline uint64_t CSVReader::parseNumber(folly::StringPiece field, char separator) {
+  const char *p = field.begin();
+  const char *e = field.end();
+  while (p != e && *p == ' ')
+    ++p;
+  while (e != p && e[-1] == ' ')
+    --e;
+
+  uint64_t value = 0;
+  unsigned digits = 0;
+#if defined(__x86_64__)
+  // Eight digits at a time while they are all digits
+  while (e - p >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, p, 8);
+    if (((chunk & 0xF0F0F0F0F0F0F0F0) |
+         (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) != 0x3333333333333333)
+      break;
+    chunk = (chunk & 0x0F0F0F0F0F0F0F0F) * 2561 >> 8;
+    chunk = (chunk & 0x00FF00FF00FF00FF) * 6553601 >> 16;
+    chunk = (chunk & 0x0000FFFF0000FFFF) * 42949672960001 >> 32;
+    value = value * 100000000 + chunk;
+    digits += 8;
+    p += 8;
+  }
+#endif
+  for (; p != e; ++p) {
+    unsigned d = unsigned(*p) - '0';
+    if (d <= 9) {
+      value = value * 10 + d;
+      ++digits;
+    } else if (*p != separator || separator == 0) {
+      throw std::runtime_error("bad number");
+    }
+  }
+  // 19 digits always fit uint64_t
+  if (digits == 0 || digits > 19)
+    throw std::runtime_error("bad number");
+  return value;
+}
+
+#endif // CALLFWD_CSVREADER_H
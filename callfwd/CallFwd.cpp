@@ -33,6 +33,8 @@ int main(int argc, char* argv[]) {
   folly::Init init(&argc, &argv);
   google::InstallFailureSignalHandler();
   setlocale(LC_ALL, "C");
+  // Restore jobs are queued before any reload sent over the socket
+  warmStart();
   startControlSocket();
 
   CHECK(FLAGS_http_port < 65536);
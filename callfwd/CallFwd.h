@@ -12,6 +12,7 @@ namespace folly {
   class IPAddress;
   class LogWriter;
   class EventBase;
+  struct dynamic;
 }
 namespace proxygen {
   class RequestHandlerFactory;
@@ -19,6 +20,13 @@ namespace proxygen {
 
 void startControlSocket();
 
+/** Repeat loads recorded in --warm_start_manifest, waits for them
+  * with --warm_start_wait. */
+void warmStart();
+
+/** Get memory usage of every dataset, see MemoryUsage. */
+folly::dynamic memoryReport();
+
 std::unique_ptr<proxygen::RequestHandlerFactory>
 makeApiHandlerFactory();
 
@@ -0,0 +1,97 @@
+#ifndef CALLFWD_CODECOLUMN_H
+#define CALLFWD_CODECOLUMN_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include "HugePages.h"
+
+/**
+ * Column of dictionary codes packed into 2, 3 or 4 bytes each, the width
+ * is chosen by dictionary size. Codes are read with a single unaligned
+ * little-endian load, so storage is padded to allow reading past the last
+ * code.
+ */
+class CodeColumn {
+ public:
+  static constexpr size_t PADDING = 3;
+
+  /** Get number of bytes per code enough for a dictionary. */
+  static unsigned widthFor(size_t dictSize) noexcept {
+    if (dictSize <= (1u << 16))
+      return 2;
+    if (dictSize <= (1u << 24))
+      return 3;
+    return 4;
+  }
+
+  /** Get number of bytes used by a column. */
+  static size_t bytesFor(size_t size, unsigned width) noexcept {
+    return size * width + PADDING;
+  }
+
+  CodeColumn() = default;
+
+  /** Allocate zeroed column. */
+  CodeColumn(size_t size, unsigned width)
+    : store_(bytesFor(size, width), 0)
+    , bytes_(folly::range(store_))
+    , size_(size)
+    , width_(width)
+    , mask_(maskFor(width))
+  {}
+
+  /** Attach to bytes of a column built before, e.g. mapped from file.
+    * Throws `runtime_error` if size doesn't match. */
+  CodeColumn(folly::ByteRange bytes, size_t size, unsigned width)
+    : bytes_(bytes)
+    , size_(size)
+    , width_(width)
+    , mask_(maskFor(width))
+  {
+    if (bytes.size() != bytesFor(size, width) && !(size == 0 && bytes.empty()))
+      throw std::runtime_error("CodeColumn: unexpected size");
+  }
+
+  CodeColumn(CodeColumn&& rhs) noexcept = default;
+  CodeColumn& operator=(CodeColumn&& rhs) noexcept = default;
+
+  size_t size() const noexcept { return size_; }
+  unsigned width() const noexcept { return width_; }
+  /** Get bytes allocated, 0 if attached to an array. */
+  size_t allocatedBytes() const noexcept { return store_.capacity(); }
+  folly::ByteRange bytes() const noexcept { return bytes_; }
+
+  uint32_t operator[](size_t i) const noexcept {
+    uint32_t code;
+    memcpy(&code, bytes_.data() + i * width_, sizeof(code));
+    return code & mask_;
+  }
+
+  const uint8_t* address(size_t i) const noexcept {
+    return bytes_.data() + i * width_;
+  }
+
+  /** Store code of an allocated column. */
+  void set(size_t i, uint32_t code) noexcept {
+    memcpy(&store_[i * width_], &code, width_);
+  }
+
+ private:
+  static uint32_t maskFor(unsigned width) noexcept {
+    return width >= 4 ? ~uint32_t(0) : (uint32_t(1) << (8 * width)) - 1;
+  }
+
+  LargeVector<uint8_t> store_;
+  folly::ByteRange bytes_;
+  size_t size_ = 0;
+  unsigned width_ = 4;
+  uint32_t mask_ = ~uint32_t(0);
+};
+
+#endif // CALLFWD_CODECOLUMN_H
@@ -1,9 +1,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <memory>
+#include <system_error>
 #include <thread>
+#include <vector>
 #include <atomic>
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-journal.h>
@@ -22,12 +30,18 @@
 #include "DnoMapping.h"
 #include "TollFreeMapping.h"
 #include "LergMapping.h"
+#include "KeyFilter.h"
 #include "YoumailMapping.h"
 #include "GeoMapping.h"
 #include "FtcMapping.h"
 #include "F404Mapping.h"
 #include "F606Mapping.h"
+#include "HugePages.h"
+#include "Reclaimer.h"
+#include "ReloadScheduler.h"
+#include "Manifest.h"
 #include "ACL.h"
+#include "CSVReader.h"
 
 using folly::StringPiece;
 
@@ -35,8 +49,15 @@ DEFINE_uint32(status_report_period, 0,
               "How often (in seconds) long operation reports about its status");
 static auto reportPeriod = std::chrono::seconds(30);
 
-static std::atomic<PhoneMapping::Data*> mappingUS;
-static std::atomic<PhoneMapping::Data*> mappingCA;
+DEFINE_string(warm_start_manifest, "",
+              "Record committed loads of every dataset in this file and repeat them at startup");
+DEFINE_string(warm_start_snapshot_dir, "",
+              "Write snapshots of datasets here after each reload and delta, "
+              "manifest refers to them instead of the inputs");
+DEFINE_bool(warm_start_wait, false,
+            "Open control socket, HTTP and SIP ports after the manifest is restored");
+
+static std::atomic<NanpMapping::Data*> mappingNANP;
 static std::atomic<DncMapping::Data*> mappingDNC;
 static std::atomic<DnoMapping::Data*> mappingDNO;
 static std::atomic<TollFreeMapping::Data*> mappingTollFree;
@@ -48,8 +69,9 @@ static std::atomic<FtcMapping::Data*> mappingFtc;
 static std::atomic<F404Mapping::Data*> mapping404;
 static std::atomic<F606Mapping::Data*> mapping606;
 
-PhoneMapping PhoneMapping::getUS() noexcept { return { mappingUS }; }
-PhoneMapping PhoneMapping::getCA() noexcept { return { mappingCA }; }
+NanpMapping NanpMapping::getNANP() noexcept { return { mappingNANP }; }
+PhoneMapping PhoneMapping::getUS() noexcept { return { mappingNANP, NanpMapping::Country::US }; }
+PhoneMapping PhoneMapping::getCA() noexcept { return { mappingNANP, NanpMapping::Country::CA }; }
 DnoMapping DnoMapping::getDNO() noexcept { return { mappingDNO }; }
 DncMapping DncMapping::getDNC() noexcept { return { mappingDNC }; }
 TollFreeMapping TollFreeMapping::getTollFree() noexcept { return { mappingTollFree }; }
@@ -61,7 +83,9 @@ F404Mapping F404Mapping::getF404() noexcept { return { mapping404 }; }
 F606Mapping F606Mapping::getF606() noexcept { return { mapping606 }; }
 
 bool PhoneMapping::isAvailable() noexcept {
-  return !!mappingUS.load() && !!mappingCA.load();
+  NanpMapping nanp = NanpMapping::getNANP();
+  return nanp.hasCountry(NanpMapping::Country::US)
+    && nanp.hasCountry(NanpMapping::Country::CA);
 }
 
 bool DncMapping::isAvailable() noexcept {
@@ -102,6 +126,39 @@ bool F606Mapping::isAvailable() noexcept {
 
 ACL ACL::get() noexcept { return { currentACL }; }
 
+folly::dynamic memoryReport() {
+  std::pair<size_t, size_t> large = largeBlocks();
+  ReclaimerStats reclaimer = reclaimerStats();
+  return folly::dynamic::object
+    ("nanp", NanpMapping::getNANP().memoryUsage())
+    ("us", PhoneMapping::getUS().memoryUsage())
+    ("ca", PhoneMapping::getCA().memoryUsage())
+    ("dnc", DncMapping::getDNC().memoryUsage())
+    ("dno", DnoMapping::getDNO().memoryUsage())
+    ("tollfree", TollFreeMapping::getTollFree().memoryUsage())
+    ("lerg", LergMapping::getLerg().memoryUsage())
+    ("youmail", YoumailMapping::getYoumail().memoryUsage())
+    ("geo", GeoMapping::getGeo().memoryUsage())
+    ("ftc", FtcMapping::getFtc().memoryUsage())
+    ("404", F404Mapping::getF404().memoryUsage())
+    ("606", F606Mapping::getF606().memoryUsage())
+    ("large_blocks", folly::dynamic::object("count", large.first)
+                                           ("bytes", large.second))
+    ("reclaimer", folly::dynamic::object
+      ("pending_versions", reclaimer.pendingVersions)
+      ("pending_bytes", reclaimer.pendingBytes)
+      ("lag_seconds", reclaimer.lagSeconds)
+      ("reclaimed_versions", reclaimer.reclaimedVersions)
+      ("reclaimed_bytes", reclaimer.reclaimedBytes));
+}
+
+static void logMemoryReport() {
+  LOG(INFO) << "Memory usage:";
+  for (auto kv : memoryReport().items())
+    LOG(INFO) << "  " << kv.first.asString()
+              << ": " << folly::toJson(kv.second);
+}
+
 static StringPiece osBasename(StringPiece path) {
   auto idx = path.rfind('/');
   if (idx == StringPiece::npos) {
@@ -137,230 +194,126 @@ static bool loadMappingFile(const std::string &path, folly::dynamic meta)
   const std::string &name = meta.getDefault("file_name", path).asString();
   const std::string &country = meta.getDefault("country", "US").asString();
 
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
   folly::stop_watch<> watch;
 
   PhoneMapping::Builder builder;
   size_t nrows = 0;
 
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
+    CSVReader in(path);
 
     builder.sizeHint(estimate + estimate / 20);
     builder.setMetadata(meta);
+    builder.setEngine(PhoneMapping::parseEngine(
+      meta.getDefault("index", "f14").asString()));
 
     LOG(INFO) << "Reading database from " << name
       << " (" << estimate << " rows estimated)";
 
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
+    while (!in.eof()) {
+      builder.fromCSV(in, nrows, 1 << 20);
       if (watch.lap(reportPeriod)) {
         LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
         LOG_IF(INFO, estimate == 0) << nrows << " rows read";
       }
     }
-    in.close();
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ':' << nrows + 1 << ": " << e.what();
     return false;
   }
 
   LOG(INFO) << "Building index (" << nrows << " rows)...";
-  if (country == "CA")
-    builder.commit(mappingCA);
-  else
-    builder.commit(mappingUS);
-  folly::hazptr_cleanup();
-  return true;
-}
-
-static bool loadDNCMappingFile(const std::string &path, folly::dynamic meta)
-{
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
-  const std::string &name = meta.getDefault("file_name", path).asString();
-
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
-  folly::stop_watch<> watch;
-
-  DncMapping::Builder builder;
-  size_t nrows = 0;
-
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
-    builder.setMetadata(meta);
-
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
+    if (country == "CA")
+      builder.commit(mappingNANP, NanpMapping::Country::CA);
+    else
+      builder.commit(mappingNANP, NanpMapping::Country::US);
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ": " << e.what();
     return false;
   }
-
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mappingDNC);
   folly::hazptr_cleanup();
   return true;
 }
 
-static bool loadDnoMappingFile(const std::string &path, folly::dynamic meta, std::string dnotype)
+static bool loadDeltaFile(const std::string &path, folly::dynamic meta)
 {
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
   const std::string &name = meta.getDefault("file_name", path).asString();
+  const std::string &country = meta.getDefault("country", "US").asString();
 
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
-  folly::stop_watch<> watch;
-
-  DnoMapping::Builder builder;
+  PhoneMapping::Builder builder;
   size_t nrows = 0;
 
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
+    CSVReader in(path);
     builder.setMetadata(meta);
 
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, dnotype, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
+    LOG(INFO) << "Reading delta from " << name;
+    while (!in.eof())
+      builder.deltaFromCSV(in, nrows, 1 << 20);
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ':' << nrows + 1 << ": " << e.what();
     return false;
   }
 
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mappingDNO);
-  folly::hazptr_cleanup();
-  return true;
-}
-
-static bool loadTollFreeMappingFile(const std::string &path, folly::dynamic meta)
-{
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
-  const std::string &name = meta.getDefault("file_name", path).asString();
-
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
-  folly::stop_watch<> watch;
-
-  TollFreeMapping::Builder builder;
-  size_t nrows = 0;
-
+  LOG(INFO) << "Applying delta (" << nrows << " rows)...";
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
-    builder.setMetadata(meta);
-
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
+    if (country == "CA")
+      builder.commitDelta(mappingNANP, NanpMapping::Country::CA);
+    else
+      builder.commitDelta(mappingNANP, NanpMapping::Country::US);
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ": " << e.what();
     return false;
   }
-
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mappingTollFree);
   folly::hazptr_cleanup();
   return true;
 }
 
-static bool loadLergMappingFile(const std::string &path, folly::dynamic meta)
+static bool loadSnapshotFile(const std::string &path, folly::dynamic meta)
 {
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
   const std::string &name = meta.getDefault("file_name", path).asString();
+  const std::string &country = meta.getDefault("country", "US").asString();
 
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
   folly::stop_watch<> watch;
-
-  LergMapping::Builder builder;
-  size_t nrows = 0;
+  PhoneMapping::Builder builder;
 
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
-    builder.setMetadata(meta);
-
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
+    LOG(INFO) << "Mapping snapshot " << name;
+    builder.fromSnapshot(path);
+    LOG(INFO) << "Snapshot mapped in " << watch.elapsed().count() << "ms";
+
+    if (country == "CA")
+      builder.commit(mappingNANP, NanpMapping::Country::CA);
+    else
+      builder.commit(mappingNANP, NanpMapping::Country::US);
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ": " << e.what();
     return false;
   }
-
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mappingLerg);
   folly::hazptr_cleanup();
   return true;
 }
 
-static bool loadYoumailMappingFile(const std::string &path, folly::dynamic meta)
+/**
+ * Read rows of an aux dataset into a Builder of Mapping and commit it to
+ * global. Datasets share MappingTable, so they are all loaded this way,
+ * args are passed to fromCSV() before the row counter.
+ */
+template <class Mapping, class Data, class... Args>
+static bool loadTableFile(const std::string &path, folly::dynamic meta,
+                          std::atomic<Data*> &global, const Args&... args)
 {
   int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
   const std::string &name = meta.getDefault("file_name", path).asString();
 
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
   folly::stop_watch<> watch;
 
-  YoumailMapping::Builder builder;
+  typename Mapping::Builder builder;
   size_t nrows = 0;
 
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
+    CSVReader in(path);
 
     builder.sizeHint(estimate + estimate / 20);
     builder.setMetadata(meta);
@@ -368,198 +321,67 @@ static bool loadYoumailMappingFile(const std::string &path, folly::dynamic meta)
     LOG(INFO) << "Reading database from " << name
       << " (" << estimate << " rows estimated)";
 
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
+    while (!in.eof()) {
+      builder.fromCSV(in, args..., nrows, 10000);
       if (watch.lap(reportPeriod)) {
         LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
         LOG_IF(INFO, estimate == 0) << nrows << " rows read";
       }
     }
-    in.close();
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ':' << nrows + 1 << ": " << e.what();
     return false;
   }
 
   LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mappingYoumail);
-  folly::hazptr_cleanup();
-  return true;
-}
-
-static bool loadGeoMappingFile(const std::string &path, folly::dynamic meta)
-{
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
-  const std::string &name = meta.getDefault("file_name", path).asString();
-
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
-  folly::stop_watch<> watch;
-
-  GeoMapping::Builder builder;
-  size_t nrows = 0;
-
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
-    builder.setMetadata(meta);
-
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
+    builder.commit(global);
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ": " << e.what();
     return false;
   }
-
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mappingGeo);
   folly::hazptr_cleanup();
   return true;
 }
 
-static bool loadFtcMappingFile(const std::string &path, folly::dynamic meta)
+/** Map snapshot of an aux dataset written for warm start and commit it
+  * to global, rows are not parsed and filters are not built again. */
+template <class Mapping, class Data>
+static bool loadTableSnapshot(const std::string &path, folly::dynamic meta,
+                              std::atomic<Data*> &global)
 {
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
   const std::string &name = meta.getDefault("file_name", path).asString();
 
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
   folly::stop_watch<> watch;
-
-  FtcMapping::Builder builder;
-  size_t nrows = 0;
+  typename Mapping::Builder builder;
 
   try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
-    builder.setMetadata(meta);
-
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
+    LOG(INFO) << "Mapping snapshot of " << name;
+    builder.fromSnapshot(path);
+    builder.commit(global);
   } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(path) << ": " << e.what();
     return false;
   }
-
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mappingFtc);
+  LOG(INFO) << "Snapshot mapped in " << watch.elapsed().count() << "ms";
   folly::hazptr_cleanup();
   return true;
 }
 
-static bool load404MappingFile(const std::string &path, folly::dynamic meta)
+/** Write snapshot of an aux dataset, false if it isn't loaded. */
+template <class Mapping, class Data>
+static bool writeTableSnapshot(const std::string &path, std::atomic<Data*> &global)
 {
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
-  const std::string &name = meta.getDefault("file_name", path).asString();
-
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
-  folly::stop_watch<> watch;
-
-  F404Mapping::Builder builder;
-  size_t nrows = 0;
-
-  try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
-    builder.setMetadata(meta);
-
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
-  } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
+  if (!global.load())
     return false;
-  }
-
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mapping404);
-  folly::hazptr_cleanup();
-  return true;
-}
-
-static bool load606MappingFile(const std::string &path, folly::dynamic meta)
-{
-  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
-  const std::string &name = meta.getDefault("file_name", path).asString();
-
-  std::ifstream in;
-  std::vector<char> rbuf(1ull << 19);
-  folly::stop_watch<> watch;
-
-  F606Mapping::Builder builder;
-  size_t nrows = 0;
-
-  try {
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.rdbuf()->pubsetbuf(rbuf.data(), rbuf.size());
-    in.open(path);
-
-    builder.sizeHint(estimate + estimate / 20);
-    builder.setMetadata(meta);
-
-    LOG(INFO) << "Reading database from " << name
-      << " (" << estimate << " rows estimated)";
-
-    while (in.good()) {
-      builder.fromCSV(in, nrows, 10000);
-      if (watch.lap(reportPeriod)) {
-        LOG_IF(INFO, estimate != 0) << nrows * 100 / estimate << "% completed";
-        LOG_IF(INFO, estimate == 0) << nrows << " rows read";
-      }
-    }
-    in.close();
-  } catch (std::runtime_error &e) {
-    LOG(ERROR) << osBasename(name) << ':' << nrows << ": " << e.what();
-    return false;
-  }
-
-  LOG(INFO) << "Building index (" << nrows << " rows)...";
-  builder.commit(mapping606);
-  folly::hazptr_cleanup();
+  Mapping(global).writeSnapshot(path);
   return true;
 }
 
 static bool verifyMappingFile(const std::string &path, folly::dynamic meta)
 {
-  std::ifstream in;
-  std::string linebuf;
-  std::vector<uint64_t> row;
+  folly::StringPiece linebuf;
+  std::vector<folly::StringPiece> row;
   folly::stop_watch<> watch;
   size_t maxdiff = 100;
   size_t nrows = 0;
@@ -569,23 +391,23 @@ static bool verifyMappingFile(const std::string &path, folly::dynamic meta)
 
   try {
     LOG(INFO) << "Verifying database";
-    in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    in.open(path);
-    while (in.good()) {
+    CSVReader in(path);
+    while (!in.eof()) {
       for (size_t i = 0; i < 10000; ++i) {
-        if (in.peek() == EOF)
+        if (!in.readLine(linebuf))
           break;
 
-        row.clear();
-        std::getline(in, linebuf);
-        folly::split(',', linebuf, row);
+        CSVReader::split(linebuf, row);
+        if (row.size() != 2)
+          throw std::runtime_error("bad number of columns");
+        uint64_t pn = CSVReader::parseNumber(row[0]);
         ++nrows;
 
-        if (db.getRN(row[0]) == row[1])
+        if (db.getRN(pn) == CSVReader::parseNumber(row[1]))
           continue;
 
         LOG(ERROR) << osBasename(path) << ":" << nrows
-                    << ": key " << row[0] << " differs";
+                    << ": key " << pn << " differs";
         if (--maxdiff == 0) {
           LOG(ERROR) << "Diff limit reached, stopping";
           return false;
@@ -594,7 +416,6 @@ static bool verifyMappingFile(const std::string &path, folly::dynamic meta)
       if (watch.lap(reportPeriod))
         LOG_IF(INFO, db.size()) << nrows * 100 / db.size() << "% completed";
     }
-    in.close();
   } catch (std::runtime_error& e) {
     LOG(ERROR) << osBasename(path) << ":" << nrows << ": " << e.what();
     return false;
@@ -609,33 +430,57 @@ static bool verifyMappingFile(const std::string &path, folly::dynamic meta)
   return true;
 }
 
-static bool dumpMappingFile(const std::string &path, folly::dynamic meta)
+/**
+ * Write mapping into file open as fd. Output is never truncated, as it may
+ * be a snapshot mapped by this process, so regular files must be empty.
+ */
+static bool dumpMappingFile(int fd, folly::dynamic meta)
 {
   std::ofstream out;
   folly::stop_watch<> watch;
   size_t nrows = 0;
 
+  const std::string &name = meta.getDefault("file_name", "dump").asString();
   bool canada = meta.getDefault("country", "US").asString() == "CA";
   PhoneMapping db = canada ? PhoneMapping::getCA() : PhoneMapping::getUS();
 
+  if (meta.getDefault("format", "csv").asString() == "snapshot") {
+    try {
+      LOG(INFO) << "Writing database snapshot";
+      db.writeSnapshot(fd);
+    } catch (std::runtime_error& e) {
+      LOG(ERROR) << osBasename(name) << ": " << e.what();
+      return false;
+    }
+
+    LOG(INFO) << db.size() << " rows written";
+    return true;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (S_ISREG(st.st_mode) && st.st_size != 0)) {
+    LOG(ERROR) << osBasename(name) << ": output must be a pipe or an empty file";
+    return false;
+  }
+
   try {
     LOG(INFO) << "Dumping database";
     out.exceptions(std::ios_base::failbit | std::ios_base::badbit);
-    out.open(path);
-
-    for (db.visitRows(); db.hasRow(); ) {
-      for (size_t i = 0; i < 10000 && db.hasRow(); ++i) {
-        out << db.currentPN() << "," << db.currentRN() << "\r\n";
-        db.advance();
-        ++nrows;
-      }
+    out.open(folly::sformat("/proc/self/fd/{}", fd), std::ios_base::app);
+
+    std::vector<uint64_t> pn(10000), rn(10000);
+    PhoneMapping::RowScan scan = db.scanRows();
+    while (size_t n = db.readRows(scan, pn.size(), pn.data(), rn.data())) {
+      for (size_t i = 0; i < n; ++i)
+        out << pn[i] << "," << rn[i] << "\r\n";
+      nrows += n;
       if (watch.lap(reportPeriod))
         LOG_IF(INFO, db.size()) << nrows * 100 / db.size() << "% completed";
     }
     out.flush();
     out.close();
   } catch (std::runtime_error& e) {
-    LOG(ERROR) << osBasename(path) << ":" << nrows << ": " << e.what();
+    LOG(ERROR) << osBasename(name) << ":" << nrows << ": " << e.what();
     return false;
   }
 
@@ -643,6 +488,301 @@ static bool dumpMappingFile(const std::string &path, folly::dynamic meta)
   return true;
 }
 
+/** Load of a dataset, queued in reloadScheduler(). */
+struct LoadCommand {
+  const char *cmd;
+  const char *dataset;  // nullptr for US/CA, then it is the country
+  int priority;         // 0 for US/CA, loaded first at startup
+  size_t rowBytes;      // rough peak memory of the build per row
+  bool delta;           // applied on top of the previous load
+  bool (*load)(const std::string &path, folly::dynamic meta);
+};
+
+static const LoadCommand LOAD_COMMANDS[] = {
+  { "reload", nullptr, 0, 64, false, loadMappingFile },
+  { "delta_reload", nullptr, 0, 64, true, loadDeltaFile },
+  { "load_snapshot", nullptr, 0, 0, false, loadSnapshotFile },
+  { "dnc_reload", "dnc", 1, 32, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<DncMapping>(path, meta, mappingDNC); } },
+  { "tollfree_reload", "tollfree", 1, 32, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<TollFreeMapping>(path, meta, mappingTollFree); } },
+  { "dno_reload", "dno", 1, 32, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<DnoMapping>(path, meta, mappingDNO, std::string("dno")); } },
+  { "dno_npa_reload", "dno", 1, 32, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<DnoMapping>(path, meta, mappingDNO, std::string("dno_npa")); } },
+  { "dno_npa_nxx_reload", "dno", 1, 32, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<DnoMapping>(path, meta, mappingDNO, std::string("dno_npa_nxx")); } },
+  { "dno_npa_nxx_x_reload", "dno", 1, 32, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<DnoMapping>(path, meta, mappingDNO, std::string("dno_npa_nxx_x")); } },
+  { "lerg_reload", "lerg", 1, 256, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<LergMapping>(path, meta, mappingLerg); } },
+  { "youmail_reload", "youmail", 1, 160, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<YoumailMapping>(path, meta, mappingYoumail); } },
+  { "geo_reload", "geo", 1, 256, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<GeoMapping>(path, meta, mappingGeo); } },
+  { "ftc_reload", "ftc", 1, 128, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<FtcMapping>(path, meta, mappingFtc); } },
+  { "404_reload", "404", 1, 96, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<F404Mapping>(path, meta, mapping404); } },
+  { "606_reload", "606", 1, 96, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableFile<F606Mapping>(path, meta, mapping606); } },
+  { "dnc_load_snapshot", "dnc", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<DncMapping>(path, meta, mappingDNC); } },
+  { "tollfree_load_snapshot", "tollfree", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<TollFreeMapping>(path, meta, mappingTollFree); } },
+  { "dno_load_snapshot", "dno", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<DnoMapping>(path, meta, mappingDNO); } },
+  { "lerg_load_snapshot", "lerg", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<LergMapping>(path, meta, mappingLerg); } },
+  { "youmail_load_snapshot", "youmail", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<YoumailMapping>(path, meta, mappingYoumail); } },
+  { "geo_load_snapshot", "geo", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<GeoMapping>(path, meta, mappingGeo); } },
+  { "ftc_load_snapshot", "ftc", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<FtcMapping>(path, meta, mappingFtc); } },
+  { "404_load_snapshot", "404", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<F404Mapping>(path, meta, mapping404); } },
+  { "606_load_snapshot", "606", 1, 0, false, [](const std::string &path, folly::dynamic meta) {
+      return loadTableSnapshot<F606Mapping>(path, meta, mapping606); } },
+};
+
+/** Snapshot of a dataset written for warm start. */
+struct SnapshotCommand {
+  const char *dataset;
+  const char *cmd;  // load command mapping it again
+  bool (*write)(const std::string &path);  // false if dataset is skipped
+};
+
+static const SnapshotCommand SNAPSHOT_COMMANDS[] = {
+  { "us", "load_snapshot", [](const std::string &path) {
+      return PhoneMapping::getUS().writeOwnSnapshot(path); } },
+  { "ca", "load_snapshot", [](const std::string &path) {
+      return PhoneMapping::getCA().writeOwnSnapshot(path); } },
+  { "dnc", "dnc_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<DncMapping>(path, mappingDNC); } },
+  { "tollfree", "tollfree_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<TollFreeMapping>(path, mappingTollFree); } },
+  { "dno", "dno_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<DnoMapping>(path, mappingDNO); } },
+  { "lerg", "lerg_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<LergMapping>(path, mappingLerg); } },
+  { "youmail", "youmail_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<YoumailMapping>(path, mappingYoumail); } },
+  { "geo", "geo_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<GeoMapping>(path, mappingGeo); } },
+  { "ftc", "ftc_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<FtcMapping>(path, mappingFtc); } },
+  { "404", "404_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<F404Mapping>(path, mapping404); } },
+  { "606", "606_load_snapshot", [](const std::string &path) {
+      return writeTableSnapshot<F606Mapping>(path, mapping606); } },
+};
+
+static const LoadCommand* findLoadCommand(const std::string &cmd) {
+  for (const LoadCommand &load : LOAD_COMMANDS)
+    if (cmd == load.cmd)
+      return &load;
+  return nullptr;
+}
+
+// Never destroyed, jobs may still run when the process exits
+static ReloadScheduler& reloadScheduler() {
+  static ReloadScheduler *instance = new ReloadScheduler(PhoneMapping::isAvailable);
+  return *instance;
+}
+
+static Manifest& manifest() {
+  static Manifest *instance = new Manifest(FLAGS_warm_start_manifest);
+  return *instance;
+}
+
+/** Get dataset of US/CA named by country of the command. */
+static std::string countryDataset(const folly::dynamic &meta) {
+  return meta.getDefault("country", "US").asString() == "CA" ? "ca" : "us";
+}
+
+/** Get dataset replaced by load, US/CA ones are named by country. */
+static std::string datasetOf(const LoadCommand &load, const folly::dynamic &meta) {
+  if (load.dataset)
+    return load.dataset;
+  return countryDataset(meta);
+}
+
+/** Get job running load of dataset, memory is estimated from its rows. */
+static ReloadScheduler::Job makeJob(const LoadCommand &load, const std::string &dataset,
+                                    const folly::dynamic &meta) {
+  int64_t estimate = meta.getDefault("row_estimate", 0).asInt();
+  ReloadScheduler::Job job;
+  job.name = load.cmd;
+  job.dataset = dataset;
+  job.priority = load.priority;
+  job.memoryBytes = size_t(std::max<int64_t>(estimate, 0)) * load.rowBytes;
+  return job;
+}
+
+static bool portNumber(const folly::dynamic &msg, bool unport)
+{
+  const std::string &country = msg.getDefault("country", "US").asString();
+  auto code = country == "CA" ? NanpMapping::Country::CA : NanpMapping::Country::US;
+
+  try {
+    uint64_t pn = PhoneNumber::fromString(msg["pn"].asString());
+    uint64_t rn = PhoneNumber::NONE;
+    if (!unport)
+      rn = PhoneNumber::fromString(msg["rn"].asString());
+    if (pn == PhoneNumber::NONE || (!unport && rn == PhoneNumber::NONE))
+      throw std::runtime_error("bad phone number");
+
+    if (!PhoneMapping::port(mappingNANP, code, pn, rn))
+      return true;
+  } catch (std::runtime_error &e) {
+    LOG(ERROR) << (unport ? "unport: " : "port: ") << e.what();
+    return false;
+  }
+
+  // Folding changes is a delta of the partition, queued behind its loads
+  ReloadScheduler::Job job;
+  job.name = "compact_overlay";
+  job.dataset = countryDataset(msg);
+  job.run = [code] {
+    PhoneMapping::compactOverlay(mappingNANP, code);
+    return true;
+  };
+  reloadScheduler().submit(std::move(job));
+  return true;
+}
+
+/** Get absolute path of the regular file open as fd, or empty string
+  * for pipes and deleted files, which can't be loaded again. */
+static std::string regularFilePath(int fd) {
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_nlink == 0)
+    return "";
+  char buf[PATH_MAX];
+  std::string link = folly::sformat("/proc/self/fd/{}", fd);
+  ssize_t len = readlink(link.c_str(), buf, sizeof(buf));
+  if (len <= 0 || size_t(len) == sizeof(buf) || buf[0] != '/')
+    return "";
+  return std::string(buf, len);
+}
+
+/** Queue writing snapshot of dataset for warm start, once written the
+  * manifest refers to it instead of the loads before. Only a country
+  * mapped as one table is written as it is, one with a delta or NPA
+  * shards keeps being restored from its inputs rather than rebuilt. */
+static void queueSnapshot(const LoadCommand &load, const std::string &dataset,
+                          const folly::dynamic &meta) {
+  const SnapshotCommand *snapshot = nullptr;
+  for (const SnapshotCommand &command : SNAPSHOT_COMMANDS)
+    if (dataset == command.dataset)
+      snapshot = &command;
+  if (!snapshot || strcmp(load.cmd, snapshot->cmd) == 0)
+    return;
+
+  std::string path = FLAGS_warm_start_snapshot_dir + "/" + dataset + ".snapshot";
+  ReloadScheduler::Job job;
+  job.name = "write_snapshot";
+  job.dataset = dataset;
+  job.priority = load.priority + 1;
+  job.run = [snapshot, dataset, path, meta] {
+    folly::stop_watch<> watch;
+    if (!snapshot->write(path)) {
+      LOG(INFO) << "Snapshot for warm start skipped, " << dataset << " carries a delta";
+      return true;
+    }
+    LOG(INFO) << "Snapshot of " << dataset << " for warm start written in "
+              << watch.elapsed().count() << "ms";
+    manifest().record(dataset, Manifest::Step{ snapshot->cmd, path, meta }, false);
+    return true;
+  };
+  reloadScheduler().submit(std::move(job));
+}
+
+/** Record committed load of dataset read from source in the manifest. */
+static void recordLoad(const LoadCommand &load, const std::string &dataset,
+                       const std::string &source, const folly::dynamic &meta) {
+  Manifest &m = manifest();
+  if (!m.enabled())
+    return;
+
+  if (source.empty()) {
+    LOG(WARNING) << load.cmd << " input is not a regular file, warm start skips " << dataset;
+    m.forget(dataset);
+  } else {
+    m.record(dataset, Manifest::Step{ load.cmd, source, meta }, load.delta);
+  }
+
+  // Datasets are restored from their snapshot where there is one
+  if (!FLAGS_warm_start_snapshot_dir.empty())
+    queueSnapshot(load, dataset, meta);
+}
+
+/** Repeat loads of dataset from the manifest, stops at the first failure. */
+static bool restoreDataset(const std::string &dataset,
+                           const std::vector<Manifest::Step> &steps) {
+  for (const Manifest::Step &step : steps) {
+    const LoadCommand *load = findLoadCommand(step.cmd);
+    if (!load) {
+      LOG(ERROR) << dataset << ": unknown command in manifest: " << step.cmd;
+      return false;
+    }
+    LOG(INFO) << "Restoring " << dataset << " by " << step.cmd << " of " << step.path;
+    if (!load->load(step.path, step.meta))
+      return false;
+  }
+  return true;
+}
+
+void warmStart() {
+  Manifest &m = manifest();
+  if (!m.enabled())
+    return;
+
+  std::map<std::string, std::vector<Manifest::Step>> datasets;
+  try {
+    m.load();
+    datasets = m.datasets();
+  } catch (std::exception &e) {
+    LOG(ERROR) << FLAGS_warm_start_manifest << ": " << e.what();
+    return;
+  }
+  if (datasets.empty())
+    return;
+
+  struct Progress {
+    std::atomic<size_t> left;
+    std::atomic<size_t> restored{0};
+    folly::stop_watch<> watch;
+    std::promise<void> finished;
+  };
+  auto progress = std::make_shared<Progress>();
+  progress->left = datasets.size();
+  std::future<void> finished = progress->finished.get_future();
+
+  LOG(INFO) << "Restoring " << datasets.size() << " datasets from " << FLAGS_warm_start_manifest;
+  for (auto &kv : datasets) {
+    const std::string &dataset = kv.first;
+    const LoadCommand *load = findLoadCommand(kv.second.front().cmd);
+    ReloadScheduler::Job job = load ? makeJob(*load, dataset, kv.second.front().meta)
+                                    : ReloadScheduler::Job();
+    job.name = "restore " + dataset;
+    job.dataset = dataset;
+    job.run = [dataset, steps = kv.second] { return restoreDataset(dataset, steps); };
+    job.done = [progress, total = datasets.size()](bool ok) {
+      progress->restored += ok;
+      if (--progress->left > 0)
+        return;
+      LOG(INFO) << "Warm start restored " << progress->restored << " of " << total
+                << " datasets in " << progress->watch.elapsed().count() << "ms";
+      progress->finished.set_value();
+    };
+    reloadScheduler().submit(std::move(job));
+  }
+
+  if (FLAGS_warm_start_wait)
+    finished.wait();
+}
+
 class FdLogSink : public google::LogSink {
 public:
   FdLogSink(int fd)
@@ -708,6 +848,8 @@ class ControlThread {
   ssize_t awaitMessage();
   void dispatch(sockaddr_t peer, folly::dynamic msg,
                 std::vector<int> argfd) const noexcept;
+  void reply(sockaddr_t peer, char status,
+             const std::vector<int> &argfd) const noexcept;
 
  private:
   int sock_;
@@ -733,6 +875,7 @@ ssize_t ControlThread::awaitMessage()
   io.msg_flags = 0;
   io.msg_control = cbuf_;
   io.msg_controllen = sizeof(cbuf_);
+  argfd_.clear();
 
   ssize_t ret = recvmsg(sock_, &io, MSG_CMSG_CLOEXEC);
   if (ret < 0) {
@@ -762,7 +905,7 @@ ssize_t ControlThread::awaitMessage()
 void ControlThread::dispatch(sockaddr_t peer, folly::dynamic msg,
                              std::vector<int> argfd) const noexcept
 try {
-  std::unique_ptr<google::LogSink> sink;
+  std::shared_ptr<google::LogSink> sink;
 
   auto mapfd = [&](int index) { return (index >= 0) ? argfd.at(index) : index; };
 
@@ -770,7 +913,6 @@ try {
   int stdin = mapfd(msg.getDefault("stdin", -1).asInt());
   std::string stdinPath = folly::sformat("/proc/self/fd/{}", stdin);
   int stdout = mapfd(msg.getDefault("stdout", -1).asInt());
-  std::string stdoutPath = folly::sformat("/proc/self/fd/{}", stdout);
   int stderr = mapfd(msg.getDefault("stderr", -1).asInt());
 
   msg.erase("stdin");
@@ -779,56 +921,49 @@ try {
   msg.erase("cmd");
 
   if (stderr >= 0)
-    sink.reset(new FdLogSink(stderr));
+    sink = std::make_shared<FdLogSink>(stderr);
+
+  if (const LoadCommand *load = findLoadCommand(cmd)) {
+    std::string dataset = datasetOf(*load, msg);
+    std::string source = regularFilePath(stdin);
+
+    ReloadScheduler::Job job = makeJob(*load, dataset, msg);
+    job.run = [load, dataset, source, stdinPath, msg] {
+      if (!load->load(stdinPath, msg))
+        return false;
+      recordLoad(*load, dataset, source, msg);
+      return true;
+    };
+    // Client keeps receiving logs until its job is done
+    job.done = [this, peer, argfd, sink](bool ok) { reply(peer, ok ? 'S' : 'F', argfd); };
+    reloadScheduler().submit(std::move(job));
+    return;
+  }
+
+  // Commands reading or writing whole files are queued like loads, so
+  // this thread keeps serving the socket
+  if (cmd == "verify" || cmd == "dump" || cmd == "acl") {
+    ReloadScheduler::Job job;
+    job.name = cmd;
+    job.dataset = cmd == "acl" ? "acl" : countryDataset(msg);
+    job.run = [cmd, stdinPath, stdout, msg] {
+      if (cmd == "verify")
+        return verifyMappingFile(stdinPath, msg);
+      if (cmd == "dump")
+        return dumpMappingFile(stdout, msg);
+      return loadACLFile(stdinPath);
+    };
+    job.done = [this, peer, argfd, sink](bool ok) { reply(peer, ok ? 'S' : 'F', argfd); };
+    reloadScheduler().submit(std::move(job));
+    return;
+  }
 
   char status = 'F';
-  if (cmd == "reload") {
-    if (loadMappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "dnc_reload") {
-    if (loadDNCMappingFile(stdinPath, msg))
+  if (cmd == "port") {
+    if (portNumber(msg, false))
       status = 'S';
-  } else if (cmd == "tollfree_reload") {
-    if (loadTollFreeMappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "dno_npa_reload") {
-    if (loadDnoMappingFile(stdinPath, msg, std::string("dno_npa")))
-      status = 'S';
-  } else if (cmd == "dno_reload") {
-    if (loadDnoMappingFile(stdinPath, msg, std::string("dno")))
-      status = 'S';
-  } else if (cmd == "dno_npa_nxx_reload") {
-    if (loadDnoMappingFile(stdinPath, msg, std::string("dno_npa_nxx")))
-      status = 'S';
-  } else if (cmd == "dno_npa_nxx_x_reload") {
-    if (loadDnoMappingFile(stdinPath, msg, std::string("dno_npa_nxx_x")))
-      status = 'S';
-  } else if (cmd == "lerg_reload") {
-    if (loadLergMappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "youmail_reload") {
-    if (loadYoumailMappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "geo_reload") {
-    if (loadGeoMappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "ftc_reload") {
-    if (loadFtcMappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "404_reload") {
-    if (load404MappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "606_reload") {
-    if (load606MappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "verify") {
-    if (verifyMappingFile(stdinPath, msg))
-      status = 'S';
-  } else if (cmd == "dump") {
-    if (dumpMappingFile(stdoutPath, msg))
-      status = 'S';
-  } else if (cmd == "acl") {
-    if (loadACLFile(stdinPath))
+  } else if (cmd == "unport") {
+    if (portNumber(msg, true))
       status = 'S';
   } else if (cmd == "meta") {
     PhoneMapping::getUS().printMetadata();
@@ -836,19 +971,27 @@ try {
     DncMapping::getDNC().printMetadata();
     TollFreeMapping::getTollFree().printMetadata();
     LergMapping::getLerg().printMetadata();
+    FilterStats::logAll();
+    logMemoryReport();
+    reloadScheduler().logStatus();
     status = 'S';
   } else {
     LOG(WARNING) << "Unrecognized command: " << cmd << "(fds: " << argfd.size() << ")";
   }
 
+  reply(peer, status, argfd);
+ } catch (std::exception& e) {
+  LOG(ERROR) << "Bad argument: " << e.what();
+ }
+
+void ControlThread::reply(sockaddr_t peer, char status,
+                          const std::vector<int> &argfd) const noexcept {
   if (sendto(sock_, &status, 1, 0, &peer.addr, peer.addr_len) < 0)
     PLOG(WARNING) << "sendto";
 
   for (int fd : argfd)
     close(fd);
- } catch (std::exception& e) {
-  LOG(ERROR) << "Bad argument: " << e.what();
- }
+}
 
 void ControlThread::operator()() {
   while (true) try {
@@ -858,14 +1001,14 @@ void ControlThread::operator()() {
       continue;
     }
 
+    // Long commands are queued in reloadScheduler(), the rest are quick
     StringPiece body{pktbuf_.data(), (size_t)bytes};
-    folly::dynamic msg = folly::parseJson(body);
-    std::thread([this, peer = peer_, msg = std::move(msg), argfd = argfd_]() {
-      dispatch(peer, msg, argfd);
-    }).detach();
+    dispatch(peer_, folly::parseJson(body), argfd_);
 
   } catch (std::exception& e) {
     LOG(ERROR) << "Bad message: " << e.what();
+    for (int fd : argfd_)
+      close(fd);
   }
 }
 
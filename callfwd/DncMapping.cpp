@@ -1,102 +1,32 @@
 #include "DncMapping.h"
-#include "PhoneMapping.h"
+#include "MappingTable.h"
+#include "CSVReader.h"
 
+#include <ctype.h>
 #include <algorithm>
-#include <array>
 #include <stdexcept>
 #include <vector>
-#if HAVE_STD_PARALLEL
-#include <execution>
-#endif
 #include <glog/logging.h>
-#include <folly/json.h>
 #include <folly/dynamic.h>
-#include <folly/Likely.h>
-#include <folly/String.h>
-#include <folly/Conv.h>
-#include <folly/small_vector.h>
-#include <folly/container/F14Map.h>
-#include <folly/synchronization/Hazptr.h>
 #include <folly/portability/GFlags.h>
 
 
-// TODO: benchmark prefetch size
-DEFINE_uint32(dnc_f14map_prefetch, 16, "Maximum number of keys to prefetch");
+DEFINE_uint32(dnc_f14map_prefetch, 16,
+              "Number of keys between stages of batch lookup kernel");
+DEFINE_uint32(dnc_filter_bits, 10,
+              "Bits per key of filter rejecting absent numbers before lookup, 0 disables it");
 
-struct PhoneList {
-  uint64_t phone : 34, next : 30;
-};
-static constexpr uint64_t MAXROWS = (1 << 30) - 1;
-static_assert(sizeof(PhoneList) == 8, "");
+static FilterStats lookupStats("dnc");
 
-class DncMapping::Data : public folly::hazptr_obj_base<DncMapping::Data> {
+class DncMapping::Data : public MappingTable<DncMapping::Data, Listed, FullPN> {
  public:
-  void getDNCs(size_t N, const uint64_t *pn, uint64_t *dn) const;
-  std::unique_ptr<Cursor> inverseDNCs(uint64_t fromDNC, uint64_t toDNC) const;
-  std::unique_ptr<Cursor> visitRows() const;
-  void build();
-  ~Data() noexcept;
-
-  // metadata
-  folly::dynamic meta;
-  // pn->dn mapping
-  folly::F14ValueMap<uint64_t, uint64_t> dict;
-  // pn column joined with sorted dnc column
-  std::vector<PhoneList> pnColumn;
-  // unique-sorted dnc column joined with pn
-  std::vector<PhoneList> dncIndex;
+  static constexpr const char *NAME = "dnc";
 };
 
-DncMapping::Data::~Data() noexcept {
-  LOG_IF(INFO, pnColumn.size() > 0) << "Reclaiming memory";
-}
-
-class DncMapping::Cursor {
- public:
-  virtual ~Cursor() = default;
-
-  bool hasRow() const noexcept { return size_ != 0; }
-  uint64_t currentPN() const noexcept { return pn_[pos_]; }
-  uint64_t currentDNC() const noexcept { return dnc_[pos_]; }
-  void prefetch(const Data *data) noexcept;
-  void advance(const Data *data) noexcept;
-  virtual void refill() = 0;
-
- protected:
-  std::array<uint64_t, 8> pn_;
-  std::array<uint64_t, 8> dnc_;
-  unsigned size_;
-  unsigned pos_;
-};
-
-void DncMapping::Data::getDNCs(size_t N, const uint64_t *pn, uint64_t *dnc) const {
-  folly::small_vector<folly::F14HashToken, 1> token;
-  token.resize(std::min<size_t>(N, FLAGS_dnc_f14map_prefetch));
-
-  while (N > 0) {
-    size_t M = std::min<size_t>(N, FLAGS_dnc_f14map_prefetch);
-
-    // Compute hash and prefetch buckets into CPU cache
-    for (size_t i = 0; i < M; ++i)
-      token[i] = dict.prehash(pn[i]);
-
-    // Fill output vector
-    for (size_t i = 0; i < M; ++i) {
-      const auto it = dict.find(token[i], pn[i]);
-      if (it != dict.cend())
-        dnc[i] = 1;
-      else
-        dnc[i] = 0;
-    }
-
-    pn += M;
-    dnc += M;
-    N -= M;
-  }
-}
-
 void DncMapping::getDNCs(size_t N, const uint64_t *pn, uint64_t *dnc) const {
-  data_->getDNCs(N, pn, dnc);
+  std::fill(dnc, dnc + N, 0);
+  data_->lookup(N, pn, FLAGS_dnc_f14map_prefetch, lookupStats,
+                [&](size_t i, Listed) { dnc[i] = 1; });
 }
 
 uint64_t DncMapping::getDNC(uint64_t pn) const {
@@ -112,9 +42,7 @@ DncMapping::Builder::Builder()
 DncMapping::Builder::~Builder() noexcept = default;
 
 void DncMapping::Builder::sizeHint(size_t numRecords) {
-  data_->pnColumn.reserve(numRecords);
-  data_->dncIndex.reserve(numRecords);
-  data_->dict.reserve(numRecords);
+  data_->reserve(0, numRecords);
 }
 
 void DncMapping::Builder::setMetadata(const folly::dynamic &meta) {
@@ -122,94 +50,51 @@ void DncMapping::Builder::setMetadata(const folly::dynamic &meta) {
 }
 
 DncMapping::Builder& DncMapping::Builder::addRow(uint64_t pn, uint64_t dnc) {
-  if (data_->dict.count(pn))
-    throw std::runtime_error("DncMapping::Builder: duplicate key");
-  if (data_->pnColumn.size() >= MAXROWS)
-    throw std::runtime_error("DncMapping::Builder: too much rows");
-
-  data_->dict.emplace(pn, dnc);
-  data_->pnColumn.push_back(PhoneList{pn, MAXROWS});
-  data_->dncIndex.push_back(PhoneList{dnc, MAXROWS});
+  data_->insert(0, pn, Listed());
   return *this;
 }
 
-std::string DncMapping::Builder::deleteCharacter(const std::string& input, char character) {
-    std::string result;
-    for (char c : input) {
-        if (c != character) {
-            result += c;
-        }
-    }
-    return result;
+/** Read number of a line the way `istream >> uint64_t` did once commas
+  * were deleted from it: leading spaces are skipped and whatever follows
+  * the digits is ignored, so both "201,555,0100" and "2015550100\tx"
+  * give 2015550100. A line without digits gives 0. */
+static uint64_t parseListedNumber(folly::StringPiece line) {
+  const char *p = line.begin();
+  while (p != line.end() && (*p == ',' || isspace((unsigned char)*p)))
+    ++p;
+
+  uint64_t value = 0;
+  for (; p != line.end(); ++p) {
+    unsigned d = unsigned(*p) - '0';
+    if (d <= 9)
+      value = value * 10 + d;
+    else if (*p != ',')
+      break;
+  }
+  return value;
 }
-void DncMapping::Builder::fromCSV(std::istream &in, size_t &line, size_t limit) {
-  std::string linebuf;
-  std::string number;
-  std::vector<uint64_t> rowbuf;
+
+void DncMapping::Builder::fromCSV(CSVReader &in, size_t &line, size_t limit) {
+  folly::StringPiece linebuf;
 
   for (limit += line; line < limit; ++line) {
-    if (in.peek() == EOF)
+    if (!in.readLine(linebuf))
       break;
-    std::getline(in, linebuf);
-    rowbuf.clear();
-    number = deleteCharacter(linebuf, ',');
-
-    std::istringstream iss(number);
-    uint64_t pn;
-    iss >> pn;
-
-    addRow(pn, 1);
+    addRow(parseListedNumber(linebuf), 1);
   }
 }
 
-void DncMapping::Data::build() {
-  size_t N = pnColumn.size();
-
-  // Connect dncIndex_ with pnColumn_ before shuffling
-  for (size_t i = 0; i < N; ++i)
-    dncIndex[i].next = i;
-
-  static auto cmp = [](const PhoneList &lhs, const PhoneList &rhs) {
-    if (lhs.phone == rhs.phone)
-      return lhs.next < rhs.next;
-    return lhs.phone < rhs.phone;
-  };
-
-#if HAVE_STD_PARALLEL
-  std::stable_sort(std::execution::par_unseq, dncIndex.begin(), dncIndex.end(), cmp);
-#else
-  std::stable_sort(dncIndex.begin(), dncIndex.end(), cmp);
-#endif
-
-  // Wire pnColumn_ list by target
-  for (size_t i = 0; i + 1 < N; ++i)
-    pnColumn[dncIndex[i].next].next = dncIndex[i+1].next;
-
-  static auto equal = [](const PhoneList &lhs, const PhoneList &rhs) {
-    return lhs.phone == rhs.phone;
-  };
-  auto last = std::unique(dncIndex.begin(), dncIndex.end(), equal);
-  dncIndex.erase(last, dncIndex.end());
-  dncIndex.shrink_to_fit();
+void DncMapping::Builder::fromSnapshot(const std::string &path) {
+  data_ = std::make_unique<Data>();
+  data_->attachSnapshot(path);
 }
 
 DncMapping DncMapping::Builder::build() {
-  auto data = std::make_unique<Data>();
-  std::swap(data, data_);
-  data->build();
-  return DncMapping(std::move(data));
+  return DncMapping(Data::build(data_, FLAGS_dnc_filter_bits));
 }
 
 void DncMapping::Builder::commit(std::atomic<Data*> &global) {
-  auto data = std::make_unique<Data>();
-  std::swap(data, data_);
-  data->build();
-
-  size_t pn_count = data->pnColumn.size();
-  size_t dnc_count = data->dncIndex.size();
-  if (Data *veteran = global.exchange(data.release()))
-    veteran->retire();
-  LOG(INFO) << "Database updated: PNs=" << pn_count << " DNCs=" << dnc_count;
+  Data::commit(Data::build(data_, FLAGS_dnc_filter_bits), global);
 }
 
 DncMapping::DncMapping(std::unique_ptr<Data> data) {
@@ -229,15 +114,18 @@ DncMapping::DncMapping(DncMapping&& rhs) noexcept = default;
 DncMapping::~DncMapping() noexcept = default;
 
 void DncMapping::printMetadata() {
-  if (!data_)
-    return;
-  LOG(INFO) << "Current mapping info:";
-  for (auto kv : data_->meta.items())
-    LOG(INFO) << "  " << kv.first.asString()
-                  << ": " << folly::toJson(kv.second);
+  if (data_)
+    data_->printMetadata();
 }
 
-size_t DncMapping::size() const noexcept {
-  return data_->pnColumn.size();
+folly::dynamic DncMapping::memoryUsage() const {
+  return Data::usageOf(data_);
+}
+
+void DncMapping::writeSnapshot(const std::string &path) const {
+  data_->writeSnapshot(path);
 }
 
+size_t DncMapping::size() const noexcept {
+  return data_->size();
+}
@@ -6,19 +6,18 @@
 #include <limits>
 #include <cstddef>
 #include <atomic>
-#include <istream>
 #include <string>
 
 #include <folly/Range.h>
 #include <folly/synchronization/HazptrHolder.h>
 
 namespace folly { struct dynamic; }
+class CSVReader;
 
 
 class DnoMapping {
  public:
   class Data; /* opaque */
-  class Cursor; /* opaque */
 
   class Builder {
   public:
@@ -36,7 +35,12 @@ class DnoMapping {
     Builder& addRow(uint64_t pn, std::string dnotype, uint64_t dno);
 
     /** Add many rows from CSV text stream. */
-    void fromCSV(std::istream &in, std::string dnotype, size_t& line, size_t limit);
+    void fromCSV(CSVReader &in, std::string dnotype, size_t& line, size_t limit);
+
+    /** Map a snapshot written by writeSnapshot() in place of the scratch
+      * buffer, rows and filters are taken from the file.
+      * Throws `runtime_error` if snapshot is malformed. */
+    void fromSnapshot(const std::string &path);
 
     /** Build indexes and release the data. */
     DnoMapping build();
@@ -44,9 +48,6 @@ class DnoMapping {
     /** Build indexes and commit data to global. */
     void commit(std::atomic<Data*> &global);
 
-    /* delete specific character in the string*/
-    std::string deleteCharacter(const std::string& input, char character);
-
   private:
     std::unique_ptr<Data> data_;
   };
@@ -66,6 +67,14 @@ class DnoMapping {
   /** Log metadata to system journal */
   void printMetadata();
 
+  /** Get bytes held by dicts, filters, arena and metadata, and by
+    * versions replaced but not reclaimed yet, see MemoryUsage. */
+  folly::dynamic memoryUsage() const;
+
+  /** Write rows and filters into a binary snapshot for warm start.
+    * Throws `system_error` if file can't be written. */
+  void writeSnapshot(const std::string &path) const;
+
   /** Get a routing number from portability number.
     * If key wasn't found returns NONE. */
   uint64_t getDNO(uint64_t pn) const;
@@ -77,7 +86,6 @@ class DnoMapping {
  private:
   folly::hazptr_holder<> holder_;
   const Data *data_;
-  std::unique_ptr<Cursor> cursor_;
 };
 
 #endif // CALLFWD_DnoMapping_H
@@ -0,0 +1,132 @@
+#include "EliasFano.h"
+
+#include <stdexcept>
+
+constexpr size_t EliasFano::SAMPLE;
+
+unsigned EliasFano::lowBitsFor(size_t size, uint64_t universe) noexcept {
+  if (size == 0 || universe / size == 0)
+    return 0;
+  return 63 - __builtin_clzll(universe / size);
+}
+
+static size_t lowWords(size_t size, unsigned lowBits) {
+  // One more word lets the reader load two words unconditionally
+  return (size * lowBits + 63) / 64 + 1;
+}
+
+static size_t highWords(size_t size, uint64_t universe, unsigned lowBits) {
+  if (size == 0)
+    return 1;
+  return (size + (universe >> lowBits) + 1 + 63) / 64;
+}
+
+static size_t sampleCount(size_t size) {
+  return (size + EliasFano::SAMPLE - 1) / EliasFano::SAMPLE;
+}
+
+EliasFano EliasFano::build(folly::Range<const uint64_t*> values, uint64_t universe) {
+  EliasFano ret;
+  size_t N = values.size();
+  unsigned l = lowBitsFor(N, universe);
+  ret.size_ = N;
+  ret.lowBits_ = l;
+  ret.lowStore_.assign(lowWords(N, l), 0);
+  ret.highStore_.assign(highWords(N, universe, l), 0);
+  ret.sampleStore_.resize(sampleCount(N));
+
+  uint64_t lowMask = l == 0 ? 0 : (~uint64_t(0) >> (64 - l));
+  uint64_t prev = 0;
+  for (size_t i = 0; i < N; ++i) {
+    uint64_t value = values[i];
+    if (value >= universe)
+      throw std::invalid_argument("EliasFano: value is out of range");
+    if (value < prev)
+      throw std::invalid_argument("EliasFano: values are not sorted");
+    prev = value;
+
+    if (l > 0) {
+      uint64_t low = value & lowMask;
+      size_t bit = i * l;
+      size_t shift = bit % 64;
+      ret.lowStore_[bit / 64] |= low << shift;
+      if (shift + l > 64)
+        ret.lowStore_[bit / 64 + 1] |= low >> (64 - shift);
+    }
+
+    uint64_t pos = (value >> l) + i;
+    ret.highStore_[pos / 64] |= uint64_t(1) << (pos % 64);
+    if (i % SAMPLE == 0)
+      ret.sampleStore_[i / SAMPLE] = pos;
+  }
+
+  ret.lows_ = folly::range(ret.lowStore_);
+  ret.highs_ = folly::range(ret.highStore_);
+  ret.samples_ = folly::range(ret.sampleStore_);
+  return ret;
+}
+
+EliasFano::EliasFano(size_t size, uint64_t universe,
+                     folly::Range<const uint64_t*> lows,
+                     folly::Range<const uint64_t*> highs,
+                     folly::Range<const uint64_t*> samples)
+  : lows_(lows)
+  , highs_(highs)
+  , samples_(samples)
+  , size_(size)
+  , lowBits_(lowBitsFor(size, universe))
+{
+  if (lows.size() != lowWords(size, lowBits_) ||
+      highs.size() != highWords(size, universe, lowBits_) ||
+      samples.size() != sampleCount(size))
+    throw std::runtime_error("EliasFano: inconsistent arrays");
+
+  // Count set bits, descend into a word only when it holds a sample
+  size_t rank = 0;
+  for (size_t w = 0; w < highs.size(); ++w) {
+    uint64_t word = highs[w];
+    size_t count = __builtin_popcountll(word);
+    for (size_t s = (rank + SAMPLE - 1) / SAMPLE;
+         s * SAMPLE < rank + count && s < samples.size(); ++s) {
+      uint64_t bits = word;
+      for (size_t k = rank; k < s * SAMPLE; ++k)
+        bits &= bits - 1;
+      if (samples[s] != w * 64 + __builtin_ctzll(bits))
+        throw std::runtime_error("EliasFano: broken samples");
+    }
+    rank += count;
+  }
+  if (rank != size)
+    throw std::runtime_error("EliasFano: broken high bits");
+}
+
+EliasFano::Reader EliasFano::resume(size_t i, size_t wordIndex,
+                                    uint64_t word) const noexcept {
+  Reader ret;
+  ret.highs_ = highs_.data();
+  ret.lows_ = lows_.data();
+  ret.lowBits_ = lowBits_;
+  ret.lowMask_ = lowBits_ == 0 ? 0 : (~uint64_t(0) >> (64 - lowBits_));
+  ret.pos_ = i;
+  ret.wordIdx_ = wordIndex;
+  ret.word_ = word;
+  return ret;
+}
+
+EliasFano::Reader EliasFano::read(size_t i) const noexcept {
+  if (i >= size_)
+    return resume(i, 0, 0);
+
+  // Jump to the sampled value, then skip set bits word by word
+  uint64_t bit = samples_[i / SAMPLE];
+  size_t skip = i % SAMPLE;
+  size_t w = bit / 64;
+  uint64_t word = highs_[w] & (~uint64_t(0) << (bit % 64));
+  for (size_t count; (count = __builtin_popcountll(word)) <= skip; ) {
+    skip -= count;
+    word = highs_[++w];
+  }
+  while (skip--)
+    word &= word - 1;
+  return resume(i, w, word);
+}
@@ -0,0 +1,114 @@
+#ifndef CALLFWD_ELIASFANO_H
+#define CALLFWD_ELIASFANO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include <folly/Range.h>
+
+/**
+ * Elias-Fano encoding of a static non-decreasing sequence of integers
+ * below a known universe, about 2 + log(universe / size) bits per value.
+ *
+ * Low bits of every value are packed verbatim. The rest is stored in
+ * unary: value i sets bit (value >> lowBits) + i of the high bit vector.
+ * Position of every SAMPLE-th set bit is kept, so decoding may start at
+ * any index and then proceeds sequentially one word at a time.
+ */
+class EliasFano {
+ public:
+  static constexpr size_t SAMPLE = 256;
+
+  /** Sequential decoder, see read(). */
+  class Reader {
+   public:
+    Reader() = default;
+
+    /** Decode the next value. Must not be called past the end. */
+    uint64_t next() noexcept {
+      while (word_ == 0)
+        word_ = highs_[++wordIdx_];
+      uint64_t high = wordIdx_ * 64 + __builtin_ctzll(word_) - pos_;
+      word_ &= word_ - 1;
+      return (high << lowBits_) | low(pos_++);
+    }
+
+    /** Index of the next value. */
+    size_t position() const noexcept { return pos_; }
+
+    /** Decoder state to pass to EliasFano::resume(). */
+    size_t wordIndex() const noexcept { return wordIdx_; }
+    uint64_t word() const noexcept { return word_; }
+
+   private:
+    friend class EliasFano;
+
+    uint64_t low(size_t i) const noexcept {
+      if (lowBits_ == 0)
+        return 0;
+      size_t bit = i * lowBits_;
+      size_t shift = bit % 64;
+      uint64_t ret = lows_[bit / 64] >> shift;
+      if (shift + lowBits_ > 64)
+        ret |= lows_[bit / 64 + 1] << (64 - shift);
+      return ret & lowMask_;
+    }
+
+    const uint64_t *highs_ = nullptr;
+    const uint64_t *lows_ = nullptr;
+    unsigned lowBits_ = 0;
+    uint64_t lowMask_ = 0;
+    size_t pos_ = 0;       // index of the next value
+    size_t wordIdx_ = 0;   // high word being decoded
+    uint64_t word_ = 0;    // its set bits not decoded yet
+  };
+
+  EliasFano() = default;
+  /** Attach to arrays of a sequence encoded before, e.g. mapped from file.
+    * Throws `runtime_error` if arrays are inconsistent. */
+  EliasFano(size_t size, uint64_t universe,
+            folly::Range<const uint64_t*> lows,
+            folly::Range<const uint64_t*> highs,
+            folly::Range<const uint64_t*> samples);
+  EliasFano(EliasFano&& rhs) noexcept = default;
+  EliasFano& operator=(EliasFano&& rhs) noexcept = default;
+
+  /** Encode values. Throws `invalid_argument` if values are decreasing
+    * or not below universe. */
+  static EliasFano build(folly::Range<const uint64_t*> values, uint64_t universe);
+
+  /** Get number of values. */
+  size_t size() const noexcept { return size_; }
+
+  /** Get bytes allocated by build(), 0 if attached to arrays. */
+  size_t allocatedBytes() const noexcept {
+    return (lowStore_.capacity() + highStore_.capacity()
+            + sampleStore_.capacity()) * sizeof(uint64_t);
+  }
+
+  /** Get decoder positioned at i-th value, i <= size(). */
+  Reader read(size_t i) const noexcept;
+
+  /** Get decoder back to the state saved from Reader at i-th value,
+    * which is cheaper than read(i). */
+  Reader resume(size_t i, size_t wordIndex, uint64_t word) const noexcept;
+
+  folly::Range<const uint64_t*> lows() const noexcept { return lows_; }
+  folly::Range<const uint64_t*> highs() const noexcept { return highs_; }
+  folly::Range<const uint64_t*> samples() const noexcept { return samples_; }
+
+ private:
+  static unsigned lowBitsFor(size_t size, uint64_t universe) noexcept;
+
+  std::vector<uint64_t> lowStore_;
+  std::vector<uint64_t> highStore_;
+  std::vector<uint64_t> sampleStore_;
+  folly::Range<const uint64_t*> lows_;
+  folly::Range<const uint64_t*> highs_;
+  folly::Range<const uint64_t*> samples_;
+  size_t size_ = 0;
+  unsigned lowBits_ = 0;
+};
+
+#endif // CALLFWD_ELIASFANO_H
@@ -6,13 +6,13 @@
 #include <limits>
 #include <cstddef>
 #include <atomic>
-#include <istream>
 #include <string>
 
 #include <folly/Range.h>
 #include <folly/synchronization/HazptrHolder.h>
 
 namespace folly { struct dynamic; }
+class CSVReader;
 
 struct F606Data {
   uint64_t pn;
@@ -23,7 +23,6 @@ struct F606Data {
 class F606Mapping {
  public:
   class Data; /* opaque */
-  class Cursor; /* opaque */
 
   class Builder {
   public:
@@ -38,10 +37,15 @@ class F606Mapping {
 
     /** Add a new row into the scratch buffer.
       * Throws `runtime_error` if key already exists. */
-    Builder& addRow(std::vector<std::string> rowbuf);
+    Builder& addRow(const std::vector<folly::StringPiece> &rowbuf);
 
     /** Add many rows from CSV text stream. */
-    void fromCSV(std::istream &in, size_t& line, size_t limit);
+    void fromCSV(CSVReader &in, size_t& line, size_t limit);
+
+    /** Map a snapshot written by writeSnapshot() in place of the scratch
+      * buffer, rows and filters are taken from the file.
+      * Throws `runtime_error` if snapshot is malformed. */
+    void fromSnapshot(const std::string &path);
 
     /** Build indexes and release the data. */
     F606Mapping build();
@@ -49,9 +53,6 @@ class F606Mapping {
     /** Build indexes and commit data to global. */
     void commit(std::atomic<Data*> &global);
 
-    /* delete specific character in the string*/
-    std::string deleteCharacter(const std::string& input, char character);
-
   private:
     std::unique_ptr<Data> data_;
   };
@@ -74,6 +75,14 @@ class F606Mapping {
   /** Log metadata to system journal */
   void printMetadata();
 
+  /** Get bytes held by dicts, filters, arena and metadata, and by
+    * versions replaced but not reclaimed yet, see MemoryUsage. */
+  folly::dynamic memoryUsage() const;
+
+  /** Write rows and filters into a binary snapshot for warm start.
+    * Throws `system_error` if file can't be written. */
+  void writeSnapshot(const std::string &path) const;
+
   /** Get a routing number from portability number.
     * If key wasn't found returns NONE. */
   F606Data getF606(uint64_t pn) const;
@@ -85,7 +94,6 @@ class F606Mapping {
  private:
   folly::hazptr_holder<> holder_;
   const Data *data_;
-  std::unique_ptr<Cursor> cursor_;
 };
 
 #endif // CALLFWD_F606Mapping_H
@@ -0,0 +1,263 @@
+#include "HugePages.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <glog/logging.h>
+#include <folly/Conv.h>
+#include <folly/portability/GFlags.h>
+
+DEFINE_string(hugepages, "thp",
+              "Pages of large tables: none, thp (transparent huge pages), "
+              "2m or 1g (reserved huge pages, thp when none are left; "
+              "1g takes 2m pages for blocks below a gigabyte)");
+
+static constexpr size_t HUGE_PAGE = size_t(2) << 20;
+static constexpr size_t GIANT_PAGE = size_t(1) << 30;
+static constexpr int MAP_HUGE_2M = 21 << MAP_HUGE_SHIFT;
+static constexpr int MAP_HUGE_1G = 30 << MAP_HUGE_SHIFT;
+static constexpr unsigned MAX_NODES = 1024;
+
+enum class Backing { NONE, THP, HUGE_2M, HUGE_1G };
+
+static Backing backing() {
+  const std::string &mode = FLAGS_hugepages;
+  if (mode == "none")
+    return Backing::NONE;
+  if (mode == "2m")
+    return Backing::HUGE_2M;
+  if (mode == "1g")
+    return Backing::HUGE_1G;
+  if (mode != "thp")
+    LOG_FIRST_N(WARNING, 1) << "Unknown --hugepages=" << mode << ", using thp";
+  return Backing::THP;
+}
+
+static size_t roundUp(size_t value, size_t page) {
+  return (value + page - 1) / page * page;
+}
+
+// Every mapped block, to unmap it whole. Never destroyed, tables may
+// be freed after static destructors ran.
+struct MappedBlock {
+  size_t length;
+  size_t page;  // unmapped by multiples of the page
+};
+struct MappedBlocks {
+  std::mutex mutex;
+  std::map<void*, MappedBlock> blocks;
+};
+static MappedBlocks& mappedBlocks() {
+  static MappedBlocks *blocks = new MappedBlocks;
+  return *blocks;
+}
+
+static uint8_t* mapAnonymous(size_t length, int flags) {
+  void *addr = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  return addr == MAP_FAILED ? nullptr : static_cast<uint8_t*>(addr);
+}
+
+/** Map length bytes aligned on huge page. */
+static uint8_t* mapAligned(size_t length) {
+  uint8_t *addr = mapAnonymous(length + HUGE_PAGE, 0);
+  if (!addr)
+    return nullptr;
+  uint8_t *aligned = reinterpret_cast<uint8_t*>(
+    roundUp(reinterpret_cast<uintptr_t>(addr), HUGE_PAGE));
+  size_t head = aligned - addr;
+  if (head > 0)
+    munmap(addr, head);
+  munmap(aligned + length, HUGE_PAGE - head);
+  return aligned;
+}
+
+static void bindToNode(void *addr, size_t length, int node) {
+  if (unsigned(node) >= MAX_NODES)
+    return;
+  unsigned long mask[MAX_NODES / 64] = {};
+  mask[node / 64] = 1ul << (node % 64);
+  // Pages are not touched yet, binding places all of them
+  if (syscall(SYS_mbind, addr, length, MPOL_BIND, mask, MAX_NODES + 1, 0) < 0)
+    PLOG_FIRST_N(WARNING, 1) << "mbind to NUMA node " << node;
+}
+
+void* allocateLarge(size_t bytes, int node) {
+  Backing mode = backing();
+  if (bytes < LARGE_ALLOCATION || (mode == Backing::NONE && node < 0))
+    return ::operator new(bytes);
+
+  uint8_t *addr = nullptr;
+  size_t length = 0;
+  size_t page = HUGE_PAGE;
+  if (mode == Backing::HUGE_1G && bytes >= GIANT_PAGE) {
+    page = GIANT_PAGE;
+    length = roundUp(bytes, page);
+    addr = mapAnonymous(length, MAP_HUGETLB | MAP_HUGE_1G);
+    if (!addr)
+      LOG_FIRST_N(WARNING, 1) << "No reserved 1GB pages for " << bytes
+                              << " bytes, using 2MB ones";
+  }
+  // Blocks below a gigabyte would mostly waste a 1GB page
+  if (!addr && (mode == Backing::HUGE_2M || mode == Backing::HUGE_1G)) {
+    page = HUGE_PAGE;
+    length = roundUp(bytes, page);
+    addr = mapAnonymous(length, MAP_HUGETLB | MAP_HUGE_2M);
+    if (!addr)
+      LOG_FIRST_N(WARNING, 1) << "No reserved huge pages for " << bytes
+                              << " bytes, using transparent ones";
+  }
+  if (!addr) {
+    page = HUGE_PAGE;
+    length = roundUp(bytes, HUGE_PAGE);
+    addr = mapAligned(length);
+    if (!addr)
+      throw std::bad_alloc();
+    if (mode != Backing::NONE)
+      madvise(addr, length, MADV_HUGEPAGE);
+  }
+  if (node >= 0)
+    bindToNode(addr, length, node);
+
+  MappedBlocks &blocks = mappedBlocks();
+  std::lock_guard<std::mutex> lock(blocks.mutex);
+  blocks.blocks.emplace(addr, MappedBlock{length, page});
+  return addr;
+}
+
+// Release of blocks freed by this thread, see releaseLargeInChunks()
+static thread_local size_t releaseChunk = 0;
+static thread_local void (*releasePause)(size_t bytes) = nullptr;
+
+void releaseLargeInChunks(size_t chunk, void (*pause)(size_t bytes)) noexcept {
+  releaseChunk = chunk;
+  releasePause = pause;
+}
+
+void deallocateLarge(void *p, size_t bytes) noexcept {
+  if (!p)
+    return;
+  if (bytes >= LARGE_ALLOCATION) {
+    MappedBlock block = {0, 0};
+    {
+      MappedBlocks &blocks = mappedBlocks();
+      std::lock_guard<std::mutex> lock(blocks.mutex);
+      auto it = blocks.blocks.find(p);
+      if (it != blocks.blocks.end()) {
+        block = it->second;
+        blocks.blocks.erase(it);
+      }
+    }
+    if (block.length > 0) {
+      // Pages of a gigabyte table take a while to free, give them back
+      // by chunks for other threads to take turns
+      uint8_t *addr = static_cast<uint8_t*>(p);
+      size_t chunk = releaseChunk > 0 ? roundUp(releaseChunk, block.page) : block.length;
+      for (size_t offset = 0; offset < block.length; offset += chunk) {
+        size_t length = std::min(chunk, block.length - offset);
+        munmap(addr + offset, length);
+        if (releasePause)
+          releasePause(length);
+      }
+      return;
+    }
+  }
+  ::operator delete(p);
+}
+
+void discardLarge(void *p, size_t bytes) noexcept {
+  MappedBlock block = {0, 0};
+  {
+    MappedBlocks &blocks = mappedBlocks();
+    std::lock_guard<std::mutex> lock(blocks.mutex);
+    auto it = blocks.blocks.find(p);
+    if (it != blocks.blocks.end())
+      block = it->second;
+  }
+  if (block.length == 0)
+    return;
+  size_t length = std::min(bytes, block.length) / block.page * block.page;
+  if (length > 0)
+    madvise(p, length, MADV_DONTNEED);
+}
+
+std::pair<size_t, size_t> largeBlocks() noexcept {
+  MappedBlocks &blocks = mappedBlocks();
+  std::lock_guard<std::mutex> lock(blocks.mutex);
+  size_t length = 0;
+  for (const auto &kv : blocks.blocks)
+    length += kv.second.length;
+  return {blocks.blocks.size(), length};
+}
+
+namespace {
+
+struct NumaTopology {
+  unsigned nodes = 1;
+  std::vector<unsigned> cpuNode;
+};
+
+} // namespace
+
+/** Parse list of ranges like "0-15,32-47". */
+static std::vector<unsigned> parseList(const std::string &text) {
+  std::vector<unsigned> ret;
+  std::istringstream in(text);
+  std::string range;
+  while (std::getline(in, range, ',')) {
+    unsigned first, last;
+    int n = sscanf(range.c_str(), "%u-%u", &first, &last);
+    if (n < 1)
+      return {};
+    for (unsigned i = first; i <= (n == 2 ? last : first); ++i)
+      ret.push_back(i);
+  }
+  return ret;
+}
+
+static std::string readLine(const std::string &path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+static const NumaTopology& numaTopology() {
+  static const NumaTopology topology = [] {
+    NumaTopology ret;
+    for (unsigned node : parseList(readLine("/sys/devices/system/node/online"))) {
+      ret.nodes = std::max(ret.nodes, node + 1);
+      std::string cpulist = readLine(folly::to<std::string>(
+        "/sys/devices/system/node/node", node, "/cpulist"));
+      for (unsigned cpu : parseList(cpulist)) {
+        if (cpu >= ret.cpuNode.size())
+          ret.cpuNode.resize(cpu + 1);
+        ret.cpuNode[cpu] = node;
+      }
+    }
+    ret.nodes = std::min(ret.nodes, MAX_NODES);
+    return ret;
+  }();
+  return topology;
+}
+
+unsigned numaNodes() noexcept {
+  return numaTopology().nodes;
+}
+
+unsigned currentNumaNode() noexcept {
+  const NumaTopology &topology = numaTopology();
+  int cpu = sched_getcpu();
+  if (cpu < 0 || size_t(cpu) >= topology.cpuNode.size())
+    return 0;
+  return std::min(topology.cpuNode[cpu], topology.nodes - 1);
+}
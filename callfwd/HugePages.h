@@ -0,0 +1,73 @@
+#ifndef CALLFWD_HUGEPAGES_H
+#define CALLFWD_HUGEPAGES_H
+
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+/*
+ * Memory of large tables. Blocks above LARGE_ALLOCATION bytes are mapped
+ * separately and backed by huge pages as set by --hugepages, so lookups
+ * spanning gigabytes don't miss TLB on every probe. Smaller blocks come
+ * from the regular heap.
+ */
+
+static constexpr size_t LARGE_ALLOCATION = size_t(2) << 20;
+
+/** Allocate at least `bytes`, place a large block on NUMA node if it is
+  * not negative. Throws `bad_alloc` if out of memory. */
+void* allocateLarge(size_t bytes, int node = -1);
+
+/** Free memory of allocateLarge(). */
+void deallocateLarge(void *p, size_t bytes) noexcept;
+
+/** Give back whole pages within the first `bytes` of a large block, they
+  * read as zeros if touched again. Small blocks are left as they are. */
+void discardLarge(void *p, size_t bytes) noexcept;
+
+/** Unmap large blocks freed by the calling thread by at least `chunk` bytes,
+  * calling pause(bytes) after every chunk, see Reclaimer. Zero chunk unmaps
+  * a block at once. */
+void releaseLargeInChunks(size_t chunk, void (*pause)(size_t bytes)) noexcept;
+
+/** Get number of blocks mapped by allocateLarge() and their length. */
+std::pair<size_t, size_t> largeBlocks() noexcept;
+
+/** Get number of NUMA nodes, 1 if the system has no NUMA. */
+unsigned numaNodes() noexcept;
+
+/** Get NUMA node of the CPU running the calling thread. */
+unsigned currentNumaNode() noexcept;
+
+/** Stateless allocator of allocateLarge() for containers. */
+template <class T>
+class HugePageAllocator {
+ public:
+  using value_type = T;
+
+  HugePageAllocator() noexcept = default;
+  template <class U>
+  HugePageAllocator(const HugePageAllocator<U>&) noexcept {}
+
+  T* allocate(size_t n) {
+    if (n > size_t(-1) / sizeof(T))
+      throw std::bad_array_new_length();
+    return static_cast<T*>(allocateLarge(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) noexcept {
+    deallocateLarge(p, n * sizeof(T));
+  }
+
+  template <class U>
+  bool operator==(const HugePageAllocator<U>&) const noexcept { return true; }
+  template <class U>
+  bool operator!=(const HugePageAllocator<U>&) const noexcept { return false; }
+};
+
+template <class T>
+using LargeVector = std::vector<T, HugePageAllocator<T>>;
+
+#endif // CALLFWD_HUGEPAGES_H
@@ -0,0 +1,127 @@
+#ifndef CALLFWD_INDEXBUILD_H
+#define CALLFWD_INDEXBUILD_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "Parallel.h"
+
+/*
+ * Index construction shared by all mappings. Rows are structs with
+ * `phone : 34` and `next : 30` bit fields.
+ */
+
+namespace detail {
+
+static constexpr size_t INDEX_CHUNK_ROWS = 1 << 16;
+// Below that comparison sort is faster than three radix passes
+static constexpr size_t RADIX_MIN_ROWS = 1 << 12;
+static constexpr unsigned RADIX_PASS_BITS[] = {12, 11, 11};
+
+/** Split N rows into chunks to be processed in parallel. */
+inline size_t indexChunks(size_t N) {
+  size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+  return std::max<size_t>(std::min(N / INDEX_CHUNK_ROWS, 4 * threads), 1);
+}
+
+} // namespace detail
+
+/**
+ * Stable sort by `phone` with parallel LSD radix sort, three passes over
+ * 34-bit keys. Passes where all keys share the digit are skipped.
+ * Temporarily needs memory for another copy of rows.
+ */
+template <class Row, class Alloc>
+void radixSortByPhone(std::vector<Row, Alloc> &rows) {
+  size_t N = rows.size();
+  if (N < detail::RADIX_MIN_ROWS) {
+    std::stable_sort(rows.begin(), rows.end(), [](const Row &lhs, const Row &rhs) {
+      return lhs.phone < rhs.phone;
+    });
+    return;
+  }
+
+  size_t C = detail::indexChunks(N);
+  auto chunkBegin = [&](size_t c) { return N * c / C; };
+  std::vector<Row, Alloc> buffer(N);
+  std::vector<size_t> offset;
+
+  unsigned shift = 0;
+  for (unsigned bits : detail::RADIX_PASS_BITS) {
+    size_t R = size_t(1) << bits;
+    uint64_t mask = R - 1;
+    auto digit = [&](const Row &row) -> size_t {
+      return (row.phone >> shift) & mask;
+    };
+
+    // Count digits in every chunk
+    offset.assign(C * R, 0);
+    parallelFor(C, [&](size_t c) {
+      size_t *count = &offset[c * R];
+      for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+        ++count[digit(rows[i])];
+    });
+
+    // Chunks of a digit follow each other, that keeps sort stable
+    size_t total = 0;
+    bool trivial = false;
+    for (size_t d = 0; d < R; ++d) {
+      size_t begin = total;
+      for (size_t c = 0; c < C; ++c) {
+        size_t count = offset[c * R + d];
+        offset[c * R + d] = total;
+        total += count;
+      }
+      trivial |= total - begin == N;
+    }
+
+    if (!trivial) {
+      parallelFor(C, [&](size_t c) {
+        size_t *pos = &offset[c * R];
+        for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+          buffer[pos[digit(rows[i])]++] = rows[i];
+      });
+      rows.swap(buffer);
+    }
+    shift += bits;
+  }
+}
+
+/**
+ * Build reverse index of a mapping. On input `index` holds values of
+ * `pnColumn` rows. On output `index` is unique-sorted by value with `next`
+ * pointing to the first row having it, and `pnColumn` rows are linked
+ * with `next` in (value, row) order. Last row of the list keeps its `next`.
+ */
+template <class Row, class Alloc>
+void buildReverseIndex(std::vector<Row, Alloc> &pnColumn, std::vector<Row, Alloc> &index) {
+  size_t N = pnColumn.size();
+  size_t C = detail::indexChunks(N);
+
+  // Connect index with pnColumn before shuffling
+  parallelChunks(N, C, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      index[i].next = i;
+  });
+
+  radixSortByPhone(index);
+
+  // Wire pnColumn list by value, every row is written once
+  if (N > 0) {
+    parallelChunks(N - 1, C, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i)
+        pnColumn[index[i].next].next = index[i+1].next;
+    });
+  }
+
+  auto last = std::unique(index.begin(), index.end(), [](const Row &lhs, const Row &rhs) {
+    return lhs.phone == rhs.phone;
+  });
+  index.erase(last, index.end());
+  index.shrink_to_fit();
+}
+
+#endif // CALLFWD_INDEXBUILD_H
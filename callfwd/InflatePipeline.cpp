@@ -0,0 +1,464 @@
+#include "InflatePipeline.h"
+
+#include <poll.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <glog/logging.h>
+#include <folly/portability/GFlags.h>
+
+DEFINE_uint32(inflate_block_kb, 1024,
+              "Size of blocks passed between stages of .gz reload");
+DEFINE_uint32(inflate_queue_blocks, 16,
+              "Number of blocks queued between stages of .gz reload");
+
+using Clock = std::chrono::steady_clock;
+using Block = std::vector<char>;
+
+static double secondsSince(Clock::time_point since) {
+  return std::chrono::duration<double>(Clock::now() - since).count();
+}
+
+namespace {
+
+/** Blocks passed from one stage to the next one. */
+class BlockQueue {
+ public:
+  explicit BlockQueue(size_t capacity) : capacity_(capacity) {}
+
+  /** Wait for room and add block, false if the queue is closed. */
+  bool push(Block block, double &stalled) {
+    Clock::time_point since = Clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    notFull_.wait(lock, [&] { return closed_ || queue_.size() < capacity_; });
+    stalled += secondsSince(since);
+    if (closed_)
+      return false;
+    queue_.push_back(std::move(block));
+    notEmpty_.notify_one();
+    return true;
+  }
+
+  /** Wait for a block, false if the queue is closed and empty. */
+  bool pop(Block &block, double &stalled) {
+    Clock::time_point since = Clock::now();
+    std::unique_lock<std::mutex> lock(mutex_);
+    notEmpty_.wait(lock, [&] { return closed_ || !queue_.empty(); });
+    stalled += secondsSince(since);
+    if (queue_.empty())
+      return false;
+    block = std::move(queue_.front());
+    queue_.pop_front();
+    notFull_.notify_one();
+    return true;
+  }
+
+  /** No more blocks after the queued ones, wake both sides. */
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    notFull_.notify_all();
+    notEmpty_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable notFull_;
+  std::condition_variable notEmpty_;
+  std::deque<Block> queue_;
+  size_t capacity_;
+  bool closed_ = false;
+};
+
+/**
+ * Cut the first regular file out of a tar stream. Input which is not
+ * a tar archive is passed as is, the case of a plain .gz file.
+ */
+class TarFilter {
+ public:
+  /** Append text of n bytes to out, false once the file ended. */
+  bool feed(const char *p, size_t n, Block &out);
+
+  /** Flush at the end of input, false if the archive was cut short. */
+  bool finish(Block &out);
+
+ private:
+  enum class State { PROBE, HEADER, DATA, PAX, SKIP, RAW, DONE };
+
+  void parseHeader();
+  static uint64_t parseSize(const char *field);
+
+  State state_ = State::PROBE;
+  char header_[512];
+  size_t filled_ = 0;       // bytes of header_
+  uint64_t remaining_ = 0;  // bytes of DATA, PAX or SKIP
+  uint64_t padding_ = 0;    // skipped after DATA or PAX
+  std::string pax_;
+  int64_t paxSize_ = -1;    // size of the next member from pax header
+};
+
+} // namespace
+
+bool TarFilter::feed(const char *p, size_t n, Block &out) {
+  while (n > 0) {
+    switch (state_) {
+    case State::PROBE:
+    case State::HEADER: {
+      size_t k = std::min(n, sizeof(header_) - filled_);
+      memcpy(header_ + filled_, p, k);
+      filled_ += k;
+      p += k;
+      n -= k;
+      if (filled_ < sizeof(header_))
+        break;
+      filled_ = 0;
+      if (state_ == State::PROBE && memcmp(header_ + 257, "ustar", 5) != 0) {
+        state_ = State::RAW;
+        out.insert(out.end(), header_, header_ + sizeof(header_));
+        break;
+      }
+      parseHeader();
+      break;
+    }
+    case State::DATA:
+    case State::PAX:
+    case State::SKIP: {
+      size_t k = std::min<uint64_t>(n, remaining_);
+      if (state_ == State::DATA)
+        out.insert(out.end(), p, p + k);
+      if (state_ == State::PAX)
+        pax_.append(p, k);
+      p += k;
+      n -= k;
+      remaining_ -= k;
+      if (remaining_ > 0)
+        break;
+      if (state_ == State::DATA) {
+        state_ = State::DONE;
+        return false;
+      }
+      if (state_ == State::PAX) {
+        // Records "<length> <key>=<value>\n", only size matters
+        size_t pos = pax_.find(" size=");
+        if (pos != std::string::npos)
+          paxSize_ = strtoll(pax_.c_str() + pos + 6, nullptr, 10);
+        pax_.clear();
+      }
+      remaining_ = padding_;
+      padding_ = 0;
+      state_ = remaining_ > 0 ? State::SKIP : State::HEADER;
+      break;
+    }
+    case State::RAW:
+      out.insert(out.end(), p, p + n);
+      n = 0;
+      break;
+    case State::DONE:
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TarFilter::finish(Block &out) {
+  if (state_ == State::PROBE) {
+    // Text shorter than a tar header
+    out.insert(out.end(), header_, header_ + filled_);
+    state_ = State::DONE;
+  }
+  return state_ == State::RAW || state_ == State::DONE;
+}
+
+void TarFilter::parseHeader() {
+  if (std::all_of(header_, header_ + sizeof(header_), [](char c) { return c == 0; })) {
+    // End of archive without a regular file
+    state_ = State::DONE;
+    return;
+  }
+
+  uint64_t size = parseSize(header_ + 124);
+  if (paxSize_ >= 0)
+    size = paxSize_;
+  char type = header_[156];
+  if (type != 'x')
+    paxSize_ = -1;
+
+  remaining_ = size;
+  padding_ = (512 - size % 512) % 512;
+  if (type == '0' || type == '\0' || type == '7') {
+    state_ = State::DATA;
+  } else if (type == 'x') {
+    state_ = State::PAX;
+  } else {
+    remaining_ += padding_;
+    padding_ = 0;
+    state_ = State::SKIP;
+  }
+
+  if (remaining_ == 0) {
+    // Empty file or member, its padding is empty too
+    state_ = state_ == State::DATA ? State::DONE : State::HEADER;
+  }
+}
+
+uint64_t TarFilter::parseSize(const char *field) {
+  uint64_t size = 0;
+  if (uint8_t(field[0]) & 0x80) {
+    // GNU base-256 encoding of files over 8GB
+    size = uint8_t(field[0]) & 0x7f;
+    for (int i = 1; i < 12; ++i)
+      size = size << 8 | uint8_t(field[i]);
+    return size;
+  }
+  for (int i = 0; i < 12; ++i) {
+    if (field[i] >= '0' && field[i] <= '7')
+      size = size * 8 + (field[i] - '0');
+    else if (size > 0 || field[i] == '\0')
+      break;
+  }
+  return size;
+}
+
+struct InflatePipeline::State {
+  State(int fd, size_t queueBlocks)
+    : fd(fd), compressed(queueBlocks), text(queueBlocks) {}
+
+  /** Keep the first error and stop all stages. */
+  void fail(std::exception_ptr e) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error)
+        error = e;
+    }
+    stop = true;
+    compressed.close();
+    text.close();
+  }
+
+  /** Add work of a stage to stats. */
+  void account(Stage InflatePipeline::Stats::*stage, const Stage &delta) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Stage &s = stats.*stage;
+    s.bytes += delta.bytes;
+    s.busy += delta.busy;
+    s.stalled += delta.stalled;
+  }
+
+  void readStage(Block head);
+  void inflateStage();
+
+  int fd;
+  size_t blockSize = size_t(std::max(FLAGS_inflate_block_kb, 64u)) << 10;
+  BlockQueue compressed;
+  BlockQueue text;
+  std::atomic<bool> stop{false};
+  std::thread reader;
+  std::thread inflater;
+
+  mutable std::mutex mutex;
+  std::exception_ptr error;
+  InflatePipeline::Stats stats;
+
+  // Caller side
+  Block current;
+  size_t pos = 0;
+  bool finished = false;
+  Clock::time_point returned = Clock::now();
+};
+
+void InflatePipeline::State::readStage(Block head) {
+  try {
+    Stage delta;
+    delta.bytes = head.size();
+    if (!head.empty() && !compressed.push(std::move(head), delta.stalled))
+      return;
+    account(&Stats::read, delta);
+
+    while (!stop) {
+      Block block(blockSize);
+      delta = Stage();
+      Clock::time_point since = Clock::now();
+
+      // Poll to notice stop while a pipe is idle
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      int ready = poll(&pfd, 1, 100);
+      if (ready < 0 && errno != EINTR)
+        throw std::system_error(errno, std::generic_category(), "poll");
+      if (ready <= 0)
+        continue;
+      ssize_t n = ::read(fd, block.data(), block.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        throw std::system_error(errno, std::generic_category(), "read");
+      delta.busy = secondsSince(since);
+      if (n == 0)
+        break;
+
+      block.resize(n);
+      delta.bytes = n;
+      bool pushed = compressed.push(std::move(block), delta.stalled);
+      account(&Stats::read, delta);
+      if (!pushed)
+        return;
+    }
+  } catch (...) {
+    fail(std::current_exception());
+  }
+  compressed.close();
+}
+
+void InflatePipeline::State::inflateStage() {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  // Accept gzip header only, members may follow each other
+  if (inflateInit2(&z, 15 + 16) != Z_OK) {
+    fail(std::make_exception_ptr(std::runtime_error("inflateInit failed")));
+    return;
+  }
+
+  try {
+    TarFilter tar;
+    Block in, out;
+    std::vector<char> scratch(blockSize);
+    bool streamEnd = false;
+    bool more = true;
+    Stage delta;
+
+    while (more && compressed.pop(in, delta.stalled)) {
+      Clock::time_point since = Clock::now();
+      z.next_in = reinterpret_cast<Bytef*>(in.data());
+      z.avail_in = in.size();
+      do {
+        z.next_out = reinterpret_cast<Bytef*>(scratch.data());
+        z.avail_out = scratch.size();
+        int rc = inflate(&z, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+          streamEnd = true;
+          if (z.avail_in > 0) {
+            inflateReset(&z);
+            streamEnd = false;
+          }
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+          throw std::runtime_error(std::string("corrupt gzip stream: ") +
+                                   (z.msg ? z.msg : "unknown error"));
+        }
+
+        size_t produced = scratch.size() - z.avail_out;
+        more = tar.feed(scratch.data(), produced, out);
+        if (rc == Z_BUF_ERROR && produced == 0)
+          break;
+      } while (more && (z.avail_in > 0 || z.avail_out == 0));
+      delta.busy += secondsSince(since);
+
+      if (out.size() >= blockSize || !more) {
+        delta.bytes += out.size();
+        bool pushed = text.push(std::move(out), delta.stalled);
+        account(&Stats::inflate, delta);
+        delta = Stage();
+        out = Block();
+        out.reserve(blockSize + scratch.size());
+        if (!pushed)
+          break;
+      }
+    }
+
+    if (more && !stop) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (error)
+          std::rethrow_exception(error);
+      }
+      if (!streamEnd)
+        throw std::runtime_error("gzip stream is cut short");
+      if (!tar.finish(out))
+        throw std::runtime_error("tar archive is cut short");
+      delta.bytes += out.size();
+      if (!out.empty())
+        text.push(std::move(out), delta.stalled);
+      account(&Stats::inflate, delta);
+    }
+  } catch (...) {
+    fail(std::current_exception());
+  }
+  inflateEnd(&z);
+  text.close();
+  // Reading the rest is no use once the file ended
+  stop = true;
+  compressed.close();
+}
+
+InflatePipeline::InflatePipeline(int fd, const char *head, size_t size)
+  : state_(std::make_unique<State>(fd, std::max(FLAGS_inflate_queue_blocks, 1u)))
+{
+  State &s = *state_;
+  s.reader = std::thread([&s, block = Block(head, head + size)]() mutable {
+    s.readStage(std::move(block));
+  });
+  s.inflater = std::thread([&s] { s.inflateStage(); });
+}
+
+InflatePipeline::~InflatePipeline() noexcept {
+  State &s = *state_;
+  s.stop = true;
+  s.compressed.close();
+  s.text.close();
+  s.reader.join();
+  s.inflater.join();
+  close(s.fd);
+
+  Stats st = stats();
+  auto stage = [](const char *name, const Stage &stage) {
+    char text[128];
+    double mb = stage.bytes / 1e6;
+    snprintf(text, sizeof(text), "%s %.1fMB at %.0fMB/s, stalled %.1fs",
+             name, mb, stage.busy > 0 ? mb / stage.busy : 0.0, stage.stalled);
+    return std::string(text);
+  };
+  LOG_IF(INFO, st.read.bytes > 0) << "Unpacked input: "
+    << stage("read", st.read) << "; " << stage("inflate", st.inflate)
+    << "; " << stage("parse", st.parse);
+}
+
+size_t InflatePipeline::read(char *buf, size_t n) {
+  State &s = *state_;
+  Stage delta;
+  delta.busy = secondsSince(s.returned);
+
+  while (s.pos == s.current.size() && !s.finished) {
+    s.pos = 0;
+    s.current.clear();
+    if (!s.text.pop(s.current, delta.stalled)) {
+      s.finished = true;
+      std::lock_guard<std::mutex> lock(s.mutex);
+      if (s.error)
+        std::rethrow_exception(s.error);
+    }
+  }
+
+  size_t k = std::min(n, s.current.size() - s.pos);
+  memcpy(buf, s.current.data() + s.pos, k);
+  s.pos += k;
+  delta.bytes = k;
+  s.account(&Stats::parse, delta);
+  s.returned = Clock::now();
+  return k;
+}
+
+InflatePipeline::Stats InflatePipeline::stats() const {
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->stats;
+}
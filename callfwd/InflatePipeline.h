@@ -0,0 +1,58 @@
+#ifndef CALLFWD_INFLATEPIPELINE_H
+#define CALLFWD_INFLATEPIPELINE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/*
+ * Text of a .gz or .tar.gz input, unpacked in stages on their own threads.
+ * One thread reads compressed blocks from the file, another inflates them
+ * and cuts the first regular file out of a tar archive, and the caller
+ * takes blocks of text for parsing. Stages are connected by bounded queues,
+ * so a reload runs at the pace of the slowest stage instead of their sum.
+ * Members of a multi-member gzip stream are inflated one after another.
+ */
+class InflatePipeline {
+ public:
+  /** Start stages on fd, which the pipeline owns from now on. The first
+    * `size` bytes of the stream, already read from fd, are in `head`. */
+  InflatePipeline(int fd, const char *head, size_t size);
+
+  InflatePipeline(const InflatePipeline&) = delete;
+  InflatePipeline& operator=(const InflatePipeline&) = delete;
+
+  /** Stop stages and log their throughput. */
+  ~InflatePipeline() noexcept;
+
+  /** Copy up to n bytes of text into buf, 0 at the end of it.
+    * Throws `runtime_error` if input is corrupt or can't be read. */
+  size_t read(char *buf, size_t n);
+
+  /** Check if bytes start a gzip stream. */
+  static bool isGzip(const char *head, size_t size) noexcept {
+    return size >= 2 && uint8_t(head[0]) == 0x1f && uint8_t(head[1]) == 0x8b;
+  }
+
+  struct Stage {
+    uint64_t bytes = 0;   // passed to the next stage
+    double busy = 0;      // seconds of work
+    double stalled = 0;   // seconds waiting for other stages
+  };
+
+  struct Stats {
+    Stage read;     // compressed bytes
+    Stage inflate;  // text bytes
+    Stage parse;    // text bytes taken by caller
+  };
+
+  /** Get throughput of stages so far. */
+  Stats stats() const;
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
+
+#endif // CALLFWD_INFLATEPIPELINE_H
@@ -0,0 +1,124 @@
+#include "KeyFilter.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <glog/logging.h>
+#include <folly/small_vector.h>
+
+constexpr size_t KeyFilter::BLOCK_WORDS;
+constexpr uint64_t KeyFilter::SEED;
+constexpr size_t FilterStats::STRIPES;
+
+// Odd multipliers picking a bit of every block word from 32 hash bits
+static constexpr uint32_t SALT[KeyFilter::BLOCK_WORDS] = {
+  0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+  0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+};
+
+static inline uint32_t bitOf(uint64_t hash, size_t w) noexcept {
+  return uint32_t(1) << ((uint32_t(hash) * SALT[w]) >> 27);
+}
+
+static inline bool blockHas(const uint32_t *block, uint64_t hash) noexcept {
+  bool ret = true;
+  for (size_t w = 0; w < KeyFilter::BLOCK_WORDS; ++w)
+    ret &= (block[w] & bitOf(hash, w)) != 0;
+  return ret;
+}
+
+KeyFilter::KeyFilter(folly::Range<const uint32_t*> words)
+  : words_(words)
+  , numBlocks_(words.size() / BLOCK_WORDS)
+{
+  if (words.size() % BLOCK_WORDS != 0)
+    throw std::runtime_error("KeyFilter: partial block");
+}
+
+void KeyFilter::allocate(size_t N, unsigned bitsPerKey) {
+  numBlocks_ = (N * bitsPerKey + BLOCK_WORDS * 32 - 1) / (BLOCK_WORDS * 32);
+  store_.assign(numBlocks_ * BLOCK_WORDS, 0);
+  words_ = folly::range(store_);
+}
+
+void KeyFilter::insert(uint64_t key) noexcept {
+  uint64_t hash = hashKey(key);
+  uint32_t *block = &store_[blockOf(hash) * BLOCK_WORDS];
+  // Chunks of a parallel build may share blocks
+  for (size_t w = 0; w < BLOCK_WORDS; ++w)
+    __atomic_fetch_or(&block[w], bitOf(hash, w), __ATOMIC_RELAXED);
+}
+
+bool KeyFilter::mayContain(uint64_t key) const noexcept {
+  if (empty())
+    return true;
+  uint64_t hash = hashKey(key);
+  return blockHas(&words_[blockOf(hash) * BLOCK_WORDS], hash);
+}
+
+size_t KeyFilter::select(size_t N, const uint64_t *keys, uint32_t *pos,
+                         size_t distance) const noexcept {
+  size_t M = 0;
+  if (empty()) {
+    for (size_t i = 0; i < N; ++i)
+      pos[M++] = i;
+    return M;
+  }
+
+  folly::small_vector<uint64_t, 64> hash(N);
+  mixHashBatch(N, keys, SEED, hash.data());
+
+  const uint32_t *words = words_.data();
+  for (size_t i = 0; i < std::min(N, distance); ++i)
+    __builtin_prefetch(&words[blockOf(hash[i]) * BLOCK_WORDS]);
+  for (size_t i = 0; i < N; ++i) {
+    if (i + distance < N)
+      __builtin_prefetch(&words[blockOf(hash[i + distance]) * BLOCK_WORDS]);
+    // Store unconditionally, keep the loop free of branches
+    pos[M] = i;
+    M += blockHas(&words[blockOf(hash[i]) * BLOCK_WORDS], hash[i]);
+  }
+  return M;
+}
+
+FilterStats::FilterStats(const char *name)
+  : name_(name)
+{
+  registry().push_back(this);
+}
+
+std::vector<const FilterStats*>& FilterStats::registry() {
+  static std::vector<const FilterStats*> instances;
+  return instances;
+}
+
+void FilterStats::add(size_t queried, size_t rejected, size_t found) noexcept {
+  static std::atomic<size_t> nextStripe{0};
+  static thread_local size_t stripe = nextStripe++ % STRIPES;
+  Stripe &s = stripes_[stripe];
+  s.queried.fetch_add(queried, std::memory_order_relaxed);
+  s.rejected.fetch_add(rejected, std::memory_order_relaxed);
+  s.found.fetch_add(found, std::memory_order_relaxed);
+}
+
+FilterStats::Totals FilterStats::totals() const noexcept {
+  Totals ret;
+  for (const Stripe &s : stripes_) {
+    ret.found += s.found.load(std::memory_order_relaxed);
+    ret.rejected += s.rejected.load(std::memory_order_relaxed);
+    ret.queried += s.queried.load(std::memory_order_relaxed);
+  }
+  // Stripes are read while written, do not report a negative difference
+  if (ret.queried < ret.rejected + ret.found)
+    ret.queried = ret.rejected + ret.found;
+  return ret;
+}
+
+void FilterStats::logAll() {
+  LOG(INFO) << "Lookup filters:";
+  forEach([](const FilterStats &stats) {
+    Totals t = stats.totals();
+    LOG(INFO) << "  " << stats.name() << ": queried=" << t.queried
+              << " rejected=" << t.rejected << " found=" << t.found
+              << " false_positives=" << t.falsePositives();
+  });
+}
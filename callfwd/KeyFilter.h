@@ -0,0 +1,135 @@
+#ifndef CALLFWD_KEYFILTER_H
+#define CALLFWD_KEYFILTER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include "BatchHash.h"
+#include "HugePages.h"
+#include "Parallel.h"
+
+/**
+ * Split block Bloom filter over 64-bit keys, answers whether a key may be
+ * present with no false negatives.
+ *
+ * Every key sets one bit in each 32-bit word of a single 256-bit block,
+ * so a query reads one half of a cache line and never misses twice.
+ * False positive rate is about 1.5% with 10 bits per key, 0.5% with 14.
+ */
+class KeyFilter {
+ public:
+  static constexpr size_t BLOCK_WORDS = 8;
+
+  KeyFilter() = default;
+  /** Attach to blocks of a filter built before, e.g. mapped from file.
+    * Throws `runtime_error` if it is not made of whole blocks. */
+  explicit KeyFilter(folly::Range<const uint32_t*> words);
+  KeyFilter(KeyFilter&& rhs) noexcept = default;
+  KeyFilter& operator=(KeyFilter&& rhs) noexcept = default;
+
+  /** Build filter of keyAt(i) for every i in [0, N) with about bitsPerKey
+    * bits per key. Filter is empty if N or bitsPerKey is 0. */
+  template <class F>
+  static KeyFilter build(size_t N, unsigned bitsPerKey, F &&keyAt);
+
+  /** Check if key may be present, always true for an empty filter. */
+  bool mayContain(uint64_t key) const noexcept;
+
+  /** Store position of every key which may be present into pos, return
+    * their number. Blocks are prefetched `distance` keys ahead. */
+  size_t select(size_t N, const uint64_t *keys, uint32_t *pos,
+                size_t distance) const noexcept;
+
+  bool empty() const noexcept { return words_.empty(); }
+  folly::Range<const uint32_t*> words() const noexcept { return words_; }
+  /** Get bytes allocated by build(), 0 if attached to words. */
+  size_t allocatedBytes() const noexcept {
+    return store_.capacity() * sizeof(uint32_t);
+  }
+
+ private:
+  void allocate(size_t N, unsigned bitsPerKey);
+  void insert(uint64_t key) noexcept;
+
+  static uint64_t hashKey(uint64_t key) noexcept { return mixHash(key ^ SEED); }
+  size_t blockOf(uint64_t hash) const noexcept {
+    return ((hash >> 32) * numBlocks_) >> 32;
+  }
+
+  static constexpr uint64_t SEED = 0x8a5cd789635d2dffull;
+
+  LargeVector<uint32_t> store_;
+  folly::Range<const uint32_t*> words_;
+  size_t numBlocks_ = 0;
+};
+
+template <class F>
+KeyFilter KeyFilter::build(size_t N, unsigned bitsPerKey, F &&keyAt) {
+  KeyFilter ret;
+  if (N == 0 || bitsPerKey == 0)
+    return ret;
+
+  ret.allocate(N, bitsPerKey);
+  parallelChunks(N, 256, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i)
+      ret.insert(keyAt(i));
+  });
+  return ret;
+}
+
+/**
+ * Lookup counters of a filtered table, kept per thread stripe and summed
+ * when read. Every instance is listed by forEach() under its name.
+ */
+class FilterStats {
+ public:
+  struct Totals {
+    uint64_t queried = 0;   // keys looked up
+    uint64_t rejected = 0;  // keys answered by filter alone
+    uint64_t found = 0;     // keys present in the table
+
+    /** Keys which passed filter but are absent. */
+    uint64_t falsePositives() const noexcept {
+      return queried - rejected - found;
+    }
+  };
+
+  explicit FilterStats(const char *name);
+  FilterStats(const FilterStats&) = delete;
+  FilterStats& operator=(const FilterStats&) = delete;
+
+  /** Count a batch of lookups. */
+  void add(size_t queried, size_t rejected, size_t found) noexcept;
+
+  const char *name() const noexcept { return name_; }
+  Totals totals() const noexcept;
+
+  /** Call f(stats) for every instance. */
+  template <class F>
+  static void forEach(F &&f) {
+    for (const FilterStats *stats : registry())
+      f(*stats);
+  }
+
+  /** Log counters of every instance. */
+  static void logAll();
+
+ private:
+  static constexpr size_t STRIPES = 16;
+  static std::vector<const FilterStats*>& registry();
+
+  struct alignas(64) Stripe {
+    std::atomic<uint64_t> queried{0};
+    std::atomic<uint64_t> rejected{0};
+    std::atomic<uint64_t> found{0};
+  };
+
+  const char *name_;
+  Stripe stripes_[STRIPES];
+};
+
+#endif // CALLFWD_KEYFILTER_H
@@ -0,0 +1,102 @@
+#include "Manifest.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <glog/logging.h>
+#include <folly/json.h>
+
+static constexpr int MANIFEST_VERSION = 1;
+
+Manifest::Manifest(std::string path)
+  : path_(std::move(path))
+{}
+
+void Manifest::load() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  datasets_.clear();
+
+  struct stat st;
+  if (stat(path_.c_str(), &st) != 0) {
+    if (errno == ENOENT)
+      return;
+    throw std::system_error(errno, std::generic_category(), path_);
+  }
+
+  std::ifstream in;
+  std::stringstream text;
+  in.exceptions(std::ios_base::failbit | std::ios_base::badbit);
+  in.open(path_);
+  text << in.rdbuf();
+
+  folly::dynamic manifest = folly::parseJson(text.str());
+  if (manifest.getDefault("version", 0).asInt() != MANIFEST_VERSION)
+    throw std::runtime_error(path_ + ": unsupported manifest version");
+
+  for (auto &kv : manifest["datasets"].items()) {
+    std::vector<Step> &steps = datasets_[kv.first.asString()];
+    for (const folly::dynamic &step : kv.second)
+      steps.push_back(Step{ step["cmd"].asString(), step["path"].asString(),
+                            step.getDefault("meta", folly::dynamic::object()) });
+  }
+}
+
+void Manifest::record(const std::string &dataset, Step step, bool delta) {
+  if (!enabled())
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Step> &steps = datasets_[dataset];
+  if (!delta)
+    steps.clear();
+  steps.push_back(std::move(step));
+  save();
+}
+
+void Manifest::forget(const std::string &dataset) {
+  if (!enabled())
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (datasets_.erase(dataset))
+    save();
+}
+
+std::map<std::string, std::vector<Manifest::Step>> Manifest::datasets() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return datasets_;
+}
+
+void Manifest::save() {
+  folly::dynamic datasets = folly::dynamic::object();
+  for (auto &kv : datasets_) {
+    folly::dynamic steps = folly::dynamic::array();
+    for (const Step &step : kv.second)
+      steps.push_back(folly::dynamic::object
+        ("cmd", step.cmd)
+        ("path", step.path)
+        ("meta", step.meta));
+    datasets[kv.first] = std::move(steps);
+  }
+  folly::dynamic manifest = folly::dynamic::object
+    ("version", MANIFEST_VERSION)
+    ("datasets", std::move(datasets));
+
+  // Contents must reach the disk before rename makes them current
+  std::string text = folly::toPrettyJson(manifest) + '\n';
+  std::string tmpPath = path_ + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    PLOG(ERROR) << "Writing manifest " << tmpPath;
+    return;
+  }
+  bool ok = write(fd, text.data(), text.size()) == ssize_t(text.size()) && fsync(fd) == 0;
+  PLOG_IF(ERROR, !ok) << "Writing manifest " << tmpPath;
+  close(fd);
+  if (ok && rename(tmpPath.c_str(), path_.c_str()) != 0)
+    PLOG(ERROR) << "Replacing manifest " << path_;
+}
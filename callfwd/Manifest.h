@@ -0,0 +1,54 @@
+#ifndef CALLFWD_MANIFEST_H
+#define CALLFWD_MANIFEST_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <folly/dynamic.h>
+
+/*
+ * Record of loads committed to every dataset, kept on disk so a restarted
+ * daemon can repeat them instead of waiting for callfwdctl. A dataset has
+ * a full load, like `reload` or `load_snapshot`, followed by the deltas
+ * applied since. The file is JSON
+ * {"version": 1, "datasets": {name: [{"cmd", "path", "meta"}, ...]}}
+ * and is replaced by rename, so a crash leaves either version of it.
+ */
+class Manifest {
+ public:
+  struct Step {
+    std::string cmd;     // control command which committed it
+    std::string path;    // input file, absolute
+    folly::dynamic meta; // message of the command
+  };
+
+  /** Keep manifest in path, empty path disables it. */
+  explicit Manifest(std::string path);
+
+  bool enabled() const noexcept { return !path_.empty(); }
+
+  /** Read the file, a missing one is an empty manifest.
+    * Throws `runtime_error` if it can't be read or parsed. */
+  void load();
+
+  /** Replace steps of dataset by a full load, or append a delta to them.
+    * The file is rewritten, failures to write it are logged. */
+  void record(const std::string &dataset, Step step, bool delta);
+
+  /** Drop dataset whose last load can't be repeated. */
+  void forget(const std::string &dataset);
+
+  /** Get steps of every dataset in order of commit. */
+  std::map<std::string, std::vector<Step>> datasets() const;
+
+ private:
+  /** Write all datasets to the file, lock must be held. */
+  void save();
+
+  const std::string path_;
+  mutable std::mutex mutex_;
+  std::map<std::string, std::vector<Step>> datasets_;
+};
+
+#endif // CALLFWD_MANIFEST_H
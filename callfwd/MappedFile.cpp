@@ -0,0 +1,128 @@
+#include "MappedFile.h"
+#include "HugePages.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <utility>
+
+static std::system_error errnoError(const std::string &what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+MappedFile MappedFile::openReadOnly(const std::string &path, bool populate) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw errnoError("open " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    auto err = errnoError("fstat " + path);
+    close(fd);
+    throw err;
+  }
+
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return MappedFile();
+  }
+
+  int flags = MAP_SHARED | (populate ? MAP_POPULATE : 0);
+  void *addr = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+  if (addr == MAP_FAILED) {
+    auto err = errnoError("mmap " + path);
+    close(fd);
+    throw err;
+  }
+
+  close(fd);
+  return MappedFile(static_cast<uint8_t*>(addr), size);
+}
+
+MappedFile MappedFile::createWritable(const std::string &path, size_t size) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0)
+    throw errnoError("open " + path);
+
+  try {
+    MappedFile ret = createWritable(fd, size);
+    close(fd);
+    return ret;
+  } catch (std::system_error &) {
+    close(fd);
+    unlink(path.c_str());
+    throw;
+  }
+}
+
+MappedFile MappedFile::createWritable(int fd, size_t size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    throw errnoError("fstat");
+  if (!S_ISREG(st.st_mode) || st.st_size != 0)
+    throw std::system_error(EEXIST, std::generic_category(), "output is not an empty file");
+
+  if (ftruncate(fd, size) < 0)
+    throw errnoError("ftruncate");
+  if (size == 0)
+    return MappedFile();
+
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    throw errnoError("mmap");
+  return MappedFile(static_cast<uint8_t*>(addr), size);
+}
+
+MappedFile MappedFile::createAnonymous(size_t size, int node) {
+  if (size == 0)
+    return MappedFile();
+
+  void *addr = allocateLarge(size, node);
+  memset(addr, 0, size);
+  return MappedFile(static_cast<uint8_t*>(addr), size, true);
+}
+
+MappedFile::MappedFile(MappedFile&& rhs) noexcept
+  : data_(std::exchange(rhs.data_, nullptr))
+  , size_(std::exchange(rhs.size_, 0))
+  , anonymous_(std::exchange(rhs.anonymous_, false))
+{}
+
+MappedFile& MappedFile::operator=(MappedFile&& rhs) noexcept {
+  if (this != &rhs) {
+    reset();
+    data_ = std::exchange(rhs.data_, nullptr);
+    size_ = std::exchange(rhs.size_, 0);
+    anonymous_ = std::exchange(rhs.anonymous_, false);
+  }
+  return *this;
+}
+
+MappedFile::~MappedFile() noexcept {
+  reset();
+}
+
+void MappedFile::willNeed() const noexcept {
+  if (data_)
+    madvise(data_, size_, MADV_WILLNEED);
+}
+
+void MappedFile::sync() {
+  if (data_ && !anonymous_ && msync(data_, size_, MS_SYNC) < 0)
+    throw errnoError("msync");
+}
+
+void MappedFile::reset() noexcept {
+  if (data_ && anonymous_)
+    deallocateLarge(data_, size_);
+  else if (data_)
+    munmap(data_, size_);
+  data_ = nullptr;
+  size_ = 0;
+  anonymous_ = false;
+}
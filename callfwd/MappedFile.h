@@ -0,0 +1,59 @@
+#ifndef CALLFWD_MAPPEDFILE_H
+#define CALLFWD_MAPPEDFILE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include <folly/Range.h>
+
+/** Memory mapping of a whole file. */
+class MappedFile {
+ public:
+  /** Map existing file read-only.
+    * Throws `system_error` if file can't be mapped. */
+  static MappedFile openReadOnly(const std::string &path, bool populate = false);
+
+  /** Create a new file of exact size and map it writable. An existing
+    * file is never truncated, others may have it mapped.
+    * Throws `system_error` if path exists or file can't be mapped. */
+  static MappedFile createWritable(const std::string &path, size_t size);
+
+  /** Grow empty regular file open as fd to exact size and map it writable.
+    * Throws `system_error` if file isn't empty or can't be mapped. */
+  static MappedFile createWritable(int fd, size_t size);
+
+  /** Allocate zeroed memory of exact size with no file behind, in huge
+    * pages and on NUMA node if it is not negative, see allocateLarge().
+    * Throws `bad_alloc` if out of memory. */
+  static MappedFile createAnonymous(size_t size, int node = -1);
+
+  MappedFile() noexcept = default;
+  MappedFile(MappedFile&& rhs) noexcept;
+  MappedFile& operator=(MappedFile&& rhs) noexcept;
+  ~MappedFile() noexcept;
+
+  /** Get mapped bytes. */
+  folly::ByteRange range() const noexcept { return {data_, size_}; }
+  uint8_t* writableData() noexcept { return data_; }
+  size_t size() const noexcept { return size_; }
+
+  /** Ask kernel to start reading the whole file in background. */
+  void willNeed() const noexcept;
+
+  /** Write dirty pages back to disk, nothing to do for anonymous memory. */
+  void sync();
+
+  /** Unmap file or free anonymous memory. */
+  void reset() noexcept;
+
+ private:
+  MappedFile(uint8_t *data, size_t size, bool anonymous = false) noexcept
+    : data_(data), size_(size), anonymous_(anonymous) {}
+
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  bool anonymous_ = false;
+};
+
+#endif // CALLFWD_MAPPEDFILE_H
@@ -0,0 +1,416 @@
+#ifndef CALLFWD_MAPPINGTABLE_H
+#define CALLFWD_MAPPINGTABLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+#include <folly/small_vector.h>
+#include <folly/container/F14Map.h>
+#include <folly/container/F14Set.h>
+#include <folly/synchronization/Hazptr.h>
+
+#include "Arena.h"
+#include "BatchLookup.h"
+#include "HugePages.h"
+#include "KeyFilter.h"
+#include "MemoryUsage.h"
+#include "Reclaimer.h"
+#include "Snapshot.h"
+
+/** Key of a 10-digit number with its last digits dropped. */
+template <uint64_t DIVISOR>
+struct PrefixKey {
+  static uint64_t of(uint64_t pn) noexcept { return pn / DIVISOR; }
+};
+
+using FullPN = PrefixKey<1>;
+using NpaKey = PrefixKey<10000000>;
+using NpaNxxKey = PrefixKey<10000>;
+using NpaNxxXKey = PrefixKey<1000>;
+
+/** Row of datasets which only list numbers, their tables are sets. */
+struct Listed {};
+
+/**
+ * Storage and lookup engine of aux datasets, the Data of DncMapping,
+ * LergMapping and the others is a MappingTable. Derived is that Data and
+ * names the dataset by `NAME`. Row is the value layout stored in dicts as
+ * is, its strings are views into `arena`. Each of Keys is a level with its
+ * own dict and filter, e.g. LERG has NPA-NXX-X and NPA-NXX blocks, and a
+ * number resolves to the row of the first level holding its key. Keys of
+ * a level pass its filter and are probed by the pipelined batch kernel,
+ * the same as in US/CA mapping. Derived lists string fields of Row in
+ * `STRINGS`, so a snapshot can store them apart from the rows.
+ */
+template <class Derived, class Row, class... Keys>
+class MappingTable
+  : public folly::hazptr_obj_base<Derived, std::atomic, ReclaimLater<Derived>> {
+ public:
+  static constexpr size_t LEVELS = sizeof...(Keys);
+  static_assert(LEVELS > 0, "MappingTable needs a key");
+
+  using Dict = std::conditional_t<std::is_empty<Row>::value,
+    folly::F14ValueSet<uint64_t,
+                       folly::f14::DefaultHasher<uint64_t>,
+                       folly::f14::DefaultKeyEqual<uint64_t>,
+                       HugePageAllocator<uint64_t>>,
+    folly::F14ValueMap<uint64_t, Row,
+                       folly::f14::DefaultHasher<uint64_t>,
+                       folly::f14::DefaultKeyEqual<uint64_t>,
+                       HugePageAllocator<std::pair<const uint64_t, Row>>>>;
+
+  ~MappingTable() noexcept {
+    LOG_IF(INFO, size() > 0) << "Reclaiming memory";
+    if (retiredBytes > 0)
+      retired().reclaim(retiredBytes);
+  }
+
+  /** Preallocate level for expected number of keys. */
+  void reserve(size_t level, size_t numRecords) {
+    dicts_[level].reserve(numRecords);
+  }
+
+  /** Add row of key to level.
+    * Throws `runtime_error` if key already exists. */
+  void insert(size_t level, uint64_t key, const Row &row) {
+    bool inserted;
+    if constexpr (std::is_empty<Row>::value)
+      inserted = dicts_[level].insert(key).second;
+    else
+      inserted = dicts_[level].emplace(key, row).second;
+    if (!inserted)
+      throw std::runtime_error(std::string(Derived::NAME) + ": duplicate key");
+  }
+
+  /** Build filters of levels, 0 bits per key disables them.
+    * Levels taken from a snapshot keep its filters. */
+  void build(unsigned bitsPerKey);
+
+  /** Write keys, rows and filters of every level into snapshot file of
+    * kind NAME, strings of rows are gathered after them. Throws
+    * `system_error` if the file can't be written. */
+  void writeSnapshot(const std::string &path) const;
+
+  /** Map snapshot written by writeSnapshot() and fill levels from it.
+    * Strings of rows and filters are used from the mapping in place.
+    * Throws `runtime_error` if snapshot is malformed. */
+  void attachSnapshot(const std::string &path);
+
+  /** Call hit(i, row) for every pn[i] found at some level. Probes are
+    * `distance` keys apart and counted in stats. */
+  template <class Hit>
+  void lookup(size_t N, const uint64_t *pn, size_t distance,
+              FilterStats &stats, Hit &&hit) const;
+
+  /** Get number of keys of all levels. */
+  size_t size() const noexcept {
+    size_t ret = 0;
+    for (const Dict &dict : dicts_)
+      ret += dict.size();
+    return ret;
+  }
+
+  /** Count bytes of dicts, filters, arena and metadata. */
+  void memoryUsage(MemoryUsage &usage) const {
+    usage.addMeta(meta);
+    usage.add("arena", arena.allocatedBytes());
+    for (size_t level = 0; level < LEVELS; ++level) {
+      usage.addTable("dict", dicts_[level]);
+      usage.add("filter", filters_[level].allocatedBytes());
+    }
+    // Mapped file, resident as far as lookups touched it
+    if (snapshot_)
+      usage.add("snapshot", snapshot_->size());
+  }
+
+  /** Log metadata to system journal. */
+  void printMetadata() const {
+    LOG(INFO) << "Current mapping info:";
+    for (auto kv : meta.items())
+      LOG(INFO) << "  " << kv.first.asString()
+                << ": " << folly::toJson(kv.second);
+  }
+
+  /** Take data out of builder, leaving an empty one, and build it. */
+  static std::unique_ptr<Derived> build(std::unique_ptr<Derived> &data,
+                                        unsigned bitsPerKey) {
+    auto ret = std::make_unique<Derived>();
+    std::swap(ret, data);
+    ret->build(bitsPerKey);
+    return ret;
+  }
+
+  /** Replace version in global, the old one is retired. */
+  static void commit(std::unique_ptr<Derived> data, std::atomic<Derived*> &global) {
+    size_t rows = data->size();
+    if (Derived *veteran = global.exchange(data.release()))
+      retireVersion(veteran, retired());
+    LOG(INFO) << "Database updated: " << Derived::NAME << " keys=" << rows;
+  }
+
+  /** Get memory usage of a version, if any, and of retired ones. */
+  static folly::dynamic usageOf(const Derived *data) {
+    MemoryUsage usage;
+    if (data)
+      data->memoryUsage(usage);
+    folly::dynamic ret = usage.toDynamic();
+    retired().addTo(ret);
+    return ret;
+  }
+
+  // metadata
+  folly::dynamic meta;
+  // strings of rows, released at once with the version
+  Arena arena;
+  // bytes counted in retired() once replaced in global
+  size_t retiredBytes = 0;
+
+ private:
+  using Positions = folly::small_vector<uint32_t, 64>;
+  using KeyBuffer = folly::small_vector<uint64_t, 64>;
+
+  // Position of a string of a row among strings of the snapshot
+  struct StringRef {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  static constexpr uint32_t SNAPSHOT_VERSION = 1;
+  // Section tags, levels take LEVEL_TAGS tags each after SNAP_LEVEL
+  static constexpr uint32_t SNAP_META = 1;
+  static constexpr uint32_t SNAP_CHARS = 2;
+  static constexpr uint32_t SNAP_LEVEL = 16;
+  static constexpr uint32_t LEVEL_TAGS = 4;
+  static constexpr uint32_t SNAP_KEYS = 0;
+  static constexpr uint32_t SNAP_ROWS = 1;
+  static constexpr uint32_t SNAP_STRINGS = 2;
+  static constexpr uint32_t SNAP_FILTER = 3;
+
+  static uint32_t levelTag(size_t level, uint32_t tag) noexcept {
+    return SNAP_LEVEL + level * LEVEL_TAGS + tag;
+  }
+
+  /** Versions of the dataset replaced but not reclaimed yet. */
+  static RetiredVersions& retired() {
+    static RetiredVersions versions;
+    return versions;
+  }
+
+  template <class Hit, size_t... L>
+  void lookupLevels(const uint64_t *pn, size_t distance, FilterStats &stats,
+                    Positions &pending, Hit &hit, std::index_sequence<L...>) const {
+    (lookupLevel<L, std::tuple_element_t<L, std::tuple<Keys...>>>(
+      pn, distance, stats, pending, hit), ...);
+  }
+
+  template <size_t L, class Key, class Hit>
+  void lookupLevel(const uint64_t *pn, size_t distance, FilterStats &stats,
+                   Positions &pending, Hit &hit) const;
+
+  std::array<Dict, LEVELS> dicts_;
+  std::array<KeyFilter, LEVELS> filters_;
+  // strings and filters of rows taken from snapshot file
+  std::unique_ptr<SnapshotReader> snapshot_;
+};
+
+template <class Derived, class Row, class... Keys>
+void MappingTable<Derived, Row, Keys...>::build(unsigned bitsPerKey) {
+  if (snapshot_)
+    return;
+  for (size_t level = 0; level < LEVELS; ++level) {
+    std::vector<uint64_t> keys;
+    keys.reserve(dicts_[level].size());
+    for (const auto &entry : dicts_[level]) {
+      if constexpr (std::is_empty<Row>::value)
+        keys.push_back(entry);
+      else
+        keys.push_back(entry.first);
+    }
+    filters_[level] = KeyFilter::build(keys.size(), bitsPerKey, [&](size_t i) {
+      return keys[i];
+    });
+  }
+}
+
+template <class Derived, class Row, class... Keys>
+void MappingTable<Derived, Row, Keys...>::writeSnapshot(const std::string &path) const {
+  static_assert(std::is_trivially_copyable<Row>::value, "Row is stored as is");
+  std::string metaJson = folly::toJson(meta);
+  SnapshotWriter writer(Derived::NAME, SNAPSHOT_VERSION);
+
+  size_t chars = 0;
+  writer.addSection<char>(SNAP_META, metaJson.size());
+  for (size_t level = 0; level < LEVELS; ++level) {
+    size_t N = dicts_[level].size();
+    writer.addSection<uint64_t>(levelTag(level, SNAP_KEYS), N);
+    if (!filters_[level].empty())
+      writer.addSection<uint32_t>(levelTag(level, SNAP_FILTER),
+                                  filters_[level].words().size());
+    if constexpr (!std::is_empty<Row>::value) {
+      writer.addSection<Row>(levelTag(level, SNAP_ROWS), N);
+      writer.addSection<StringRef>(levelTag(level, SNAP_STRINGS),
+                                   N * std::size(Derived::STRINGS));
+      for (const auto &entry : dicts_[level])
+        for (auto field : Derived::STRINGS)
+          chars += (entry.second.*field).size();
+    }
+  }
+  writer.addSection<char>(SNAP_CHARS, chars);
+  writer.open(path);
+
+  auto metaOut = writer.section<char>(SNAP_META);
+  std::copy(metaJson.begin(), metaJson.end(), metaOut.begin());
+  auto charsOut = writer.section<char>(SNAP_CHARS);
+  size_t offset = 0;
+  for (size_t level = 0; level < LEVELS; ++level) {
+    auto keysOut = writer.section<uint64_t>(levelTag(level, SNAP_KEYS));
+    if (!filters_[level].empty()) {
+      auto words = filters_[level].words();
+      auto filterOut = writer.section<uint32_t>(levelTag(level, SNAP_FILTER));
+      std::copy(words.begin(), words.end(), filterOut.begin());
+    }
+
+    size_t i = 0;
+    if constexpr (std::is_empty<Row>::value) {
+      for (uint64_t key : dicts_[level])
+        keysOut[i++] = key;
+    } else {
+      // Strings are stored by position, their views are left empty
+      auto rowsOut = writer.section<Row>(levelTag(level, SNAP_ROWS));
+      auto refsOut = writer.section<StringRef>(levelTag(level, SNAP_STRINGS));
+      size_t ref = 0;
+      for (const auto &entry : dicts_[level]) {
+        Row row = entry.second;
+        for (auto field : Derived::STRINGS) {
+          folly::StringPiece s = row.*field;
+          std::copy(s.begin(), s.end(), charsOut.begin() + offset);
+          refsOut[ref++] = StringRef{offset, s.size()};
+          offset += s.size();
+          row.*field = folly::StringPiece();
+        }
+        keysOut[i] = entry.first;
+        rowsOut[i++] = row;
+      }
+    }
+  }
+  writer.commit();
+}
+
+template <class Derived, class Row, class... Keys>
+void MappingTable<Derived, Row, Keys...>::attachSnapshot(const std::string &path) {
+  const std::string error = std::string(Derived::NAME) + ": inconsistent snapshot";
+  snapshot_ = std::make_unique<SnapshotReader>(path, Derived::NAME);
+  if (snapshot_->version() != SNAPSHOT_VERSION)
+    throw std::runtime_error(std::string(Derived::NAME) + ": unsupported snapshot version");
+
+  auto metaJson = snapshot_->section<char>(SNAP_META);
+  meta = folly::parseJson(folly::StringPiece(metaJson.begin(), metaJson.end()));
+  auto chars = snapshot_->section<char>(SNAP_CHARS);
+
+  for (size_t level = 0; level < LEVELS; ++level) {
+    auto keys = snapshot_->section<uint64_t>(levelTag(level, SNAP_KEYS));
+    dicts_[level].reserve(keys.size());
+    if constexpr (std::is_empty<Row>::value) {
+      for (uint64_t key : keys)
+        insert(level, key, Row());
+    } else {
+      static constexpr size_t S = std::size(Derived::STRINGS);
+      auto rows = snapshot_->section<Row>(levelTag(level, SNAP_ROWS));
+      auto refs = snapshot_->section<StringRef>(levelTag(level, SNAP_STRINGS));
+      if (rows.size() != keys.size() || refs.size() != keys.size() * S)
+        throw std::runtime_error(error);
+      for (size_t i = 0; i < keys.size(); ++i) {
+        Row row = rows[i];
+        for (size_t k = 0; k < S; ++k) {
+          const StringRef &ref = refs[i * S + k];
+          if (ref.offset > chars.size() || ref.size > chars.size() - ref.offset)
+            throw std::runtime_error(error);
+          row.*Derived::STRINGS[k] = folly::StringPiece(chars.begin() + ref.offset, ref.size);
+        }
+        insert(level, keys[i], row);
+      }
+    }
+    // Levels written without filter are served by their dict alone
+    if (snapshot_->hasSection(levelTag(level, SNAP_FILTER)))
+      filters_[level] = KeyFilter(snapshot_->section<uint32_t>(levelTag(level, SNAP_FILTER)));
+  }
+}
+
+template <class Derived, class Row, class... Keys>
+template <class Hit>
+void MappingTable<Derived, Row, Keys...>::lookup(
+  size_t N, const uint64_t *pn, size_t distance, FilterStats &stats, Hit &&hit) const
+{
+  // Numbers not found at previous levels
+  Positions pending(N);
+  std::iota(pending.begin(), pending.end(), 0);
+  lookupLevels(pn, distance, stats, pending, hit,
+               std::make_index_sequence<LEVELS>());
+}
+
+template <class Derived, class Row, class... Keys>
+template <size_t L, class Key, class Hit>
+void MappingTable<Derived, Row, Keys...>::lookupLevel(
+  const uint64_t *pn, size_t distance, FilterStats &stats,
+  Positions &pending, Hit &hit) const
+{
+  const Dict &dict = dicts_[L];
+  size_t P = pending.size();
+  if (P == 0 || dict.empty())
+    return;
+
+  KeyBuffer key(P);
+  for (size_t j = 0; j < P; ++j)
+    key[j] = Key::of(pn[pending[j]]);
+
+  // Only keys passing filter are probed, sel maps them back to pending
+  Positions sel(P);
+  size_t M = P;
+  if (!filters_[L].empty()) {
+    M = filters_[L].select(P, key.data(), sel.data(), distance);
+    for (size_t j = 0; j < M; ++j)
+      key[j] = key[sel[j]];
+  } else {
+    std::iota(sel.begin(), sel.end(), 0);
+  }
+
+  static constexpr uint32_t FOUND = ~uint32_t(0);
+  size_t found = 0;
+  f14Lookup(dict, M, key.data(), distance, [&](size_t j, auto it) {
+    if (it == dict.cend())
+      return;
+    uint32_t &i = pending[sel[j]];
+    if constexpr (std::is_empty<Row>::value)
+      hit(i, Row());
+    else
+      hit(i, it->second);
+    i = FOUND;
+    ++found;
+  });
+  stats.add(P, P - M, found);
+
+  if (found > 0 && L + 1 < LEVELS) {
+    size_t n = 0;
+    for (uint32_t i : pending)
+      if (i != FOUND)
+        pending[n++] = i;
+    pending.resize(n);
+  }
+}
+
+#endif // CALLFWD_MAPPINGTABLE_H
@@ -0,0 +1,83 @@
+#include "MemoryUsage.h"
+
+#include <folly/dynamic.h>
+
+void MemoryUsage::add(const std::string &part, size_t bytes) {
+  parts_[part].bytes += bytes;
+}
+
+void MemoryUsage::addTable(const std::string &part, size_t bytes,
+                           size_t size, size_t capacity) {
+  Part &p = parts_[part];
+  p.bytes += bytes;
+  p.size += size;
+  p.capacity += capacity;
+}
+
+void MemoryUsage::addMeta(const folly::dynamic &meta) {
+  add("meta", dynamicBytes(meta));
+}
+
+size_t MemoryUsage::total() const noexcept {
+  size_t ret = 0;
+  for (const auto &kv : parts_)
+    ret += kv.second.bytes;
+  return ret;
+}
+
+folly::dynamic MemoryUsage::toDynamic() const {
+  folly::dynamic parts = folly::dynamic::object();
+  for (const auto &kv : parts_) {
+    const Part &p = kv.second;
+    folly::dynamic part = folly::dynamic::object("bytes", p.bytes);
+    if (p.capacity > 0)
+      part["load_factor"] = double(p.size) / p.capacity;
+    parts[kv.first] = std::move(part);
+  }
+  return folly::dynamic::object("total", total())("parts", std::move(parts));
+}
+
+size_t stringBytes(const std::string &s) noexcept {
+  // Short strings are kept inside the object
+  const char *object = reinterpret_cast<const char*>(&s);
+  if (s.data() >= object && s.data() < object + sizeof(s))
+    return 0;
+  return s.capacity() + 1;
+}
+
+size_t dynamicBytes(const folly::dynamic &value) {
+  size_t ret = sizeof(folly::dynamic);
+  if (value.isString()) {
+    ret += stringBytes(value.getString());
+  } else if (value.isArray()) {
+    for (const folly::dynamic &item : value)
+      ret += dynamicBytes(item);
+  } else if (value.isObject()) {
+    for (const auto &kv : value.items())
+      ret += dynamicBytes(kv.first) + dynamicBytes(kv.second);
+  }
+  return ret;
+}
+
+void RetiredVersions::retire(size_t bytes) noexcept {
+  versions_.fetch_add(1, std::memory_order_relaxed);
+  bytes_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void RetiredVersions::reclaim(size_t bytes) noexcept {
+  versions_.fetch_sub(1, std::memory_order_relaxed);
+  bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+size_t RetiredVersions::versions() const noexcept {
+  return versions_.load(std::memory_order_relaxed);
+}
+
+size_t RetiredVersions::bytes() const noexcept {
+  return bytes_.load(std::memory_order_relaxed);
+}
+
+void RetiredVersions::addTo(folly::dynamic &usage) const {
+  usage["retired_versions"] = versions();
+  usage["retired_bytes"] = bytes();
+}
@@ -0,0 +1,111 @@
+#ifndef CALLFWD_MEMORYUSAGE_H
+#define CALLFWD_MEMORYUSAGE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <map>
+#include <string>
+
+namespace folly { struct dynamic; }
+
+/**
+ * Bytes of memory held by parts of a dataset, e.g. its dict, columns and
+ * indexes, with load factor of hash tables. Parts of the same name are
+ * summed, so a mapping made of shards reports them as one.
+ */
+class MemoryUsage {
+ public:
+  /** Count bytes of a part. */
+  void add(const std::string &part, size_t bytes);
+
+  /** Count bytes of a hash table holding size entries of capacity. */
+  void addTable(const std::string &part, size_t bytes,
+                size_t size, size_t capacity);
+
+  /** Count F14 table, plus heapOf(value) bytes owned by every value. */
+  template <class Table>
+  void addTable(const std::string &part, const Table &table);
+  template <class Table, class F>
+  void addTable(const std::string &part, const Table &table, F &&heapOf);
+
+  /** Count vector by its capacity. */
+  template <class Vector>
+  void addVector(const std::string &part, const Vector &v) {
+    add(part, v.capacity() * sizeof(typename Vector::value_type));
+  }
+
+  /** Count metadata as part "meta". */
+  void addMeta(const folly::dynamic &meta);
+
+  /** Get sum of all parts. */
+  size_t total() const noexcept;
+
+  /** Get object {"total", "parts": {name: {"bytes", "load_factor"}}}. */
+  folly::dynamic toDynamic() const;
+
+ private:
+  struct Part {
+    size_t bytes = 0;
+    size_t size = 0;      // entries of hash tables
+    size_t capacity = 0;  // and their capacity
+  };
+  std::map<std::string, Part> parts_;
+};
+
+template <class Table>
+void MemoryUsage::addTable(const std::string &part, const Table &table) {
+  addTable(part, table.getAllocatedMemorySize(),
+           table.size(), table.bucket_count());
+}
+
+template <class Table, class F>
+void MemoryUsage::addTable(const std::string &part, const Table &table,
+                           F &&heapOf) {
+  size_t heap = 0;
+  for (const auto &kv : table)
+    heap += heapOf(kv.second);
+  addTable(part, table.getAllocatedMemorySize() + heap,
+           table.size(), table.bucket_count());
+}
+
+/** Get bytes a string holds out of its object, 0 for short strings. */
+size_t stringBytes(const std::string &s) noexcept;
+
+/** Get approximate bytes held by a dynamic value with all its children. */
+size_t dynamicBytes(const folly::dynamic &value);
+
+/**
+ * Versions of a dataset replaced in its global and waiting for hazptr to
+ * reclaim them, still held by lookups which started before the swap.
+ */
+class RetiredVersions {
+ public:
+  /** Count a version of bytes, see retireVersion(). */
+  void retire(size_t bytes) noexcept;
+  /** Uncount a version when destroyed. */
+  void reclaim(size_t bytes) noexcept;
+
+  size_t versions() const noexcept;
+  size_t bytes() const noexcept;
+
+  /** Add "retired_versions" and "retired_bytes" to usage object. */
+  void addTo(folly::dynamic &usage) const;
+
+ private:
+  std::atomic<size_t> versions_{0};
+  std::atomic<size_t> bytes_{0};
+};
+
+/** Retire veteran Data swapped out of global, counting its memory which
+  * Data gives back in destructor with retired.reclaim(retiredBytes). */
+template <class Data>
+void retireVersion(Data *veteran, RetiredVersions &retired) {
+  MemoryUsage usage;
+  veteran->memoryUsage(usage);
+  veteran->retiredBytes = usage.total();
+  retired.retire(veteran->retiredBytes);
+  veteran->retire();
+}
+
+#endif // CALLFWD_MEMORYUSAGE_H
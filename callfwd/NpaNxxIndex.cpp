@@ -0,0 +1,105 @@
+#include "NpaNxxIndex.h"
+
+#include <cstring>
+#include <stdexcept>
+
+constexpr size_t NpaNxxIndex::NUM_BLOCKS;
+constexpr size_t NpaNxxIndex::BLOCK_SIZE;
+constexpr size_t NpaNxxIndex::LINE_BITS;
+constexpr size_t NpaNxxIndex::LINES_PER_BLOCK;
+constexpr uint32_t NpaNxxIndex::NO_BLOCK;
+constexpr size_t NpaNxxIndex::NONE;
+
+static_assert(sizeof(NpaNxxIndex::Line) == 64, "");
+
+NpaNxxIndex NpaNxxIndex::build(folly::Range<const uint64_t*> keys) {
+  NpaNxxIndex ret;
+  ret.size_ = keys.size();
+  if (keys.empty())
+    return ret;
+
+  ret.blockStore_.assign(NUM_BLOCKS, NO_BLOCK);
+  uint64_t prev = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    uint64_t key = keys[i];
+    if (key >= NUM_BLOCKS * BLOCK_SIZE)
+      throw std::invalid_argument("NpaNxxIndex: key is out of range");
+    if (i > 0 && key <= prev)
+      throw std::invalid_argument("NpaNxxIndex: keys are not sorted");
+    prev = key;
+
+    uint32_t &block = ret.blockStore_[key / BLOCK_SIZE];
+    if (block == NO_BLOCK) {
+      block = ret.lineStore_.size();
+      Line empty;
+      memset(&empty, 0, sizeof(empty));
+      ret.lineStore_.insert(ret.lineStore_.end(), LINES_PER_BLOCK, empty);
+    }
+
+    size_t bit = key % BLOCK_SIZE;
+    Line &line = ret.lineStore_[block + bit / LINE_BITS];
+    bit %= LINE_BITS;
+    line.bits[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+
+  // Count keys before every line, blocks are laid out in key order
+  uint64_t rank = 0;
+  for (Line &line : ret.lineStore_) {
+    line.rank = rank;
+    for (uint64_t word : line.bits)
+      rank += __builtin_popcountll(word);
+  }
+
+  ret.blocks_ = folly::range(ret.blockStore_);
+  ret.lines_ = folly::range(ret.lineStore_);
+  return ret;
+}
+
+NpaNxxIndex::NpaNxxIndex(folly::Range<const uint32_t*> blocks,
+                         folly::Range<const Line*> lines)
+  : blocks_(blocks)
+  , lines_(lines)
+{
+  if ((!blocks.empty() && blocks.size() != NUM_BLOCKS) ||
+      (blocks.empty() && !lines.empty()) ||
+      lines.size() % LINES_PER_BLOCK != 0)
+    throw std::runtime_error("NpaNxxIndex: inconsistent arrays");
+
+  for (uint32_t block : blocks)
+    if (block != NO_BLOCK &&
+        (block % LINES_PER_BLOCK != 0 || block >= lines.size()))
+      throw std::runtime_error("NpaNxxIndex: block is out of range");
+
+  uint64_t rank = 0;
+  for (const Line &line : lines) {
+    if (line.rank != rank)
+      throw std::runtime_error("NpaNxxIndex: broken rank counters");
+    for (uint64_t word : line.bits)
+      rank += __builtin_popcountll(word);
+  }
+  size_ = rank;
+}
+
+const NpaNxxIndex::Line* NpaNxxIndex::line(uint64_t key) const noexcept {
+  if (key >= NUM_BLOCKS * BLOCK_SIZE || blocks_.empty())
+    return nullptr;
+  uint32_t block = blocks_[key / BLOCK_SIZE];
+  if (block == NO_BLOCK)
+    return nullptr;
+  const Line *ret = &lines_[block + key % BLOCK_SIZE / LINE_BITS];
+  __builtin_prefetch(ret);
+  return ret;
+}
+
+size_t NpaNxxIndex::rank(const Line *line, uint64_t key) noexcept {
+  size_t bit = key % BLOCK_SIZE % LINE_BITS;
+  size_t word = bit / 64;
+  uint64_t mask = uint64_t(1) << (bit % 64);
+  if (!(line->bits[word] & mask))
+    return NONE;
+
+  size_t ret = line->rank + __builtin_popcountll(line->bits[word] & (mask - 1));
+  for (size_t i = 0; i < word; ++i)
+    ret += __builtin_popcountll(line->bits[i]);
+  return ret;
+}
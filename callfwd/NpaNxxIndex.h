@@ -0,0 +1,87 @@
+#ifndef CALLFWD_NPANXXINDEX_H
+#define CALLFWD_NPANXXINDEX_H
+
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include "HugePages.h"
+
+/**
+ * Direct-addressed index over a static set of 10-digit NANP numbers.
+ *
+ * Top level maps every NPA-NXX to the bitmap of its 10000-number block,
+ * or to nothing if no number in the block is present. Bitmap is split
+ * into cache lines holding 448 presence bits along with the number of
+ * keys before the line, so a lookup is three dependent loads: top level,
+ * bitmap line and the caller's value column indexed by key rank.
+ */
+class NpaNxxIndex {
+ public:
+  struct alignas(64) Line {
+    uint64_t rank;      // number of keys before this line
+    uint64_t bits[7];
+  };
+
+  static constexpr size_t NUM_BLOCKS = 1000000;
+  static constexpr size_t BLOCK_SIZE = 10000;
+  static constexpr size_t LINE_BITS = 7 * 64;
+  static constexpr size_t LINES_PER_BLOCK = (BLOCK_SIZE + LINE_BITS - 1) / LINE_BITS;
+  static constexpr uint32_t NO_BLOCK = std::numeric_limits<uint32_t>::max();
+  static constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+  NpaNxxIndex() = default;
+  /** Attach to arrays of an index built before, e.g. mapped from file.
+    * Throws `runtime_error` if arrays are inconsistent. */
+  NpaNxxIndex(folly::Range<const uint32_t*> blocks,
+              folly::Range<const Line*> lines);
+  NpaNxxIndex(NpaNxxIndex&& rhs) noexcept = default;
+  NpaNxxIndex& operator=(NpaNxxIndex&& rhs) noexcept = default;
+
+  /** Build index over sorted distinct keys.
+    * Throws `invalid_argument` if keys are unsorted or not 10-digit. */
+  static NpaNxxIndex build(folly::Range<const uint64_t*> keys);
+
+  /** Get number of keys. */
+  size_t size() const noexcept { return size_; }
+
+  /** Get bytes allocated by build(), 0 if attached to arrays. */
+  size_t allocatedBytes() const noexcept {
+    return blockStore_.capacity() * sizeof(uint32_t)
+      + lineStore_.capacity() * sizeof(Line);
+  }
+
+  /** Prefetch top level entry of the key. */
+  void prefetchBlock(uint64_t key) const noexcept {
+    if (key < NUM_BLOCKS * BLOCK_SIZE && !blocks_.empty())
+      __builtin_prefetch(&blocks_[key / BLOCK_SIZE]);
+  }
+
+  /** Find bitmap line covering the key and prefetch it.
+    * Returns nullptr if block of the key is empty. */
+  const Line* line(uint64_t key) const noexcept;
+
+  /** Get rank of the key among all keys or NONE if it is absent.
+    * Line must be found by line() for the same key. */
+  static size_t rank(const Line *line, uint64_t key) noexcept;
+
+  size_t operator()(uint64_t key) const noexcept {
+    const Line *l = line(key);
+    return l ? rank(l, key) : NONE;
+  }
+
+  folly::Range<const uint32_t*> blocks() const noexcept { return blocks_; }
+  folly::Range<const Line*> lines() const noexcept { return lines_; }
+
+ private:
+  LargeVector<uint32_t> blockStore_;
+  LargeVector<Line> lineStore_;
+  folly::Range<const uint32_t*> blocks_;
+  folly::Range<const Line*> lines_;
+  size_t size_ = 0;
+};
+
+#endif // CALLFWD_NPANXXINDEX_H
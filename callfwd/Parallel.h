@@ -0,0 +1,34 @@
+#ifndef CALLFWD_PARALLEL_H
+#define CALLFWD_PARALLEL_H
+
+#include <cstddef>
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#if HAVE_STD_PARALLEL
+#include <execution>
+#endif
+
+/** Call f(i) for every i in [0, n) using all cores if possible. */
+template <class F>
+void parallelFor(size_t n, F f) {
+  std::vector<size_t> index(n);
+  std::iota(index.begin(), index.end(), 0);
+#if HAVE_STD_PARALLEL
+  std::for_each(std::execution::par, index.begin(), index.end(), f);
+#else
+  std::for_each(index.begin(), index.end(), f);
+#endif
+}
+
+/** Split [0, n) into about `chunks` contiguous ranges and call f(begin, end)
+  * for every one in parallel. */
+template <class F>
+void parallelChunks(size_t n, size_t chunks, F f) {
+  chunks = std::max<size_t>(std::min(chunks, n), 1);
+  parallelFor(chunks, [&](size_t c) {
+    f(n * c / chunks, n * (c + 1) / chunks);
+  });
+}
+
+#endif // CALLFWD_PARALLEL_H
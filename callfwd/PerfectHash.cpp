@@ -0,0 +1,275 @@
+#include "PerfectHash.h"
+#include "BatchHash.h"
+#include "Parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <stdexcept>
+#include <folly/Likely.h>
+
+static constexpr size_t PARTITION_SIZE = 1 << 16; // average keys per partition
+static constexpr size_t BUCKET_SIZE = 4;          // average keys per bucket
+static constexpr size_t MAX_PILOT = 1 << 16;
+static constexpr unsigned MAX_ATTEMPTS = 32;
+static constexpr uint64_t PARTITION_SEED = 0x243F6A8885A308D3ull;
+
+static inline uint64_t mulhi(uint64_t a, uint64_t b) {
+  return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+}
+
+static inline size_t numBuckets(size_t n) {
+  return n / BUCKET_SIZE + 1;
+}
+
+static inline size_t numExtra(size_t n) {
+  // Keep load factor around 0.99 so that most pilots are short
+  return n / 100 + 1;
+}
+
+static inline uint64_t bucketOf(uint64_t h, uint64_t seed, uint64_t buckets) {
+  // Skewed split: 60% of keys go into 30% of buckets
+  uint64_t x = mixHash(h ^ seed);
+  uint64_t dense = buckets * 3 / 10;
+  if (dense > 0 && static_cast<uint32_t>(x) < 0x9999999Au)
+    return mulhi(x, dense);
+  return dense + mulhi(x, buckets - dense);
+}
+
+static inline uint64_t positionOf(uint64_t h, uint64_t seed, uint64_t pilot,
+                                  uint64_t table) {
+  return mulhi(mixHash((h ^ seed) + (pilot + 1) * 0x9E3779B97F4A7C15ull), table);
+}
+
+namespace {
+
+enum class PartitionResult { OK, NO_PILOT, DUPLICATE };
+
+struct PartitionBuilder {
+  const uint64_t *hash;
+  size_t n;
+  uint64_t seed;
+  uint16_t *pilots;
+  uint32_t *remap;
+
+  PartitionResult operator()() const;
+};
+
+PartitionResult PartitionBuilder::operator()() const {
+  size_t buckets = numBuckets(n);
+  size_t table = n + numExtra(n);
+
+  // Group keys by bucket
+  std::vector<uint32_t> bucketOfKey(n);
+  std::vector<uint32_t> start(buckets + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    bucketOfKey[i] = bucketOf(hash[i], seed, buckets);
+    ++start[bucketOfKey[i] + 1];
+  }
+  std::partial_sum(start.begin(), start.end(), start.begin());
+  std::vector<uint64_t> keys(n);
+  {
+    std::vector<uint32_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; ++i)
+      keys[fill[bucketOfKey[i]]++] = hash[i];
+  }
+
+  // Order buckets by size descending, big buckets are hard to place late
+  size_t maxSize = 0;
+  for (size_t b = 0; b < buckets; ++b)
+    maxSize = std::max<size_t>(maxSize, start[b + 1] - start[b]);
+  std::vector<uint32_t> bySize(maxSize + 2, 0);
+  for (size_t b = 0; b < buckets; ++b)
+    ++bySize[maxSize - (start[b + 1] - start[b]) + 1];
+  std::partial_sum(bySize.begin(), bySize.end(), bySize.begin());
+  std::vector<uint32_t> order(buckets);
+  for (size_t b = 0; b < buckets; ++b)
+    order[bySize[maxSize - (start[b + 1] - start[b])]++] = b;
+
+  std::vector<uint64_t> taken((table + 63) / 64, 0);
+  auto isTaken = [&](uint64_t p) { return (taken[p / 64] >> (p % 64)) & 1; };
+  std::vector<uint64_t> pos(maxSize);
+
+  for (uint32_t b : order) {
+    const uint64_t *bucket = &keys[start[b]];
+    size_t size = start[b + 1] - start[b];
+    pilots[b] = 0;
+    if (size == 0)
+      continue;
+
+    // Mixing is a bijection, so equal hashes mean equal keys
+    for (size_t i = 0; i < size; ++i)
+      for (size_t j = 0; j < i; ++j)
+        if (bucket[i] == bucket[j])
+          return PartitionResult::DUPLICATE;
+
+    size_t pilot = 0;
+    for (; pilot < MAX_PILOT; ++pilot) {
+      size_t i = 0;
+      for (; i < size; ++i) {
+        pos[i] = positionOf(bucket[i], seed, pilot, table);
+        if (isTaken(pos[i]) ||
+            std::find(pos.begin(), pos.begin() + i, pos[i]) != pos.begin() + i)
+          break;
+      }
+      if (i == size)
+        break;
+    }
+    if (pilot == MAX_PILOT)
+      return PartitionResult::NO_PILOT;
+
+    pilots[b] = pilot;
+    for (size_t i = 0; i < size; ++i)
+      taken[pos[i] / 64] |= uint64_t(1) << (pos[i] % 64);
+  }
+
+  // Move keys from the tail into holes to make the function minimal
+  size_t hole = 0;
+  for (size_t p = n; p < table; ++p) {
+    remap[p - n] = 0;
+    if (!isTaken(p))
+      continue;
+    while (isTaken(hole))
+      ++hole;
+    remap[p - n] = hole++;
+  }
+  return PartitionResult::OK;
+}
+
+} // namespace
+
+PerfectHash PerfectHash::build(folly::Range<const uint64_t*> keys) {
+  size_t N = keys.size();
+  size_t P = N / PARTITION_SIZE + 1;
+  PerfectHash ret;
+
+  // Split hashes by partition
+  std::vector<uint64_t> hashes(N);
+  std::vector<size_t> start(P + 1, 0);
+  for (uint64_t key : keys)
+    ++start[mulhi(mixHash(key ^ PARTITION_SEED), P) + 1];
+  std::partial_sum(start.begin(), start.end(), start.begin());
+  {
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (uint64_t key : keys) {
+      uint64_t h = mixHash(key ^ PARTITION_SEED);
+      hashes[fill[mulhi(h, P)]++] = h;
+    }
+  }
+
+  ret.partStore_.resize(P + 1);
+  Partition next{0, 0, 0, 0};
+  for (size_t p = 0; p < P; ++p) {
+    size_t n = start[p + 1] - start[p];
+    ret.partStore_[p] = next;
+    ret.partStore_[p].seed = mixHash(PARTITION_SEED + p);
+    next.keyOffset += n;
+    next.pilotOffset += numBuckets(n);
+    next.remapOffset += numExtra(n);
+  }
+  ret.partStore_[P] = next;
+  ret.pilotStore_.resize(next.pilotOffset);
+  ret.remapStore_.resize(next.remapOffset);
+
+  std::atomic<bool> duplicate{false};
+  std::atomic<bool> failed{false};
+  parallelFor(P, [&](size_t p) {
+    Partition &part = ret.partStore_[p];
+    PartitionBuilder builder{
+      &hashes[part.keyOffset], start[p + 1] - start[p], part.seed,
+      &ret.pilotStore_[part.pilotOffset], &ret.remapStore_[part.remapOffset]
+    };
+    for (unsigned attempt = 0; attempt < MAX_ATTEMPTS; ++attempt) {
+      switch (builder()) {
+      case PartitionResult::OK:
+        part.seed = builder.seed;
+        return;
+      case PartitionResult::DUPLICATE:
+        duplicate = true;
+        return;
+      case PartitionResult::NO_PILOT:
+        builder.seed = mixHash(builder.seed);
+        break;
+      }
+    }
+    failed = true;
+  });
+
+  if (duplicate)
+    throw std::invalid_argument("PerfectHash: duplicate key");
+  if (failed)
+    throw std::runtime_error("PerfectHash: failed to find pilots");
+
+  ret.parts_ = folly::range(ret.partStore_);
+  ret.pilots_ = folly::range(ret.pilotStore_);
+  ret.remap_ = folly::range(ret.remapStore_);
+  return ret;
+}
+
+PerfectHash::PerfectHash(folly::Range<const Partition*> parts,
+                         folly::Range<const uint16_t*> pilots,
+                         folly::Range<const uint32_t*> remap)
+  : parts_(parts)
+  , pilots_(pilots)
+  , remap_(remap)
+{
+  if (parts.size() < 2 || parts.front().keyOffset != 0 ||
+      parts.front().pilotOffset != 0 || parts.front().remapOffset != 0 ||
+      parts.back().pilotOffset != pilots.size() ||
+      parts.back().remapOffset != remap.size())
+    throw std::runtime_error("PerfectHash: inconsistent partitions");
+
+  for (size_t p = 0; p + 1 < parts.size(); ++p) {
+    const Partition &cur = parts[p], &next = parts[p + 1];
+    if (next.keyOffset < cur.keyOffset ||
+        next.pilotOffset - cur.pilotOffset != numBuckets(next.keyOffset - cur.keyOffset) ||
+        next.remapOffset - cur.remapOffset != numExtra(next.keyOffset - cur.keyOffset))
+      throw std::runtime_error("PerfectHash: inconsistent partitions");
+
+    uint64_t n = next.keyOffset - cur.keyOffset;
+    for (uint64_t i = cur.remapOffset; i < next.remapOffset; ++i)
+      if (remap[i] >= std::max<uint64_t>(n, 1))
+        throw std::runtime_error("PerfectHash: remap is out of range");
+  }
+}
+
+size_t PerfectHash::size() const noexcept {
+  return parts_.empty() ? 0 : parts_.back().keyOffset;
+}
+
+size_t PerfectHash::allocatedBytes() const noexcept {
+  return partStore_.capacity() * sizeof(Partition)
+    + pilotStore_.capacity() * sizeof(uint16_t)
+    + remapStore_.capacity() * sizeof(uint32_t);
+}
+
+void PerfectHash::hashKeys(size_t N, const uint64_t *keys, uint64_t *hashes) noexcept {
+  mixHashBatch(N, keys, PARTITION_SEED, hashes);
+}
+
+PerfectHash::Token PerfectHash::prehash(uint64_t key) const noexcept {
+  return prehashed(mixHash(key ^ PARTITION_SEED));
+}
+
+PerfectHash::Token PerfectHash::prehashed(uint64_t h) const noexcept {
+  const Partition *part = &parts_[mulhi(h, parts_.size() - 1)];
+  uint64_t buckets = part[1].pilotOffset - part->pilotOffset;
+  uint64_t pilot = part->pilotOffset + bucketOf(h, part->seed, buckets);
+  __builtin_prefetch(&pilots_[pilot]);
+  return Token{h, part, pilot};
+}
+
+size_t PerfectHash::position(const Token &token) const noexcept {
+  const Partition *part = token.part;
+  uint64_t n = part[1].keyOffset - part->keyOffset;
+  uint64_t table = n + (part[1].remapOffset - part->remapOffset);
+  uint64_t pos = positionOf(token.hash, part->seed, pilots_[token.pilot], table);
+  if (UNLIKELY(pos >= n)) {
+    if (UNLIKELY(n == 0))
+      return 0;
+    pos = remap_[part->remapOffset + pos - n];
+  }
+  // Arrays mapped from a damaged file must not send a lookup past slots
+  pos += part->keyOffset;
+  return LIKELY(pos < parts_.back().keyOffset) ? pos : 0;
+}
@@ -0,0 +1,86 @@
+#ifndef CALLFWD_PERFECTHASH_H
+#define CALLFWD_PERFECTHASH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include "HugePages.h"
+
+/**
+ * Minimal perfect hash function over a static set of 64-bit keys.
+ *
+ * Keys are split by hash into partitions of ~64K keys built independently.
+ * Within a partition keys are grouped into small buckets, and for every
+ * bucket a 16-bit pilot is searched which moves all of its keys into free
+ * positions (PTHash). Positions past the partition size are remapped into
+ * the holes left in it. Looking up an unknown key yields an arbitrary
+ * position, so callers have to compare keys.
+ */
+class PerfectHash {
+ public:
+  struct Partition {
+    uint64_t keyOffset;   // first position of the partition
+    uint64_t pilotOffset; // first pilot of the partition
+    uint64_t remapOffset; // first remap entry of the partition
+    uint64_t seed;        // seed of bucket and position hashes
+  };
+
+  struct Token {
+    uint64_t hash;
+    const Partition *part;
+    uint64_t pilot;
+  };
+
+  PerfectHash() = default;
+  /** Attach to arrays of a function built before, e.g. mapped from file.
+    * Throws `runtime_error` if arrays are inconsistent. */
+  PerfectHash(folly::Range<const Partition*> parts,
+              folly::Range<const uint16_t*> pilots,
+              folly::Range<const uint32_t*> remap);
+  PerfectHash(PerfectHash&& rhs) noexcept = default;
+  PerfectHash& operator=(PerfectHash&& rhs) noexcept = default;
+
+  /** Build function over distinct keys.
+    * Throws `invalid_argument` if some key is repeated. */
+  static PerfectHash build(folly::Range<const uint64_t*> keys);
+
+  /** Get number of keys. */
+  size_t size() const noexcept;
+
+  /** Get bytes allocated by build(), 0 if attached to arrays. */
+  size_t allocatedBytes() const noexcept;
+
+  /** Compute hash and prefetch pilot into CPU cache. */
+  Token prehash(uint64_t key) const noexcept;
+
+  /** Compute key hashes for a batch at once using SIMD. */
+  static void hashKeys(size_t N, const uint64_t *keys, uint64_t *hashes) noexcept;
+
+  /** Same as prehash() taking a hash computed by hashKeys(). */
+  Token prehashed(uint64_t hash) const noexcept;
+
+  /** Finish lookup started by prehash(), the position is below size()
+    * or 0 if there are no keys. */
+  size_t position(const Token &token) const noexcept;
+
+  size_t operator()(uint64_t key) const noexcept {
+    return position(prehash(key));
+  }
+
+  folly::Range<const Partition*> partitions() const noexcept { return parts_; }
+  folly::Range<const uint16_t*> pilots() const noexcept { return pilots_; }
+  folly::Range<const uint32_t*> remap() const noexcept { return remap_; }
+
+ private:
+  std::vector<Partition> partStore_;
+  LargeVector<uint16_t> pilotStore_;
+  LargeVector<uint32_t> remapStore_;
+  folly::Range<const Partition*> parts_;
+  folly::Range<const uint16_t*> pilots_;
+  folly::Range<const uint32_t*> remap_;
+};
+
+#endif // CALLFWD_PERFECTHASH_H
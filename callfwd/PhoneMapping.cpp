@@ -1,26 +1,58 @@
 #include "PhoneMapping.h"
+#include "Snapshot.h"
+#include "PerfectHash.h"
+#include "NpaNxxIndex.h"
+#include "EliasFano.h"
+#include "KeyFilter.h"
+#include "HugePages.h"
+#include "PortOverlay.h"
+#include "CodeColumn.h"
+#include "BatchHash.h"
+#include "BatchLookup.h"
+#include "Parallel.h"
+#include "IndexBuild.h"
+#include "MemoryUsage.h"
+#include "Reclaimer.h"
+#include "CSVReader.h"
 
 #include <algorithm>
 #include <array>
+#include <bitset>
+#include <exception>
+#include <functional>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_set>
 #include <vector>
-#if HAVE_STD_PARALLEL
-#include <execution>
-#endif
 #include <glog/logging.h>
 #include <folly/json.h>
 #include <folly/dynamic.h>
 #include <folly/Likely.h>
 #include <folly/String.h>
 #include <folly/Conv.h>
-#include <folly/small_vector.h>
-#include <folly/container/F14Map.h>
+#include <folly/container/F14Set.h>
+#include <folly/hash/Hash.h>
 #include <folly/synchronization/Hazptr.h>
 #include <folly/portability/GFlags.h>
 
 
-// TODO: benchmark prefetch size
-DEFINE_uint32(f14map_prefetch, 16, "Maximum number of keys to prefetch");
+DEFINE_uint32(f14map_prefetch, 16,
+              "Number of keys between stages of batch lookup kernel");
+DEFINE_bool(snapshot_populate, false,
+            "Prefault all pages of a snapshot while mapping it");
+DEFINE_bool(snapshot_verify, true,
+            "Check all row links of a snapshot before serving it");
+DEFINE_double(delta_compact_ratio, 0.05,
+              "Rebuild mapping in full once its delta holds this share of base rows");
+DEFINE_uint32(overlay_compact_rows, 1000,
+              "Fold numbers changed by port command into mapping once there are so many");
+DEFINE_uint32(mapping_filter_bits, 10,
+              "Bits per key of filter rejecting absent numbers before lookup index, 0 disables it");
+DEFINE_bool(numa_replicas, false,
+            "Copy lookup index of US/CA mapping to memory of every NUMA node");
+DEFINE_uint32(mapping_shards, 16,
+              "Split US/CA mapping into so many NPA ranges built and swapped one by one, "
+              "at most 64");
 
 struct PhoneList {
   uint64_t phone : 34, next : 30;
@@ -28,70 +60,562 @@ struct PhoneList {
 static constexpr uint64_t MAXROWS = (1 << 30) - 1;
 static_assert(sizeof(PhoneList) == 8, "");
 
-class PhoneMapping::Data : public folly::hazptr_obj_base<PhoneMapping::Data> {
+// Routing number of a key removed by delta, sorts after any real one
+static constexpr uint64_t REMOVED_RN = (uint64_t(1) << 34) - 1;
+
+// Reverse index value: rnRows position above 34 bits of pn
+static constexpr unsigned CSR_CODE_SHIFT = 34;
+static constexpr uint64_t CSR_PN_MASK = (uint64_t(1) << CSR_CODE_SHIFT) - 1;
+
+// Units of work for parallel build
+static constexpr size_t CSV_CHUNK_LINES = 1 << 14;
+static constexpr size_t PARTITION_CHUNK_ROWS = 1 << 20;
+
+// NPA shards of a partition fit shardOf entries, see commit()
+static constexpr size_t MAX_SHARDS = PhoneMapping::MAX_SHARDS;
+static_assert(MAX_SHARDS <= 256, "");
+// Keys looked up at once, so that scratch buffers of lookup fit on stack
+static constexpr size_t LOOKUP_WINDOW = 64;
+// Input chunks copied into NPA shards before their pages are given back
+static constexpr size_t SHARD_COPY_CHUNKS = 16;
+
+// pn->rnRows position, code holds row number until build()
+struct DictEntry {
+  uint64_t phone : 34;
+  mutable uint64_t code : 30;
+};
+static_assert(sizeof(DictEntry) == 8, "");
+
+struct DictHash {
+  using is_transparent = void;
+  size_t operator()(uint64_t pn) const noexcept {
+    return folly::hasher<uint64_t>()(pn);
+  }
+  size_t operator()(const DictEntry &e) const noexcept {
+    return folly::hasher<uint64_t>()(e.phone);
+  }
+};
+
+struct DictEqual {
+  using is_transparent = void;
+  static uint64_t key(uint64_t pn) noexcept { return pn; }
+  static uint64_t key(const DictEntry &e) noexcept { return e.phone; }
+  template <class L, class R>
+  bool operator()(const L &lhs, const R &rhs) const noexcept {
+    return key(lhs) == key(rhs);
+  }
+};
+
+// DictEntry set split by hash into shards, so that shards are built by
+// different threads
+class ShardedDict {
+ public:
+  static constexpr unsigned SHARD_BITS = 6;
+  static constexpr size_t NUM_SHARDS = size_t(1) << SHARD_BITS;
+  using Shard = folly::F14ValueSet<DictEntry, DictHash, DictEqual,
+                                   HugePageAllocator<DictEntry>>;
+
+  struct Token {
+    const Shard *shard;
+    folly::F14HashToken token;
+  };
+
+  // Independent of F14 hasher, keeps all hash bits useful inside a shard
+  static size_t shardOf(uint64_t pn) noexcept {
+    return mixHash(pn) >> (64 - SHARD_BITS);
+  }
+
+  Shard& shard(size_t i) noexcept { return shards_[i]; }
+  const Shard& shard(size_t i) const noexcept { return shards_[i]; }
+
+  /** Count all shards as one table. */
+  void addTo(MemoryUsage &usage, const std::string &part) const {
+    for (const Shard &shard : shards_)
+      usage.addTable(part, shard);
+  }
+
+  /** Select shard and prefetch its bucket. */
+  Token prehash(uint64_t pn) const {
+    const Shard &shard = shards_[shardOf(pn)];
+    return {&shard, shard.prehash(pn)};
+  }
+
+  /** Finish lookup started by prehash(), returns nullptr if key is absent. */
+  const DictEntry* find(const Token &token, uint64_t pn) const {
+    auto it = token.shard->find(token.token, pn);
+    return it != token.shard->cend() ? &*it : nullptr;
+  }
+
+ private:
+  std::array<Shard, NUM_SHARDS> shards_;
+};
+
+// Snapshot layout
+static constexpr char SNAPSHOT_KIND[] = "lrn";
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+enum : uint32_t {
+  SNAP_META = 1,       // metadata as JSON text
+  SNAP_PN_COLUMN = 2,  // pnColumn
+  SNAP_RN_INDEX = 3,   // rnIndex
+  SNAP_FLAT_INDEX = 4, // flatIndex
+  SNAP_MPH_PARTITIONS = 5,
+  SNAP_MPH_PILOTS = 6,
+  SNAP_MPH_REMAP = 7,
+  SNAP_MPH_SLOTS = 8,  // mphSlots
+  SNAP_NPANXX_BLOCKS = 9,
+  SNAP_NPANXX_LINES = 10,
+  SNAP_NPANXX_CODES = 11, // npanxxCodes
+  SNAP_CSR_OFFSETS = 12,  // csrOffsets
+  SNAP_CSR_LOWS = 13,     // csr
+  SNAP_CSR_HIGHS = 14,
+  SNAP_CSR_SAMPLES = 15,
+  SNAP_FILTER = 16,       // filter, optional
+  SNAP_SHARD_OF = 17,     // shardOf of a partition split into NPA shards
+  SNAP_SHARD_TAGS = 32,   // sections of every shard, see shardTags()
+};
+
+/** Tag offset of sections of NPA shard s in a sharded snapshot. */
+static inline uint32_t shardTags(size_t s) {
+  return SNAP_SHARD_TAGS * uint32_t(s + 1);
+}
+
+// Empty slot of flatIndex, never a valid 10-digit number
+static constexpr uint64_t FLAT_EMPTY = (uint64_t(1) << 34) - 1;
+
+static constexpr uint64_t FLAT_MULTIPLIER = 0x9E3779B97F4A7C15ull;
+
+static inline size_t flatSlot(uint64_t pn, unsigned shift) {
+  return (pn * FLAT_MULTIPLIER) >> shift;
+}
+
+// NANP view routes by NPA, numbers other than 10-digit share last route
+static constexpr size_t NPA_ROUTES = 1001;
+
+static inline size_t npaRoute(uint64_t pn) {
+  return std::min<uint64_t>(pn / 10000000, NPA_ROUTES - 1);
+}
+
+static FilterStats lookupStats("lrn");
+// Partitions, their bases and shards replaced in NANP global
+static RetiredVersions retiredParts;
+
+class PhoneMapping::Data
+  : public folly::hazptr_obj_base<PhoneMapping::Data, std::atomic,
+                                  ReclaimLater<PhoneMapping::Data>> {
  public:
   void getRNs(size_t N, const uint64_t *pn, uint64_t *rn) const;
-  std::unique_ptr<Cursor> inverseRNs(uint64_t fromRN, uint64_t toRN) const;
-  std::unique_ptr<Cursor> visitRows() const;
+  RowScan scanRNs(uint64_t fromRN, uint64_t toRN) const noexcept;
+  RowScan scanRows() const noexcept;
+  size_t readRows(RowScan &scan, size_t N, uint64_t *pn, uint64_t *rn) const noexcept;
   void build();
+  void mergeDelta(const Data &older);
+  void countDeltaRows();
+  std::unique_ptr<Data> compact() const;
+  void mapSnapshot(const std::string &path);
+  /** Check if the mapping or any of its shards is a delta. */
+  bool hasDelta() const noexcept;
+  /** Write snapshot of all rows, open() maps the output. */
+  void writeSnapshot(const std::function<void(SnapshotWriter &)> &open) const;
+  /** Count memory of this data alone. */
+  void ownMemoryUsage(MemoryUsage &usage) const;
+  /** Count memory of this data, its base and shards. */
+  void memoryUsage(MemoryUsage &usage) const;
   ~Data() noexcept;
 
   // metadata
   folly::dynamic meta;
-  // pn->rn mapping
-  folly::F14ValueMap<uint64_t, uint64_t> dict;
+  // number of rows, including the base ones
+  size_t numRows = 0;
+  // rows of a delta are changes to the base, removed keys have REMOVED_RN
+  std::shared_ptr<const Data> base;
+  // changes made after build, shared with next versions of a partition
+  std::shared_ptr<PortOverlay> overlay;
+  // lookup index to build
+  Engine engine = Engine::F14;
+  // pn->rn mapping, rn is encoded as position in rnRows
+  ShardedDict dict;
   // pn column joined with sorted rn column
-  std::vector<PhoneList> pnColumn;
+  LargeVector<PhoneList> pnColumn;
   // unique-sorted rn column joined with pn
-  std::vector<PhoneList> rnIndex;
+  LargeVector<PhoneList> rnIndex;
+
+  // read-only views of columns above or of the mapped snapshot
+  folly::Range<const PhoneList*> pnRows;
+  folly::Range<const PhoneList*> rnRows;
+  // pn->rnRows position with linear probing, replaces dict in snapshots
+  folly::Range<const PhoneList*> flatIndex;
+  unsigned flatShift = 0;
+  // pn->mphSlots position, replaces dict with Engine::MPH
+  PerfectHash mph;
+  // (pn, rnRows position) placed by mph
+  LargeVector<PhoneList> mphColumn;
+  folly::Range<const PhoneList*> mphSlots;
+  // 10-digit pn->rank, replaces dict with Engine::NPANXX
+  NpaNxxIndex npanxx;
+  // rnRows position of every pn in rank order
+  CodeColumn npanxxCodes;
+  // rn->pn reverse index: group of every rnRows position starts at its
+  // offset, groups hold pn-sorted values (code << CSR_CODE_SHIFT | pn)
+  std::vector<uint32_t> csrOffsetStore;
+  folly::Range<const uint32_t*> csrOffsets;
+  EliasFano csr;
+  // pn filter checked before lookup index, empty with Engine::NPANXX
+  KeyFilter filter;
+  // mapped file, shared by NPA shards of a sharded snapshot
+  std::shared_ptr<const SnapshotReader> snapshot;
+  // bytes of the file held for this data alone
+  size_t snapshotBytes = 0;
+  // NPAs having numbers in pnRows, filled when committed to NANP view
+  std::bitset<NPA_ROUTES> npas;
+  // ranges of NPA built and swapped one by one, each a mapping of its own,
+  // and shard of every NPA route; such partition has no rows of its own
+  std::vector<std::shared_ptr<const Data>> shards;
+  std::array<uint8_t, NPA_ROUTES> shardOf;
+  // builder input row of every row of a shard, for error messages
+  std::vector<uint32_t> inputRows;
+  // lookup index and rn codes in memory of every NUMA node, serve getOwnRNs()
+  std::vector<std::unique_ptr<const Data>> replicas;
+  // bytes counted in retiredParts once replaced in NANP global
+  mutable size_t retiredBytes = 0;
+
+  void collectNpas();
+  void joinShards();
+  void replicate();
+
+ private:
+  void getOwnRNs(size_t N, const uint64_t *pn, uint64_t *rn) const;
+  void probeOwnRNs(size_t N, const uint64_t *pn, uint64_t *rn) const;
+  void getBaseRNs(size_t N, const uint64_t *pn, uint64_t *rn) const;
+  void getRNsFlat(size_t N, const uint64_t *pn, uint64_t *rn) const;
+  void getRNsMPH(size_t N, const uint64_t *pn, uint64_t *rn) const;
+  void getShardRNs(size_t N, const uint64_t *pn, uint64_t *rn) const;
+  void buildDict();
+  void buildPerfectHash();
+  void buildNpaNxxIndex();
+  void buildReverseCSR();
+  void writeSections(SnapshotWriter &writer, const std::function<void()> &open,
+                     bool lookupOnly = false, uint32_t tags = 0) const;
+  void writeShards(SnapshotWriter &writer, const std::function<void()> &open) const;
+  void attachSnapshot(bool verify, uint32_t tags = 0);
+  void attachShards(bool verify);
+  folly::Range<const PhoneList*> attachLookup(size_t N, uint32_t tags = 0);
+  RowScan::Stream scanOwn(uint64_t fromRN, uint64_t toRN) const noexcept;
+  size_t readLayerRows(RowScan::Stream &own, RowScan::Stream &under, size_t N,
+                       uint64_t *pn, uint64_t *rn) const noexcept;
+  size_t readOwnRows(RowScan::Stream &scan, size_t N,
+                     uint64_t *pn, uint64_t *rn) const noexcept;
+  size_t readMergedRows(RowScan::Stream &ownScan, RowScan::Stream &baseScan, size_t N,
+                        uint64_t *pn, uint64_t *rn) const noexcept;
+  void scanShards(uint64_t fromRN, uint64_t toRN, RowScan &scan) const noexcept;
+  size_t readShardRows(RowScan &scan, size_t N,
+                       uint64_t *pn, uint64_t *rn) const noexcept;
+  EliasFano::Reader openStream(const RowScan::Stream &scan) const noexcept;
+
+  /** Call f(row, code) for every row in rn order, where code is
+    * position of its rn in rnRows. */
+  template <class F>
+  void forEachRowCode(F &&f) const;
 };
 
+template <class F>
+void PhoneMapping::Data::forEachRowCode(F &&f) const {
+  size_t R = rnRows.size();
+  uint64_t code = 0;
+  uint64_t row = R > 0 ? rnRows[0].next : MAXROWS;
+  for (; row != MAXROWS; row = pnRows[row].next) {
+    if (code + 1 < R && rnRows[code + 1].next == row)
+      ++code;
+    f(row, code);
+  }
+}
+
 PhoneMapping::Data::~Data() noexcept {
-  LOG_IF(INFO, pnColumn.size() > 0) << "Reclaiming memory";
+  LOG_IF(INFO, pnRows.size() > 0) << "Reclaiming memory";
+  if (retiredBytes > 0)
+    retiredParts.reclaim(retiredBytes);
 }
 
-class PhoneMapping::Cursor {
- public:
-  virtual ~Cursor() = default;
-
-  bool hasRow() const noexcept { return size_ != 0; }
-  uint64_t currentPN() const noexcept { return pn_[pos_]; }
-  uint64_t currentRN() const noexcept { return rn_[pos_]; }
-  void prefetch(const Data *data) noexcept;
-  void advance(const Data *data) noexcept;
-  virtual void refill() = 0;
-
- protected:
-  std::array<uint64_t, 8> pn_;
-  std::array<uint64_t, 8> rn_;
-  unsigned size_;
-  unsigned pos_;
+void PhoneMapping::Data::ownMemoryUsage(MemoryUsage &usage) const {
+  usage.addMeta(meta);
+  dict.addTo(usage, "dict");
+  usage.addVector("pnColumn", pnColumn);
+  usage.addVector("rnIndex", rnIndex);
+  usage.add("mph", mph.allocatedBytes());
+  usage.addVector("mphColumn", mphColumn);
+  usage.add("npanxx", npanxx.allocatedBytes() + npanxxCodes.allocatedBytes());
+  usage.addVector("csr", csrOffsetStore);
+  usage.add("csr", csr.allocatedBytes());
+  usage.add("filter", filter.allocatedBytes());
+  usage.addVector("inputRows", inputRows);
+  // Mapped file, resident as far as lookups touched it
+  if (snapshot)
+    usage.add("snapshot", snapshotBytes);
+  for (const auto &replica : replicas)
+    usage.add("replicas", replica->snapshot->size());
+}
+
+void PhoneMapping::Data::memoryUsage(MemoryUsage &usage) const {
+  ownMemoryUsage(usage);
+  if (base)
+    base->memoryUsage(usage);
+  for (const auto &shard : shards)
+    shard->memoryUsage(usage);
+}
+
+namespace {
+
+struct FlatProbe {
+  static constexpr unsigned STAGES = 2;
+  struct State {};
+
+  const PhoneMapping::Data &data;
+  const uint64_t *pn;
+  const uint64_t *slot;
+  uint64_t *rn;
+
+  template <unsigned S>
+  void stage(size_t i, State &) {
+    const auto &flatIndex = data.flatIndex;
+    if constexpr (S == 0) {
+      __builtin_prefetch(&flatIndex[slot[i]]);
+    } else {
+      // Probe until key or empty slot found
+      const size_t mask = flatIndex.size() - 1;
+      rn[i] = PhoneNumber::NONE;
+      if (UNLIKELY(pn[i] >= FLAT_EMPTY))
+        return;
+      for (size_t j = slot[i]; flatIndex[j].phone != FLAT_EMPTY; j = (j + 1) & mask) {
+        if (flatIndex[j].phone == pn[i]) {
+          rn[i] = data.rnRows[flatIndex[j].next].phone;
+          break;
+        }
+      }
+    }
+  }
 };
 
-void PhoneMapping::Data::getRNs(size_t N, const uint64_t *pn, uint64_t *rn) const {
-  folly::small_vector<folly::F14HashToken, 1> token;
-  token.resize(std::min<size_t>(N, FLAGS_f14map_prefetch));
+struct MPHProbe {
+  static constexpr unsigned STAGES = 3;
+  struct State {
+    PerfectHash::Token token;
+    size_t slot;
+  };
 
-  while (N > 0) {
-    size_t M = std::min<size_t>(N, FLAGS_f14map_prefetch);
+  const PhoneMapping::Data &data;
+  const uint64_t *pn;
+  const uint64_t *hash;
+  uint64_t *rn;
 
-    // Compute hash and prefetch buckets into CPU cache
-    for (size_t i = 0; i < M; ++i)
-      token[i] = dict.prehash(pn[i]);
+  template <unsigned S>
+  void stage(size_t i, State &state) {
+    if constexpr (S == 0) {
+      // Prefetch pilot
+      state.token = data.mph.prehashed(hash[i]);
+    } else if constexpr (S == 1) {
+      // Resolve position and prefetch slot
+      state.slot = data.mph.position(state.token);
+      __builtin_prefetch(&data.mphSlots[state.slot]);
+    } else {
+      // Unknown keys land on arbitrary slot, so compare the whole key
+      const PhoneList &s = data.mphSlots[state.slot];
+      if (s.phone == pn[i])
+        rn[i] = data.rnRows[s.next].phone;
+      else
+        rn[i] = PhoneNumber::NONE;
+    }
+  }
+};
+
+struct NpaNxxProbe {
+  static constexpr unsigned STAGES = 4;
+  struct State {
+    const NpaNxxIndex::Line *line;
+    size_t rank;
+  };
+
+  const PhoneMapping::Data &data;
+  const uint64_t *pn;
+  uint64_t *rn;
 
-    // Fill output vector
-    for (size_t i = 0; i < M; ++i) {
-      const auto it = dict.find(token[i], pn[i]);
-      if (it != dict.cend())
-        rn[i] = it->second;
+  template <unsigned S>
+  void stage(size_t i, State &state) {
+    if constexpr (S == 0) {
+      data.npanxx.prefetchBlock(pn[i]);
+    } else if constexpr (S == 1) {
+      // Find and prefetch bitmap line
+      state.line = data.npanxx.line(pn[i]);
+    } else if constexpr (S == 2) {
+      // Test presence and prefetch code
+      state.rank = NpaNxxIndex::NONE;
+      if (state.line)
+        state.rank = NpaNxxIndex::rank(state.line, pn[i]);
+      if (state.rank != NpaNxxIndex::NONE)
+        __builtin_prefetch(data.npanxxCodes.address(state.rank));
+    } else {
+      if (state.rank != NpaNxxIndex::NONE)
+        rn[i] = data.rnRows[data.npanxxCodes[state.rank]].phone;
       else
         rn[i] = PhoneNumber::NONE;
     }
+  }
+};
+
+} // namespace
+
+void PhoneMapping::Data::getRNs(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  for (; N > LOOKUP_WINDOW; N -= LOOKUP_WINDOW, pn += LOOKUP_WINDOW, rn += LOOKUP_WINDOW)
+    getRNs(LOOKUP_WINDOW, pn, rn);
+
+  if (!shards.empty()) {
+    getShardRNs(N, pn, rn);
+  } else {
+    getOwnRNs(N, pn, rn);
+    if (base)
+      getBaseRNs(N, pn, rn);
+  }
+  if (overlay)
+    overlay->patch(N, pn, rn);
+}
+
+void PhoneMapping::Data::getShardRNs(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  if (N == 1) {
+    shards[shardOf[npaRoute(*pn)]]->getRNs(1, pn, rn);
+    return;
+  }
+
+  // Group keys by shard, so every shard is probed with a single batch
+  DCHECK_LE(N, LOOKUP_WINDOW);
+  size_t S = shards.size();
+  std::array<uint8_t, LOOKUP_WINDOW> shard;
+  std::array<uint32_t, MAX_SHARDS + 1> begin;
+  std::fill(begin.begin(), begin.begin() + S + 1, 0);
+  for (size_t i = 0; i < N; ++i) {
+    shard[i] = shardOf[npaRoute(pn[i])];
+    ++begin[shard[i] + 1];
+  }
+  for (size_t s = 0; s < S; ++s)
+    begin[s + 1] += begin[s];
+
+  std::array<uint64_t, LOOKUP_WINDOW> key, found;
+  std::array<uint32_t, LOOKUP_WINDOW> pos;
+  std::array<uint32_t, MAX_SHARDS> next;
+  std::copy(begin.begin(), begin.begin() + S, next.begin());
+  for (size_t i = 0; i < N; ++i) {
+    uint32_t j = next[shard[i]]++;
+    key[j] = pn[i];
+    pos[j] = i;
+  }
+
+  for (size_t s = 0; s < S; ++s)
+    if (begin[s] < begin[s + 1])
+      shards[s]->getRNs(begin[s + 1] - begin[s], &key[begin[s]], &found[begin[s]]);
+  for (size_t j = 0; j < N; ++j)
+    rn[pos[j]] = found[j];
+}
+
+void PhoneMapping::Data::getBaseRNs(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  DCHECK_LE(N, LOOKUP_WINDOW);
+  std::array<uint64_t, LOOKUP_WINDOW> key, found;
+  std::array<uint32_t, LOOKUP_WINDOW> pos;
+
+  // Keys changed by delta are answered already, the rest go to base
+  size_t M = 0;
+  for (size_t i = 0; i < N; ++i) {
+    if (rn[i] == REMOVED_RN) {
+      rn[i] = PhoneNumber::NONE;
+    } else if (rn[i] == PhoneNumber::NONE) {
+      key[M] = pn[i];
+      pos[M++] = i;
+    }
+  }
+
+  if (M == 0)
+    return;
+  // Base is never a delta, and overlay is applied on top
+  base->getOwnRNs(M, key.data(), found.data());
+  for (size_t j = 0; j < M; ++j)
+    rn[pos[j]] = found[j];
+}
+
+void PhoneMapping::Data::getOwnRNs(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  DCHECK_LE(N, LOOKUP_WINDOW);
+  const Data &local = replicas.empty() ? *this : *replicas[currentNumaNode()];
+  const KeyFilter &filter = local.filter;
+  if (filter.empty()) {
+    local.probeOwnRNs(N, pn, rn);
+    if (!base)
+      lookupStats.add(N, 0, std::count_if(rn, rn + N, [](uint64_t value) {
+        return value != PhoneNumber::NONE;
+      }));
+    return;
+  }
+
+  // Most numbers are not ported, only keys passing filter reach the index
+  std::array<uint32_t, LOOKUP_WINDOW> pos;
+  std::array<uint64_t, LOOKUP_WINDOW> key, found;
+  size_t M = filter.select(N, pn, pos.data(), FLAGS_f14map_prefetch);
+  for (size_t j = 0; j < M; ++j)
+    key[j] = pn[pos[j]];
+  local.probeOwnRNs(M, key.data(), found.data());
+
+  std::fill(rn, rn + N, PhoneNumber::NONE);
+  size_t hits = 0;
+  for (size_t j = 0; j < M; ++j) {
+    rn[pos[j]] = found[j];
+    hits += found[j] != PhoneNumber::NONE;
+  }
+  // Delta answers changed keys only, the rest is counted by its base
+  if (!base)
+    lookupStats.add(N, N - M, hits);
+}
+
+void PhoneMapping::Data::probeOwnRNs(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  if (N == 0)
+    return;
+  if (!flatIndex.empty()) {
+    getRNsFlat(N, pn, rn);
+    return;
+  }
+  if (engine == Engine::MPH) {
+    getRNsMPH(N, pn, rn);
+    return;
+  }
+  if (engine == Engine::NPANXX) {
+    // Stages are cheap, tight per-stage loops beat the pipeline here
+    NpaNxxProbe probe{*this, pn, rn};
+    groupLookup(probe, N, FLAGS_f14map_prefetch);
+    return;
+  }
+
+  f14Lookup(dict, N, pn, FLAGS_f14map_prefetch, [&](size_t i, const DictEntry *e) {
+    if (e)
+      rn[i] = rnRows[e->code].phone;
+    else
+      rn[i] = PhoneNumber::NONE;
+  });
+}
+
+void PhoneMapping::Data::getRNsFlat(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  DCHECK_LE(N, LOOKUP_WINDOW);
+  std::array<uint64_t, LOOKUP_WINDOW> slot;
+  multiplyShiftBatch(N, pn, FLAT_MULTIPLIER, flatShift, slot.data());
+
+  FlatProbe probe{*this, pn, slot.data(), rn};
+  pipelinedLookup(probe, N, FLAGS_f14map_prefetch);
+}
 
-    pn += M;
-    rn += M;
-    N -= M;
+void PhoneMapping::Data::getRNsMPH(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  if (mphSlots.empty()) {
+    std::fill(rn, rn + N, PhoneNumber::NONE);
+    return;
   }
+
+  DCHECK_LE(N, LOOKUP_WINDOW);
+  std::array<uint64_t, LOOKUP_WINDOW> hash;
+  PerfectHash::hashKeys(N, pn, hash.data());
+
+  MPHProbe probe{*this, pn, hash.data(), rn};
+  pipelinedLookup(probe, N, FLAGS_f14map_prefetch);
 }
 
 void PhoneMapping::getRNs(size_t N, const uint64_t *pn, uint64_t *rn) const {
@@ -104,101 +628,245 @@ uint64_t PhoneMapping::getRN(uint64_t pn) const {
   return rn;
 }
 
-class InverseRNVisitor final : public PhoneMapping::Cursor {
- public:
-  InverseRNVisitor(const PhoneMapping::Data *data, uint64_t it, uint64_t end)
-    : base_(data->pnColumn.data())
-    , it_(it), end_(end)
-  {
-    prefetch(data);
+PhoneMapping::RowScan
+PhoneMapping::Data::scanRNs(uint64_t fromRN, uint64_t toRN) const noexcept {
+  // Removed keys of a delta are never selected
+  fromRN = std::min(fromRN, REMOVED_RN);
+  toRN = std::min(toRN, REMOVED_RN);
+  RowScan ret;
+  if (!shards.empty()) {
+    scanShards(fromRN, toRN, ret);
+    return ret;
   }
-  void refill() override;
- private:
-  const PhoneList *base_;
-  uint64_t it_, end_;
-};
-
-class RowVisitor final : public PhoneMapping::Cursor {
- public:
-  using Iterator = std::vector<PhoneList>::const_iterator;
-  RowVisitor(const PhoneMapping::Data *data, Iterator it, Iterator end)
-    : it_(it), end_(end)
-  {
-    prefetch(data);
-  }
-  void refill() override;
- private:
-  Iterator it_, end_;
-};
-
-std::unique_ptr<PhoneMapping::Cursor>
-PhoneMapping::Data::inverseRNs(uint64_t fromRN, uint64_t toRN) const {
-  std::vector<uint64_t> ret;
+  ret.own = scanOwn(fromRN, toRN);
+  if (base)
+    ret.base = base->scanOwn(fromRN, toRN);
+  return ret;
+}
 
+PhoneMapping::RowScan::Stream
+PhoneMapping::Data::scanOwn(uint64_t fromRN, uint64_t toRN) const noexcept {
   static auto cmp = [](const PhoneList &lhs, const PhoneList &rhs) {
     return lhs.phone < rhs.phone;
   };
-  auto rnLeft = std::lower_bound(rnIndex.begin(), rnIndex.end(), PhoneList{fromRN, 0}, cmp);
-  auto rnRight = std::lower_bound(rnLeft, rnIndex.end(), PhoneList{toRN, 0}, cmp);
-  uint64_t pnBegin = rnLeft == rnIndex.end() ? MAXROWS : rnLeft->next;
-  uint64_t pnEnd = rnRight == rnIndex.end() ? MAXROWS : rnRight->next;
+  auto rnLeft = std::lower_bound(rnRows.begin(), rnRows.end(), PhoneList{fromRN, 0}, cmp);
+  auto rnRight = std::lower_bound(rnLeft, rnRows.end(), PhoneList{toRN, 0}, cmp);
 
-  if (pnBegin != pnEnd)
-    return std::make_unique<InverseRNVisitor>(this, pnBegin, pnEnd);
+  RowScan::Stream ret;
+  ret.pos = csrOffsets[rnLeft - rnRows.begin()];
+  ret.end = csrOffsets[rnRight - rnRows.begin()];
+  return ret;
+}
+
+PhoneMapping::RowScan PhoneMapping::Data::scanRows() const noexcept {
+  return scanRNs(0, REMOVED_RN);
+}
+
+EliasFano::Reader
+PhoneMapping::Data::openStream(const RowScan::Stream &scan) const noexcept {
+  if (scan.resumePos == scan.pos && scan.pos > 0)
+    return csr.resume(scan.pos, scan.resumeWord, scan.resumeBits);
   else
-    return nullptr;
+    return csr.read(scan.pos);
 }
 
-PhoneMapping& PhoneMapping::inverseRNs(uint64_t fromRN, uint64_t toRN) & {
-  cursor_ = data_->inverseRNs(fromRN, toRN);
-  return *this;
+static void closeStream(PhoneMapping::RowScan::Stream &scan,
+                        const EliasFano::Reader &reader) noexcept {
+  scan.pos = scan.resumePos = reader.position();
+  scan.resumeWord = reader.wordIndex();
+  scan.resumeBits = reader.word();
 }
 
-PhoneMapping&& PhoneMapping::inverseRNs(uint64_t fromRN, uint64_t toRN) && {
-  cursor_ = data_->inverseRNs(fromRN, toRN);
-  return std::move(*this);
+size_t PhoneMapping::Data::readRows(RowScan &scan, size_t N,
+                                    uint64_t *pn, uint64_t *rn) const noexcept {
+  if (!shards.empty())
+    return readShardRows(scan, N, pn, rn);
+  else
+    return readLayerRows(scan.own, scan.base, N, pn, rn);
 }
 
-std::unique_ptr<PhoneMapping::Cursor>
-PhoneMapping::Data::visitRows() const {
-  if (pnColumn.size() > 0)
-    return std::make_unique<RowVisitor>(this, pnColumn.begin(), pnColumn.end());
+size_t PhoneMapping::Data::readLayerRows(RowScan::Stream &own, RowScan::Stream &under,
+                                         size_t N, uint64_t *pn, uint64_t *rn) const noexcept {
+  if (base && !under.done())
+    return readMergedRows(own, under, N, pn, rn);
   else
-    return nullptr;
+    return readOwnRows(own, N, pn, rn);
 }
 
-PhoneMapping& PhoneMapping::visitRows() & {
-  cursor_ = data_->visitRows();
-  return *this;
+size_t PhoneMapping::Data::readOwnRows(RowScan::Stream &scan, size_t N,
+                                       uint64_t *pn, uint64_t *rn) const noexcept {
+  // Groups are contiguous, so one seek and then sequential decoding
+  if (scan.done())
+    return 0;
+  N = std::min(N, scan.end - scan.pos);
+  EliasFano::Reader reader = openStream(scan);
+  const PhoneList *rnBase = rnRows.data();
+  for (size_t i = 0; i < N; ++i) {
+    uint64_t value = reader.next();
+    pn[i] = value & CSR_PN_MASK;
+    rn[i] = rnBase[value >> CSR_CODE_SHIFT].phone;
+  }
+  closeStream(scan, reader);
+  return N;
 }
 
-PhoneMapping&& PhoneMapping::visitRows() && {
-  cursor_ = data_->visitRows();
-  return std::move(*this);
+size_t PhoneMapping::Data::readMergedRows(RowScan::Stream &ownScan,
+                                          RowScan::Stream &baseScan, size_t N,
+                                          uint64_t *pn, uint64_t *rn) const noexcept {
+  auto decode = [](const Data &data, EliasFano::Reader &reader,
+                   uint64_t &pn, uint64_t &rn) {
+    uint64_t value = reader.next();
+    pn = value & CSR_PN_MASK;
+    rn = data.rnRows[value >> CSR_CODE_SHIFT].phone;
+  };
+
+  // Both streams are (rn, pn) sorted, merge them skipping base rows of
+  // keys changed by delta. Peeked rows are decoded again on next call.
+  EliasFano::Reader own = openStream(ownScan), ownNext = own;
+  EliasFano::Reader under = base->openStream(baseScan), underNext = under;
+  uint64_t ownPN = 0, ownRN = 0, basePN = 0, baseRN = 0;
+  bool haveOwn = false, haveBase = false;
+  size_t n = 0;
+
+  while (n < N) {
+    if (!haveOwn && own.position() < ownScan.end) {
+      ownNext = own;
+      decode(*this, ownNext, ownPN, ownRN);
+      haveOwn = true;
+    }
+    while (!haveBase && under.position() < baseScan.end) {
+      underNext = under;
+      decode(*base, underNext, basePN, baseRN);
+      if (dict.find(dict.prehash(basePN), basePN))
+        under = underNext;
+      else
+        haveBase = true;
+    }
+
+    if (haveOwn && (!haveBase || std::make_pair(ownRN, ownPN) < std::make_pair(baseRN, basePN))) {
+      pn[n] = ownPN;
+      rn[n++] = ownRN;
+      own = ownNext;
+      haveOwn = false;
+    } else if (haveBase) {
+      pn[n] = basePN;
+      rn[n++] = baseRN;
+      under = underNext;
+      haveBase = false;
+    } else {
+      break;
+    }
+  }
+
+  closeStream(ownScan, own);
+  closeStream(baseScan, under);
+  return n;
 }
 
-void InverseRNVisitor::refill() {
-  for (; it_ != end_ && size_ < pn_.size(); it_ = base_[it_].next) {
-    pn_[size_++] = base_[it_].phone;
+void PhoneMapping::Data::scanShards(uint64_t fromRN, uint64_t toRN,
+                                    RowScan &scan) const noexcept {
+  scan.numShards = shards.size();
+  for (size_t s = 0; s < shards.size(); ++s) {
+    RowScan::Shard &shard = scan.shards[s];
+    shard.own = shards[s]->scanOwn(fromRN, toRN);
+    if (shards[s]->base)
+      shard.base = shards[s]->base->scanOwn(fromRN, toRN);
+    scan.liveShards += !shard.own.done() || !shard.base.done();
   }
 }
 
-void RowVisitor::refill() {
-  for (; it_ != end_ && size_ < pn_.size(); ++it_) {
-    pn_[size_++] = it_->phone;
+size_t PhoneMapping::Data::readShardRows(RowScan &scan, size_t N,
+                                         uint64_t *pn, uint64_t *rn) const noexcept {
+  size_t S = scan.numShards;
+  auto peek = [&](size_t s) {
+    RowScan::Shard &shard = scan.shards[s];
+    if (shard.aheadPos == shard.aheadEnd) {
+      shard.aheadPos = 0;
+      shard.aheadEnd = shards[s]->readLayerRows(shard.own, shard.base, SHARD_AHEAD_ROWS,
+                                                shard.aheadPN.data(), shard.aheadRN.data());
+    }
+    return shard.aheadPos < shard.aheadEnd;
+  };
+
+  // Shards hold ascending ranges of pn, so rows with equal rn go in shard
+  // order. Take rows of the least shard while they precede all the others.
+  size_t n = 0;
+  while (n < N) {
+    size_t best = S, next = S;
+    uint64_t bestRN = 0, nextRN = 0;
+    for (size_t s = 0; s < S; ++s) {
+      if (!peek(s))
+        continue;
+      uint64_t head = scan.shards[s].aheadRN[scan.shards[s].aheadPos];
+      if (best == S || head < bestRN) {
+        next = best;
+        nextRN = bestRN;
+        best = s;
+        bestRN = head;
+      } else if (next == S || head < nextRN) {
+        next = s;
+        nextRN = head;
+      }
+    }
+    if (best == S)
+      break;
+
+    RowScan::Shard &shard = scan.shards[best];
+    uint32_t &pos = shard.aheadPos;
+    while (n < N && pos < shard.aheadEnd &&
+           (next == S || shard.aheadRN[pos] < nextRN ||
+            (shard.aheadRN[pos] == nextRN && best < next))) {
+      pn[n] = shard.aheadPN[pos];
+      rn[n++] = shard.aheadRN[pos++];
+    }
+  }
+
+  scan.liveShards = 0;
+  for (size_t s = 0; s < S; ++s) {
+    const RowScan::Shard &shard = scan.shards[s];
+    scan.liveShards += shard.aheadPos < shard.aheadEnd ||
+                       !shard.own.done() || !shard.base.done();
   }
+  return n;
+}
+
+PhoneMapping::RowScan
+PhoneMapping::scanRNs(uint64_t fromRN, uint64_t toRN) const noexcept {
+  return data_->scanRNs(fromRN, toRN);
+}
+
+PhoneMapping::RowScan PhoneMapping::scanRows() const noexcept {
+  return data_->scanRows();
+}
+
+size_t PhoneMapping::readRows(RowScan &scan, size_t N,
+                              uint64_t *pn, uint64_t *rn) const noexcept {
+  return data_->readRows(scan, N, pn, rn);
+}
+
+PhoneMapping& PhoneMapping::inverseRNs(uint64_t fromRN, uint64_t toRN) & {
+  scan_ = std::make_unique<RowScan>(scanRNs(fromRN, toRN));
+  refill();
+  return *this;
+}
+
+PhoneMapping&& PhoneMapping::inverseRNs(uint64_t fromRN, uint64_t toRN) && {
+  return std::move(inverseRNs(fromRN, toRN));
 }
 
-void PhoneMapping::Cursor::prefetch(const Data *data) noexcept {
-  pos_ = size_ = 0;
+PhoneMapping& PhoneMapping::visitRows() & {
+  scan_ = std::make_unique<RowScan>(scanRows());
   refill();
-  data->getRNs(size_, pn_.begin(), rn_.begin());
+  return *this;
 }
 
-void PhoneMapping::Cursor::advance(const Data *data) noexcept {
-  ++pos_;
-  if (UNLIKELY(pos_ == size_))
-    prefetch(data);
+PhoneMapping&& PhoneMapping::visitRows() && {
+  return std::move(visitRows());
+}
+
+void PhoneMapping::refill() noexcept {
+  pos_ = 0;
+  size_ = readRows(*scan_, CURSOR_ROWS, pn_.data(), rn_.data());
 }
 
 PhoneMapping::Builder::Builder()
@@ -210,7 +878,10 @@ PhoneMapping::Builder::~Builder() noexcept = default;
 void PhoneMapping::Builder::sizeHint(size_t numRecords) {
   data_->pnColumn.reserve(numRecords);
   data_->rnIndex.reserve(numRecords);
-  data_->dict.reserve(numRecords);
+}
+
+void PhoneMapping::Builder::setEngine(Engine engine) {
+  data_->engine = engine;
 }
 
 void PhoneMapping::Builder::setMetadata(const folly::dynamic &meta) {
@@ -218,63 +889,737 @@ void PhoneMapping::Builder::setMetadata(const folly::dynamic &meta) {
 }
 
 PhoneMapping::Builder& PhoneMapping::Builder::addRow(uint64_t pn, uint64_t rn) {
-  if (data_->dict.count(pn))
-    throw std::runtime_error("PhoneMapping::Builder: duplicate key");
   if (data_->pnColumn.size() >= MAXROWS)
     throw std::runtime_error("PhoneMapping::Builder: too much rows");
 
-  data_->dict.emplace(pn, rn);
+  // Duplicates are detected by build() in parallel
   data_->pnColumn.push_back(PhoneList{pn, MAXROWS});
   data_->rnIndex.push_back(PhoneList{rn, MAXROWS});
   return *this;
 }
 
-void PhoneMapping::Builder::fromCSV(std::istream &in, size_t &line, size_t limit) {
-  std::string linebuf;
-  std::vector<uint64_t> rowbuf;
+void PhoneMapping::Builder::fromSnapshot(const std::string &path) {
+  auto data = std::make_unique<Data>();
+  data->mapSnapshot(path);
+  std::swap(data, data_);
+}
 
-  for (limit += line; line < limit; ++line) {
-    if (in.peek() == EOF)
-      break;
-    std::getline(in, linebuf);
-    rowbuf.clear();
-    folly::split(',', linebuf, rowbuf);
-    if (rowbuf.size() == 2)
-      addRow(rowbuf[0], rowbuf[1]);
-    else
-      throw std::runtime_error("bad number of columns");
+PhoneMapping::Builder& PhoneMapping::Builder::removeRow(uint64_t pn) {
+  return addRow(pn, REMOVED_RN);
+}
+
+void PhoneMapping::Builder::fromCSV(CSVReader &in, size_t &line, size_t limit) {
+  readCSV(in, line, limit, false);
+}
+
+void PhoneMapping::Builder::deltaFromCSV(CSVReader &in, size_t &line, size_t limit) {
+  readCSV(in, line, limit, true);
+}
+
+void PhoneMapping::Builder::readCSV(CSVReader &in, size_t &line,
+                                    size_t limit, bool delta) {
+  std::vector<folly::StringPiece> lines;
+
+  struct Chunk {
+    std::vector<std::pair<uint64_t, uint64_t>> rows;
+    std::exception_ptr error;
+  };
+  std::vector<Chunk> chunks;
+
+  // Cut lines of a buffer sequentially, parse them in parallel
+  while (limit > 0 && in.readLines(limit, lines) > 0) {
+    size_t L = lines.size();
+    limit -= L;
+    chunks.clear();
+    chunks.resize((L + CSV_CHUNK_LINES - 1) / CSV_CHUNK_LINES);
+
+    parallelFor(chunks.size(), [&](size_t c) {
+      Chunk &chunk = chunks[c];
+      std::vector<folly::StringPiece> rowbuf;
+      size_t end = std::min(L, (c + 1) * CSV_CHUNK_LINES);
+      chunk.rows.reserve(end - c * CSV_CHUNK_LINES);
+
+      try {
+        for (size_t i = c * CSV_CHUNK_LINES; i < end; ++i) {
+          CSVReader::split(lines[i], rowbuf);
+          if (delta && (rowbuf.size() == 1 || (rowbuf.size() == 2 && rowbuf[1].empty())))
+            chunk.rows.emplace_back(CSVReader::parseNumber(rowbuf[0]), REMOVED_RN);
+          else if (rowbuf.size() == 2)
+            chunk.rows.emplace_back(CSVReader::parseNumber(rowbuf[0]),
+                                    CSVReader::parseNumber(rowbuf[1]));
+          else
+            throw std::runtime_error("bad number of columns");
+        }
+      } catch (...) {
+        // Rows parsed so far stay, the same as with sequential parsing
+        chunk.error = std::current_exception();
+      }
+    });
+
+    // Append rows in input order, stop at the first bad line
+    for (const Chunk &chunk : chunks) {
+      for (const auto &row : chunk.rows) {
+        addRow(row.first, row.second);
+        ++line;
+      }
+      if (chunk.error)
+        std::rethrow_exception(chunk.error);
+    }
   }
 }
 
 void PhoneMapping::Data::build() {
+  if (snapshot)
+    return;
+
   size_t N = pnColumn.size();
+  numRows = N;
+  buildDict();
 
-  // Connect rnIndex_ with pnColumn_ before shuffling
-  for (size_t i = 0; i < N; ++i)
-    rnIndex[i].next = i;
+  // Sort rnIndex and link pnColumn rows by value
+  buildReverseIndex(pnColumn, rnIndex);
 
-  static auto cmp = [](const PhoneList &lhs, const PhoneList &rhs) {
-    if (lhs.phone == rhs.phone)
-      return lhs.next < rhs.next;
-    return lhs.phone < rhs.phone;
-  };
+  pnRows = folly::range(pnColumn);
+  rnRows = folly::range(rnIndex);
+  buildReverseCSR();
+
+  // NPA-NXX index rejects absent keys by itself, mostly in cache
+  if (engine != Engine::NPANXX)
+    filter = KeyFilter::build(N, FLAGS_mapping_filter_bits, [&](size_t i) {
+      return uint64_t(pnRows[i].phone);
+    });
+
+  if (engine == Engine::MPH)
+    buildPerfectHash();
+  if (engine == Engine::NPANXX)
+    buildNpaNxxIndex();
+
+  if (engine == Engine::F14) {
+    // Replace row numbers by rn codes
+    std::vector<uint32_t> rowCode(N);
+    forEachRowCode([&](uint64_t row, uint64_t code) {
+      rowCode[row] = code;
+    });
+    parallelFor(ShardedDict::NUM_SHARDS, [&](size_t s) {
+      for (const DictEntry &entry : dict.shard(s))
+        entry.code = rowCode[entry.code];
+    });
+  }
+  replicate();
+}
+
+void PhoneMapping::Data::buildReverseCSR() {
+  size_t N = pnRows.size();
+  size_t R = rnRows.size();
+
+  // Rows come grouped by code, count groups along the way
+  std::vector<uint64_t> values;
+  values.reserve(N);
+  csrOffsetStore.assign(R + 1, 0);
+  forEachRowCode([&](uint64_t row, uint64_t code) {
+    values.push_back(code << CSR_CODE_SHIFT | pnRows[row].phone);
+    ++csrOffsetStore[code + 1];
+  });
+  for (size_t c = 0; c < R; ++c)
+    csrOffsetStore[c + 1] += csrOffsetStore[c];
+
+  parallelChunks(R, detail::indexChunks(N), [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; ++c)
+      std::sort(values.begin() + csrOffsetStore[c],
+                values.begin() + csrOffsetStore[c + 1]);
+  });
+
+  csr = EliasFano::build(folly::range(values), uint64_t(R) << CSR_CODE_SHIFT);
+  csrOffsets = folly::range(csrOffsetStore);
+}
+
+/** Error for a repeated key on builder input row (0-based), reported
+  * as the 1-based line it was read from by Builder::fromCSV(). */
+static std::runtime_error duplicateKey(uint64_t row) {
+  return std::runtime_error(folly::to<std::string>(
+    "PhoneMapping::Builder: duplicate key on line ", row + 1));
+}
+
+void PhoneMapping::Data::buildDict() {
+  static constexpr size_t S = ShardedDict::NUM_SHARDS;
+  size_t N = pnColumn.size();
+  size_t C = std::max<size_t>(N / PARTITION_CHUNK_ROWS, 1);
+  auto chunkBegin = [&](size_t c) { return N * c / C; };
+
+  // Count rows of every shard in every chunk
+  std::vector<size_t> offset(C * S);
+  parallelFor(C, [&](size_t c) {
+    size_t *count = &offset[c * S];
+    for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+      ++count[ShardedDict::shardOf(pnColumn[i].phone)];
+  });
+
+  // Place chunks one after another within every shard
+  std::vector<size_t> shardBegin(S + 1);
+  size_t total = 0;
+  for (size_t s = 0; s < S; ++s) {
+    shardBegin[s] = total;
+    for (size_t c = 0; c < C; ++c) {
+      size_t count = offset[c * S + s];
+      offset[c * S + s] = total;
+      total += count;
+    }
+  }
+  shardBegin[S] = total;
+
+  // Group row numbers by shard, they stay sorted within a shard
+  std::vector<uint32_t> order(N);
+  parallelFor(C, [&](size_t c) {
+    size_t *pos = &offset[c * S];
+    for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+      order[pos[ShardedDict::shardOf(pnColumn[i].phone)]++] = i;
+  });
+
+  // Fill shards, report the row sequential insertion would fail on
+  std::vector<uint64_t> duplicate(S, MAXROWS);
+  parallelFor(S, [&](size_t s) {
+    ShardedDict::Shard &shard = dict.shard(s);
+    shard.reserve(shardBegin[s + 1] - shardBegin[s]);
+    for (size_t j = shardBegin[s]; j < shardBegin[s + 1]; ++j) {
+      uint32_t row = order[j];
+      if (!shard.insert(DictEntry{pnColumn[row].phone, row}).second) {
+        duplicate[s] = row;
+        break;
+      }
+    }
+  });
+
+  uint64_t row = *std::min_element(duplicate.begin(), duplicate.end());
+  if (row != MAXROWS && !inputRows.empty())
+    row = inputRows[row];
+  if (row != MAXROWS)
+    throw duplicateKey(row);
+}
+
+void PhoneMapping::Data::buildPerfectHash() {
+  std::vector<uint64_t> keys(pnRows.size());
+  for (size_t i = 0; i < keys.size(); ++i)
+    keys[i] = pnRows[i].phone;
+
+  try {
+    mph = PerfectHash::build(folly::range(keys));
+  } catch (const std::invalid_argument &) {
+    // Keys are unique in dict, so some got truncated by PhoneList
+    throw std::runtime_error("PhoneMapping::Builder: key is out of range");
+  }
+
+  mphColumn.resize(keys.size());
+  forEachRowCode([&](uint64_t row, uint64_t code) {
+    uint64_t pn = pnRows[row].phone;
+    mphColumn[mph(pn)] = PhoneList{pn, code};
+  });
+  mphSlots = folly::range(mphColumn);
+
+  // Perfect hash takes over lookups
+  dict = decltype(dict)();
+}
+
+void PhoneMapping::Data::buildNpaNxxIndex() {
+  std::vector<PhoneList> sorted;
+  sorted.reserve(pnRows.size());
+  forEachRowCode([&](uint64_t row, uint64_t code) {
+    sorted.push_back(PhoneList{pnRows[row].phone, code});
+  });
 
-#if HAVE_STD_PARALLEL
-  std::stable_sort(std::execution::par_unseq, rnIndex.begin(), rnIndex.end(), cmp);
-#else
-  std::stable_sort(rnIndex.begin(), rnIndex.end(), cmp);
-#endif
+  radixSortByPhone(sorted);
 
-  // Wire pnColumn_ list by target
-  for (size_t i = 0; i + 1 < N; ++i)
-    pnColumn[rnIndex[i].next].next = rnIndex[i+1].next;
+  std::vector<uint64_t> keys(sorted.size());
+  for (size_t i = 0; i < sorted.size(); ++i)
+    keys[i] = sorted[i].phone;
+
+  try {
+    npanxx = NpaNxxIndex::build(folly::range(keys));
+  } catch (const std::invalid_argument &) {
+    throw std::runtime_error("PhoneMapping::Builder: key is not a 10-digit number");
+  }
+
+  npanxxCodes = CodeColumn(sorted.size(), CodeColumn::widthFor(rnRows.size()));
+  for (size_t i = 0; i < sorted.size(); ++i)
+    npanxxCodes.set(i, sorted[i].next);
+
+  // Direct index takes over lookups
+  dict = decltype(dict)();
+}
+
+bool PhoneMapping::Data::hasDelta() const noexcept {
+  if (base)
+    return true;
+  for (const auto &shard : shards)
+    if (shard->base)
+      return true;
+  return false;
+}
 
-  static auto equal = [](const PhoneList &lhs, const PhoneList &rhs) {
-    return lhs.phone == rhs.phone;
+void PhoneMapping::Data::writeSnapshot(
+    const std::function<void(SnapshotWriter &)> &open) const {
+  if (hasDelta()) {
+    compact()->writeSnapshot(open);
+    return;
+  }
+
+  SnapshotWriter writer(SNAPSHOT_KIND, SNAPSHOT_VERSION);
+  if (shards.empty())
+    writeSections(writer, [&] { open(writer); });
+  else
+    writeShards(writer, [&] { open(writer); });
+  writer.commit();
+}
+
+/** Declare and fill metadata, shardOf and sections of every NPA shard,
+  * open() maps the output. Shards are written as they are, each one
+  * under its shardTags(). */
+void PhoneMapping::Data::writeShards(SnapshotWriter &writer,
+                                     const std::function<void()> &open) const {
+  std::string metaJson = folly::toJson(meta);
+  writer.addSection<char>(SNAP_META, metaJson.size());
+  writer.addSection<uint8_t>(SNAP_SHARD_OF, NPA_ROUTES);
+
+  // Every shard declares its sections and fills them once the next ones
+  // are declared and the output is open
+  std::function<void(size_t)> declare = [&](size_t s) {
+    if (s < shards.size()) {
+      shards[s]->writeSections(writer, [&] { declare(s + 1); },
+                               false, shardTags(s));
+      return;
+    }
+    open();
+    auto metaOut = writer.section<char>(SNAP_META);
+    std::copy(metaJson.begin(), metaJson.end(), metaOut.begin());
+    auto shardOfOut = writer.section<uint8_t>(SNAP_SHARD_OF);
+    std::copy(shardOf.begin(), shardOf.end(), shardOfOut.begin());
   };
-  auto last = std::unique(rnIndex.begin(), rnIndex.end(), equal);
-  rnIndex.erase(last, rnIndex.end());
-  rnIndex.shrink_to_fit();
+  declare(0);
+}
+
+/** Declare and fill sections of own rows, open() maps the output.
+  * With `lookupOnly` only sections read by getOwnRNs() are written.
+  * Tags of all sections are offset by `tags`. */
+void PhoneMapping::Data::writeSections(SnapshotWriter &writer,
+                                       const std::function<void()> &open,
+                                       bool lookupOnly, uint32_t tags) const {
+  size_t N = pnRows.size();
+  size_t R = rnRows.size();
+  std::string metaJson = folly::toJson(meta);
+
+  // Keep load factor of flat index below 0.7
+  size_t capacity = 2;
+  while (capacity * 7 < N * 10)
+    capacity *= 2;
+  unsigned shift = 64 - __builtin_ctzll(capacity);
+
+  writer.addSection<PhoneList>(tags + SNAP_RN_INDEX, R);
+  if (!lookupOnly) {
+    writer.addSection<char>(tags + SNAP_META, metaJson.size());
+    writer.addSection<PhoneList>(tags + SNAP_PN_COLUMN, N);
+    writer.addSection<uint32_t>(tags + SNAP_CSR_OFFSETS, csrOffsets.size());
+    writer.addSection<uint64_t>(tags + SNAP_CSR_LOWS, csr.lows().size());
+    writer.addSection<uint64_t>(tags + SNAP_CSR_HIGHS, csr.highs().size());
+    writer.addSection<uint64_t>(tags + SNAP_CSR_SAMPLES, csr.samples().size());
+  }
+  if (!filter.empty())
+    writer.addSection<uint32_t>(tags + SNAP_FILTER, filter.words().size());
+  if (engine == Engine::MPH) {
+    writer.addSection<PerfectHash::Partition>(tags + SNAP_MPH_PARTITIONS,
+                                              mph.partitions().size());
+    writer.addSection<uint16_t>(tags + SNAP_MPH_PILOTS, mph.pilots().size());
+    writer.addSection<uint32_t>(tags + SNAP_MPH_REMAP, mph.remap().size());
+    writer.addSection<PhoneList>(tags + SNAP_MPH_SLOTS, N);
+  } else if (engine == Engine::NPANXX) {
+    writer.addSection<uint32_t>(tags + SNAP_NPANXX_BLOCKS, npanxx.blocks().size());
+    writer.addSection<NpaNxxIndex::Line>(tags + SNAP_NPANXX_LINES, npanxx.lines().size());
+    writer.addSection<uint8_t>(tags + SNAP_NPANXX_CODES, npanxxCodes.bytes().size());
+  } else {
+    writer.addSection<PhoneList>(tags + SNAP_FLAT_INDEX, capacity);
+  }
+  open();
+
+  auto rnOut = writer.section<PhoneList>(tags + SNAP_RN_INDEX);
+  std::copy(rnRows.begin(), rnRows.end(), rnOut.begin());
+  if (!lookupOnly) {
+    auto metaOut = writer.section<char>(tags + SNAP_META);
+    std::copy(metaJson.begin(), metaJson.end(), metaOut.begin());
+    auto pnOut = writer.section<PhoneList>(tags + SNAP_PN_COLUMN);
+    std::copy(pnRows.begin(), pnRows.end(), pnOut.begin());
+    auto offsetsOut = writer.section<uint32_t>(tags + SNAP_CSR_OFFSETS);
+    std::copy(csrOffsets.begin(), csrOffsets.end(), offsetsOut.begin());
+    auto lowsOut = writer.section<uint64_t>(tags + SNAP_CSR_LOWS);
+    std::copy(csr.lows().begin(), csr.lows().end(), lowsOut.begin());
+    auto highsOut = writer.section<uint64_t>(tags + SNAP_CSR_HIGHS);
+    std::copy(csr.highs().begin(), csr.highs().end(), highsOut.begin());
+    auto samplesOut = writer.section<uint64_t>(tags + SNAP_CSR_SAMPLES);
+    std::copy(csr.samples().begin(), csr.samples().end(), samplesOut.begin());
+  }
+  if (!filter.empty()) {
+    auto filterOut = writer.section<uint32_t>(tags + SNAP_FILTER);
+    std::copy(filter.words().begin(), filter.words().end(), filterOut.begin());
+  }
+
+  if (engine == Engine::MPH) {
+    auto partsOut = writer.section<PerfectHash::Partition>(tags + SNAP_MPH_PARTITIONS);
+    std::copy(mph.partitions().begin(), mph.partitions().end(), partsOut.begin());
+    auto pilotsOut = writer.section<uint16_t>(tags + SNAP_MPH_PILOTS);
+    std::copy(mph.pilots().begin(), mph.pilots().end(), pilotsOut.begin());
+    auto remapOut = writer.section<uint32_t>(tags + SNAP_MPH_REMAP);
+    std::copy(mph.remap().begin(), mph.remap().end(), remapOut.begin());
+    auto slotsOut = writer.section<PhoneList>(tags + SNAP_MPH_SLOTS);
+    std::copy(mphSlots.begin(), mphSlots.end(), slotsOut.begin());
+    return;
+  }
+
+  if (engine == Engine::NPANXX) {
+    auto blocksOut = writer.section<uint32_t>(tags + SNAP_NPANXX_BLOCKS);
+    std::copy(npanxx.blocks().begin(), npanxx.blocks().end(), blocksOut.begin());
+    auto linesOut = writer.section<NpaNxxIndex::Line>(tags + SNAP_NPANXX_LINES);
+    std::copy(npanxx.lines().begin(), npanxx.lines().end(), linesOut.begin());
+    auto codesOut = writer.section<uint8_t>(tags + SNAP_NPANXX_CODES);
+    std::copy(npanxxCodes.bytes().begin(), npanxxCodes.bytes().end(),
+              codesOut.begin());
+    return;
+  }
+
+  auto flat = writer.section<PhoneList>(tags + SNAP_FLAT_INDEX);
+  std::fill(flat.begin(), flat.end(), PhoneList{FLAT_EMPTY, 0});
+  forEachRowCode([&](uint64_t row, uint64_t code) {
+    uint64_t pn = pnRows[row].phone;
+    if (pn == FLAT_EMPTY)
+      throw std::runtime_error("PhoneMapping: key is out of range");
+
+    size_t j = flatSlot(pn, shift);
+    while (flat[j].phone != FLAT_EMPTY)
+      j = (j + 1) & (capacity - 1);
+    flat[j] = PhoneList{pn, code};
+  });
+}
+
+void PhoneMapping::Data::mapSnapshot(const std::string &path) {
+  snapshot = std::make_shared<SnapshotReader>(path, SNAPSHOT_KIND,
+                                              FLAGS_snapshot_populate);
+  snapshotBytes = snapshot->size();
+  if (snapshot->hasSection(SNAP_SHARD_OF)) {
+    attachShards(FLAGS_snapshot_verify);
+    return;
+  }
+  attachSnapshot(FLAGS_snapshot_verify);
+  replicate();
+}
+
+/** Map NPA shards of a snapshot written by writeShards(), each one a
+  * mapping of its own sharing the file. */
+void PhoneMapping::Data::attachShards(bool verify) {
+  if (snapshot->version() != SNAPSHOT_VERSION)
+    throw std::runtime_error("PhoneMapping: unsupported snapshot version");
+
+  auto metaJson = snapshot->section<char>(SNAP_META);
+  meta = folly::parseJson(folly::StringPiece(metaJson.begin(), metaJson.end()));
+  auto shardOfIn = snapshot->section<uint8_t>(SNAP_SHARD_OF);
+  size_t S = 0;
+  while (S < MAX_SHARDS && snapshot->hasSection(shardTags(S) + SNAP_PN_COLUMN))
+    ++S;
+  if (shardOfIn.size() != NPA_ROUTES)
+    throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+  for (size_t npa = 0; npa < NPA_ROUTES; ++npa) {
+    if (shardOfIn[npa] >= S)
+      throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+    shardOf[npa] = shardOfIn[npa];
+  }
+
+  shards.resize(S);
+  std::vector<std::exception_ptr> errors(S);
+  parallelFor(S, [&](size_t s) {
+    try {
+      auto shard = std::make_unique<Data>();
+      shard->snapshot = snapshot;
+      shard->attachSnapshot(verify, shardTags(s));
+      // Keys of other NPAs would be routed past the shard holding them
+      if (verify)
+        for (const PhoneList &row : shard->pnRows)
+          if (shardOf[npaRoute(row.phone)] != s)
+            throw std::runtime_error("PhoneMapping: broken shard in snapshot");
+      shard->snapshotBytes = snapshot->sectionBytes(shardTags(s), shardTags(s + 1));
+      shard->replicate();
+      shard->collectNpas();
+      shards[s] = std::move(shard);
+    } catch (...) {
+      errors[s] = std::current_exception();
+    }
+  });
+  for (const auto &error : errors)
+    if (error)
+      std::rethrow_exception(error);
+
+  for (const auto &shard : shards)
+    snapshotBytes -= shard->snapshotBytes;
+  engine = shards[0]->engine;
+  joinShards();
+}
+
+void PhoneMapping::Data::attachSnapshot(bool verify, uint32_t tags) {
+  if (snapshot->version() != SNAPSHOT_VERSION)
+    throw std::runtime_error("PhoneMapping: unsupported snapshot version");
+
+  auto metaJson = snapshot->section<char>(tags + SNAP_META);
+  meta = folly::parseJson(folly::StringPiece(metaJson.begin(), metaJson.end()));
+  pnRows = snapshot->section<PhoneList>(tags + SNAP_PN_COLUMN);
+  rnRows = snapshot->section<PhoneList>(tags + SNAP_RN_INDEX);
+
+  size_t N = pnRows.size();
+  size_t R = rnRows.size();
+  if (N >= MAXROWS || R > N)
+    throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+  numRows = N;
+
+  csrOffsets = snapshot->section<uint32_t>(tags + SNAP_CSR_OFFSETS);
+  csr = EliasFano(N, uint64_t(R) << CSR_CODE_SHIFT,
+                  snapshot->section<uint64_t>(tags + SNAP_CSR_LOWS),
+                  snapshot->section<uint64_t>(tags + SNAP_CSR_HIGHS),
+                  snapshot->section<uint64_t>(tags + SNAP_CSR_SAMPLES));
+  if (csrOffsets.size() != R + 1 || csrOffsets[0] != 0 || csrOffsets[R] != N)
+    throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+  auto slots = attachLookup(N, tags);
+
+  if (!verify)
+    return;
+  for (const PhoneList &rn : rnRows)
+    if (rn.next >= N)
+      throw std::runtime_error("PhoneMapping: broken rn index in snapshot");
+  for (const PhoneList &pn : pnRows)
+    if (pn.next >= N && pn.next != MAXROWS)
+      throw std::runtime_error("PhoneMapping: broken row link in snapshot");
+  for (const PhoneList &pn : pnRows)
+    if (!filter.mayContain(pn.phone))
+      throw std::runtime_error("PhoneMapping: broken filter in snapshot");
+  for (const PhoneList &slot : slots)
+    if (slot.phone != FLAT_EMPTY && slot.next >= R)
+      throw std::runtime_error("PhoneMapping: broken lookup index in snapshot");
+  for (size_t i = 0; i < npanxxCodes.size(); ++i)
+    if (npanxxCodes[i] >= R)
+      throw std::runtime_error("PhoneMapping: broken lookup index in snapshot");
+
+  // Every group holds its own code with strictly increasing pn
+  EliasFano::Reader reader = csr.read(0);
+  for (size_t c = 0; c < R; ++c) {
+    if (csrOffsets[c] > csrOffsets[c + 1])
+      throw std::runtime_error("PhoneMapping: broken reverse index in snapshot");
+    uint64_t prev = 0;
+    for (size_t i = csrOffsets[c]; i < csrOffsets[c + 1]; ++i) {
+      uint64_t value = reader.next();
+      if (value >> CSR_CODE_SHIFT != c || (i > csrOffsets[c] && value <= prev))
+        throw std::runtime_error("PhoneMapping: broken reverse index in snapshot");
+      prev = value;
+    }
+  }
+}
+
+/** Map lookup index of N rows and rn codes, the part of a snapshot read
+  * by getOwnRNs(), from sections tagged with offset `tags`. Returns slots
+  * of the index holding rn codes. */
+folly::Range<const PhoneList*> PhoneMapping::Data::attachLookup(size_t N, uint32_t tags) {
+  rnRows = snapshot->section<PhoneList>(tags + SNAP_RN_INDEX);
+  size_t R = rnRows.size();
+
+  folly::Range<const PhoneList*> slots;
+  if (snapshot->hasSection(tags + SNAP_MPH_SLOTS)) {
+    engine = Engine::MPH;
+    mph = PerfectHash(
+      snapshot->section<PerfectHash::Partition>(tags + SNAP_MPH_PARTITIONS),
+      snapshot->section<uint16_t>(tags + SNAP_MPH_PILOTS),
+      snapshot->section<uint32_t>(tags + SNAP_MPH_REMAP));
+    mphSlots = slots = snapshot->section<PhoneList>(tags + SNAP_MPH_SLOTS);
+    if (mph.size() != N || mphSlots.size() != N)
+      throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+    // Every non-empty partition starts within slots, after the one before
+    auto parts = mph.partitions();
+    for (size_t p = 0; p + 1 < parts.size(); ++p)
+      if (parts[p + 1].keyOffset < parts[p].keyOffset ||
+          (parts[p + 1].keyOffset > parts[p].keyOffset && parts[p].keyOffset >= N))
+        throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+  } else if (snapshot->hasSection(tags + SNAP_NPANXX_CODES)) {
+    engine = Engine::NPANXX;
+    npanxx = NpaNxxIndex(
+      snapshot->section<uint32_t>(tags + SNAP_NPANXX_BLOCKS),
+      snapshot->section<NpaNxxIndex::Line>(tags + SNAP_NPANXX_LINES));
+    npanxxCodes = CodeColumn(snapshot->section<uint8_t>(tags + SNAP_NPANXX_CODES),
+                             N, CodeColumn::widthFor(R));
+    if (npanxx.size() != N)
+      throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+  } else {
+    flatIndex = slots = snapshot->section<PhoneList>(tags + SNAP_FLAT_INDEX);
+    size_t capacity = flatIndex.size();
+    if (capacity < 2 || capacity <= N || (capacity & (capacity - 1)) != 0)
+      throw std::runtime_error("PhoneMapping: inconsistent snapshot");
+    flatShift = 64 - __builtin_ctzll(capacity);
+  }
+  // Snapshots written without filter are served by the index alone
+  if (snapshot->hasSection(tags + SNAP_FILTER))
+    filter = KeyFilter(snapshot->section<uint32_t>(tags + SNAP_FILTER));
+  return slots;
+}
+
+void PhoneMapping::Data::replicate() {
+  if (!FLAGS_numa_replicas || numaNodes() < 2)
+    return;
+
+  // Replica holds lookup index and rn codes only, flat one in place of
+  // dict; rows and reverse index stay where they are
+  for (unsigned node = 0; node < numaNodes(); ++node) {
+    SnapshotWriter writer(SNAPSHOT_KIND, SNAPSHOT_VERSION);
+    writeSections(writer, [&] { writer.openMemory(node); }, true);
+    auto replica = std::make_unique<Data>();
+    replica->snapshot = std::make_unique<SnapshotReader>(writer.release(), SNAPSHOT_KIND);
+    replica->attachLookup(numRows);
+    replicas.push_back(std::move(replica));
+  }
+
+  // Lookups are served by replicas, delta still needs dict to skip
+  // changed keys of its base in reverse scans
+  if (!base)
+    dict = decltype(dict)();
+}
+
+void PhoneMapping::Data::collectNpas() {
+  npas.reset();
+  for (const PhoneList &row : pnRows)
+    npas.set(npaRoute(row.phone));
+  if (base)
+    npas |= base->npas;
+}
+
+void PhoneMapping::Data::joinShards() {
+  numRows = 0;
+  npas.reset();
+  for (const auto &shard : shards) {
+    numRows += shard->numRows;
+    npas |= shard->npas;
+  }
+}
+
+void PhoneMapping::Data::mergeDelta(const Data &older) {
+  folly::F14FastSet<uint64_t> changed;
+  changed.reserve(pnColumn.size());
+  for (const PhoneList &row : pnColumn)
+    changed.insert(row.phone);
+
+  // Changes of the older delta stay unless changed again
+  older.forEachRowCode([&](uint64_t row, uint64_t code) {
+    uint64_t pn = older.pnRows[row].phone;
+    if (changed.count(pn) == 0) {
+      pnColumn.push_back(PhoneList{pn, MAXROWS});
+      rnIndex.push_back(PhoneList{older.rnRows[code].phone, MAXROWS});
+    }
+  });
+}
+
+void PhoneMapping::Data::countDeltaRows() {
+  size_t N = pnRows.size();
+  std::vector<uint64_t> key(N), own(N), found(N);
+  for (size_t i = 0; i < N; ++i)
+    key[i] = pnRows[i].phone;
+  for (size_t i = 0; i < N; i += LOOKUP_WINDOW) {
+    size_t n = std::min(N - i, LOOKUP_WINDOW);
+    getOwnRNs(n, &key[i], &own[i]);
+    base->getOwnRNs(n, &key[i], &found[i]);
+  }
+
+  // Keys found in base are replaced or removed, the rest are added
+  numRows = base->numRows;
+  for (size_t i = 0; i < N; ++i) {
+    numRows -= found[i] != PhoneNumber::NONE;
+    numRows += own[i] != REMOVED_RN;
+  }
+}
+
+std::unique_ptr<PhoneMapping::Data> PhoneMapping::Data::compact() const {
+  auto ret = std::make_unique<Data>();
+  ret->engine = base ? base->engine : engine;
+  ret->meta = meta;
+  ret->pnColumn.reserve(numRows);
+  ret->rnIndex.reserve(numRows);
+
+  std::array<uint64_t, 1024> pn, rn;
+  RowScan scan = scanRows();
+  while (size_t n = readRows(scan, pn.size(), pn.data(), rn.data())) {
+    for (size_t i = 0; i < n; ++i) {
+      ret->pnColumn.push_back(PhoneList{pn[i], MAXROWS});
+      ret->rnIndex.push_back(PhoneList{rn[i], MAXROWS});
+    }
+  }
+  ret->build();
+  return ret;
+}
+
+class NanpMapping::Data
+  : public folly::hazptr_obj_base<NanpMapping::Data, std::atomic,
+                                  ReclaimLater<NanpMapping::Data>> {
+ public:
+  void buildRoutes();
+  void getRNs(size_t N, const uint64_t *pn, uint64_t *rn, Country *country) const;
+
+  // country partitions, shared with views built before and after
+  std::array<std::shared_ptr<const PhoneMapping::Data>, 2> parts;
+  // NPA -> bit per country having numbers in it
+  std::array<uint8_t, NPA_ROUTES> routes;
+  // bytes of partitions dropped with this view once replaced in global
+  size_t retiredBytes = 0;
+};
+
+void NanpMapping::Data::buildRoutes() {
+  routes.fill(0);
+  for (size_t c = 0; c < parts.size(); ++c) {
+    if (!parts[c])
+      continue;
+    for (size_t npa = 0; npa < NPA_ROUTES; ++npa)
+      if (parts[c]->npas.test(npa))
+        routes[npa] |= 1 << c;
+    // Numbers ported into NPA new to the partition
+    if (parts[c]->overlay)
+      for (const auto &change : parts[c]->overlay->changes())
+        routes[npaRoute(change.first)] |= 1 << c;
+  }
+}
+
+void NanpMapping::Data::getRNs(size_t N, const uint64_t *pn, uint64_t *rn,
+                               Country *country) const {
+  for (; N > LOOKUP_WINDOW; N -= LOOKUP_WINDOW, pn += LOOKUP_WINDOW, rn += LOOKUP_WINDOW) {
+    getRNs(LOOKUP_WINDOW, pn, rn, country);
+    if (country)
+      country += LOOKUP_WINDOW;
+  }
+
+  std::array<uint64_t, LOOKUP_WINDOW> key, found;
+  std::array<uint32_t, LOOKUP_WINDOW> pos;
+
+  std::fill(rn, rn + N, PhoneNumber::NONE);
+  if (country)
+    std::fill(country, country + N, Country::NONE);
+
+  // Probe partitions one after another, each with a batch of keys routed
+  // to it. NPA shared by both countries falls back to CA if US misses.
+  for (size_t c = 0; c < parts.size(); ++c) {
+    if (!parts[c])
+      continue;
+
+    size_t M = 0;
+    for (size_t i = 0; i < N; ++i) {
+      if ((routes[npaRoute(pn[i])] & (1 << c)) && rn[i] == PhoneNumber::NONE) {
+        key[M] = pn[i];
+        pos[M++] = i;
+      }
+    }
+
+    parts[c]->getRNs(M, key.data(), found.data());
+    for (size_t j = 0; j < M; ++j) {
+      if (found[j] == PhoneNumber::NONE)
+        continue;
+      rn[pos[j]] = found[j];
+      if (country)
+        country[pos[j]] = Country(c);
+    }
+  }
 }
 
 PhoneMapping PhoneMapping::Builder::build() {
@@ -284,16 +1629,429 @@ PhoneMapping PhoneMapping::Builder::build() {
   return PhoneMapping(std::move(data));
 }
 
-void PhoneMapping::Builder::commit(std::atomic<Data*> &global) {
+// Control commands run concurrently, keep reload of the other country
+// from replacing global between load and exchange
+static std::mutex nanpCommitMutex;
+
+/** Collect data making a partition: itself, its bases and shards. */
+static void collectParts(const PhoneMapping::Data *data,
+                         std::unordered_set<const PhoneMapping::Data*> &parts) {
+  if (!data || !parts.insert(data).second)
+    return;
+  collectParts(data->base.get(), parts);
+  for (const auto &shard : data->shards)
+    collectParts(shard.get(), parts);
+}
+
+/** Replace a partition of NANP global, nanpCommitMutex must be held. */
+static void replacePart(std::atomic<NanpMapping::Data*> &global,
+                        NanpMapping::Country country,
+                        std::shared_ptr<const PhoneMapping::Data> part) {
+  using Data = PhoneMapping::Data;
+  std::unordered_set<const Data*> kept, dropped;
+  collectParts(part.get(), kept);
+
+  auto recruit = std::make_unique<NanpMapping::Data>();
+  if (const NanpMapping::Data *current = global.load()) {
+    recruit->parts = current->parts;
+    collectParts(current->parts[size_t(country)].get(), dropped);
+  }
+  recruit->parts[size_t(country)] = std::move(part);
+  recruit->buildRoutes();
+
+  if (NanpMapping::Data *veteran = global.exchange(recruit.release())) {
+    // Count data which the new partition doesn't share with the old one
+    for (const Data *data : dropped) {
+      if (kept.count(data) || data->retiredBytes > 0)
+        continue;
+      MemoryUsage usage;
+      data->ownMemoryUsage(usage);
+      data->retiredBytes = usage.total();
+      retiredParts.retire(data->retiredBytes);
+      veteran->retiredBytes += data->retiredBytes;
+    }
+    veteran->retire();
+  }
+}
+
+/** Get overlay of the loaded partition for its next version, numbers
+  * ported before or during a reload stay ported. */
+static std::shared_ptr<PortOverlay> keptOverlay(const PhoneMapping::Data *part) {
+  if (part && part->overlay)
+    return part->overlay;
+  return std::make_shared<PortOverlay>();
+}
+
+/** Copy partition split into NPA shards, to replace some of them. */
+static std::unique_ptr<PhoneMapping::Data> copyShards(const PhoneMapping::Data &part) {
+  auto ret = std::make_unique<PhoneMapping::Data>();
+  ret->meta = part.meta;
+  ret->engine = part.engine;
+  ret->overlay = part.overlay;
+  ret->shards = part.shards;
+  ret->shardOf = part.shardOf;
+  return ret;
+}
+
+/** Find the row build() of a shard would report a duplicate key on, that
+  * is the second one of a key in input order, or MAXROWS. Sets `outOfRange`
+  * if the engine can't index some key. */
+static uint64_t checkShardRows(const PhoneMapping::Data &shard, bool &outOfRange) {
+  std::vector<PhoneList> keys(shard.pnColumn.size());
+  for (size_t j = 0; j < keys.size(); ++j)
+    keys[j] = PhoneList{shard.pnColumn[j].phone, j};
+  radixSortByPhone(keys);
+
+  // Sort is stable, the later row of equal keys comes second
+  uint64_t duplicate = MAXROWS;
+  for (size_t j = 1; j < keys.size(); ++j)
+    if (keys[j].phone == keys[j - 1].phone)
+      duplicate = std::min<uint64_t>(duplicate, shard.inputRows[keys[j].next]);
+  if (shard.engine == PhoneMapping::Engine::NPANXX && !keys.empty() &&
+      keys.back().phone >= 10000000000)
+    outOfRange = true;
+  return duplicate;
+}
+
+/** Build input rows into NPA shards and replace the partition, see commit(). */
+static void commitShards(std::unique_ptr<PhoneMapping::Data> input,
+                         std::atomic<NanpMapping::Data*> &global,
+                         NanpMapping::Country country) {
+  using Data = PhoneMapping::Data;
+  size_t S = std::min<size_t>(FLAGS_mapping_shards, MAX_SHARDS);
+  size_t N = input->pnColumn.size();
+  size_t C = std::max<size_t>(N / PARTITION_CHUNK_ROWS, 1);
+  auto chunkBegin = [&](size_t c) { return N * c / C; };
+
+  // Count rows of every NPA in every chunk
+  std::vector<size_t> npaCount(C * NPA_ROUTES);
+  parallelFor(C, [&](size_t c) {
+    size_t *count = &npaCount[c * NPA_ROUTES];
+    for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i)
+      ++count[npaRoute(input->pnColumn[i].phone)];
+  });
+
+  // Keep ranges of the loaded partition, so its shards can be replaced
+  // one by one. Otherwise split NPAs into ranges of about equal rows.
+  std::array<uint8_t, NPA_ROUTES> shardOf;
+  bool inPlace;
+  {
+    std::lock_guard<std::mutex> lock(nanpCommitMutex);
+    const NanpMapping::Data *current = global.load();
+    const Data *part = current ? current->parts[size_t(country)].get() : nullptr;
+    inPlace = part && part->shards.size() == S;
+    if (inPlace)
+      shardOf = part->shardOf;
+  }
+  if (!inPlace) {
+    size_t rows = 0, s = 0;
+    for (size_t npa = 0; npa < NPA_ROUTES; ++npa) {
+      shardOf[npa] = s;
+      for (size_t c = 0; c < C; ++c)
+        rows += npaCount[c * NPA_ROUTES + npa];
+      while (s + 1 < S && rows >= N * (s + 1) / S)
+        ++s;
+    }
+  }
+
+  // Place rows of every chunk one after another within every shard
+  std::vector<size_t> offset(C * S);
+  std::vector<size_t> shardBegin(S + 1);
+  for (size_t c = 0; c < C; ++c)
+    for (size_t npa = 0; npa < NPA_ROUTES; ++npa)
+      offset[c * S + shardOf[npa]] += npaCount[c * NPA_ROUTES + npa];
+  size_t total = 0;
+  for (size_t s = 0; s < S; ++s) {
+    shardBegin[s] = total;
+    for (size_t c = 0; c < C; ++c) {
+      size_t count = offset[c * S + s];
+      offset[c * S + s] = total;
+      total += count;
+    }
+  }
+  shardBegin[S] = total;
+  auto shardRows = [&](size_t c, size_t s) {
+    return (c < C ? offset[c * S + s] : shardBegin[s + 1]) - shardBegin[s];
+  };
+
+  // Copy rows into shards keeping input order, a few chunks at a time.
+  // Input pages already copied are given back, so input and shards
+  // together hold about one copy of rows.
+  std::vector<std::unique_ptr<Data>> split(S);
+  for (size_t s = 0; s < S; ++s) {
+    split[s] = std::make_unique<Data>();
+    split[s]->engine = input->engine;
+    split[s]->pnColumn.reserve(shardRows(C, s));
+    split[s]->rnIndex.reserve(shardRows(C, s));
+    split[s]->inputRows.reserve(shardRows(C, s));
+  }
+  for (size_t lo = 0; lo < C; lo += SHARD_COPY_CHUNKS) {
+    size_t hi = std::min(C, lo + SHARD_COPY_CHUNKS);
+    for (size_t s = 0; s < S; ++s) {
+      split[s]->pnColumn.resize(shardRows(hi, s));
+      split[s]->rnIndex.resize(shardRows(hi, s));
+      split[s]->inputRows.resize(shardRows(hi, s));
+    }
+    parallelFor(hi - lo, [&](size_t k) {
+      size_t c = lo + k;
+      std::array<size_t, MAX_SHARDS> pos;
+      for (size_t s = 0; s < S; ++s)
+        pos[s] = shardRows(c, s);
+      for (size_t i = chunkBegin(c); i < chunkBegin(c + 1); ++i) {
+        uint64_t pn = input->pnColumn[i].phone;
+        Data &shard = *split[shardOf[npaRoute(pn)]];
+        size_t &j = pos[shardOf[npaRoute(pn)]];
+        shard.pnColumn[j] = PhoneList{pn, MAXROWS};
+        shard.rnIndex[j] = input->rnIndex[i];
+        shard.inputRows[j++] = i;
+      }
+    });
+    discardLarge(input->pnColumn.data(), chunkBegin(hi) * sizeof(PhoneList));
+    discardLarge(input->rnIndex.data(), chunkBegin(hi) * sizeof(PhoneList));
+  }
+  LargeVector<PhoneList>().swap(input->pnColumn);
+  LargeVector<PhoneList>().swap(input->rnIndex);
+
+  // Reject bad rows before the first shard is swapped, so they leave the
+  // loaded partition as it is. Errors match those of build().
+  uint64_t duplicate = MAXROWS;
+  bool outOfRange = false;
+  for (size_t s = 0; s < S; ++s) {
+    duplicate = std::min(duplicate, checkShardRows(*split[s], outOfRange));
+    std::vector<uint32_t>().swap(split[s]->inputRows);
+  }
+  if (duplicate != MAXROWS)
+    throw duplicateKey(duplicate);
+  if (outOfRange)
+    throw std::runtime_error("PhoneMapping::Builder: key is not a 10-digit number");
+
+  std::vector<std::shared_ptr<const Data>> built(S);
+  for (size_t s = 0; s < S; ++s) {
+    std::unique_ptr<Data> shard = std::move(split[s]);
+    shard->build();
+    shard->collectNpas();
+
+    if (!inPlace) {
+      built[s] = std::move(shard);
+      continue;
+    }
+
+    // Swap the shard and reclaim the old one before building the next
+    {
+      std::lock_guard<std::mutex> lock(nanpCommitMutex);
+      const NanpMapping::Data *current = global.load();
+      const Data *part = current ? current->parts[size_t(country)].get() : nullptr;
+      if (!part || part->shards.size() != S || part->shardOf != shardOf)
+        throw std::runtime_error("PhoneMapping: partition was replaced while reloading");
+      auto recruit = copyShards(*part);
+      recruit->shards[s] = std::move(shard);
+      recruit->joinShards();
+      replacePart(global, country, std::move(recruit));
+    }
+    folly::hazptr_cleanup();
+    waitReclaimed();
+  }
+
+  auto data = std::make_unique<Data>();
+  data->meta = std::move(input->meta);
+  data->engine = input->engine;
+  data->shardOf = shardOf;
+  input.reset();
+
+  std::lock_guard<std::mutex> lock(nanpCommitMutex);
+  const NanpMapping::Data *current = global.load();
+  const Data *part = current ? current->parts[size_t(country)].get() : nullptr;
+  if (inPlace) {
+    if (!part || part->shards.size() != S || part->shardOf != shardOf)
+      throw std::runtime_error("PhoneMapping: partition was replaced while reloading");
+    data->shards = part->shards;
+  } else {
+    data->shards = std::move(built);
+  }
+  data->overlay = keptOverlay(part);
+  data->joinShards();
+
+  size_t pn_count = data->numRows;
+  replacePart(global, country, std::move(data));
+  LOG(INFO) << "Database updated: PNs=" << pn_count << " shards=" << S;
+}
+
+void PhoneMapping::Builder::commit(std::atomic<NanpMapping::Data*> &global,
+                                   NanpMapping::Country country) {
   auto data = std::make_unique<Data>();
   std::swap(data, data_);
+  if (FLAGS_mapping_shards > 1 && !data->snapshot) {
+    commitShards(std::move(data), global, country);
+    return;
+  }
+
+  // Shards of a sharded snapshot are mapped and indexed already
+  size_t S = data->shards.size();
+  if (S == 0) {
+    data->build();
+    data->collectNpas();
+  }
+
+  size_t pn_count = data->numRows;
+  size_t rn_count = data->rnRows.size();
+
+  std::lock_guard<std::mutex> lock(nanpCommitMutex);
+  const NanpMapping::Data *current = global.load();
+  data->overlay = keptOverlay(current ? current->parts[size_t(country)].get() : nullptr);
+  replacePart(global, country, std::move(data));
+  if (S > 0)
+    LOG(INFO) << "Database updated: PNs=" << pn_count << " shards=" << S;
+  else
+    LOG(INFO) << "Database updated: PNs=" << pn_count << " RNs=" << rn_count;
+}
+
+/** Index rows as changes to a mapping without NPA shards, see commitDelta().
+  * Adds number of changed rows to `delta_count`. */
+static std::unique_ptr<PhoneMapping::Data>
+applyDelta(std::unique_ptr<PhoneMapping::Data> data,
+           const std::shared_ptr<const PhoneMapping::Data> &part,
+           size_t &delta_count) {
+  // Deltas don't stack, the new one is merged with the older
+  if (part->base)
+    data->mergeDelta(*part);
+  data->base = part->base ? part->base : part;
+
+  folly::dynamic deltaMeta = std::move(data->meta);
+  data->meta = folly::dynamic::object();
+  if (data->base->meta.isObject())
+    data->meta = data->base->meta;
+  data->meta["delta"] = std::move(deltaMeta);
+  data->engine = PhoneMapping::Engine::F14;
   data->build();
+  data->countDeltaRows();
 
-  size_t pn_count = data->pnColumn.size();
-  size_t rn_count = data->rnIndex.size();
-  if (Data *veteran = global.exchange(data.release()))
-    veteran->retire();
-  LOG(INFO) << "Database updated: PNs=" << pn_count << " RNs=" << rn_count;
+  size_t rows = data->pnRows.size();
+  delta_count += rows;
+  if (rows > FLAGS_delta_compact_ratio * data->base->numRows) {
+    LOG(INFO) << "Compacting delta (" << rows << " rows)...";
+    data = data->compact();
+  }
+  data->collectNpas();
+  return data;
+}
+
+/** Apply delta to a country partition, see Builder::commitDelta(). Rows
+  * from the overlay are given as `folded`, the result then gets the overlay
+  * without them in place of the loaded one. */
+static void publishDelta(std::atomic<NanpMapping::Data*> &global, NanpMapping::Country country,
+                         std::unique_ptr<PhoneMapping::Data> delta,
+                         std::vector<std::pair<uint64_t, uint64_t>> *folded) {
+  using Data = PhoneMapping::Data;
+
+  // Hold the lock while building, delta must apply to the current version
+  std::lock_guard<std::mutex> lock(nanpCommitMutex);
+  const NanpMapping::Data *current = global.load();
+  std::shared_ptr<const Data> part = current ? current->parts[size_t(country)] : nullptr;
+  if (!part)
+    throw std::runtime_error("PhoneMapping: no mapping to apply delta to");
+
+  std::unique_ptr<Data> data;
+  size_t delta_count = 0;
+  if (part->shards.empty()) {
+    data = applyDelta(std::move(delta), part, delta_count);
+  } else {
+    // Every shard gets its own delta, the rest are shared as is
+    std::vector<std::unique_ptr<Data>> split(part->shards.size());
+    for (size_t i = 0; i < delta->pnColumn.size(); ++i) {
+      auto &shard = split[part->shardOf[npaRoute(delta->pnColumn[i].phone)]];
+      if (!shard)
+        shard = std::make_unique<Data>();
+      shard->pnColumn.push_back(delta->pnColumn[i]);
+      shard->rnIndex.push_back(delta->rnIndex[i]);
+      shard->inputRows.push_back(i);
+    }
+
+    data = copyShards(*part);
+    for (size_t s = 0; s < split.size(); ++s)
+      if (split[s])
+        data->shards[s] = applyDelta(std::move(split[s]), part->shards[s], delta_count);
+    data->joinShards();
+    if (!data->meta.isObject())
+      data->meta = folly::dynamic::object();
+    data->meta["delta"] = std::move(delta->meta);
+  }
+  data->overlay = folded ? part->overlay->fold(std::move(*folded)) : part->overlay;
+
+  size_t pn_count = data->numRows;
+  replacePart(global, country, std::move(data));
+  LOG(INFO) << "Database updated: PNs=" << pn_count << " delta=" << delta_count;
+}
+
+void PhoneMapping::Builder::commitDelta(std::atomic<NanpMapping::Data*> &global,
+                                        NanpMapping::Country country) {
+  auto delta = std::make_unique<Data>();
+  std::swap(delta, data_);
+  publishDelta(global, country, std::move(delta), nullptr);
+}
+
+bool PhoneMapping::port(std::atomic<NanpMapping::Data*> &global,
+                        NanpMapping::Country country, uint64_t pn, uint64_t rn) {
+  std::shared_ptr<PortOverlay> overlay;
+  bool routed;
+  {
+    folly::hazptr_holder<> holder;
+    const NanpMapping::Data *nanp = holder.get_protected(global);
+    const auto *part = nanp ? nanp->parts[size_t(country)].get() : nullptr;
+    if (!part || !part->overlay)
+      throw std::runtime_error("PhoneMapping: no mapping to port number in");
+
+    overlay = part->overlay;
+    overlay->put(pn, rn);
+    routed = nanp->routes[npaRoute(pn)] & (1 << size_t(country));
+  }
+
+  // Republish the view routing the new NPA to the partition
+  if (!routed && rn != PhoneNumber::NONE) {
+    std::lock_guard<std::mutex> lock(nanpCommitMutex);
+    if (const NanpMapping::Data *current = global.load())
+      replacePart(global, country, current->parts[size_t(country)]);
+  }
+
+  // Caller runs it once, until compactOverlay() is done
+  return overlay->size() >= FLAGS_overlay_compact_rows && overlay->beginCompaction();
+}
+
+void PhoneMapping::compactOverlay(std::atomic<NanpMapping::Data*> &global,
+                                  NanpMapping::Country country) {
+  std::shared_ptr<PortOverlay> overlay;
+  {
+    std::lock_guard<std::mutex> lock(nanpCommitMutex);
+    const NanpMapping::Data *current = global.load();
+    if (current && current->parts[size_t(country)])
+      overlay = current->parts[size_t(country)]->overlay;
+  }
+  if (!overlay)
+    return;
+
+  auto changes = overlay->changes();
+  if (changes.empty()) {
+    overlay->endCompaction();
+    return;
+  }
+
+  auto delta = std::make_unique<Data>();
+  delta->meta = folly::dynamic::object("overlay_rows", changes.size());
+  for (const auto &change : changes) {
+    uint64_t rn = change.second == PortOverlay::REMOVED ? REMOVED_RN : change.second;
+    delta->pnColumn.push_back(PhoneList{change.first, MAXROWS});
+    delta->rnIndex.push_back(PhoneList{rn, MAXROWS});
+  }
+
+  // New version has the same answers, so it gets a fresh overlay with
+  // a clean filter and only the numbers changed again meanwhile. The
+  // replaced overlay stays in compaction, port() calls still holding it
+  // must not start another one.
+  try {
+    publishDelta(global, country, std::move(delta), &changes);
+  } catch (...) {
+    overlay->endCompaction();
+    throw;
+  }
 }
 
 PhoneMapping::PhoneMapping(std::unique_ptr<Data> data) {
@@ -303,15 +2061,56 @@ PhoneMapping::PhoneMapping(std::unique_ptr<Data> data) {
   data_ = data.release();
 }
 
-PhoneMapping::PhoneMapping(std::atomic<Data*> &global)
-  : data_(holder_.get_protected(global))
+PhoneMapping::PhoneMapping(std::atomic<NanpMapping::Data*> &global,
+                           NanpMapping::Country country)
 {
   CHECK(FLAGS_f14map_prefetch > 0);
+  const NanpMapping::Data *nanp = holder_.get_protected(global);
+  data_ = nanp ? nanp->parts[size_t(country)].get() : nullptr;
 }
 
 PhoneMapping::PhoneMapping(PhoneMapping&& rhs) noexcept = default;
 PhoneMapping::~PhoneMapping() noexcept = default;
 
+NanpMapping::NanpMapping(std::atomic<Data*> &global)
+  : data_(holder_.get_protected(global))
+{
+  CHECK(FLAGS_f14map_prefetch > 0);
+}
+
+NanpMapping::NanpMapping(NanpMapping&& rhs) noexcept = default;
+NanpMapping::~NanpMapping() noexcept = default;
+
+folly::dynamic NanpMapping::memoryUsage() const {
+  static const char *const COUNTRY[] = {"US", "CA"};
+  MemoryUsage usage;
+  for (size_t c = 0; data_ && c < data_->parts.size(); ++c) {
+    if (!data_->parts[c])
+      continue;
+    MemoryUsage part;
+    data_->parts[c]->memoryUsage(part);
+    usage.add(COUNTRY[c], part.total());
+  }
+  folly::dynamic ret = usage.toDynamic();
+  retiredParts.addTo(ret);
+  return ret;
+}
+
+bool NanpMapping::hasCountry(Country country) const noexcept {
+  return data_ && data_->parts[size_t(country)];
+}
+
+uint64_t NanpMapping::getRN(uint64_t pn, Country *country) const {
+  uint64_t rn;
+  getRNs(1, &pn, &rn, country);
+  return rn;
+}
+
+void NanpMapping::getRNs(size_t N, const uint64_t *pn, uint64_t *rn,
+                         Country *country) const {
+  data_->getRNs(N, pn, rn, country);
+}
+
 void PhoneMapping::printMetadata() {
   if (!data_)
     return;
@@ -321,29 +2120,63 @@ void PhoneMapping::printMetadata() {
                   << ": " << folly::toJson(kv.second);
 }
 
+void PhoneMapping::writeSnapshot(const std::string &path) const {
+  data_->writeSnapshot([&](SnapshotWriter &writer) { writer.open(path); });
+}
+
+void PhoneMapping::writeSnapshot(int fd) const {
+  data_->writeSnapshot([&](SnapshotWriter &writer) { writer.open(fd); });
+}
+
+bool PhoneMapping::writeOwnSnapshot(const std::string &path) const {
+  if (data_->hasDelta())
+    return false;
+  writeSnapshot(path);
+  return true;
+}
+
+folly::dynamic PhoneMapping::memoryUsage() const {
+  MemoryUsage usage;
+  if (data_) {
+    data_->memoryUsage(usage);
+    if (data_->overlay)
+      usage.add("overlay", data_->overlay->allocatedBytes());
+  }
+  return usage.toDynamic();
+}
+
 size_t PhoneMapping::size() const noexcept {
-  return data_->pnColumn.size();
+  return data_->numRows;
 }
 
 bool PhoneMapping::hasRow() const noexcept {
-  return !!cursor_;
+  return pos_ < size_;
 }
 
 uint64_t PhoneMapping::currentPN() const noexcept {
-  return cursor_->currentPN();
+  return pn_[pos_];
 }
 
 uint64_t PhoneMapping::currentRN() const noexcept {
-  return cursor_->currentRN();
+  return rn_[pos_];
 }
 
 PhoneMapping& PhoneMapping::advance() noexcept {
-  cursor_->advance(data_);
-  if (!cursor_->hasRow())
-    cursor_.reset();
+  if (UNLIKELY(++pos_ == size_))
+    refill();
   return *this;
 }
 
+PhoneMapping::Engine PhoneMapping::parseEngine(folly::StringPiece name) {
+  if (name == "f14")
+    return Engine::F14;
+  if (name == "mph")
+    return Engine::MPH;
+  if (name == "npanxx")
+    return Engine::NPANXX;
+  throw std::runtime_error("unknown index engine: " + name.str());
+}
+
 uint64_t PhoneNumber::fromString(folly::StringPiece s) {
   std::string digits;
 
@@ -2,16 +2,19 @@
 #define CALLFWD_PHONEMAPPING_H
 
 #include <cstdint>
+#include <array>
 #include <memory>
 #include <limits>
 #include <cstddef>
 #include <atomic>
-#include <istream>
+#include <string>
+#include <vector>
 
 #include <folly/Range.h>
 #include <folly/synchronization/HazptrHolder.h>
 
 namespace folly { struct dynamic; }
+class CSVReader;
 
 class PhoneNumber {
 public:
@@ -20,10 +23,111 @@ public:
   static uint64_t fromString(folly::StringPiece s);
 };
 
+/**
+ * US and CA mappings combined into one view. Every NPA is routed to the
+ * country having numbers in it, so a number is answered with a single
+ * hazard pointer and usually a single probe. Each country is a partition
+ * reloaded independently, the other one is shared with the old view.
+ */
+class NanpMapping {
+ public:
+  class Data; /* opaque */
+
+  /** Partition of the view, i.e. origin of a number. */
+  enum class Country : uint8_t {
+    US,
+    CA,
+    NONE,
+  };
+
+  /** Construct from global and hold protected reference. */
+  NanpMapping(std::atomic<Data*> &global);
+  /** Ensure move constructor exists */
+  NanpMapping(NanpMapping&& rhs) noexcept;
+  /** Get default instance from global variable. */
+  static NanpMapping getNANP() noexcept;
+  ~NanpMapping() noexcept;
+
+  /** Check if a country was loaded into the view. */
+  bool hasCountry(Country country) const noexcept;
+
+  /** Get bytes held by every country partition, and by partitions
+    * replaced but not reclaimed yet, see MemoryUsage. */
+  folly::dynamic memoryUsage() const;
+
+  /** Get a routing number and optionally the country it was found in.
+    * If key wasn't found returns NONE and Country::NONE. */
+  uint64_t getRN(uint64_t pn, Country *country = nullptr) const;
+
+  /** Get routing numbers and countries for a batch of keys.
+    * Faster than calling getRN() multiple times. */
+  void getRNs(size_t N, const uint64_t *pn, uint64_t *rn,
+              Country *country = nullptr) const;
+
+ private:
+  folly::hazptr_holder<> holder_;
+  const Data *data_;
+};
+
 class PhoneMapping {
  public:
   class Data; /* opaque */
-  class Cursor; /* opaque */
+
+  /** Most NPA shards of a partition, see Builder::commit(). */
+  static constexpr size_t MAX_SHARDS = 64;
+  /** Rows read ahead from every NPA shard while merging their scans. */
+  static constexpr size_t SHARD_AHEAD_ROWS = 8;
+
+  /** Position of a row scan, see scanRNs(). A plain value, valid as long
+    * as the instance which started it holds the same data. It is sized
+    * for MAX_SHARDS, so starting a scan never allocates. */
+  struct RowScan {
+    /** Rows of one layer in reverse index order. */
+    struct Stream {
+      size_t pos = 0;
+      size_t end = 0;
+
+      // where readRows() stopped decoding, saves a seek on the next call
+      size_t resumePos = 0;
+      size_t resumeWord = 0;
+      uint64_t resumeBits = 0;
+
+      bool done() const noexcept { return pos >= end; }
+    };
+
+    Stream own;   // rows of the mapping itself
+    Stream base;  // rows of the base under a delta, see commitDelta()
+
+    /** Scan of an NPA shard, see commit(), and rows read ahead from it
+      * to be merged in order with the other shards. */
+    struct Shard {
+      Stream own;
+      Stream base;
+      std::array<uint64_t, SHARD_AHEAD_ROWS> aheadPN;
+      std::array<uint64_t, SHARD_AHEAD_ROWS> aheadRN;
+      uint32_t aheadPos = 0;
+      uint32_t aheadEnd = 0;
+    };
+    std::array<Shard, MAX_SHARDS> shards;
+    size_t numShards = 0;
+    size_t liveShards = 0;
+
+    /** Are all rows read? */
+    bool done() const noexcept {
+      return own.done() && base.done() && liveShards == 0;
+    }
+  };
+
+  /** Lookup index over portability numbers. */
+  enum class Engine {
+    F14,    // general-purpose hash table
+    MPH,    // minimal perfect hash, several times smaller but slower to build
+    NPANXX, // direct bitmap per NPA-NXX block, 10-digit numbers only
+  };
+
+  /** Parse engine name as passed in metadata ("f14", "mph" or "npanxx").
+    * Throws `runtime_error` if name is unknown. */
+  static Engine parseEngine(folly::StringPiece name);
 
   class Builder {
   public:
@@ -33,29 +137,74 @@ class PhoneMapping {
     /** Attach arbitrary metadata. */
     void setMetadata(const folly::dynamic &meta);
 
+    /** Select lookup index built by build(), F14 by default. */
+    void setEngine(Engine engine);
+
     /** Preallocate memory for expected number of records. */
     void sizeHint(size_t numRecords);
 
     /** Add a new row into the scratch buffer.
-      * Throws `runtime_error` if key already exists. */
+      * Duplicate keys are detected later by build(). */
     Builder& addRow(uint64_t pn, uint64_t rn);
 
-    /** Add many rows from CSV text stream. */
-    void fromCSV(std::istream &in, size_t& line, size_t limit);
+    /** Remove a key of the base mapping, see commitDelta(). */
+    Builder& removeRow(uint64_t pn);
 
-    /** Build indexes and release the data. */
+    /** Add up to `limit` rows from CSV text stream, parsed in parallel.
+      * `line` counts rows read, so on error the bad one is line + 1. */
+    void fromCSV(CSVReader &in, size_t& line, size_t limit);
+
+    /** Same as fromCSV() for a delta file, where a row without routing
+      * number ("pn," or just "pn") removes the key. */
+    void deltaFromCSV(CSVReader &in, size_t& line, size_t limit);
+
+    /** Map a binary snapshot written by PhoneMapping::writeSnapshot()
+      * in place of the scratch buffer. Indexes are taken from the file,
+      * NPA shards of a sharded one are committed as they are.
+      * Throws `runtime_error` if snapshot is malformed. */
+    void fromSnapshot(const std::string &path);
+
+    /** Build indexes and release the data. Throws `runtime_error`
+      * with line number of the first repeated key, counting input rows
+      * from 1 the way fromCSV() reads them. */
     PhoneMapping build();
 
-    /** Build indexes and commit data to global. */
-    void commit(std::atomic<Data*> &global);
+    /** Build indexes and replace a country partition of NANP global.
+      * Throws `runtime_error` the same as build().
+      *
+      * The partition is split into --mapping_shards ranges of NPA built
+      * one after another. If the loaded partition has the same number of
+      * shards, its ranges are kept and every shard is swapped and
+      * reclaimed as soon as its replacement is built, so reload needs
+      * memory for input rows and one shard on top of the loaded mapping.
+      * Rows of every shard are checked before the first swap, so repeated
+      * or out of range keys leave the loaded partition as it is. If
+      * building a shard fails otherwise, shards swapped before stay, each
+      * NPA is answered either from the old or from the new rows.
+      * Changes made by port() and not yet folded are kept. */
+    void commit(std::atomic<NanpMapping::Data*> &global,
+                NanpMapping::Country country);
+
+    /** Apply rows as changes to a country partition of NANP global.
+      * Only the changes are indexed, the partition is shared as the base
+      * of the result, and a delta committed before is merged with this
+      * one. Once delta outgrows --delta_compact_ratio of the base, both
+      * are folded into a full rebuild. Throws `runtime_error` the same
+      * as build() or if the partition isn't loaded. */
+    void commitDelta(std::atomic<NanpMapping::Data*> &global,
+                     NanpMapping::Country country);
   private:
+    void readCSV(CSVReader &in, size_t& line, size_t limit, bool delta);
+
     std::unique_ptr<Data> data_;
   };
 
   /** Construct taking ownership of Data. Used for tests. */
   PhoneMapping(std::unique_ptr<Data> data);
-  /** Construct from globals and hold protected reference. */
-  PhoneMapping(std::atomic<Data*> &global);
+  /** Construct from a country partition of NANP global
+    * and hold protected reference. */
+  PhoneMapping(std::atomic<NanpMapping::Data*> &global,
+               NanpMapping::Country country);
   /** Ensure move constructor exists */
   PhoneMapping(PhoneMapping&& rhs) noexcept;
   /** Get default US instance from global variable. */
@@ -64,6 +213,22 @@ class PhoneMapping {
   static PhoneMapping getCA() noexcept;
   /** Check if DB fully loaded into memory. */
   static bool isAvailable() noexcept;
+
+  /** Change routing number of a number in a country partition of NANP
+    * global, visible to lookups right away. NONE as `rn` removes the
+    * number. Reverse lookups see changes once they are folded into the
+    * partition by compactOverlay(), full reload keeps them. Returns true
+    * once there are --overlay_compact_rows of them, then the caller must
+    * run compactOverlay() in background, and no other call returns true
+    * until it is done. Throws `runtime_error` if the partition isn't
+    * loaded. */
+  static bool port(std::atomic<NanpMapping::Data*> &global,
+                   NanpMapping::Country country, uint64_t pn, uint64_t rn);
+
+  /** Fold changes made by port() into the partition with commitDelta().
+    * Throws `runtime_error` the same as commitDelta(). */
+  static void compactOverlay(std::atomic<NanpMapping::Data*> &global,
+                             NanpMapping::Country country);
   ~PhoneMapping() noexcept;
 
   /** Get total number of records */
@@ -72,6 +237,25 @@ class PhoneMapping {
   /** Log metadata to system journal */
   void printMetadata();
 
+  /** Get bytes held by dict, columns, indexes and metadata of the
+    * mapping with its base and shards, see MemoryUsage. */
+  folly::dynamic memoryUsage() const;
+
+  /** Write the whole mapping with prebuilt lookup index into a file
+    * suitable for Builder::fromSnapshot(), NPA shards one after another.
+    * The file replaces path once complete, so a snapshot mapped from path
+    * stays intact. */
+  void writeSnapshot(const std::string &path) const;
+
+  /** Same, written in place into empty regular file open as fd. */
+  void writeSnapshot(int fd) const;
+
+  /** Same as writeSnapshot(path) if neither the mapping nor any of its
+    * NPA shards is a delta on top of another, so columns are written as
+    * they are. Otherwise returns false and writes nothing, where
+    * writeSnapshot() would first build a copy of the whole table. */
+  bool writeOwnSnapshot(const std::string &path) const;
+
   /** Get a routing number from portability number.
     * If key wasn't found returns NONE. */
   uint64_t getRN(uint64_t pn) const;
@@ -80,12 +264,24 @@ class PhoneMapping {
     * Faster than calling getRN() multiple times. */
   void getRNs(size_t N, const uint64_t *pn, uint64_t *rn) const;
 
-  /** Select rows by routing number prefix.
+  /** Start scan of rows with routing number in [fromRN, toRN).
+    * Rows come sorted by routing number, then by portability number. */
+  RowScan scanRNs(uint64_t fromRN, uint64_t toRN) const noexcept;
+
+  /** Start scan of all rows, in the same order as with scanRNs(). */
+  RowScan scanRows() const noexcept;
+
+  /** Read up to N next rows of the scan into caller's arrays and advance
+    * it. Returns number of rows read, 0 once the scan is done. */
+  size_t readRows(RowScan &scan, size_t N, uint64_t *pn, uint64_t *rn) const noexcept;
+
+  /** Select rows by routing number prefix, see scanRNs().
     * Use cursor methods to retrieve relevent rows. */
   PhoneMapping& inverseRNs(uint64_t fromRN, uint64_t toRN) &;
   PhoneMapping&& inverseRNs(uint64_t fromRN, uint64_t toRN) &&;
 
-  /** Select all rows. Use cursor methods to retrieve relevent rows.*/
+  /** Select all rows, see scanRows().
+    * Use cursor methods to retrieve relevent rows. */
   PhoneMapping& visitRows() &;
   PhoneMapping&& visitRows() &&;
 
@@ -102,9 +298,19 @@ class PhoneMapping {
   PhoneMapping& advance() noexcept;
 
  private:
+  void refill() noexcept;
+
+  static constexpr unsigned CURSOR_ROWS = 8;
+
   folly::hazptr_holder<> holder_;
   const Data *data_;
-  std::unique_ptr<Cursor> cursor_;
+  // cursor state: rows left to read and the buffered ones, the scan is
+  // kept apart as it is large and only the cursor methods need it
+  std::unique_ptr<RowScan> scan_;
+  std::array<uint64_t, CURSOR_ROWS> pn_;
+  std::array<uint64_t, CURSOR_ROWS> rn_;
+  unsigned pos_ = 0;
+  unsigned size_ = 0;
 };
 
 #endif // CALLFWD_PHONEMAPPING_H
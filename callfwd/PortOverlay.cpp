@@ -0,0 +1,86 @@
+#include "PortOverlay.h"
+#include "BatchHash.h"
+
+#include <algorithm>
+
+constexpr uint64_t PortOverlay::REMOVED;
+constexpr unsigned PortOverlay::FILTER_BITS;
+
+size_t PortOverlay::filterBit(uint64_t pn) noexcept {
+  return mixHash(pn) >> (64 - FILTER_BITS);
+}
+
+bool PortOverlay::mayContain(uint64_t pn) const noexcept {
+  size_t bit = filterBit(pn);
+  return filter_[bit / 64].load(std::memory_order_acquire) & (uint64_t(1) << (bit % 64));
+}
+
+void PortOverlay::setFilterBit(uint64_t pn) noexcept {
+  size_t bit = filterBit(pn);
+  filter_[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_release);
+}
+
+void PortOverlay::put(uint64_t pn, uint64_t rn) {
+  // Set filter bit first, so readers never skip a key present in map
+  setFilterBit(pn);
+  if (map_.insert_or_assign(pn, rn).second)
+    size_.fetch_add(1, std::memory_order_release);
+
+  // Pairs with the fence in fold(): either it copies this change,
+  // or we see the new overlay and put it there ourselves
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (PortOverlay *next = forward_.load(std::memory_order_relaxed))
+    next->put(pn, rn);
+}
+
+std::shared_ptr<PortOverlay> PortOverlay::fold(std::vector<std::pair<uint64_t, uint64_t>> folded) {
+  next_ = std::make_shared<PortOverlay>();
+  forward_.store(next_.get(), std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  std::sort(folded.begin(), folded.end());
+  for (const auto &kv : map_) {
+    std::pair<uint64_t, uint64_t> change(kv.first, kv.second);
+    if (std::binary_search(folded.begin(), folded.end(), change))
+      continue;
+    // A forwarded put is newer than what we read here
+    next_->setFilterBit(change.first);
+    if (next_->map_.insert(change.first, change.second).second)
+      next_->size_.fetch_add(1, std::memory_order_release);
+  }
+  return next_;
+}
+
+size_t PortOverlay::allocatedBytes() const noexcept {
+  // Node holds key, value, hazptr links and a bucket slot
+  static constexpr size_t NODE_BYTES = 64;
+  return sizeof(*this) + size() * NODE_BYTES;
+}
+
+void PortOverlay::patch(size_t N, const uint64_t *pn, uint64_t *rn) const {
+  if (empty())
+    return;
+  for (size_t i = 0; i < N; ++i) {
+    if (!mayContain(pn[i]))
+      continue;
+    auto it = map_.find(pn[i]);
+    if (it != map_.cend())
+      rn[i] = it->second;
+  }
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> PortOverlay::changes() const {
+  std::vector<std::pair<uint64_t, uint64_t>> ret;
+  ret.reserve(size());
+  for (const auto &kv : map_)
+    ret.emplace_back(kv.first, kv.second);
+  return ret;
+}
+
+bool PortOverlay::beginCompaction() noexcept {
+  return !compacting_.exchange(true, std::memory_order_acquire);
+}
+
+void PortOverlay::endCompaction() noexcept {
+  compacting_.store(false, std::memory_order_release);
+}
@@ -0,0 +1,79 @@
+#ifndef CALLFWD_PORTOVERLAY_H
+#define CALLFWD_PORTOVERLAY_H
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+/**
+ * Small pn->rn map of recent changes in front of an immutable mapping,
+ * in the manner of LSM memtable. Writers may run concurrently, readers
+ * are lock-free: the map is folly::ConcurrentHashMap protected by hazard
+ * pointers. Bitmap of key hashes lets lookups skip the map for keys never
+ * changed, and the whole probe is a single load while overlay is empty.
+ * Once changes are folded into the mapping, a fresh overlay with a clean
+ * bitmap takes the place of this one, see fold().
+ */
+class PortOverlay {
+ public:
+  /** Value of a removed key, same as PhoneNumber::NONE. */
+  static constexpr uint64_t REMOVED = std::numeric_limits<uint64_t>::max();
+
+  /** Set routing number of a key, REMOVED hides the key below. */
+  void put(uint64_t pn, uint64_t rn);
+
+  /** Make overlay for the mapping with `folded` changes applied, holding
+    * the rest and whatever was changed again since. Writers still holding
+    * this one reach the new overlay as well, so no change is lost while
+    * it replaces this one. Called once, under compaction. */
+  std::shared_ptr<PortOverlay> fold(std::vector<std::pair<uint64_t, uint64_t>> folded);
+
+  /** Is there any change? */
+  bool empty() const noexcept {
+    return size_.load(std::memory_order_acquire) == 0;
+  }
+
+  /** Get number of changes. */
+  size_t size() const noexcept {
+    return size_.load(std::memory_order_acquire);
+  }
+
+  /** Estimate bytes held, the map allocates a node per change. */
+  size_t allocatedBytes() const noexcept;
+
+  /** Replace rn of every changed key in a batch. */
+  void patch(size_t N, const uint64_t *pn, uint64_t *rn) const;
+
+  /** Copy all changes. */
+  std::vector<std::pair<uint64_t, uint64_t>> changes() const;
+
+  /** Take exclusive right to fold changes into the mapping.
+    * Returns false if someone else holds it. */
+  bool beginCompaction() noexcept;
+  void endCompaction() noexcept;
+
+ private:
+  static constexpr unsigned FILTER_BITS = 16;
+
+  static size_t filterBit(uint64_t pn) noexcept;
+  bool mayContain(uint64_t pn) const noexcept;
+  void setFilterBit(uint64_t pn) noexcept;
+
+  folly::ConcurrentHashMap<uint64_t, uint64_t> map_;
+  // bits of keys ever put, never cleared: overlay is replaced instead
+  std::array<std::atomic<uint64_t>, (1 << FILTER_BITS) / 64> filter_{};
+  // overlay made by fold(), owned here so forwarding never dangles
+  std::shared_ptr<PortOverlay> next_;
+  std::atomic<PortOverlay*> forward_{nullptr};
+  std::atomic<size_t> size_{0};
+  std::atomic<bool> compacting_{false};
+};
+
+#endif // CALLFWD_PORTOVERLAY_H
@@ -0,0 +1,143 @@
+#include "Reclaimer.h"
+#include "HugePages.h"
+
+#include <malloc.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <glog/logging.h>
+#include <folly/portability/GFlags.h>
+
+DEFINE_bool(reclaim_thread, true,
+            "Destroy retired datasets on a dedicated thread");
+DEFINE_uint32(reclaim_chunk_mb, 64,
+              "Unmap large blocks of retired datasets by chunks of this size, "
+              "0 unmaps a block at once");
+DEFINE_uint32(reclaim_duty_percent, 25,
+              "Share of time the reclaimer thread spends unmapping, "
+              "it sleeps between chunks for the rest");
+DEFINE_bool(reclaim_purge, true,
+            "Give free heap memory back to the OS after reclaiming a version");
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Retired {
+  void *obj;
+  void (*destroy)(void *obj);
+  size_t bytes;
+  Clock::time_point since;
+};
+
+// Never destroyed, versions may be retired after static destructors ran
+struct Reclaimer {
+  std::mutex mutex;
+  std::condition_variable wake;  // a version was passed
+  std::condition_variable done;  // a version was destroyed
+  std::deque<Retired> queue;     // the front one is being destroyed
+  size_t pendingBytes = 0;
+  size_t frontBytes = 0;         // not given back by the front one yet
+  uint64_t passed = 0;
+  uint64_t reclaimed = 0;
+  uint64_t reclaimedBytes = 0;
+};
+
+} // namespace
+
+static void run(Reclaimer &r);
+
+static Reclaimer& reclaimer() {
+  static Reclaimer *instance = [] {
+    Reclaimer *r = new Reclaimer;
+    std::thread([r] { run(*r); }).detach();
+    return r;
+  }();
+  return *instance;
+}
+
+// When the reclaimer thread resumed after sleeping
+static Clock::time_point resumed;
+
+/** Count a chunk given back and sleep to keep the duty cycle. */
+static void pause(size_t bytes) {
+  Reclaimer &r = reclaimer();
+  {
+    std::lock_guard<std::mutex> lock(r.mutex);
+    size_t n = std::min(bytes, r.frontBytes);
+    r.frontBytes -= n;
+    r.pendingBytes -= n;
+  }
+
+  unsigned duty = std::min(std::max(FLAGS_reclaim_duty_percent, 1u), 100u);
+  Clock::duration busy = Clock::now() - resumed;
+  std::this_thread::sleep_for(busy * (100 - duty) / duty);
+  resumed = Clock::now();
+}
+
+static void run(Reclaimer &r) {
+  std::unique_lock<std::mutex> lock(r.mutex);
+  for (;;) {
+    r.wake.wait(lock, [&] { return !r.queue.empty(); });
+    Retired front = r.queue.front();
+    r.frontBytes = front.bytes;
+    lock.unlock();
+
+    releaseLargeInChunks(size_t(FLAGS_reclaim_chunk_mb) << 20, pause);
+    resumed = Clock::now();
+    front.destroy(front.obj);
+    if (FLAGS_reclaim_purge)
+      malloc_trim(0);
+    std::chrono::duration<double> lag = Clock::now() - front.since;
+    LOG_IF(INFO, front.bytes > 0) << "Reclaimed " << front.bytes
+                                  << " bytes in " << lag.count() << "s";
+
+    lock.lock();
+    r.pendingBytes -= r.frontBytes;
+    r.frontBytes = 0;
+    r.queue.pop_front();
+    r.reclaimed++;
+    r.reclaimedBytes += front.bytes;
+    r.done.notify_all();
+  }
+}
+
+void reclaimLater(void *obj, void (*destroy)(void *obj), size_t bytes) {
+  if (!FLAGS_reclaim_thread) {
+    destroy(obj);
+    if (FLAGS_reclaim_purge)
+      malloc_trim(0);
+    return;
+  }
+
+  Reclaimer &r = reclaimer();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.queue.push_back({obj, destroy, bytes, Clock::now()});
+  r.pendingBytes += bytes;
+  r.passed++;
+  r.wake.notify_one();
+}
+
+void waitReclaimed() {
+  Reclaimer &r = reclaimer();
+  std::unique_lock<std::mutex> lock(r.mutex);
+  uint64_t passed = r.passed;
+  r.done.wait(lock, [&] { return r.reclaimed >= passed; });
+}
+
+ReclaimerStats reclaimerStats() {
+  Reclaimer &r = reclaimer();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  ReclaimerStats ret;
+  ret.pendingVersions = r.queue.size();
+  ret.pendingBytes = r.pendingBytes;
+  if (!r.queue.empty())
+    ret.lagSeconds = std::chrono::duration<double>(
+      Clock::now() - r.queue.front().since).count();
+  ret.reclaimedVersions = r.reclaimed;
+  ret.reclaimedBytes = r.reclaimedBytes;
+  return ret;
+}
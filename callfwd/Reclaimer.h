@@ -0,0 +1,44 @@
+#ifndef CALLFWD_RECLAIMER_H
+#define CALLFWD_RECLAIMER_H
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Retired versions of datasets are destroyed on a dedicated thread
+ * instead of the one which happens to reclaim hazard pointers, often an
+ * IO thread serving requests. The reclaimer unmaps large blocks by
+ * --reclaim_chunk_mb and sleeps between chunks to stay within
+ * --reclaim_duty_percent of a CPU. Small objects of a version are in its
+ * Arena, and whatever it freed into the heap is trimmed after it.
+ */
+
+/** Destroy obj holding about `bytes` on the reclaimer thread, or right
+  * away without --reclaim_thread. */
+void reclaimLater(void *obj, void (*destroy)(void *obj), size_t bytes);
+
+/** Wait until versions passed to reclaimLater() before are destroyed.
+  * Must not be called by destructors of the versions. */
+void waitReclaimed();
+
+/** Deleter of hazptr_obj_base, destroys T on the reclaimer thread. */
+template <class T>
+struct ReclaimLater {
+  void operator()(T *obj) const {
+    reclaimLater(obj, [](void *p) { delete static_cast<T*>(p); },
+                 obj->retiredBytes);
+  }
+};
+
+struct ReclaimerStats {
+  size_t pendingVersions = 0;  // waiting or being destroyed
+  size_t pendingBytes = 0;     // not given back yet
+  double lagSeconds = 0;       // since the oldest pending version was passed
+  uint64_t reclaimedVersions = 0;
+  uint64_t reclaimedBytes = 0;
+};
+
+/** Get state of the reclaimer thread. */
+ReclaimerStats reclaimerStats();
+
+#endif // CALLFWD_RECLAIMER_H
@@ -0,0 +1,226 @@
+#include "ReloadScheduler.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+#include <glog/logging.h>
+#include <folly/json.h>
+#include <folly/portability/GFlags.h>
+
+DEFINE_uint32(reload_jobs, 2,
+              "Number of dataset loads running at once, others are queued, "
+              "0 takes one per CPU");
+DEFINE_uint32(reload_memory_mb, 0,
+              "Estimated peak memory of dataset loads running at once, "
+              "0 takes half of physical memory");
+
+static constexpr size_t FINISHED_KEPT = 16;
+
+static size_t memoryBudgetFromFlags() {
+  if (FLAGS_reload_memory_mb)
+    return size_t(FLAGS_reload_memory_mb) << 20;
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || pageSize <= 0)
+    return 0;
+  return size_t(pages) * size_t(pageSize) / 2;
+}
+
+template <class Duration>
+static double toSeconds(Duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+ReloadScheduler::ReloadScheduler(std::function<bool()> primaryReady)
+  : ReloadScheduler(FLAGS_reload_jobs, memoryBudgetFromFlags(),
+                    std::move(primaryReady))
+{}
+
+ReloadScheduler::ReloadScheduler(unsigned maxJobs, size_t memoryBudget,
+                                 std::function<bool()> primaryReady)
+  : maxJobs_(maxJobs ? maxJobs : std::max(std::thread::hardware_concurrency(), 1u))
+  , memoryBudget_(memoryBudget)
+  , primaryReady_(std::move(primaryReady))
+{
+  // No more jobs run at once than there are threads
+  workers_.reserve(maxJobs_);
+  for (unsigned i = 0; i < maxJobs_; ++i)
+    workers_.emplace_back([this] { work(); });
+}
+
+ReloadScheduler::~ReloadScheduler() {
+  waitIdle();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake_.notify_all();
+  for (std::thread &worker : workers_)
+    worker.join();
+}
+
+uint64_t ReloadScheduler::submit(Job job) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t id = nextId_++;
+  auto key = std::make_pair(job.priority, id);
+  Entry &entry = queue_[key];
+  entry.id = id;
+  entry.job = std::move(job);
+  entry.queued = Clock::now();
+
+  schedule();
+  auto it = queue_.find(key);
+  if (it != queue_.end())
+    LOG(INFO) << "Queued " << it->second.job.name << " (job " << id
+              << ", ~" << (it->second.job.memoryBytes >> 20) << "MB), waiting for "
+              << it->second.blocked;
+  return id;
+}
+
+void ReloadScheduler::schedule() {
+  // Startup lasts while primary datasets are missing and some are coming
+  bool startup = false;
+  if (primaryReady_ && !primaryReady_()) {
+    for (auto &kv : running_)
+      startup |= kv.second.job.priority == 0;
+    for (auto &kv : queue_)
+      startup |= kv.second.job.priority == 0;
+  }
+
+  std::set<std::string> busy;
+  for (auto &kv : running_)
+    busy.insert(kv.second.job.dataset);
+
+  // Once a job waits for memory, later ones wait behind it, so a large
+  // build is not starved by a stream of smaller ones
+  bool stalled = false;
+  for (auto it = queue_.begin(); it != queue_.end(); ) {
+    Entry &entry = it->second;
+    const Job &job = entry.job;
+    if (!busy.insert(job.dataset).second)
+      entry.blocked = "dataset";
+    else if (startup && job.priority != 0)
+      entry.blocked = "startup";
+    else if (stalled)
+      entry.blocked = "memory";
+    else if (running_.size() >= maxJobs_)
+      entry.blocked = "jobs";
+    else if (memoryBudget_ && !running_.empty() &&
+             reserved_ + job.memoryBytes > memoryBudget_) {
+      entry.blocked = "memory";
+      stalled = true;
+    } else {
+      LOG_IF(WARNING, memoryBudget_ && job.memoryBytes > memoryBudget_)
+        << job.name << " (job " << entry.id << ") exceeds memory budget, running it alone";
+      Entry *started = &running_.emplace(entry.id, std::move(entry)).first->second;
+      it = queue_.erase(it);
+      started->started = Clock::now();
+      started->blocked = "";
+      reserved_ += started->job.memoryBytes;
+      started_.push_back(started);
+      wake_.notify_one();
+      continue;
+    }
+    ++it;
+  }
+}
+
+void ReloadScheduler::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wake_.wait(lock, [&] { return stopping_ || !started_.empty(); });
+    if (started_.empty())
+      return;
+    Entry *entry = started_.front();
+    started_.pop_front();
+    lock.unlock();
+    execute(entry);
+    lock.lock();
+  }
+}
+
+void ReloadScheduler::execute(Entry *entry) {
+  const Job &job = entry->job;
+  double queuedSeconds = toSeconds(entry->started - entry->queued);
+  LOG_IF(INFO, queuedSeconds >= 1) << "Starting " << job.name << " (job " << entry->id
+                                    << ") after " << uint64_t(queuedSeconds) << "s in queue";
+
+  bool ok = false;
+  try {
+    ok = job.run();
+  } catch (std::exception &e) {
+    LOG(ERROR) << job.name << " (job " << entry->id << "): " << e.what();
+  }
+  if (job.done)
+    job.done(ok);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  finished_.push_back({ entry->id, job.name, ok, queuedSeconds,
+                        toSeconds(Clock::now() - entry->started) });
+  if (finished_.size() > FINISHED_KEPT)
+    finished_.pop_front();
+  reserved_ -= job.memoryBytes;
+  running_.erase(entry->id);
+  schedule();
+  if (running_.empty() && queue_.empty())
+    idle_.notify_all();
+}
+
+void ReloadScheduler::waitIdle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [&] { return running_.empty() && queue_.empty(); });
+}
+
+folly::dynamic ReloadScheduler::status() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Clock::time_point now = Clock::now();
+
+  auto describe = [](const Entry &entry) {
+    return folly::dynamic::object
+      ("id", entry.id)
+      ("cmd", entry.job.name)
+      ("dataset", entry.job.dataset)
+      ("memory_mb", entry.job.memoryBytes >> 20);
+  };
+
+  folly::dynamic running = folly::dynamic::array();
+  for (auto &kv : running_) {
+    folly::dynamic job = describe(kv.second);
+    job["run_seconds"] = uint64_t(toSeconds(now - kv.second.started));
+    running.push_back(std::move(job));
+  }
+
+  std::map<uint64_t, folly::dynamic> byId;
+  for (auto &kv : queue_) {
+    folly::dynamic job = describe(kv.second);
+    job["queued_seconds"] = uint64_t(toSeconds(now - kv.second.queued));
+    job["waiting_for"] = kv.second.blocked;
+    byId.emplace(kv.second.id, std::move(job));
+  }
+  folly::dynamic queued = folly::dynamic::array();
+  for (auto &kv : byId)
+    queued.push_back(std::move(kv.second));
+
+  folly::dynamic finished = folly::dynamic::array();
+  for (const Finished &job : finished_)
+    finished.push_back(folly::dynamic::object
+      ("id", job.id)
+      ("cmd", job.name)
+      ("ok", job.ok)
+      ("queued_seconds", uint64_t(job.queuedSeconds))
+      ("run_seconds", uint64_t(job.runSeconds)));
+
+  return folly::dynamic::object
+    ("max_jobs", maxJobs_)
+    ("memory_budget_mb", memoryBudget_ >> 20)
+    ("memory_reserved_mb", reserved_ >> 20)
+    ("running", std::move(running))
+    ("queued", std::move(queued))
+    ("finished", std::move(finished));
+}
+
+void ReloadScheduler::logStatus() const {
+  LOG(INFO) << "Reload jobs:";
+  for (auto kv : status().items())
+    LOG(INFO) << "  " << kv.first.asString() << ": " << folly::toJson(kv.second);
+}
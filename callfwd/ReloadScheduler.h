@@ -0,0 +1,102 @@
+#ifndef CALLFWD_RELOADSCHEDULER_H
+#define CALLFWD_RELOADSCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <folly/dynamic.h>
+
+/*
+ * Loads of datasets requested over the control socket are queued here
+ * instead of all starting at once. Admitted jobs run on a pool of
+ * --reload_jobs threads owned by the scheduler, at most one per dataset,
+ * and the estimated peak memory of running jobs stays within
+ * --reload_memory_mb. Lower priority values start first, equal ones in
+ * order of submission. Until the primary datasets are ready, jobs of
+ * other priorities also wait for every queued or running primary one.
+ */
+class ReloadScheduler {
+ public:
+  struct Job {
+    std::string name;        // command, for logs and status
+    std::string dataset;     // jobs of one dataset never overlap
+    int priority = 0;        // 0 marks primary datasets
+    size_t memoryBytes = 0;  // estimated peak memory of the build
+    std::function<bool()> run;
+    std::function<void(bool ok)> done;  // called with result of run()
+  };
+
+  /** Take limits from flags, primaryReady() tells if startup is over. */
+  explicit ReloadScheduler(std::function<bool()> primaryReady);
+
+  /** Run at most maxJobs within memoryBudget bytes, 0 jobs takes one per
+    * CPU and 0 bytes lifts the memory limit. */
+  ReloadScheduler(unsigned maxJobs, size_t memoryBudget,
+                  std::function<bool()> primaryReady = nullptr);
+
+  /** Wait for all jobs and stop the pool, none may be submitted meanwhile. */
+  ~ReloadScheduler();
+
+  /** Queue a job and start whatever fits, returns id of the job. */
+  uint64_t submit(Job job);
+
+  /** Wait until there are neither queued nor running jobs. */
+  void waitIdle();
+
+  /** Get object {"max_jobs", "memory_budget_mb", "memory_reserved_mb",
+    * "running", "queued", "finished"}, lists of jobs by submission. */
+  folly::dynamic status() const;
+
+  /** Log status() line by line. */
+  void logStatus() const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Entry {
+    uint64_t id;
+    Job job;
+    Clock::time_point queued;
+    Clock::time_point started;
+    const char *blocked = "";  // why it is still queued
+  };
+
+  struct Finished {
+    uint64_t id;
+    std::string name;
+    bool ok;
+    double queuedSeconds;
+    double runSeconds;
+  };
+
+  /** Start queued jobs which fit, lock must be held. */
+  void schedule();
+  /** Thread of the pool, runs started jobs until stopped. */
+  void work();
+  void execute(Entry *entry);
+
+  const unsigned maxJobs_;
+  const size_t memoryBudget_;
+  const std::function<bool()> primaryReady_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable idle_;
+  std::condition_variable wake_;      // job started or pool stopping
+  std::deque<Entry*> started_;        // running jobs not yet taken by pool
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+  uint64_t nextId_ = 1;
+  size_t reserved_ = 0;  // memoryBytes of running jobs
+  std::map<std::pair<int, uint64_t>, Entry> queue_;  // by (priority, id)
+  std::map<uint64_t, Entry> running_;
+  std::deque<Finished> finished_;  // recent ones, newest last
+};
+
+#endif // CALLFWD_RELOADSCHEDULER_H
@@ -130,9 +130,7 @@ class SIPHandler : public AsyncUDPSocket::ReadCallback {
     uint64_t pn = PhoneNumber::fromString(user);
     uint64_t rn = PhoneNumber::NONE;
     if (pn != PhoneNumber::NONE)
-      rn = PhoneMapping::getUS().getRN(pn);
-    if (rn == PhoneNumber::NONE)
-      rn = PhoneMapping::getCA().getRN(pn);
+      rn = NanpMapping::getNANP().getRN(pn);
 
     reply(302, "Moved Temporarily");
     if (rn != PhoneNumber::NONE) {
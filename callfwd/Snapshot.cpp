@@ -0,0 +1,187 @@
+#include "Snapshot.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <folly/Conv.h>
+
+static constexpr char SNAPSHOT_MAGIC[8] = {'C','F','W','D','S','N','A','P'};
+static constexpr size_t SNAPSHOT_ALIGN = 4096;
+
+struct SnapshotHeader {
+  char magic[8];
+  char kind[16];
+  uint32_t version;
+  uint32_t nsections;
+  uint64_t fileSize;
+};
+static_assert(sizeof(SnapshotHeader) == 40, "");
+static_assert(sizeof(SnapshotSection) == 24, "");
+
+static size_t alignUp(size_t offset) {
+  return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+SnapshotWriter::SnapshotWriter(folly::StringPiece kind, uint32_t version)
+  : kind_(kind.str())
+  , version_(version)
+{
+  if (kind_.size() >= sizeof(SnapshotHeader::kind))
+    throw std::invalid_argument("snapshot kind is too long");
+}
+
+void SnapshotWriter::addSection(uint32_t tag, size_t elemSize, size_t count) {
+  for (const SnapshotSection &s : sections_)
+    if (s.tag == tag)
+      throw std::invalid_argument("duplicate snapshot section");
+  sections_.push_back(SnapshotSection{tag, uint32_t(elemSize), 0, count});
+}
+
+void SnapshotWriter::layout() {
+  size_t offset = sizeof(SnapshotHeader) + sections_.size() * sizeof(SnapshotSection);
+  for (SnapshotSection &s : sections_) {
+    s.offset = alignUp(offset);
+    offset = s.offset + s.elemSize * s.count;
+  }
+  fileSize_ = offset;
+}
+
+void SnapshotWriter::writeHeader() {
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  memcpy(header.kind, kind_.data(), kind_.size());
+  header.version = version_;
+  header.nsections = sections_.size();
+  header.fileSize = fileSize_;
+
+  uint8_t *base = file_.writableData();
+  memcpy(base, &header, sizeof(header));
+  memcpy(base + sizeof(header), sections_.data(),
+         sections_.size() * sizeof(SnapshotSection));
+}
+
+void SnapshotWriter::open(const std::string &path) {
+  layout();
+  // Leftover of an interrupted write
+  std::string tmpPath = path + ".tmp";
+  unlink(tmpPath.c_str());
+  file_ = MappedFile::createWritable(tmpPath, fileSize_);
+  path_ = path;
+  writeHeader();
+}
+
+void SnapshotWriter::open(int fd) {
+  layout();
+  file_ = MappedFile::createWritable(fd, fileSize_);
+  writeHeader();
+}
+
+void SnapshotWriter::openMemory(int node) {
+  layout();
+  file_ = MappedFile::createAnonymous(fileSize_, node);
+  writeHeader();
+}
+
+folly::MutableByteRange SnapshotWriter::section(uint32_t tag, size_t elemSize) {
+  for (const SnapshotSection &s : sections_) {
+    if (s.tag != tag)
+      continue;
+    if (s.elemSize != elemSize)
+      throw std::invalid_argument("snapshot section type mismatch");
+    return {file_.writableData() + s.offset, s.elemSize * s.count};
+  }
+  throw std::invalid_argument("undeclared snapshot section");
+}
+
+void SnapshotWriter::commit() {
+  file_.sync();
+  file_.reset();
+  if (path_.empty())
+    return;
+
+  std::string tmpPath = path_ + ".tmp";
+  if (rename(tmpPath.c_str(), path_.c_str()) != 0)
+    throw std::system_error(errno, std::generic_category(), "rename " + path_);
+  path_.clear();
+}
+
+SnapshotReader::SnapshotReader(const std::string &path, folly::StringPiece kind,
+                               bool populate)
+  : file_(MappedFile::openReadOnly(path, populate))
+{
+  parse(kind);
+}
+
+SnapshotReader::SnapshotReader(MappedFile image, folly::StringPiece kind)
+  : file_(std::move(image))
+{
+  parse(kind);
+}
+
+void SnapshotReader::parse(folly::StringPiece kind) {
+  folly::ByteRange bytes = file_.range();
+  SnapshotHeader header;
+
+  if (bytes.size() < sizeof(header))
+    throw std::runtime_error("snapshot is truncated");
+  memcpy(&header, bytes.data(), sizeof(header));
+
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+    throw std::runtime_error("not a snapshot file");
+  if (kind.size() >= sizeof(header.kind) ||
+      memcmp(header.kind, kind.data(), kind.size()) != 0 ||
+      header.kind[kind.size()] != '\0')
+    throw std::runtime_error("snapshot of other dataset kind");
+  if (header.fileSize != bytes.size())
+    throw std::runtime_error("snapshot is truncated");
+
+  size_t tableEnd = sizeof(header) + header.nsections * sizeof(SnapshotSection);
+  if (tableEnd > bytes.size())
+    throw std::runtime_error("snapshot is truncated");
+
+  sections_.resize(header.nsections);
+  memcpy(sections_.data(), bytes.data() + sizeof(header),
+         header.nsections * sizeof(SnapshotSection));
+  for (const SnapshotSection &s : sections_) {
+    if (s.offset % SNAPSHOT_ALIGN != 0 || s.offset < tableEnd ||
+        s.offset > bytes.size() || s.elemSize == 0 ||
+        s.count > (bytes.size() - s.offset) / s.elemSize)
+      throw std::runtime_error(
+        folly::to<std::string>("snapshot section ", s.tag, " is out of bounds"));
+  }
+
+  version_ = header.version;
+  file_.willNeed();
+}
+
+bool SnapshotReader::hasSection(uint32_t tag) const noexcept {
+  for (const SnapshotSection &s : sections_)
+    if (s.tag == tag)
+      return true;
+  return false;
+}
+
+size_t SnapshotReader::sectionBytes(uint32_t fromTag, uint32_t toTag) const noexcept {
+  size_t bytes = 0;
+  for (const SnapshotSection &s : sections_)
+    if (s.tag >= fromTag && s.tag < toTag)
+      bytes += s.elemSize * s.count;
+  return bytes;
+}
+
+folly::ByteRange SnapshotReader::section(uint32_t tag, size_t elemSize) const {
+  for (const SnapshotSection &s : sections_) {
+    if (s.tag != tag)
+      continue;
+    if (s.elemSize != elemSize)
+      throw std::runtime_error(
+        folly::to<std::string>("snapshot section ", tag, " has unexpected type"));
+    return {file_.range().data() + s.offset, s.elemSize * s.count};
+  }
+  throw std::runtime_error(
+    folly::to<std::string>("snapshot section ", tag, " is missing"));
+}
@@ -0,0 +1,117 @@
+#ifndef CALLFWD_SNAPSHOT_H
+#define CALLFWD_SNAPSHOT_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <folly/Range.h>
+
+#include "MappedFile.h"
+
+/*
+ * Binary snapshot container.
+ *
+ * File starts with a fixed header and a section table. Every section is
+ * an array of trivially copyable elements aligned on a page boundary, so
+ * a reader can serve lookups right from the read-only mapping without
+ * copying. Integers are stored in native byte order.
+ */
+
+struct SnapshotSection {
+  uint32_t tag;
+  uint32_t elemSize;
+  uint64_t offset;
+  uint64_t count;
+};
+
+class SnapshotWriter {
+ public:
+  SnapshotWriter(folly::StringPiece kind, uint32_t version);
+
+  /** Declare a section of `count` elements. Must precede open(). */
+  void addSection(uint32_t tag, size_t elemSize, size_t count);
+  template <class T>
+  void addSection(uint32_t tag, size_t count) {
+    addSection(tag, sizeof(T), count);
+  }
+
+  /** Lay out declared sections and map a new file path.tmp, which
+    * commit() renames over path. Readers mapping path keep the old file. */
+  void open(const std::string &path);
+
+  /** Lay out declared sections and map empty file open as fd, filled in
+    * place. */
+  void open(int fd);
+
+  /** Lay out declared sections in anonymous memory on NUMA node if it is
+    * not negative, to be taken by release() instead of commit(). */
+  void openMemory(int node = -1);
+
+  /** Get writable payload of a declared section. */
+  folly::MutableByteRange section(uint32_t tag, size_t elemSize);
+  template <class T>
+  folly::Range<T*> section(uint32_t tag) {
+    folly::MutableByteRange bytes = section(tag, sizeof(T));
+    return {reinterpret_cast<T*>(bytes.begin()), bytes.size() / sizeof(T)};
+  }
+
+  /** Flush payload to disk, unmap file and put it in place of path.
+    * Throws `system_error` if file can't be written or renamed. */
+  void commit();
+
+  /** Take memory written after openMemory(). */
+  MappedFile release() noexcept { return std::move(file_); }
+
+ private:
+  void layout();
+  void writeHeader();
+
+  std::string kind_;
+  uint32_t version_;
+  std::vector<SnapshotSection> sections_;
+  size_t fileSize_ = 0;
+  MappedFile file_;
+  std::string path_;  // replaced by commit(), empty for fd and memory
+};
+
+class SnapshotReader {
+ public:
+  /** Map snapshot file and validate its layout.
+    * Throws `runtime_error` if file isn't a snapshot of expected kind. */
+  SnapshotReader(const std::string &path, folly::StringPiece kind,
+                 bool populate = false);
+  /** Take memory written by SnapshotWriter::openMemory(). */
+  SnapshotReader(MappedFile image, folly::StringPiece kind);
+
+  /** Get kind specific format version. */
+  uint32_t version() const noexcept { return version_; }
+
+  /** Get total size of the mapping. */
+  size_t size() const noexcept { return file_.size(); }
+
+  bool hasSection(uint32_t tag) const noexcept;
+
+  /** Get total payload of sections with tags in [fromTag, toTag). */
+  size_t sectionBytes(uint32_t fromTag, uint32_t toTag) const noexcept;
+
+  /** Get read-only payload of a section.
+    * Throws `runtime_error` if section is missing or has other type. */
+  folly::ByteRange section(uint32_t tag, size_t elemSize) const;
+  template <class T>
+  folly::Range<const T*> section(uint32_t tag) const {
+    folly::ByteRange bytes = section(tag, sizeof(T));
+    return {reinterpret_cast<const T*>(bytes.begin()), bytes.size() / sizeof(T)};
+  }
+
+ private:
+  void parse(folly::StringPiece kind);
+
+  uint32_t version_;
+  std::vector<SnapshotSection> sections_;
+  MappedFile file_;
+};
+
+#endif // CALLFWD_SNAPSHOT_H
@@ -0,0 +1,187 @@
+#include <callfwd/LergMapping.h>
+#include <callfwd/GeoMapping.h>
+#include <callfwd/DnoMapping.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <folly/Benchmark.h>
+#include <folly/init/Init.h>
+#include <folly/portability/GFlags.h>
+
+#include "SyntheticNanp.h"
+
+DEFINE_uint64(bench_rows, 100000000, "Number of numbers in benchmarked DNO mapping");
+DEFINE_uint32(bench_batch, 1024, "Number of keys per lookup call");
+DEFINE_uint32(bench_queries, 1 << 22, "Number of distinct lookup keys");
+DECLARE_uint32(lerg_f14map_prefetch);
+DECLARE_uint32(geo_f14map_prefetch);
+DECLARE_uint32(dno_f14map_prefetch);
+
+/*
+ * LERG and Geo tables have a row for every NPA-NXX block, LERG has ten
+ * thousands-blocks of every fourth one too, so their size doesn't depend
+ * on bench_rows. DNO mapping lists bench_rows ported-like numbers and
+ * whole blocks of every hundredth NPA-NXX. Half of the queries are
+ * numbers of the DNO mapping, half are random numbers.
+ */
+
+static std::vector<uint64_t> queries;
+
+static std::vector<std::string> lergRow(uint64_t npanxx, std::string x) {
+  std::string id = std::to_string(npanxx % 1000);
+  return {std::to_string(npanxx / 1000), std::to_string(npanxx % 1000),
+          std::move(x), "TX", "Carrier " + id, id, "Rate center " + id,
+          "CLEC", "552", "US"};
+}
+
+/** Builders take fields as views, e.g. into a mapped file. */
+static std::vector<folly::StringPiece> fields(const std::vector<std::string> &row) {
+  return std::vector<folly::StringPiece>(row.begin(), row.end());
+}
+
+static std::unique_ptr<LergMapping> makeLerg() {
+  std::mt19937_64 rng(42);
+  LergMapping::Builder builder;
+  std::vector<uint64_t> blocks = shuffledBlocks(rng);
+  builder.sizeHint(blocks.size() * 7 / 2);
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    builder.addRow(fields(lergRow(blocks[i], "")));
+    if (i % 4 == 0)
+      for (char x = '0'; x <= '9'; ++x)
+        builder.addRow(fields(lergRow(blocks[i], std::string(1, x))));
+  }
+  return std::make_unique<LergMapping>(builder.build());
+}
+
+static std::unique_ptr<GeoMapping> makeGeo() {
+  std::mt19937_64 rng(42);
+  GeoMapping::Builder builder;
+  std::vector<uint64_t> blocks = shuffledBlocks(rng);
+  builder.sizeHint(blocks.size());
+  for (uint64_t npanxx : blocks) {
+    std::vector<std::string> row(20, "x");
+    row[0] = std::to_string(npanxx);
+    row[1] = std::to_string(10000 + npanxx % 90000);
+    row[6] = "City " + std::to_string(npanxx % 1000);
+    row[9] = "32.7767";
+    row[10] = "County " + std::to_string(npanxx % 100);
+    row[11] = "-96.7970";
+    row[19] = "America/Chicago";
+    builder.addRow(fields(row));
+  }
+  return std::make_unique<GeoMapping>(builder.build());
+}
+
+static std::unique_ptr<DnoMapping> makeDno() {
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> rns = routingNumbers(rng);
+  std::vector<uint64_t> hits;
+  size_t every = std::max<size_t>(FLAGS_bench_rows / (FLAGS_bench_queries / 2), 1);
+
+  DnoMapping::Builder builder;
+  builder.sizeHint(FLAGS_bench_rows);
+  generatePorted(FLAGS_bench_rows, rng, rns, [&](size_t row, uint64_t pn, uint64_t) {
+    builder.addRow(pn, "dno", 1);
+    if (row % every == 0)
+      hits.push_back(pn);
+  });
+  std::vector<uint64_t> blocks = shuffledBlocks(rng);
+  for (size_t i = 0; i < blocks.size(); i += 100)
+    builder.addRow(blocks[i], "dno_npa_nxx", 1);
+
+  queries = std::move(hits);
+  while (queries.size() < FLAGS_bench_queries)
+    queries.push_back(randomNumber(rng));
+  std::shuffle(queries.begin(), queries.end(), rng);
+  return std::make_unique<DnoMapping>(builder.build());
+}
+
+// Queries are made with DNO mapping, build it first and keep all three
+static std::unique_ptr<DnoMapping> dno;
+static std::unique_ptr<LergMapping> lerg;
+static std::unique_ptr<GeoMapping> geo;
+
+static void makeMappings() {
+  if (!dno) {
+    dno = makeDno();
+    lerg = makeLerg();
+    geo = makeGeo();
+  }
+}
+
+/*
+ * Batch lookups by number of keys prefetched ahead, time per key.
+ */
+
+template <class F>
+static void lookupBatches(size_t iters, F &&lookupBatch) {
+  size_t pos = 0;
+  while (iters > 0) {
+    size_t n = std::min<size_t>(iters, FLAGS_bench_batch);
+    if (pos + n > queries.size())
+      pos = 0;
+    lookupBatch(n, &queries[pos]);
+    pos += n;
+    iters -= n;
+  }
+}
+
+static void lookupLerg(size_t iters, uint32_t prefetch) {
+  std::vector<LergData> out(FLAGS_bench_batch);
+  BENCHMARK_SUSPEND {
+    makeMappings();
+    FLAGS_lerg_f14map_prefetch = prefetch;
+  }
+
+  lookupBatches(iters, [&](size_t n, const uint64_t *pn) {
+    lerg->getLergs(n, pn, out.data());
+    folly::doNotOptimizeAway(out[n - 1].lerg_key);
+  });
+}
+
+static void lookupGeo(size_t iters, uint32_t prefetch) {
+  std::vector<GeoData> out(FLAGS_bench_batch);
+  BENCHMARK_SUSPEND {
+    makeMappings();
+    FLAGS_geo_f14map_prefetch = prefetch;
+  }
+
+  lookupBatches(iters, [&](size_t n, const uint64_t *pn) {
+    geo->getGeos(n, pn, out.data());
+    folly::doNotOptimizeAway(out[n - 1].npanxx);
+  });
+}
+
+static void lookupDno(size_t iters, uint32_t prefetch) {
+  std::vector<uint64_t> out(FLAGS_bench_batch);
+  BENCHMARK_SUSPEND {
+    makeMappings();
+    FLAGS_dno_f14map_prefetch = prefetch;
+  }
+
+  lookupBatches(iters, [&](size_t n, const uint64_t *pn) {
+    dno->getDNOs(n, pn, out.data());
+    folly::doNotOptimizeAway(out[n - 1]);
+  });
+}
+
+BENCHMARK_NAMED_PARAM(lookupLerg, 4, 4)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupLerg, 16, 16)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupLerg, 64, 64)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(lookupGeo, 4, 4)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupGeo, 16, 16)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupGeo, 64, 64)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(lookupDno, 4, 4)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupDno, 16, 16)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupDno, 64, 64)
+
+int main(int argc, char *argv[]) {
+  folly::Init init(&argc, &argv);
+  folly::runBenchmarks();
+  return 0;
+}
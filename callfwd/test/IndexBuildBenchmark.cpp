@@ -0,0 +1,82 @@
+#include <callfwd/IndexBuild.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#if HAVE_STD_PARALLEL
+#include <execution>
+#endif
+#include <folly/Benchmark.h>
+#include <folly/init/Init.h>
+
+/*
+ * Reverse index construction of a mapping with N rows and N/100 distinct
+ * routing numbers: radix sort against the comparison sort it replaced.
+ */
+
+struct PhoneList {
+  uint64_t phone : 34, next : 30;
+};
+
+static void makeRows(size_t N, std::vector<PhoneList> &pnColumn,
+                     std::vector<PhoneList> &index) {
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<uint64_t> rn(2002000000, 9999999999);
+  std::vector<uint64_t> pool(std::max<size_t>(N / 100, 1));
+  for (uint64_t &value : pool)
+    value = rn(rng);
+
+  pnColumn.assign(N, PhoneList{0, (1 << 30) - 1});
+  index.resize(N);
+  for (size_t i = 0; i < N; ++i) {
+    pnColumn[i].phone = 2002000000 + i;
+    index[i].phone = pool[rng() % pool.size()];
+  }
+}
+
+static void radix(size_t iters, size_t N) {
+  std::vector<PhoneList> pnColumn, index;
+  while (iters--) {
+    BENCHMARK_SUSPEND {
+      makeRows(N, pnColumn, index);
+    }
+    buildReverseIndex(pnColumn, index);
+    folly::doNotOptimizeAway(index.size());
+  }
+}
+
+static void stableSort(size_t iters, size_t N) {
+  std::vector<PhoneList> pnColumn, index;
+  while (iters--) {
+    BENCHMARK_SUSPEND {
+      makeRows(N, pnColumn, index);
+    }
+    for (size_t i = 0; i < N; ++i)
+      index[i].next = i;
+    static auto cmp = [](const PhoneList &lhs, const PhoneList &rhs) {
+      if (lhs.phone == rhs.phone)
+        return lhs.next < rhs.next;
+      return lhs.phone < rhs.phone;
+    };
+#if HAVE_STD_PARALLEL
+    std::stable_sort(std::execution::par_unseq, index.begin(), index.end(), cmp);
+#else
+    std::stable_sort(index.begin(), index.end(), cmp);
+#endif
+    for (size_t i = 0; i + 1 < N; ++i)
+      pnColumn[index[i].next].next = index[i+1].next;
+    folly::doNotOptimizeAway(index.size());
+  }
+}
+
+BENCHMARK_NAMED_PARAM(stableSort, 100M, 100000000)
+BENCHMARK_RELATIVE_NAMED_PARAM(radix, 100M, 100000000)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(stableSort, 600M, 600000000)
+BENCHMARK_RELATIVE_NAMED_PARAM(radix, 600M, 600000000)
+
+int main(int argc, char *argv[]) {
+  folly::Init init(&argc, &argv);
+  folly::runBenchmarks();
+  return 0;
+}
@@ -0,0 +1,353 @@
+#include <callfwd/PhoneMapping.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+#include <glog/logging.h>
+#include <folly/Benchmark.h>
+#include <folly/init/Init.h>
+#include <folly/portability/GFlags.h>
+#include <folly/synchronization/Hazptr.h>
+
+#include "SyntheticNanp.h"
+
+DEFINE_uint64(bench_rows, 100000000, "Number of rows in benchmarked mapping");
+DEFINE_uint32(bench_batch, 1024, "Number of keys per getRNs() call");
+DEFINE_uint32(bench_queries, 1 << 22, "Number of distinct lookup keys");
+DEFINE_uint32(bench_hit_percent, 50, "Share of lookup keys present in mapping");
+DECLARE_uint32(f14map_prefetch);
+DECLARE_uint32(mapping_shards);
+DECLARE_uint32(mapping_filter_bits);
+
+using Engine = PhoneMapping::Engine;
+
+/*
+ * Mappings of bench_rows synthetic ported numbers. Queries hit the
+ * mapping in bench_hit_percent of cases, the rest are random numbers.
+ */
+
+static std::vector<uint64_t> hits;
+static std::vector<uint64_t> misses;
+static std::vector<uint64_t> queries;
+static uint32_t queriesHitPercent = 0;
+static uint64_t largeCarrier;
+
+static void makeQueries(uint32_t hitPercent) {
+  std::mt19937_64 rng(hitPercent);
+  size_t numHits = std::min<size_t>(
+    hits.size(), uint64_t(FLAGS_bench_queries) * hitPercent / 100);
+  queries.assign(hits.begin(), hits.begin() + numHits);
+  queries.insert(queries.end(), misses.begin(),
+                 misses.begin() + (FLAGS_bench_queries - numHits));
+  std::shuffle(queries.begin(), queries.end(), rng);
+  queriesHitPercent = hitPercent;
+}
+
+static void fillMapping(PhoneMapping::Builder &builder, Engine engine) {
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> rns = routingNumbers(rng);
+  largeCarrier = rns[0];
+
+  builder.setEngine(engine);
+  builder.sizeHint(FLAGS_bench_rows);
+  hits.clear();
+  size_t every = std::max<size_t>(FLAGS_bench_rows / FLAGS_bench_queries, 1);
+  generatePorted(FLAGS_bench_rows, rng, rns,
+                 [&](size_t row, uint64_t pn, uint64_t rn) {
+    builder.addRow(pn, rn);
+    if (row % every == 0 && hits.size() < FLAGS_bench_queries)
+      hits.push_back(pn);
+  });
+  std::shuffle(hits.begin(), hits.end(), rng);
+
+  misses.resize(FLAGS_bench_queries);
+  for (uint64_t &pn : misses)
+    pn = randomNumber(rng);
+  makeQueries(FLAGS_bench_hit_percent);
+}
+
+// Keep only one mapping in memory, either built alone or in NANP view
+static std::unique_ptr<PhoneMapping> current;
+static Engine currentEngine;
+static uint32_t currentFilterBits;
+static std::atomic<NanpMapping::Data*> nanp;
+static uint32_t nanpShards = 0;
+
+static void dropMappings() {
+  current.reset();
+  if (nanpShards > 0) {
+    PhoneMapping::Builder().commit(nanp, NanpMapping::Country::US);
+    nanpShards = 0;
+  }
+  folly::hazptr_cleanup();
+}
+
+static PhoneMapping& getMapping(Engine engine) {
+  if (!current || currentEngine != engine ||
+      currentFilterBits != FLAGS_mapping_filter_bits) {
+    dropMappings();
+    PhoneMapping::Builder builder;
+    fillMapping(builder, engine);
+    current = std::make_unique<PhoneMapping>(builder.build());
+    currentEngine = engine;
+    currentFilterBits = FLAGS_mapping_filter_bits;
+  }
+  return *current;
+}
+
+static void commitMapping(uint32_t shards) {
+  if (nanpShards != shards) {
+    dropMappings();
+    PhoneMapping::Builder builder;
+    fillMapping(builder, Engine::F14);
+    FLAGS_mapping_shards = shards;
+    builder.commit(nanp, NanpMapping::Country::US);
+    nanpShards = shards;
+  }
+}
+
+static void lookupKeys(size_t iters, Engine engine, size_t batch,
+                       uint32_t hitPercent) {
+  const PhoneMapping *db = nullptr;
+  std::vector<uint64_t> rn(batch);
+  BENCHMARK_SUSPEND {
+    db = &getMapping(engine);
+    if (queriesHitPercent != hitPercent)
+      makeQueries(hitPercent);
+  }
+
+  size_t pos = 0;
+  while (iters > 0) {
+    size_t n = std::min<size_t>(iters, batch);
+    if (pos + n > queries.size())
+      pos = 0;
+    db->getRNs(n, &queries[pos], rn.data());
+    folly::doNotOptimizeAway(rn[n - 1]);
+    pos += n;
+    iters -= n;
+  }
+}
+
+static void lookup(size_t iters, Engine engine) {
+  lookupKeys(iters, engine, FLAGS_bench_batch, FLAGS_bench_hit_percent);
+}
+
+/*
+ * F14 lookups by number of keys per getRNs() call, share of present
+ * keys and number of keys prefetched ahead.
+ */
+
+static void lookupBatch(size_t iters, size_t batch) {
+  lookupKeys(iters, Engine::F14, batch, FLAGS_bench_hit_percent);
+}
+
+static void lookupHits(size_t iters, uint32_t hitPercent) {
+  lookupKeys(iters, Engine::F14, FLAGS_bench_batch, hitPercent);
+}
+
+static void lookupPrefetch(size_t iters, uint32_t prefetch) {
+  uint32_t saved = FLAGS_f14map_prefetch;
+  FLAGS_f14map_prefetch = prefetch;
+  lookup(iters, Engine::F14);
+  FLAGS_f14map_prefetch = saved;
+}
+
+/*
+ * F14 lookups without and with the filter in front of the index.
+ */
+
+static void lookupFilter(size_t iters, uint32_t bits) {
+  FLAGS_mapping_filter_bits = bits;
+  lookup(iters, Engine::F14);
+}
+
+/*
+ * Reverse scan over all rows, time per row: cursor methods against
+ * readRows() into caller's arrays of bench_batch rows.
+ */
+
+static void scanCursor(size_t iters, Engine engine) {
+  PhoneMapping *db = nullptr;
+  BENCHMARK_SUSPEND {
+    db = &getMapping(engine);
+  }
+
+  uint64_t sum = 0;
+  while (iters > 0) {
+    for (db->visitRows(); db->hasRow() && iters > 0; db->advance(), --iters)
+      sum += db->currentPN() ^ db->currentRN();
+  }
+  folly::doNotOptimizeAway(sum);
+}
+
+static void scanBatch(size_t iters, Engine engine) {
+  const PhoneMapping *db = nullptr;
+  std::vector<uint64_t> pn(FLAGS_bench_batch), rn(FLAGS_bench_batch);
+  BENCHMARK_SUSPEND {
+    db = &getMapping(engine);
+  }
+
+  uint64_t sum = 0;
+  PhoneMapping::RowScan scan;
+  while (iters > 0) {
+    if (scan.done())
+      scan = db->scanRows();
+    size_t n = db->readRows(scan, std::min<size_t>(iters, pn.size()),
+                            pn.data(), rn.data());
+    for (size_t i = 0; i < n; ++i)
+      sum += pn[i] ^ rn[i];
+    iters -= n;
+  }
+  folly::doNotOptimizeAway(sum);
+}
+
+/*
+ * Reverse scan of numbers ported to the large carrier, time per row.
+ */
+
+static void inverseLarge(size_t iters, Engine engine) {
+  PhoneMapping *db = nullptr;
+  BENCHMARK_SUSPEND {
+    db = &getMapping(engine);
+  }
+
+  uint64_t sum = 0;
+  while (iters > 0) {
+    db->inverseRNs(largeCarrier, largeCarrier + 1);
+    CHECK(db->hasRow());
+    for (; db->hasRow() && iters > 0; db->advance(), --iters)
+      sum += db->currentPN();
+  }
+  folly::doNotOptimizeAway(sum);
+}
+
+/*
+ * Builder throughput per row, generation of rows alone as baseline,
+ * and time of build() per mapping of bench_rows rows.
+ */
+
+static void generateRows(size_t iters) {
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> rns;
+  BENCHMARK_SUSPEND {
+    rns = routingNumbers(rng);
+  }
+
+  uint64_t sum = 0;
+  generatePorted(iters, rng, rns, [&](size_t, uint64_t pn, uint64_t rn) {
+    sum += pn ^ rn;
+  });
+  folly::doNotOptimizeAway(sum);
+}
+
+static void addRows(size_t iters) {
+  std::mt19937_64 rng(42);
+  std::vector<uint64_t> rns;
+  std::unique_ptr<PhoneMapping::Builder> builder;
+  BENCHMARK_SUSPEND {
+    dropMappings();
+    rns = routingNumbers(rng);
+    builder = std::make_unique<PhoneMapping::Builder>();
+    builder->sizeHint(iters);
+  }
+
+  generatePorted(iters, rng, rns, [&](size_t, uint64_t pn, uint64_t rn) {
+    builder->addRow(pn, rn);
+  });
+
+  BENCHMARK_SUSPEND {
+    builder.reset();
+  }
+}
+
+static void build(size_t iters, Engine engine) {
+  while (iters--) {
+    PhoneMapping::Builder builder;
+    BENCHMARK_SUSPEND {
+      dropMappings();
+      fillMapping(builder, engine);
+    }
+
+    auto db = std::make_unique<PhoneMapping>(builder.build());
+    folly::doNotOptimizeAway(db.get());
+
+    BENCHMARK_SUSPEND {
+      db.reset();
+      folly::hazptr_cleanup();
+    }
+  }
+}
+
+/*
+ * Lookups through NANP view, the mapping committed as US partition split
+ * into the given number of NPA shards.
+ */
+
+static void lookupShards(size_t iters, uint32_t shards) {
+  std::unique_ptr<NanpMapping> db;
+  std::vector<uint64_t> rn(FLAGS_bench_batch);
+  BENCHMARK_SUSPEND {
+    commitMapping(shards);
+    db = std::make_unique<NanpMapping>(nanp);
+  }
+
+  size_t pos = 0;
+  while (iters > 0) {
+    size_t n = std::min<size_t>(iters, FLAGS_bench_batch);
+    if (pos + n > queries.size())
+      pos = 0;
+    db->getRNs(n, &queries[pos], rn.data());
+    folly::doNotOptimizeAway(rn[n - 1]);
+    pos += n;
+    iters -= n;
+  }
+}
+
+BENCHMARK_NAMED_PARAM(lookup, f14, Engine::F14)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookup, mph, Engine::MPH)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookup, npanxx, Engine::NPANXX)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(lookupBatch, 1, 1)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupBatch, 16, 16)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupBatch, 256, 256)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupBatch, 4096, 4096)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(lookupHits, 0, 0)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupHits, 50, 50)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupHits, 100, 100)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(lookupPrefetch, 4, 4)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupPrefetch, 8, 8)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupPrefetch, 16, 16)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupPrefetch, 32, 32)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(lookupFilter, 0, 0)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupFilter, 10, 10)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(scanCursor, f14, Engine::F14)
+BENCHMARK_RELATIVE_NAMED_PARAM(scanBatch, f14, Engine::F14)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(inverseLarge, f14, Engine::F14)
+BENCHMARK_RELATIVE_NAMED_PARAM(inverseLarge, mph, Engine::MPH)
+BENCHMARK_RELATIVE_NAMED_PARAM(inverseLarge, npanxx, Engine::NPANXX)
+BENCHMARK_DRAW_LINE();
+BENCHMARK(generate, iters) {
+  generateRows(iters);
+}
+BENCHMARK_RELATIVE(addRow, iters) {
+  addRows(iters);
+}
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(build, f14, Engine::F14)
+BENCHMARK_RELATIVE_NAMED_PARAM(build, mph, Engine::MPH)
+BENCHMARK_RELATIVE_NAMED_PARAM(build, npanxx, Engine::NPANXX)
+BENCHMARK_DRAW_LINE();
+BENCHMARK_NAMED_PARAM(lookupShards, 1, 1)
+BENCHMARK_RELATIVE_NAMED_PARAM(lookupShards, 16, 16)
+
+int main(int argc, char *argv[]) {
+  folly::Init init(&argc, &argv);
+  folly::runBenchmarks();
+  return 0;
+}
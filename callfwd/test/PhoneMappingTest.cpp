@@ -1,6 +1,37 @@
 #include <callfwd/PhoneMapping.h>
+#include <callfwd/IndexBuild.h>
+#include <callfwd/PerfectHash.h>
+#include <callfwd/EliasFano.h>
+#include <callfwd/KeyFilter.h>
+#include <callfwd/HugePages.h>
+#include <callfwd/Reclaimer.h>
+#include <callfwd/Arena.h>
+#include <callfwd/CSVReader.h>
+#include <callfwd/LergMapping.h>
+#include <callfwd/DnoMapping.h>
+#include <callfwd/DncMapping.h>
+#include <callfwd/ReloadScheduler.h>
+#include <callfwd/Manifest.h>
+#include <callfwd/PortOverlay.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <thread>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <folly/dynamic.h>
 #include <folly/portability/GTest.h>
 #include <folly/portability/GMock.h>
+#include <folly/portability/GFlags.h>
+
+DECLARE_uint32(mapping_shards);
+DECLARE_bool(numa_replicas);
+DECLARE_uint32(reclaim_chunk_mb);
+DECLARE_uint32(overlay_compact_rows);
 
 using namespace testing;
 
@@ -91,9 +122,1246 @@ TEST(PhoneMappingTest, LastDigit) {
   PhoneMapping db = builder.build();
   ASSERT_EQ(drain(db.inverseRNs(2, 5)).size(), 90*3);
   ASSERT_EQ(drain(db.inverseRNs(8, 15)).size(), 90*2);
+
+  std::vector<std::pair<uint64_t, uint64_t>> expected;
+  for (size_t rn = 0; rn < 10; ++rn)
+    for (size_t i = 100 + rn; i <= 999; i += 10)
+      expected.emplace_back(i, rn);
+  ASSERT_EQ(drain(db.visitRows()), expected);
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, ReadRows) {
+  PhoneMapping::Builder builder;
+  for (size_t i = 999; i >= 100; --i)
+    builder.addRow(i, i % 10);
+  PhoneMapping db = builder.build();
+
+  // Odd batch sizes cross sample and group boundaries
+  for (size_t batch : {1, 7, 300, 1000}) {
+    std::vector<uint64_t> pn(batch), rn(batch);
+    std::vector<std::pair<uint64_t, uint64_t>> rows;
+    PhoneMapping::RowScan scan = db.scanRNs(2, 5);
+    while (size_t n = db.readRows(scan, batch, pn.data(), rn.data()))
+      for (size_t i = 0; i < n; ++i)
+        rows.emplace_back(pn[i], rn[i]);
+    ASSERT_TRUE(scan.done());
+    ASSERT_EQ(rows, drain(db.inverseRNs(2, 5)));
+  }
+
+  PhoneMapping::RowScan scan = db.scanRows();
+  ASSERT_EQ(scan.own.end - scan.own.pos, 900);
+  ASSERT_TRUE(db.scanRNs(10, 20).done());
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, Snapshot) {
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+
+  PhoneMapping::Builder builder;
+  for (size_t i = 999; i >= 100; --i)
+    builder.addRow(i, i % 10);
+  ASSERT_TRUE(builder.build().writeOwnSnapshot(path));
+
+  PhoneMapping::Builder loader;
+  loader.fromSnapshot(path);
+  PhoneMapping db = loader.build();
+
+  // Mapped snapshot is replaced, not overwritten
+  PhoneMapping::Builder().build().writeSnapshot(path);
+  unlink(path);
+
+  ASSERT_EQ(db.size(), 900);
+  for (size_t i = 100; i <= 999; ++i)
+    ASSERT_EQ(db.getRN(i), i % 10);
+  ASSERT_EQ(db.getRN(99), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(1000), PhoneNumber::NONE);
+  ASSERT_EQ(drain(db.visitRows()).size(), 900);
+  ASSERT_EQ(drain(db.inverseRNs(2, 5)).size(), 90*3);
+  ASSERT_THAT(drain(db.inverseRNs(7, 8)), Each(Pair(_, 7)));
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, Replicas) {
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+  // Replicas are made on hosts of several NUMA nodes, same answers
+  FLAGS_numa_replicas = true;
+
+  for (auto engine : {PhoneMapping::Engine::F14, PhoneMapping::Engine::MPH,
+                      PhoneMapping::Engine::NPANXX}) {
+    PhoneMapping::Builder builder;
+    builder.setEngine(engine);
+    for (size_t i = 2002000000; i < 2002010000; i += 3)
+      builder.addRow(i, i % 10);
+    PhoneMapping built = builder.build();
+    built.writeSnapshot(path);
+
+    PhoneMapping::Builder loader;
+    loader.fromSnapshot(path);
+    PhoneMapping mapped = loader.build();
+    for (PhoneMapping *db : {&built, &mapped}) {
+      for (size_t i = 2002000000; i < 2002010000; ++i)
+        ASSERT_EQ(db->getRN(i), i % 3 == 2002000000 % 3 ? i % 10 : PhoneNumber::NONE);
+      ASSERT_EQ(drain(db->inverseRNs(7, 8)).size(), 333);
+    }
+  }
+
+  FLAGS_numa_replicas = false;
+  unlink(path);
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, EmptySnapshot) {
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+
+  PhoneMapping::Builder().build().writeSnapshot(path);
+  PhoneMapping::Builder loader;
+  loader.fromSnapshot(path);
+  PhoneMapping db = loader.build();
+  unlink(path);
+
+  ASSERT_EQ(db.size(), 0);
+  ASSERT_EQ(db.getRN(555), PhoneNumber::NONE);
+  ASSERT_FALSE(db.visitRows().hasRow());
+  ASSERT_FALSE(db.inverseRNs(111, 222).hasRow());
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, PerfectHashEmpty) {
+  PhoneMapping::Builder builder;
+  builder.setEngine(PhoneMapping::Engine::MPH);
+  PhoneMapping db = builder.build();
+  ASSERT_EQ(db.size(), 0);
+  ASSERT_EQ(db.getRN(555), PhoneNumber::NONE);
+  ASSERT_FALSE(db.visitRows().hasRow());
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, PerfectHash) {
+  // Spans a few hash partitions
+  PhoneMapping::Builder builder;
+  builder.setEngine(PhoneMapping::Engine::MPH);
+  for (uint64_t i = 0; i < 200000; ++i)
+    builder.addRow(2012000000 + i * 7, 3000000000 + i % 1000);
+
+  PhoneMapping db = builder.build();
+  ASSERT_EQ(db.size(), 200000);
+  for (uint64_t i = 0; i < 200000; ++i) {
+    ASSERT_EQ(db.getRN(2012000000 + i * 7), 3000000000 + i % 1000);
+    ASSERT_EQ(db.getRN(2012000000 + i * 7 + 1), PhoneNumber::NONE);
+  }
+  ASSERT_EQ(db.getRN(PhoneNumber::NONE), PhoneNumber::NONE);
+  ASSERT_THAT(drain(db.inverseRNs(3000000042, 3000000043)),
+              AllOf(SizeIs(200), Each(Pair(_, 3000000042))));
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, PerfectHashSnapshot) {
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+
+  PhoneMapping::Builder builder;
+  builder.setEngine(PhoneMapping::Engine::MPH);
+  for (size_t i = 999; i >= 100; --i)
+    builder.addRow(i, i % 10);
+  builder.build().writeSnapshot(path);
+
+  PhoneMapping::Builder loader;
+  loader.fromSnapshot(path);
+  PhoneMapping db = loader.build();
+
+  // Mapped snapshot is replaced, not overwritten
+  PhoneMapping::Builder().build().writeSnapshot(path);
+  unlink(path);
+
+  ASSERT_EQ(db.size(), 900);
+  for (size_t i = 100; i <= 999; ++i)
+    ASSERT_EQ(db.getRN(i), i % 10);
+  ASSERT_EQ(db.getRN(99), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(1000), PhoneNumber::NONE);
+  ASSERT_EQ(drain(db.inverseRNs(2, 5)).size(), 90*3);
+  folly::hazptr_cleanup();
+}
+
+TEST(PerfectHashTest, EmptyLastPartition) {
+  // Lookups landing in an empty partition stay within slots
+  std::vector<PerfectHash::Partition> parts = {
+    {0, 0, 0, 1}, {2, 1, 1, 2}, {2, 2, 2, 0}};
+  std::vector<uint16_t> pilots = {0, 0};
+  std::vector<uint32_t> remap = {0, 0};
+  PerfectHash mph(folly::range(parts), folly::range(pilots), folly::range(remap));
+  ASSERT_EQ(mph.size(), 2);
+  for (uint64_t key = 0; key < 1000; ++key)
+    ASSERT_LT(mph(key), 2);
+}
+
+TEST(PhoneMappingTest, NpaNxx) {
+  PhoneMapping::Builder builder;
+  builder.setEngine(PhoneMapping::Engine::NPANXX);
+  for (uint64_t i = 0; i < 200000; ++i)
+    builder.addRow(2012000000 + i * 7, 3000000000 + i % 1000);
+  builder.addRow(9999999999, 42);
+
+  PhoneMapping db = builder.build();
+  ASSERT_EQ(db.size(), 200001);
+  for (uint64_t i = 0; i < 200000; ++i) {
+    ASSERT_EQ(db.getRN(2012000000 + i * 7), 3000000000 + i % 1000);
+    ASSERT_EQ(db.getRN(2012000000 + i * 7 + 1), PhoneNumber::NONE);
+  }
+  ASSERT_EQ(db.getRN(9999999999), 42);
+  ASSERT_EQ(db.getRN(2011999999), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(10000000000), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(PhoneNumber::NONE), PhoneNumber::NONE);
+  ASSERT_THAT(drain(db.inverseRNs(3000000042, 3000000043)),
+              AllOf(SizeIs(200), Each(Pair(_, 3000000042))));
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, NpaNxxSnapshot) {
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+
+  PhoneMapping::Builder builder;
+  builder.setEngine(PhoneMapping::Engine::NPANXX);
+  for (size_t i = 999; i >= 100; --i)
+    builder.addRow(i, i % 10);
+  builder.build().writeSnapshot(path);
+
+  PhoneMapping::Builder loader;
+  loader.fromSnapshot(path);
+  PhoneMapping db = loader.build();
+
+  // Mapped snapshot is replaced, not overwritten
+  PhoneMapping::Builder().build().writeSnapshot(path);
+  unlink(path);
+
+  ASSERT_EQ(db.size(), 900);
+  for (size_t i = 100; i <= 999; ++i)
+    ASSERT_EQ(db.getRN(i), i % 10);
+  ASSERT_EQ(db.getRN(99), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(1000), PhoneNumber::NONE);
+  ASSERT_EQ(drain(db.inverseRNs(2, 5)).size(), 90*3);
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, WideCodes) {
+  // More distinct RNs than 16-bit codes can address
+  PhoneMapping::Builder builder;
+  builder.setEngine(PhoneMapping::Engine::NPANXX);
+  for (uint64_t i = 0; i < 70000; ++i)
+    builder.addRow(2012000000 + i, 3000000000 + i * 3);
+
+  PhoneMapping db = builder.build();
+  for (uint64_t i = 0; i < 70000; ++i)
+    ASSERT_EQ(db.getRN(2012000000 + i), 3000000000 + i * 3);
+  ASSERT_THAT(drain(db.inverseRNs(3000000000 + 65535 * 3, 3000000000 + 65538 * 3)),
+              ElementsAre(Pair(2012065535, 3000000000 + 65535 * 3),
+                          Pair(2012065536, 3000000000 + 65536 * 3),
+                          Pair(2012065537, 3000000000 + 65537 * 3)));
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, Batch) {
+  using Engine = PhoneMapping::Engine;
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+
+  std::vector<uint64_t> pn, expected;
+  for (uint64_t i = 0; i < 5003; ++i) {
+    pn.push_back(2012000000 + i * 7);
+    expected.push_back(i % 3 ? 3032000000 + i % 101 : PhoneNumber::NONE);
+  }
+
+  for (Engine engine : {Engine::F14, Engine::MPH, Engine::NPANXX}) {
+    PhoneMapping::Builder builder;
+    builder.setEngine(engine);
+    for (size_t i = 0; i < pn.size(); ++i)
+      if (expected[i] != PhoneNumber::NONE)
+        builder.addRow(pn[i], expected[i]);
+    PhoneMapping built = builder.build();
+    built.writeSnapshot(path);
+
+    PhoneMapping::Builder loader;
+    loader.fromSnapshot(path);
+    PhoneMapping mapped = loader.build();
+
+    for (PhoneMapping *db : {&built, &mapped}) {
+      std::vector<uint64_t> rn(pn.size());
+      db->getRNs(pn.size(), pn.data(), rn.data());
+      ASSERT_EQ(rn, expected);
+    }
+  }
+  unlink(path);
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, Nanp) {
+  using Country = NanpMapping::Country;
+  static std::atomic<NanpMapping::Data*> global;
+
+  PhoneMapping::Builder us;
+  us.addRow(2012000001, 2012999999);
+  us.addRow(2012000002, 2012999999);
+  us.addRow(99, 100);
+  us.commit(global, Country::US);
+
+  ASSERT_TRUE(NanpMapping(global).hasCountry(Country::US));
+  ASSERT_FALSE(NanpMapping(global).hasCountry(Country::CA));
+
+  PhoneMapping::Builder ca;
+  ca.addRow(4162000001, 4162999999);
+  ca.addRow(2012000003, 2012888888);
+  ca.commit(global, Country::CA);
+
+  Country country;
+  NanpMapping nanp(global);
+  ASSERT_EQ(nanp.getRN(2012000001, &country), 2012999999);
+  ASSERT_EQ(country, Country::US);
+  ASSERT_EQ(nanp.getRN(4162000001, &country), 4162999999);
+  ASSERT_EQ(country, Country::CA);
+  ASSERT_EQ(nanp.getRN(2012000003, &country), 2012888888);
+  ASSERT_EQ(country, Country::CA);
+  ASSERT_EQ(nanp.getRN(99, &country), 100);
+  ASSERT_EQ(country, Country::US);
+  ASSERT_EQ(nanp.getRN(4162000002, &country), PhoneNumber::NONE);
+  ASSERT_EQ(country, Country::NONE);
+
+  // Reload of US keeps CA partition
+  PhoneMapping::Builder us2;
+  us2.addRow(2012000001, 2012777777);
+  us2.commit(global, Country::US);
+
+  std::vector<uint64_t> pn = {2012000001, 2012000002, 4162000001, 99};
+  std::vector<uint64_t> rn(pn.size());
+  std::vector<Country> countries(pn.size());
+  NanpMapping(global).getRNs(pn.size(), pn.data(), rn.data(), countries.data());
+  ASSERT_THAT(rn, ElementsAre(2012777777, PhoneNumber::NONE, 4162999999,
+                              PhoneNumber::NONE));
+  ASSERT_THAT(countries, ElementsAre(Country::US, Country::NONE, Country::CA,
+                                     Country::NONE));
+
+  // Long batches are looked up window by window
+  std::vector<uint64_t> many;
+  for (size_t i = 0; i < 50; ++i)
+    many.insert(many.end(), pn.begin(), pn.end());
+  rn.resize(many.size());
+  countries.resize(many.size());
+  NanpMapping(global).getRNs(many.size(), many.data(), rn.data(), countries.data());
+  for (size_t i = 0; i < many.size(); ++i) {
+    ASSERT_EQ(rn[i], rn[i % pn.size()]);
+    ASSERT_EQ(countries[i], countries[i % pn.size()]);
+  }
+  ASSERT_EQ(PhoneMapping(global, Country::CA).size(), 2);
+  ASSERT_EQ(PhoneMapping(global, Country::US).size(), 1);
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, MemoryUsage) {
+  using Country = NanpMapping::Country;
+  static std::atomic<NanpMapping::Data*> global;
+  // Versions retired by earlier tests may still be queued for reclaimer
+  waitReclaimed();
+  size_t retired = NanpMapping(global).memoryUsage()["retired_versions"].asInt();
+  FLAGS_mapping_shards = 1;
+
+  PhoneMapping::Builder us;
+  for (uint64_t i = 0; i < 1000; ++i)
+    us.addRow(2012000000 + i, 3000000000 + i % 10);
+  us.commit(global, Country::US);
+
+  folly::dynamic usage = PhoneMapping(global, Country::US).memoryUsage();
+  ASSERT_GE(usage["total"].asInt(), 1000 * sizeof(uint64_t));
+  ASSERT_GE(usage["parts"]["pnColumn"]["bytes"].asInt(), 1000 * sizeof(uint64_t));
+  ASSERT_TRUE(usage["parts"].count("meta"));
+
+  // Replaced partition is counted until the last reader lets it go
+  {
+    PhoneMapping reader(global, Country::US);
+    PhoneMapping::Builder us2;
+    us2.addRow(2012000001, 2012777777);
+    us2.commit(global, Country::US);
+
+    folly::dynamic nanp = NanpMapping(global).memoryUsage();
+    ASSERT_EQ(nanp["retired_versions"].asInt(), retired + 1);
+    ASSERT_GE(nanp["retired_bytes"].asInt(), 1000 * sizeof(uint64_t));
+    ASSERT_TRUE(nanp["parts"].count("US"));
+    ASSERT_FALSE(nanp["parts"].count("CA"));
+  }
+  FLAGS_mapping_shards = 16;
+  folly::hazptr_cleanup();
+  waitReclaimed();
+  ASSERT_EQ(NanpMapping(global).memoryUsage()["retired_versions"].asInt(), retired);
+}
+
+TEST(PhoneMappingTest, Delta) {
+  using Country = NanpMapping::Country;
+  static std::atomic<NanpMapping::Data*> global;
+
+  PhoneMapping::Builder empty;
+  ASSERT_THROW(empty.commitDelta(global, Country::US), std::runtime_error);
+
+  PhoneMapping::Builder full;
+  full.setEngine(PhoneMapping::Engine::MPH);
+  for (uint64_t i = 0; i < 1000; ++i)
+    full.addRow(2012000000 + i, 3000000000 + i % 10);
+  full.commit(global, Country::US);
+
+  // Modify, remove and add keys
+  std::istringstream in("2012000005,3000000042\n2012000006,\n2012000007\n"
+                        "2012999999,3000000001\n");
+  CSVReader csv(in);
+  size_t line = 0;
+  PhoneMapping::Builder delta;
+  delta.deltaFromCSV(csv, line, 100);
+  ASSERT_EQ(line, 4);
+  delta.commitDelta(global, Country::US);
+
+  PhoneMapping db(global, Country::US);
+  ASSERT_EQ(db.size(), 999);
+  ASSERT_EQ(db.getRN(2012000004), 3000000004);
+  ASSERT_EQ(db.getRN(2012000005), 3000000042);
+  ASSERT_EQ(db.getRN(2012000006), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(2012000007), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(2012999999), 3000000001);
+  ASSERT_EQ(db.getRN(2012001000), PhoneNumber::NONE);
+
+  // Second delta is merged with the first one, not stacked on it
+  PhoneMapping::Builder delta2;
+  delta2.addRow(2012000006, 3000000006);
+  delta2.removeRow(2012999999);
+  delta2.commitDelta(global, Country::US);
+
+  PhoneMapping db2(global, Country::US);
+  ASSERT_EQ(db2.size(), 999);
+  ASSERT_EQ(db2.getRN(2012000005), 3000000042);
+  ASSERT_EQ(db2.getRN(2012000006), 3000000006);
+  ASSERT_EQ(db2.getRN(2012000007), PhoneNumber::NONE);
+  ASSERT_EQ(db2.getRN(2012999999), PhoneNumber::NONE);
+
+  // Reverse scans merge both layers in (rn, pn) order
+  std::vector<std::pair<uint64_t, uint64_t>> expected;
+  for (uint64_t rn = 0; rn < 10; ++rn)
+    for (uint64_t i = rn; i < 1000; i += 10)
+      if (i != 5 && i != 7)
+        expected.emplace_back(2012000000 + i, 3000000000 + rn);
+  expected.emplace_back(2012000005, 3000000042);
+  ASSERT_EQ(drain(db2.visitRows()), expected);
+  ASSERT_THAT(drain(db2.inverseRNs(3000000042, 3000000043)),
+              ElementsAre(Pair(2012000005, 3000000042)));
+  ASSERT_EQ(drain(db2.inverseRNs(3000000007, 3000000008)).size(), 99);
+
+  // Snapshot of a delta holds merged rows, only an explicit one
+  // builds them
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+  ASSERT_FALSE(db2.writeOwnSnapshot(path));
+  db2.writeSnapshot(path);
+  PhoneMapping::Builder loader;
+  loader.fromSnapshot(path);
+  PhoneMapping db3 = loader.build();
+  unlink(path);
+  ASSERT_EQ(db3.size(), 999);
+  ASSERT_EQ(drain(db3.visitRows()), expected);
+
+  // Large delta is folded into the base
+  PhoneMapping::Builder delta3;
+  for (uint64_t i = 0; i < 100; ++i)
+    delta3.removeRow(2012000100 + i);
+  delta3.commitDelta(global, Country::US);
+  PhoneMapping db4(global, Country::US);
+  ASSERT_EQ(db4.size(), 899);
+  ASSERT_EQ(db4.getRN(2012000150), PhoneNumber::NONE);
+  ASSERT_EQ(db4.getRN(2012000006), 3000000006);
+  ASSERT_EQ(drain(db4.visitRows()).size(), 899);
+  // Folded shards carry no delta and are written as they are
+  ASSERT_TRUE(db4.writeOwnSnapshot(path));
+  unlink(path);
   folly::hazptr_cleanup();
 }
 
+TEST(PhoneMappingTest, Overlay) {
+  using Country = NanpMapping::Country;
+  static std::atomic<NanpMapping::Data*> global;
+
+  ASSERT_THROW(PhoneMapping::port(global, Country::US, 2012000001, 3000000001),
+               std::runtime_error);
+
+  PhoneMapping::Builder us;
+  for (uint64_t i = 0; i < 100; ++i)
+    us.addRow(2012000000 + i, 3000000000 + i % 10);
+  us.commit(global, Country::US);
+  PhoneMapping::Builder ca;
+  ca.addRow(4162000001, 4162999999);
+  ca.commit(global, Country::CA);
+
+  // Changes are visible right away, without a new version
+  FLAGS_overlay_compact_rows = 4;
+  ASSERT_FALSE(PhoneMapping::port(global, Country::US, 2012000005, 3000000042));
+  ASSERT_FALSE(PhoneMapping::port(global, Country::US, 2012000006, PhoneNumber::NONE));
+  ASSERT_FALSE(PhoneMapping::port(global, Country::US, 2012000100, 3000000001));
+  PhoneMapping db(global, Country::US);
+  ASSERT_EQ(db.getRN(2012000004), 3000000004);
+  ASSERT_EQ(db.getRN(2012000005), 3000000042);
+  ASSERT_EQ(db.getRN(2012000006), PhoneNumber::NONE);
+  ASSERT_EQ(db.getRN(2012000100), 3000000001);
+  ASSERT_EQ(db.size(), 100);
+
+  // Number ported into NPA new to the partition gets routed to it
+  Country country;
+  ASSERT_TRUE(PhoneMapping::port(global, Country::US, 4162000002, 4162888888));
+  ASSERT_EQ(NanpMapping(global).getRN(4162000002, &country), 4162888888);
+  ASSERT_EQ(country, Country::US);
+  ASSERT_EQ(NanpMapping(global).getRN(4162000001, &country), 4162999999);
+  ASSERT_EQ(country, Country::CA);
+
+  // Compaction is asked for once, it folds changes into the partition
+  // and empties the overlay
+  ASSERT_FALSE(PhoneMapping::port(global, Country::US, 4162000002, 4162888888));
+  PhoneMapping::compactOverlay(global, Country::US);
+  FLAGS_overlay_compact_rows = 1000;
+  PhoneMapping db2(global, Country::US);
+  ASSERT_EQ(db2.size(), 101);
+  ASSERT_EQ(db2.getRN(2012000005), 3000000042);
+  ASSERT_EQ(db2.getRN(2012000006), PhoneNumber::NONE);
+  ASSERT_THAT(drain(db2.inverseRNs(3000000042, 3000000043)),
+              ElementsAre(Pair(2012000005, 3000000042)));
+  ASSERT_EQ(NanpMapping(global).getRN(4162000002, &country), 4162888888);
+  ASSERT_EQ(country, Country::US);
+
+  // Unport after compaction hides the row of the delta
+  PhoneMapping::port(global, Country::US, 2012000005, PhoneNumber::NONE);
+  ASSERT_EQ(PhoneMapping(global, Country::US).getRN(2012000005), PhoneNumber::NONE);
+
+  // Full reload keeps changes not folded yet, folded ones are replaced
+  PhoneMapping::Builder us2;
+  us2.addRow(2012000005, 3000000005);
+  us2.addRow(2012000007, 3000000007);
+  us2.commit(global, Country::US);
+  ASSERT_EQ(PhoneMapping(global, Country::US).getRN(2012000005), PhoneNumber::NONE);
+  ASSERT_EQ(PhoneMapping(global, Country::US).getRN(2012000007), 3000000007);
+  ASSERT_EQ(NanpMapping(global).getRN(4162000002), PhoneNumber::NONE);
+  folly::hazptr_cleanup();
+}
+
+TEST(PortOverlayTest, Fold) {
+  PortOverlay overlay;
+  overlay.put(2012000001, 3000000001);
+  overlay.put(2012000002, 3000000002);
+  auto folded = overlay.changes();
+  overlay.put(2012000002, 3000000022);
+  overlay.put(2012000003, PortOverlay::REMOVED);
+
+  // Only changes made after the fold was taken are carried over,
+  // and puts into the replaced overlay reach the new one
+  auto next = overlay.fold(folded);
+  ASSERT_EQ(next->size(), 2);
+  overlay.put(2012000004, 3000000004);
+  ASSERT_EQ(next->size(), 3);
+
+  uint64_t pn[] = {2012000001, 2012000002, 2012000003, 2012000004};
+  uint64_t rn[] = {1, 2, 3, 4};
+  next->patch(4, pn, rn);
+  ASSERT_THAT(rn, ElementsAre(1, 3000000022, PortOverlay::REMOVED, 3000000004));
+}
+
+TEST(PhoneMappingTest, Shards) {
+  using Country = NanpMapping::Country;
+  static std::atomic<NanpMapping::Data*> global;
+
+  // Numbers of many NPAs sharing routing numbers
+  PhoneMapping::Builder builder;
+  std::vector<std::pair<uint64_t, uint64_t>> rows;
+  for (uint64_t npa = 200; npa < 1000; npa += 7) {
+    for (uint64_t line = 0; line < 10; ++line) {
+      rows.emplace_back(npa * 10000000 + 2000000 + line, 3000000000 + (npa + line) % 3);
+      builder.addRow(rows.back().first, rows.back().second);
+    }
+  }
+  builder.commit(global, Country::US);
+
+  std::vector<uint64_t> pn, rn(rows.size() + 1);
+  for (const auto &row : rows)
+    pn.push_back(row.first);
+  pn.push_back(2012000000);
+  PhoneMapping db(global, Country::US);
+  ASSERT_EQ(db.size(), rows.size());
+  db.getRNs(pn.size(), pn.data(), rn.data());
+  for (size_t i = 0; i < rows.size(); ++i)
+    ASSERT_EQ(rn[i], rows[i].second);
+  ASSERT_EQ(rn.back(), PhoneNumber::NONE);
+
+  // Scans of shards are merged in (rn, pn) order
+  std::vector<std::pair<uint64_t, uint64_t>> expected;
+  for (const auto &row : rows)
+    expected.emplace_back(row.second, row.first);
+  std::sort(expected.begin(), expected.end());
+  for (auto &row : expected)
+    std::swap(row.first, row.second);
+  ASSERT_EQ(drain(db.visitRows()), expected);
+  ASSERT_EQ(drain(db.inverseRNs(3000000001, 3000000002)).size(), 383);
+
+  // Shards are written as they are and mapped back as shards, sharing
+  // the file counted once
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+  ASSERT_TRUE(db.writeOwnSnapshot(path));
+  size_t fileSize = std::ifstream(path, std::ios::ate).tellg();
+  static std::atomic<NanpMapping::Data*> restored;
+  PhoneMapping::Builder loader;
+  loader.fromSnapshot(path);
+  loader.commit(restored, Country::US);
+  PhoneMapping mapped(restored, Country::US);
+  std::vector<uint64_t> mappedRN(pn.size());
+  mapped.getRNs(pn.size(), pn.data(), mappedRN.data());
+  ASSERT_EQ(mappedRN, rn);
+  ASSERT_EQ(drain(mapped.visitRows()), expected);
+  ASSERT_EQ(drain(mapped.inverseRNs(3000000001, 3000000002)).size(), 383);
+  ASSERT_EQ(mapped.memoryUsage()["parts"]["snapshot"]["bytes"].asInt(), fileSize);
+
+  // Reload swaps mapped shards one by one as well
+  PhoneMapping::Builder remap;
+  for (const auto &row : rows)
+    remap.addRow(row.first, row.second + 10);
+  remap.commit(restored, Country::US);
+  PhoneMapping remapped(restored, Country::US);
+  ASSERT_EQ(remapped.getRN(rows.back().first), rows.back().second + 10);
+  ASSERT_EQ(drain(remapped.visitRows()).size(), rows.size());
+
+  // Delta touches only shards of its rows
+  PhoneMapping::Builder delta;
+  delta.addRow(2012000000, 3000000042);
+  delta.removeRow(9982000009);
+  delta.commitDelta(global, Country::US);
+  PhoneMapping db2(global, Country::US);
+  ASSERT_EQ(db2.size(), rows.size());
+  ASSERT_EQ(db2.getRN(2012000000), 3000000042);
+  ASSERT_EQ(db2.getRN(9982000009), PhoneNumber::NONE);
+  ASSERT_EQ(drain(db2.visitRows()).size(), rows.size());
+  ASSERT_FALSE(db2.writeOwnSnapshot(path));
+  unlink(path);
+
+  // Reload with the same number of shards swaps them one by one
+  PhoneMapping::Builder reload;
+  for (const auto &row : rows)
+    reload.addRow(row.first, row.second + 10);
+  reload.commit(global, Country::US);
+  PhoneMapping db3(global, Country::US);
+  ASSERT_EQ(db3.size(), rows.size());
+  ASSERT_EQ(db3.getRN(rows.front().first), rows.front().second + 10);
+  ASSERT_EQ(db3.getRN(rows.back().first), rows.back().second + 10);
+  ASSERT_EQ(db3.getRN(2012000000), PhoneNumber::NONE);
+
+  // Bad row in a later shard fails reload before any shard is swapped,
+  // ported numbers survive the reload which succeeds
+  PhoneMapping::port(global, Country::US, rows.front().first, 3000000099);
+  PhoneMapping::Builder bad;
+  for (const auto &row : rows)
+    bad.addRow(row.first, row.second + 20);
+  bad.addRow(rows.back().first, 1);
+  try {
+    bad.commit(global, Country::US);
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_THAT(e.what(), HasSubstr("duplicate key on line " + std::to_string(rows.size() + 1)));
+  }
+  PhoneMapping db4(global, Country::US);
+  for (const auto &row : rows)
+    ASSERT_EQ(db4.getRN(row.first), row.first == rows.front().first ? 3000000099
+                                                                    : row.second + 10);
+  PhoneMapping::Builder again;
+  for (const auto &row : rows)
+    again.addRow(row.first, row.second + 30);
+  again.commit(global, Country::US);
+  PhoneMapping db5(global, Country::US);
+  ASSERT_EQ(db5.getRN(rows.front().first), 3000000099);
+  ASSERT_EQ(db5.getRN(rows.back().first), rows.back().second + 30);
+
+  // Duplicates are reported by line of the input, in a delta as well
+  static std::atomic<NanpMapping::Data*> other;
+  PhoneMapping::Builder dup;
+  dup.addRow(9992000001, 1).addRow(2012000001, 2).addRow(9992000001, 3);
+  try {
+    dup.commit(other, Country::US);
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_THAT(e.what(), HasSubstr("duplicate key on line 3"));
+  }
+  PhoneMapping::Builder dupDelta;
+  dupDelta.addRow(9992000001, 1).addRow(2012000001, 2).addRow(2012000001, 3);
+  try {
+    dupDelta.commitDelta(global, Country::US);
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_THAT(e.what(), HasSubstr("duplicate key on line 3"));
+  }
+
+  // Single shard partition replaces sharded one and back
+  FLAGS_mapping_shards = 1;
+  PhoneMapping::Builder single;
+  single.addRow(2012000001, 3000000001);
+  single.commit(global, Country::US);
+  FLAGS_mapping_shards = 16;
+  ASSERT_EQ(PhoneMapping(global, Country::US).getRN(2012000001), 3000000001);
+  PhoneMapping::Builder sharded;
+  sharded.addRow(2012000001, 3000000002);
+  sharded.commit(global, Country::US);
+  ASSERT_EQ(PhoneMapping(global, Country::US).getRN(2012000001), 3000000002);
+  folly::hazptr_cleanup();
+}
+
+TEST(PhoneMappingTest, Duplicate) {
+  PhoneMapping::Builder builder;
+  for (uint64_t i = 0; i < 100000; ++i)
+    builder.addRow(i, 1);
+  builder.addRow(70000, 2);
+  builder.addRow(10, 2);
+  try {
+    builder.build();
+    FAIL();
+  } catch (const std::runtime_error &e) {
+    ASSERT_THAT(e.what(), HasSubstr("duplicate key on line 100001"));
+  }
+}
+
+TEST(PhoneMappingTest, CSV) {
+  std::string text;
+  for (uint64_t i = 0; i < 50000; ++i)
+    text += std::to_string(i) + "," + std::to_string(i % 7) + "\n";
+  std::istringstream in(text + "1,2,3\n4,5\n");
+  CSVReader csv(in);
+
+  PhoneMapping::Builder builder;
+  size_t line = 0;
+  builder.fromCSV(csv, line, 30000);
+  ASSERT_EQ(line, 30000);
+  ASSERT_THROW(builder.fromCSV(csv, line, 30000), std::runtime_error);
+  ASSERT_EQ(line, 50000);
+
+  PhoneMapping db = builder.build();
+  ASSERT_EQ(db.size(), 50000);
+  for (uint64_t i = 0; i < 50000; i += 999)
+    ASSERT_EQ(db.getRN(i), i % 7);
+  folly::hazptr_cleanup();
+}
+
+TEST(IndexBuildTest, RadixSort) {
+  struct Row {
+    uint64_t phone : 34, next : 30;
+  };
+
+  std::mt19937_64 rng(1);
+  for (size_t N : {0, 100, 300000}) {
+    std::vector<Row> rows(N);
+    for (size_t i = 0; i < N; ++i)
+      rows[i] = Row{rng() % (N / 3 + 1) * 1000003, i};
+
+    std::vector<Row> expected = rows;
+    std::stable_sort(expected.begin(), expected.end(), [](const Row &lhs, const Row &rhs) {
+      return lhs.phone < rhs.phone;
+    });
+    radixSortByPhone(rows);
+
+    for (size_t i = 0; i < N; ++i) {
+      ASSERT_EQ(rows[i].phone, expected[i].phone);
+      ASSERT_EQ(rows[i].next, expected[i].next);
+    }
+  }
+}
+
+TEST(EliasFanoTest, Decode) {
+  std::mt19937_64 rng(1);
+  for (uint64_t universe : {uint64_t(1), uint64_t(1000), uint64_t(1) << 40}) {
+    for (size_t N : {0, 1, 255, 256, 257, 5000}) {
+      std::vector<uint64_t> values(N);
+      for (uint64_t &value : values)
+        value = rng() % universe;
+      std::sort(values.begin(), values.end());
+
+      EliasFano ef = EliasFano::build(folly::range(values), universe);
+      ASSERT_EQ(ef.size(), N);
+      EliasFano::Reader reader = ef.read(0);
+      for (size_t i = 0; i < N; ++i)
+        ASSERT_EQ(reader.next(), values[i]);
+      for (size_t i = 0; i < N; i += 97) {
+        reader = ef.read(i);
+        for (size_t j = i; j < std::min(N, i + 300); ++j)
+          ASSERT_EQ(reader.next(), values[j]);
+      }
+
+      EliasFano view(N, universe, ef.lows(), ef.highs(), ef.samples());
+      if (N > 0) {
+        ASSERT_EQ(view.read(N - 1).next(), values.back());
+      }
+    }
+  }
+
+  std::vector<uint64_t> unsorted = {2, 1};
+  ASSERT_THROW(EliasFano::build(folly::range(unsorted), 10), std::invalid_argument);
+  ASSERT_THROW(EliasFano::build(folly::range(unsorted), 2), std::invalid_argument);
+}
+
+TEST(KeyFilterTest, Select) {
+  std::mt19937_64 rng(1);
+  std::vector<uint64_t> keys(100000);
+  for (uint64_t &key : keys)
+    key = 2002000000 + rng() % 8000000000;
+  KeyFilter filter = KeyFilter::build(keys.size(), 10, [&](size_t i) {
+    return keys[i];
+  });
+  ASSERT_EQ(filter.words().size() % KeyFilter::BLOCK_WORDS, 0);
+
+  // No false negatives, alone or in a batch
+  std::vector<uint32_t> pos(keys.size());
+  ASSERT_EQ(filter.select(keys.size(), keys.data(), pos.data(), 16), keys.size());
+  for (uint64_t key : keys)
+    ASSERT_TRUE(filter.mayContain(key));
+
+  // Keys above 10 digits are never inserted
+  std::vector<uint64_t> absent(100000);
+  for (uint64_t &key : absent)
+    key = 10000000000 + rng() % 8000000000;
+  size_t M = filter.select(absent.size(), absent.data(), pos.data(), 16);
+  ASSERT_LT(M, absent.size() * 3 / 100);
+  for (size_t j = 0; j < M; ++j) {
+    ASSERT_TRUE(filter.mayContain(absent[pos[j]]));
+    ASSERT_TRUE(j == 0 || pos[j] > pos[j - 1]);
+  }
+
+  KeyFilter view(filter.words());
+  ASSERT_EQ(view.select(absent.size(), absent.data(), pos.data(), 4), M);
+
+  KeyFilter empty = KeyFilter::build(keys.size(), 0, [&](size_t i) {
+    return keys[i];
+  });
+  ASSERT_TRUE(empty.empty());
+  ASSERT_EQ(empty.select(absent.size(), absent.data(), pos.data(), 16), absent.size());
+  std::vector<uint32_t> partial(KeyFilter::BLOCK_WORDS + 1);
+  ASSERT_THROW(KeyFilter(folly::range(partial)), std::runtime_error);
+}
+
+TEST(HugePagesTest, LargeVector) {
+  LargeVector<uint64_t> small(100, 1);
+  LargeVector<uint64_t> large(LARGE_ALLOCATION, 2);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(large.data()) % LARGE_ALLOCATION, 0);
+  large.resize(3 * LARGE_ALLOCATION, 3);
+  ASSERT_EQ(large[LARGE_ALLOCATION - 1], 2);
+  ASSERT_EQ(large.back(), 3);
+  ASSERT_EQ(small.back(), 1);
+
+  void *local = allocateLarge(LARGE_ALLOCATION, currentNumaNode());
+  memset(local, 0, LARGE_ALLOCATION);
+  deallocateLarge(local, LARGE_ALLOCATION);
+  ASSERT_LT(currentNumaNode(), numaNodes());
+}
+
+TEST(ReclaimerTest, Chunks) {
+  struct Table {
+    LargeVector<uint64_t> column;
+    size_t retiredBytes;
+  };
+  FLAGS_reclaim_chunk_mb = 2;
+  waitReclaimed();
+  ReclaimerStats before = reclaimerStats();
+  std::pair<size_t, size_t> blocks = largeBlocks();
+
+  Table *table = new Table{LargeVector<uint64_t>(5 * LARGE_ALLOCATION, 1), 0};
+  table->retiredBytes = table->column.size() * sizeof(uint64_t);
+  ASSERT_EQ(largeBlocks().first, blocks.first + 1);
+  ReclaimLater<Table>()(table);
+  ReclaimLater<Table>()(new Table{LargeVector<uint64_t>(10, 2), 0});
+  waitReclaimed();
+
+  ReclaimerStats after = reclaimerStats();
+  ASSERT_EQ(after.pendingVersions, 0);
+  ASSERT_EQ(after.pendingBytes, 0);
+  ASSERT_EQ(after.lagSeconds, 0);
+  ASSERT_EQ(after.reclaimedVersions, before.reclaimedVersions + 2);
+  ASSERT_EQ(after.reclaimedBytes, before.reclaimedBytes + 5 * LARGE_ALLOCATION * sizeof(uint64_t));
+  ASSERT_EQ(largeBlocks(), blocks);
+  FLAGS_reclaim_chunk_mb = 64;
+}
+
+TEST(ArenaTest, Copy) {
+  std::pair<size_t, size_t> blocks = largeBlocks();
+  {
+    Arena arena;
+    ASSERT_EQ(arena.allocatedBytes(), 0);
+    ASSERT_TRUE(arena.copy("").empty());
+
+    std::vector<folly::StringPiece> copies;
+    for (size_t i = 0; i < 100000; ++i)
+      copies.push_back(arena.copy("row " + std::to_string(i)));
+    for (size_t i = 0; i < copies.size(); ++i)
+      ASSERT_EQ(copies[i], "row " + std::to_string(i));
+
+    void *aligned = arena.allocate(24, 64);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(aligned) % 64, 0);
+    std::string large(3 * LARGE_ALLOCATION, 'x');
+    ASSERT_EQ(arena.copy(large), large);
+    ASSERT_GE(arena.allocatedBytes(), 3 * LARGE_ALLOCATION);
+  }
+  ASSERT_EQ(largeBlocks(), blocks);
+}
+
+TEST(CSVReaderTest, Lines) {
+  std::string longLine(5 << 20, '7');
+  std::string text = "1,2\r\n\n" + longLine + ",x\n";
+  for (size_t i = 0; i < 300000; ++i)
+    text += std::to_string(i) + ",\n";
+  text += "last";
+
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_EQ(write(fd, text.data(), text.size()), ssize_t(text.size()));
+  close(fd);
+
+  // Mapped file and stream read by blocks give the same lines
+  std::istringstream in(text);
+  CSVReader mapped(path), streamed(in);
+  for (CSVReader *csv : {&mapped, &streamed}) {
+    folly::StringPiece line;
+    std::vector<folly::StringPiece> lines, fields;
+    ASSERT_TRUE(csv->readLine(line));
+    ASSERT_EQ(line, "1,2");
+    ASSERT_TRUE(csv->readLine(line));
+    ASSERT_TRUE(line.empty());
+    ASSERT_TRUE(csv->readLine(line));
+    CSVReader::split(line, fields);
+    ASSERT_EQ(fields.size(), 2);
+    ASSERT_EQ(fields[0], longLine);
+    ASSERT_EQ(fields[1], "x");
+
+    size_t n = 0;
+    while (csv->readLines(100000, lines) > 0) {
+      ASSERT_LE(lines.size(), 100000);
+      for (folly::StringPiece l : lines) {
+        if (n == 300000) {
+          ASSERT_EQ(l, "last");
+          ++n;
+          continue;
+        }
+        CSVReader::splitRow(l, fields);
+        ASSERT_EQ(fields.size(), 1);
+        ASSERT_EQ(CSVReader::parseNumber(fields[0]), n++);
+      }
+    }
+    ASSERT_EQ(n, 300001);
+    ASSERT_TRUE(csv->eof());
+    ASSERT_FALSE(csv->readLine(line));
+  }
+  unlink(path);
+
+  ASSERT_EQ(CSVReader::parseNumber(" 2015550100 "), 2015550100);
+  ASSERT_EQ(CSVReader::parseNumber("201-555-0100", '-'), 2015550100);
+  ASSERT_THROW(CSVReader::parseNumber(""), std::runtime_error);
+  ASSERT_THROW(CSVReader::parseNumber("201-555-0100"), std::runtime_error);
+  ASSERT_THROW(CSVReader::parseNumber("12a"), std::runtime_error);
+  ASSERT_THROW(CSVReader::parseNumber("99999999999999999999"), std::runtime_error);
+}
+
+/** Write text to path as gzip, cut in two members at `split`. */
+static void writeGzip(const char *path, const std::string &text, size_t split) {
+  gzFile gz = gzopen(path, "wb");
+  ASSERT_EQ(gzwrite(gz, text.data(), split), int(split));
+  gzclose(gz);
+  gz = gzopen(path, "ab");
+  ASSERT_EQ(gzwrite(gz, text.data() + split, text.size() - split), int(text.size() - split));
+  gzclose(gz);
+}
+
+/** Make ustar header of a member. */
+static std::string tarHeader(const std::string &name, size_t size, char type) {
+  std::string header(512, '\0');
+  header.replace(0, name.size(), name);
+  snprintf(&header[124], 12, "%011zo", size);
+  header[156] = type;
+  header.replace(257, 5, "ustar");
+  return header;
+}
+
+TEST(InflatePipelineTest, TarGz) {
+  std::string text;
+  for (size_t i = 0; i < 300000; ++i)
+    text += std::to_string(i) + ",\n";
+  text += "last";
+
+  // Directory, the feed and another file after it
+  std::string tar = tarHeader("feed/", 0, '5') +
+    tarHeader("feed/in.txt", text.size(), '0') + text +
+    std::string((512 - text.size() % 512) % 512, '\0') +
+    tarHeader("feed/other.txt", 5, '0') + "other" + std::string(507, '\0') +
+    std::string(1024, '\0');
+
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+  auto readAll = [&](const std::string &input) {
+    CSVReader csv(input);
+    folly::StringPiece line;
+    std::string out;
+    while (csv.readLine(line))
+      out += line.str() + "\n";
+    return out;
+  };
+
+  writeGzip(path, tar, tar.size() / 3);
+  ASSERT_EQ(readAll(path), text + "\n");
+
+  // Pipe can't be peeked, first block is passed to pipeline
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  std::thread writer([&] {
+    std::ifstream file(path);
+    std::string gz((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(write(fds[1], gz.data(), gz.size()), ssize_t(gz.size()));
+    close(fds[1]);
+  });
+  ASSERT_EQ(readAll("/proc/self/fd/" + std::to_string(fds[0])), text + "\n");
+  writer.join();
+  close(fds[0]);
+
+  // Plain .gz shorter than a tar header
+  writeGzip(path, "1,2\n3,4", 3);
+  ASSERT_EQ(readAll(path), "1,2\n3,4\n");
+
+  // Cut gzip stream is an error, not a short feed
+  writeGzip(path, tar, tar.size() / 3);
+  ASSERT_EQ(truncate(path, 4000), 0);
+  ASSERT_THROW(readAll(path), std::runtime_error);
+  unlink(path);
+}
+
+TEST(MappingTableTest, Levels) {
+  {
+    LergMapping::Builder lergBuilder;
+    std::vector<folly::StringPiece> row = {"201", "555", "", "NJ", "Telco", "1234",
+                                           "Newark", "ILEC", "224", "US"};
+    lergBuilder.addRow(row);
+    row[2] = "7";
+    row[4] = "Carrier";
+    lergBuilder.addRow(row);
+    ASSERT_THROW(lergBuilder.addRow(row), std::runtime_error);
+    LergMapping lerg = lergBuilder.build();
+    ASSERT_EQ(lerg.size(), 2);
+
+    uint64_t pns[] = { 2015557123, 2015551234, 2015561234 };
+    LergData data[3];
+    lerg.getLergs(3, pns, data);
+    ASSERT_EQ(data[0].lerg_key, 2015557);
+    ASSERT_EQ(data[0].company, "Carrier");
+    ASSERT_EQ(data[1].lerg_key, 201555);
+    ASSERT_EQ(data[1].company, "Telco");
+    ASSERT_EQ(data[2].lerg_key, 0);
+    ASSERT_GT(lerg.memoryUsage()["total"].asInt(), 0);
+
+    DnoMapping::Builder dnoBuilder;
+    dnoBuilder.addRow(2015550000, "dno", 1);
+    dnoBuilder.addRow(302, "dno_npa", 1);
+    dnoBuilder.addRow(404555, "dno_npa_nxx", 1);
+    dnoBuilder.addRow(6175551, "dno_npa_nxx_x", 1);
+    ASSERT_THROW(dnoBuilder.addRow(2015550001, "dno_area", 1), std::runtime_error);
+    DnoMapping dno = dnoBuilder.build();
+
+    uint64_t numbers[] = { 2015550000, 3025551234, 4045559999, 6175551000,
+                           2015550001, 4045560000, 6175552000 };
+    uint64_t listed[7];
+    dno.getDNOs(7, numbers, listed);
+    ASSERT_THAT(listed, ElementsAre(1, 1, 1, 1, 0, 0, 0));
+
+    // DNC lines take commas between digits and ignore what follows them
+    std::istringstream in("2015550100\n 201,555,0101\n2015550102,x\n2015550103\r\n");
+    CSVReader csv(in);
+    size_t line = 0;
+    DncMapping::Builder dncBuilder;
+    dncBuilder.fromCSV(csv, line, 100);
+    ASSERT_EQ(line, 4);
+    DncMapping dnc = dncBuilder.build();
+    uint64_t phones[] = { 2015550100, 2015550101, 2015550102, 2015550103, 2015550104 };
+    uint64_t dncs[5];
+    dnc.getDNCs(5, phones, dncs);
+    ASSERT_THAT(dncs, ElementsAre(1, 1, 1, 1, 0));
+  }
+  folly::hazptr_cleanup();
+}
+
+TEST(MappingTableTest, Snapshot) {
+  char path[] = "/tmp/MappingTableTest.XXXXXX";
+  close(mkstemp(path));
+  {
+    LergMapping::Builder lergBuilder;
+    std::vector<folly::StringPiece> row = {"201", "555", "", "NJ", "Telco", "1234",
+                                           "Newark", "ILEC", "224", "US"};
+    lergBuilder.addRow(row);
+    row[2] = "7";
+    row[4] = "Carrier";
+    lergBuilder.addRow(row);
+    lergBuilder.build().writeSnapshot(path);
+
+    // Strings of rows point into the mapped file
+    LergMapping::Builder lergLoader;
+    lergLoader.fromSnapshot(path);
+    LergMapping lerg = lergLoader.build();
+    ASSERT_EQ(lerg.size(), 2);
+    uint64_t pns[] = { 2015557123, 2015551234, 2015561234 };
+    LergData data[3];
+    lerg.getLergs(3, pns, data);
+    ASSERT_EQ(data[0].lerg_key, 2015557);
+    ASSERT_EQ(data[0].company, "Carrier");
+    ASSERT_EQ(data[1].lerg_key, 201555);
+    ASSERT_EQ(data[1].company, "Telco");
+    ASSERT_EQ(data[1].rate_center, "Newark");
+    ASSERT_EQ(data[2].lerg_key, 0);
+    ASSERT_GT(lerg.memoryUsage()["parts"]["snapshot"]["bytes"].asInt(), 0);
+
+    // Listed numbers keep their levels and filters
+    DnoMapping::Builder dnoBuilder;
+    dnoBuilder.addRow(2015550000, "dno", 1);
+    dnoBuilder.addRow(404555, "dno_npa_nxx", 1);
+    dnoBuilder.build().writeSnapshot(path);
+    DnoMapping::Builder dnoLoader;
+    dnoLoader.fromSnapshot(path);
+    DnoMapping dno = dnoLoader.build();
+    uint64_t numbers[] = { 2015550000, 4045559999, 2015550001 };
+    uint64_t listed[3];
+    dno.getDNOs(3, numbers, listed);
+    ASSERT_THAT(listed, ElementsAre(1, 1, 0));
+
+    // Snapshot of another dataset is rejected
+    LergMapping::Builder wrongKind;
+    ASSERT_THROW(wrongKind.fromSnapshot(path), std::runtime_error);
+  }
+  unlink(path);
+  folly::hazptr_cleanup();
+}
+
+TEST(ReloadSchedulerTest, Budget) {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::string> started;
+  std::set<std::string> released;
+  std::map<std::string, bool> done;
+  std::set<std::thread::id> threads;
+  std::atomic<bool> primaryReady{false};
+  ReloadScheduler scheduler(3, 100 << 20, [&] { return primaryReady.load(); });
+
+  // Jobs run until released, "fail" throws
+  auto submit = [&](std::string name, std::string dataset, int priority, size_t mb) {
+    ReloadScheduler::Job job;
+    job.name = name;
+    job.dataset = dataset;
+    job.priority = priority;
+    job.memoryBytes = mb << 20;
+    job.run = [&, name] {
+      std::unique_lock<std::mutex> lock(mutex);
+      started.push_back(name);
+      threads.insert(std::this_thread::get_id());
+      changed.notify_all();
+      changed.wait(lock, [&] { return released.count(name) > 0; });
+      if (name == "fail")
+        throw std::runtime_error("failed");
+      return true;
+    };
+    job.done = [&, name](bool ok) {
+      std::lock_guard<std::mutex> lock(mutex);
+      done[name] = ok;
+    };
+    scheduler.submit(std::move(job));
+  };
+  auto release = [&](std::string name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    released.insert(name);
+    changed.notify_all();
+  };
+  auto awaitStarted = [&](size_t n) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [&] { return started.size() >= n; });
+    return started;
+  };
+
+  submit("lerg1", "lerg", 1, 10);
+  submit("us", "us", 0, 60);
+  submit("dnc", "dnc", 1, 10);   // waits for US/CA at startup
+  submit("lerg2", "lerg", 1, 10); // waits for lerg1
+  submit("ca", "ca", 0, 50);     // waits for memory
+  ASSERT_THAT(awaitStarted(2), UnorderedElementsAre("lerg1", "us"));
+
+  folly::dynamic status = scheduler.status();
+  ASSERT_EQ(status["memory_reserved_mb"].asInt(), 70);
+  ASSERT_EQ(status["running"].size(), 2);
+  ASSERT_EQ(status["queued"].size(), 3);
+  ASSERT_EQ(status["queued"][0]["waiting_for"].asString(), "startup");
+  ASSERT_EQ(status["queued"][1]["waiting_for"].asString(), "dataset");
+  ASSERT_EQ(status["queued"][2]["waiting_for"].asString(), "memory");
+
+  primaryReady = true;
+  release("us");
+  std::vector<std::string> order = awaitStarted(4);
+  ASSERT_THAT(std::vector<std::string>(order.begin() + 2, order.end()),
+              UnorderedElementsAre("ca", "dnc"));
+  release("lerg1");
+  ASSERT_EQ(awaitStarted(5)[4], "lerg2");
+  release("ca");
+  release("dnc");
+  release("lerg2");
+  scheduler.waitIdle();
+
+  // Job larger than the budget runs once nothing else does
+  submit("fail", "geo", 1, 1000);
+  ASSERT_EQ(awaitStarted(6)[5], "fail");
+  release("fail");
+  scheduler.waitIdle();
+
+  status = scheduler.status();
+  ASSERT_EQ(status["memory_reserved_mb"].asInt(), 0);
+  ASSERT_EQ(status["finished"].size(), 6);
+  ASSERT_EQ(status["finished"][5]["cmd"].asString(), "fail");
+  ASSERT_FALSE(status["finished"][5]["ok"].asBool());
+  ASSERT_THAT(done, ElementsAre(Pair("ca", true), Pair("dnc", true), Pair("fail", false),
+                                Pair("lerg1", true), Pair("lerg2", true), Pair("us", true)));
+  // Jobs share the pool
+  ASSERT_LE(threads.size(), 3);
+}
+
+TEST(ManifestTest, Steps) {
+  char path[] = "/tmp/PhoneMappingTest.XXXXXX";
+  close(mkstemp(path));
+  unlink(path);
+
+  Manifest disabled("");
+  ASSERT_FALSE(disabled.enabled());
+  disabled.record("us", Manifest::Step{ "reload", "/data/us.txt", folly::dynamic::object() }, false);
+  ASSERT_TRUE(disabled.datasets().empty());
+
+  Manifest manifest(path);
+  manifest.load();
+  ASSERT_TRUE(manifest.datasets().empty());
+
+  folly::dynamic meta = folly::dynamic::object("country", "CA");
+  manifest.record("ca", Manifest::Step{ "reload", "/data/ca-1.txt", meta }, false);
+  manifest.record("ca", Manifest::Step{ "delta_reload", "/data/ca-2.txt", meta }, true);
+  manifest.record("lerg", Manifest::Step{ "lerg_reload", "/data/lerg.txt", folly::dynamic::object() }, false);
+  manifest.record("dnc", Manifest::Step{ "dnc_reload", "/data/dnc.txt", folly::dynamic::object() }, false);
+  manifest.record("lerg", Manifest::Step{ "lerg_reload", "/data/lerg-2.txt", folly::dynamic::object() }, false);
+  manifest.forget("dnc");
+
+  Manifest restored(path);
+  restored.load();
+  auto datasets = restored.datasets();
+  ASSERT_EQ(datasets.size(), 2);
+  ASSERT_EQ(datasets["ca"].size(), 2);
+  ASSERT_EQ(datasets["ca"][0].cmd, "reload");
+  ASSERT_EQ(datasets["ca"][1].path, "/data/ca-2.txt");
+  ASSERT_EQ(datasets["ca"][1].meta["country"].asString(), "CA");
+  ASSERT_EQ(datasets["lerg"].size(), 1);
+  ASSERT_EQ(datasets["lerg"][0].path, "/data/lerg-2.txt");
+
+  std::ofstream(path) << "{\"version\": 2, \"datasets\": {}}";
+  ASSERT_THROW(restored.load(), std::runtime_error);
+  unlink(path);
+}
+
 TEST(PhoneNumberTest, Parse) {
   ASSERT_EQ(PhoneNumber::fromString("+14844249683"), 4844249683);
   ASSERT_EQ(PhoneNumber::fromString("14844249683"), 4844249683);
@@ -0,0 +1,69 @@
+#ifndef CALLFWD_TEST_SYNTHETICNANP_H
+#define CALLFWD_TEST_SYNTHETICNANP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+/*
+ * Synthetic data shaped like the real NANP tables for benchmarks.
+ * Ported numbers fill ~20% of a random subset of NPA-NXX blocks and
+ * point to a pool of routing numbers, one of which, the large carrier,
+ * takes every LARGE_CARRIER_EVERY-th row.
+ */
+
+static constexpr size_t BLOCK_SIZE = 10000;
+static constexpr size_t ROWS_PER_BLOCK = 2000;
+static constexpr size_t NUM_RNS = 100000;
+static constexpr size_t LARGE_CARRIER_EVERY = 20;
+
+/** Get random number with NPA and NXX in [200, 999]. */
+inline uint64_t randomNumber(std::mt19937_64 &rng) {
+  std::uniform_int_distribution<uint64_t> npanxx(200, 999);
+  std::uniform_int_distribution<uint64_t> line(0, 9999);
+  return (npanxx(rng) * 1000 + npanxx(rng)) * 10000 + line(rng);
+}
+
+/** Get every NPA-NXX block in random order. */
+inline std::vector<uint64_t> shuffledBlocks(std::mt19937_64 &rng) {
+  std::vector<uint64_t> blocks;
+  for (uint64_t npa = 200; npa <= 999; ++npa)
+    for (uint64_t nxx = 200; nxx <= 999; ++nxx)
+      blocks.push_back(npa * 1000 + nxx);
+  std::shuffle(blocks.begin(), blocks.end(), rng);
+  return blocks;
+}
+
+/** Get pool of routing numbers, the large carrier first. */
+inline std::vector<uint64_t> routingNumbers(std::mt19937_64 &rng) {
+  std::vector<uint64_t> rns(NUM_RNS);
+  for (uint64_t &rn : rns)
+    rn = randomNumber(rng);
+  return rns;
+}
+
+/** Call f(row, pn, rn) for N distinct ported numbers. */
+template <class F>
+void generatePorted(size_t N, std::mt19937_64 &rng,
+                    const std::vector<uint64_t> &rns, F &&f) {
+  std::vector<uint64_t> blocks = shuffledBlocks(rng);
+  std::vector<uint16_t> lines(BLOCK_SIZE);
+  std::iota(lines.begin(), lines.end(), 0);
+  std::uniform_int_distribution<size_t> pickRN(0, rns.size() - 1);
+
+  for (size_t row = 0, block = 0; row < N; ++block) {
+    // Partial shuffle picks distinct numbers of the block
+    size_t count = std::min(ROWS_PER_BLOCK, N - row);
+    for (size_t i = 0; i < count; ++i, ++row) {
+      std::swap(lines[i], lines[i + rng() % (lines.size() - i)]);
+      uint64_t pn = blocks[block % blocks.size()] * 10000 + lines[i];
+      size_t rn = row % LARGE_CARRIER_EVERY == 0 ? 0 : pickRN(rng);
+      f(row, pn, rns[rn]);
+    }
+  }
+}
+
+#endif // CALLFWD_TEST_SYNTHETICNANP_H